@@ -41,6 +41,8 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <libvchan.h>
 
 #include "qrexec.h"
@@ -60,6 +62,10 @@ static volatile sig_atomic_t sigusr1 = 0;
 int replace_chars_stdout = -1;
 int replace_chars_stderr = -1;
 
+/* how long to keep a data connection from dom0 open for another command, in
+ * seconds; 0 to close it when the call ends */
+int data_vchan_idle_timeout = 0;
+
 static void sigchld_handler(int __attribute__((__unused__))x)
 {
     sigchld = 1;
@@ -82,13 +88,11 @@ void prepare_child_env() {
     if (setenv("QREXEC_AGENT_PID", pid_s, 1)) abort();
 }
 
-int handle_handshake(libvchan_t *ctrl)
+static int send_hello(libvchan_t *ctrl)
 {
     struct msg_header hdr;
     struct peer_info info;
-    int actual_version;
 
-    /* send own HELLO */
     hdr.type = MSG_HELLO;
     hdr.len = sizeof(info);
     info.version = QREXEC_PROTOCOL_VERSION;
@@ -102,6 +106,18 @@ int handle_handshake(libvchan_t *ctrl)
         LOG(ERROR, "Failed to send HELLO hdr to agent");
         return -1;
     }
+    return 0;
+}
+
+int handle_handshake(libvchan_t *ctrl)
+{
+    struct msg_header hdr;
+    struct peer_info info;
+    int actual_version;
+
+    /* send own HELLO */
+    if (send_hello(ctrl) < 0)
+        return -1;
 
     /* receive MSG_HELLO from remote */
     if (libvchan_recv(ctrl, &hdr, sizeof(hdr)) != sizeof(hdr)) {
@@ -130,7 +146,9 @@ int handle_handshake(libvchan_t *ctrl)
 }
 
 
-static int handle_just_exec(char *cmdline)
+/* Start the process given by cmdline with stdin/out/err connected to
+ * /dev/null, and status_fd (if not -1) closed; returns its PID, or -1 */
+static pid_t just_exec(char *cmdline, int status_fd)
 {
     int fdn, pid;
 
@@ -151,13 +169,279 @@ static int handle_just_exec(char *cmdline)
             PERROR("fork");
             return -1;
         case 0:
+            /* do_exec() may wait for the process in a PAM session, do not
+             * keep the caller waiting for EOF meanwhile */
+            if (status_fd >= 0)
+                close(status_fd);
             fdn = open("/dev/null", O_RDWR);
             fix_fds(fdn, fdn, fdn);
             do_exec(realcmd, username);
         default:;
     }
     LOG(INFO, "executed (nowait): %s (pid %d)", cmdline, pid);
-    return 0;
+    return pid;
+}
+
+static int handle_just_exec(char *cmdline)
+{
+    return just_exec(cmdline, -1) < 0 ? -1 : 0;
+}
+
+/* Config of the service in cmdline (all zeros if none) */
+static void service_config(const char *cmdline,
+                           struct qrexec_service_config *config)
+{
+    struct qrexec_parsed_command *cmd;
+
+    memset(config, 0, sizeof(*config));
+    cmd = parse_qubes_rpc_command(cmdline, !qrexec_is_fork_server);
+    if (!cmd)
+        return;
+    if (cmd->service_descriptor)
+        load_service_config_v2(cmd, config);
+    destroy_qrexec_parsed_command(cmd);
+}
+
+/* Set when a service had this process' scheduling changed (see
+ * set_service_scheduling), which then cannot be reused for other calls */
+static bool pump_scheduled;
+
+/* Run the process given by cmdline, pass the data to/from it over the data
+ * vchan (connected to connect_domain on connect_port, for the stripes), and
+ * send its exit code. Returns the exit code. stdin_params (may be NULL) and
+ * stdin_data are initial stdin passed in the request. hello_pending: see
+ * struct process_io_request. */
+static int handle_exec_cmdline(libvchan_t *data_vchan, int data_protocol_version,
+                               bool *hello_pending,
+                               int connect_domain, int connect_port,
+                               char *cmdline,
+                               const struct exec_stdin_params *stdin_params,
+                               const char *stdin_data)
+{
+    int exit_code;
+    struct buffer stdin_buf;
+    struct process_io_request req;
+    struct qrexec_service_config config;
+    int stdin_fd, stdout_fd, stderr_fd;
+    pid_t pid;
+
+    /* the connection may be reused, so start from a clean state */
+    sigchld = 0;
+    sigusr1 = 0;
+    signal(SIGUSR1, sigusr1_handler);
+
+    service_config(cmdline, &config);
+    /* this process passes the data, so it runs like the service */
+    if (set_service_scheduling(&config))
+        pump_scheduled = true;
+
+    buffer_init(&stdin_buf);
+    if (execute_qubes_rpc_command(cmdline, &pid, &stdin_fd, &stdout_fd, &stderr_fd, !qrexec_is_fork_server, &stdin_buf) < 0) {
+        struct msg_header hdr = {
+            .type = MSG_DATA_STDOUT,
+            .len = 0,
+        };
+        LOG(ERROR, "failed to spawn process");
+        /* Send stdout+stderr EOF first, since the service is expected to send
+         * one before exit code in case of MSG_EXEC_CMDLINE. Ignore
+         * libvchan_send error if any, as we're going to terminate soon
+         * anyway.
+         */
+        libvchan_send(data_vchan, &hdr, sizeof(hdr));
+        hdr.type = MSG_DATA_STDERR;
+        libvchan_send(data_vchan, &hdr, sizeof(hdr));
+        exit_code = 127;
+        send_exit_code(data_vchan, exit_code);
+        buffer_free(&stdin_buf);
+        return exit_code;
+    }
+    LOG(INFO, "executed: %s (pid %d)", cmdline, pid);
+
+    if (config.cache_ttl > 0 && data_protocol_version >= QREXEC_PROTOCOL_V11)
+        send_cache_ttl(data_vchan, config.cache_ttl);
+
+    req.vchan = data_vchan;
+    /* after what execute_qubes_rpc_command() may have put there */
+    if (stdin_params)
+        buffer_append(&stdin_buf, stdin_data, stdin_params->len);
+    req.stdin_buf = &stdin_buf;
+    req.stdin_eof = stdin_params && (stdin_params->flags & EXEC_STDIN_EOF);
+
+    req.stdin_fd = stdin_fd;
+    req.stdout_fd = stdout_fd;
+    req.stderr_fd = stderr_fd;
+    req.local_pid = pid;
+
+    req.is_service = true;
+
+    req.replace_chars_stdout = replace_chars_stdout > 0;
+    req.replace_chars_stderr = replace_chars_stderr > 0;
+    req.data_protocol_version = data_protocol_version;
+    req.compress = config.compress > 0;
+    req.max_chunk = config.max_chunk > 0 ? config.max_chunk : 0;
+    req.stripes = NULL;
+    req.stripe_domain = connect_domain;
+    req.stripe_port = connect_port;
+    req.hello_pending = hello_pending;
+
+    req.sigchld = &sigchld;
+    req.sigusr1 = &sigusr1;
+
+    exit_code = process_io(&req);
+
+    LOG(INFO, "pid %d exited with %d", pid, exit_code);
+    buffer_free(&stdin_buf);
+    return exit_code;
+}
+
+/* After a call from dom0 has ended, offer to keep the connection open
+ * (MSG_DATA_IDLE), and wait up to data_vchan_idle_timeout for another command
+ * (MSG_DATA_EXEC_CMDLINE, *cmdline is set to be freed) or MSG_DATA_MUX.
+ * Returns the message type, or -1 if the connection should be closed. */
+static int wait_for_reuse(libvchan_t *data_vchan, int data_protocol_version,
+                          bool *hello_pending, char **cmdline)
+{
+    struct msg_header hdr = { .type = MSG_DATA_IDLE, .len = sizeof(uint32_t) };
+    uint32_t timeout_ms = data_vchan_idle_timeout * 1000;
+    struct pollfd pfd = {
+        .fd = libvchan_fd_for_select(data_vchan),
+        .events = POLLIN,
+    };
+    struct timespec now, deadline;
+    char *buf;
+    int is_open, ret;
+    long remaining;
+
+    if (libvchan_send(data_vchan, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            libvchan_send(data_vchan, &timeout_ms, sizeof(timeout_ms)) !=
+            sizeof(timeout_ms))
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += data_vchan_idle_timeout;
+
+    for (;;) {
+        /* check this first, it may read more data */
+        is_open = libvchan_is_open(data_vchan);
+        while (libvchan_data_ready(data_vchan) >= (int)sizeof(hdr)) {
+            if (libvchan_recv(data_vchan, &hdr, sizeof(hdr)) != sizeof(hdr))
+                return -1;
+            if (hdr.len > MAX_QREXEC_CMD_LEN &&
+                    hdr.len > max_data_chunk_size(data_protocol_version)) {
+                LOG(ERROR, "Too big message on idle data vchan: %" PRIu32,
+                    hdr.len);
+                return -1;
+            }
+            buf = malloc(hdr.len + 1);
+            if (!buf) {
+                PERROR("malloc");
+                return -1;
+            }
+            if (!read_vchan_all(data_vchan, buf, hdr.len)) {
+                free(buf);
+                return -1;
+            }
+            if (hdr.type == MSG_HELLO && !*hello_pending) {
+                LOG(ERROR, "Unexpected MSG_HELLO on idle data vchan");
+                free(buf);
+                return -1;
+            }
+            *hello_pending = false;
+            switch (hdr.type) {
+                case MSG_DATA_STDIN:
+                case MSG_DATA_COMPRESSED:
+                case MSG_HELLO:
+                    /* the rest of the previous process' stdin, and the peer's
+                     * MSG_HELLO if the process failed to start */
+                    free(buf);
+                    break;
+                case MSG_DATA_EXEC_CMDLINE:
+                    if (hdr.len == 0) {
+                        LOG(ERROR, "Empty command line on idle data vchan");
+                        free(buf);
+                        return -1;
+                    }
+                    buf[hdr.len] = '\0';
+                    *cmdline = buf;
+                    return MSG_DATA_EXEC_CMDLINE;
+                case MSG_DATA_MUX:
+                    free(buf);
+                    if (data_protocol_version < QREXEC_PROTOCOL_V7 ||
+                            hdr.len != 0) {
+                        LOG(ERROR, "Unexpected MSG_DATA_MUX");
+                        return -1;
+                    }
+                    return MSG_DATA_MUX;
+                default:
+                    LOG(ERROR, "Unexpected msg %" PRIu32 " on idle data vchan",
+                        hdr.type);
+                    free(buf);
+                    return -1;
+            }
+        }
+        if (!is_open)
+            return -1;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining = (deadline.tv_sec - now.tv_sec) * 1000 +
+            (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (remaining <= 0)
+            return -1;
+        ret = poll(&pfd, 1, remaining);
+        if (ret < 0 && errno != EINTR) {
+            PERROR("poll");
+            return -1;
+        }
+        if (ret > 0 && libvchan_wait(data_vchan) < 0)
+            return -1;
+    }
+}
+
+/* Run processes over a multiplexed connection (after MSG_DATA_MUX) until dom0
+ * closes it. */
+static void handle_mux(libvchan_t *data_vchan, int data_protocol_version)
+{
+    struct process_io_mux_request req = {
+        .vchan = data_vchan,
+        .data_protocol_version = data_protocol_version,
+        .strip_username = !qrexec_is_fork_server,
+        .sigchld = &sigchld,
+    };
+
+    sigchld = 0;
+    /* not supported with many processes, see process_io_mux() */
+    signal(SIGUSR1, SIG_IGN);
+    process_io_mux(&req);
+}
+
+/* Parse what follows the null byte of cmdline in an exec request (see
+ * qrexec.h): return the protocol version of the data connection peer (0 if
+ * not known), and set *stdin_data (NULL if none) and *stdin_params to
+ * initial stdin. */
+static int parse_exec_extra(const char *data, size_t len,
+                            struct exec_stdin_params *stdin_params,
+                            const char **stdin_data)
+{
+    struct peer_info info;
+
+    *stdin_data = NULL;
+    if (len < sizeof(info))
+        return 0;
+    memcpy(&info, data, sizeof(info));
+    data += sizeof(info);
+    len -= sizeof(info);
+    if (len == 0)
+        return info.version;
+    if (len < sizeof(*stdin_params)) {
+        LOG(ERROR, "Bad command from dom0: truncated initial stdin");
+        abort();
+    }
+    memcpy(stdin_params, data, sizeof(*stdin_params));
+    if (stdin_params->len != len - sizeof(*stdin_params)) {
+        LOG(ERROR, "Bad command from dom0: invalid initial stdin length");
+        abort();
+    }
+    *stdin_data = data + sizeof(*stdin_params);
+    return info.version;
 }
 
 /* Behaviour depends on type parameter:
@@ -166,7 +450,9 @@ static int handle_just_exec(char *cmdline)
  *    running), then return 0
  *  MSG_EXEC_CMDLINE - connect to vchan server, fork+exec process given by
  *    cmdline parameter, pass the data to/from that process, then return local
- *    process exit code
+ *    process exit code; if the connection is from dom0, it may then be reused
+ *    for more processes, one at a time or multiplexed (see
+ *    data_vchan_idle_timeout)
  *
  *  buffer_size is about vchan buffer allocated (only for vchan server cases),
  *  use 0 to use built-in default (64k); needs to be power of 2
@@ -179,10 +465,13 @@ static int handle_new_process_common(
     libvchan_t *data_vchan;
     int exit_code;
     int data_protocol_version;
-    struct buffer stdin_buf;
-    struct process_io_request req;
-    int stdin_fd, stdout_fd, stderr_fd;
-    pid_t pid;
+    int peer_version;
+    bool hello_pending = false;
+    char *next_cmdline;
+    int next;
+    char *end;
+    struct exec_stdin_params stdin_params;
+    const char *stdin_data;
 
     assert(type != MSG_SERVICE_CONNECT);
 
@@ -195,20 +484,41 @@ static int handle_new_process_common(
     } else if (cmdline_len == 0) {
         LOG(ERROR, "internal qrexec error: zero-length command line passed to a non-MSG_SERVICE_CONNECT call");
         abort();
-    } else if (cmdline_len > MAX_QREXEC_CMD_LEN) {
+    } else if (cmdline_len > MAX_QREXEC_CMD_LEN + MAX_EXEC_EXTRA_LEN) {
         /* This is arbitrary, but it helps reduce the risk of overflows in other code */
         LOG(ERROR, "Bad command from dom0: command line too long: length %zu", cmdline_len);
         abort();
     }
-    cmdline[cmdline_len-1] = 0;
+    end = memchr(cmdline, 0, cmdline_len);
+    if (!end) {
+        end = cmdline + cmdline_len - 1;
+        *end = 0;
+    }
+    peer_version = parse_exec_extra(end + 1, cmdline + cmdline_len - (end + 1),
+                                    &stdin_params, &stdin_data);
     data_vchan = libvchan_client_init(connect_domain, connect_port);
     if (!data_vchan) {
         LOG(ERROR, "Data vchan connection failed");
         exit(1);
     }
-    data_protocol_version = handle_handshake(data_vchan);
-    if (data_protocol_version < 0) {
-        exit(1);
+    if (peer_version > 0) {
+        /* Known from the request, so do not wait for the peer's MSG_HELLO;
+         * it is checked when it arrives (see handle_remote_data). */
+        if (send_hello(data_vchan) < 0)
+            exit(1);
+        hello_pending = true;
+        data_protocol_version = peer_version < QREXEC_PROTOCOL_VERSION ?
+            peer_version : QREXEC_PROTOCOL_VERSION;
+        if (data_protocol_version < QREXEC_DATA_MIN_VERSION) {
+            LOG(ERROR, "Incompatible peer protocol version (remote %d, local %d)",
+                peer_version, QREXEC_PROTOCOL_VERSION);
+            exit(1);
+        }
+    } else {
+        data_protocol_version = handle_handshake(data_vchan);
+        if (data_protocol_version < 0) {
+            exit(1);
+        }
     }
 
     prepare_child_env();
@@ -221,27 +531,32 @@ static int handle_new_process_common(
             libvchan_close(data_vchan);
             return 0;
         case MSG_EXEC_CMDLINE:
-            buffer_init(&stdin_buf);
-            if (execute_qubes_rpc_command(cmdline, &pid, &stdin_fd, &stdout_fd, &stderr_fd, !qrexec_is_fork_server, &stdin_buf) < 0) {
-                struct msg_header hdr = {
-                    .type = MSG_DATA_STDOUT,
-                    .len = 0,
-                };
-                LOG(ERROR, "failed to spawn process");
-                /* Send stdout+stderr EOF first, since the service is expected to send
-                 * one before exit code in case of MSG_EXEC_CMDLINE. Ignore
-                 * libvchan_send error if any, as we're going to terminate soon
-                 * anyway.
-                 */
-                libvchan_send(data_vchan, &hdr, sizeof(hdr));
-                hdr.type = MSG_DATA_STDERR;
-                libvchan_send(data_vchan, &hdr, sizeof(hdr));
-                exit_code = 127;
-                send_exit_code(data_vchan, exit_code);
-                libvchan_close(data_vchan);
-                return exit_code;
+            exit_code = handle_exec_cmdline(data_vchan, data_protocol_version,
+                                            &hello_pending,
+                                            connect_domain, connect_port,
+                                            cmdline,
+                                            stdin_data ? &stdin_params : NULL,
+                                            stdin_data);
+            /* Only dom0 can reuse the connection: a command from another VM
+             * must go through qrexec-daemon (and the policy) each time. */
+            if (connect_domain != 0 || data_vchan_idle_timeout <= 0 ||
+                    pump_scheduled)
+                break;
+            while (!pump_scheduled &&
+                    (next = wait_for_reuse(data_vchan, data_protocol_version,
+                                           &hello_pending, &next_cmdline)) ==
+                    MSG_DATA_EXEC_CMDLINE) {
+                exit_code = handle_exec_cmdline(data_vchan,
+                                                data_protocol_version,
+                                                &hello_pending,
+                                                connect_domain, connect_port,
+                                                next_cmdline, NULL, NULL);
+                free(next_cmdline);
+            }
+            if (next == MSG_DATA_MUX) {
+                handle_mux(data_vchan, data_protocol_version);
+                exit_code = 0;
             }
-            LOG(INFO, "executed: %s (pid %d)", cmdline, pid);
             break;
         default:
             LOG(ERROR, "unknown request type: %d", type);
@@ -249,28 +564,6 @@ static int handle_new_process_common(
             return 0;
     }
 
-    req.vchan = data_vchan;
-    req.stdin_buf = &stdin_buf;
-
-    req.stdin_fd = stdin_fd;
-    req.stdout_fd = stdout_fd;
-    req.stderr_fd = stderr_fd;
-    req.local_pid = pid;
-
-    req.is_service = true;
-
-    req.replace_chars_stdout = replace_chars_stdout > 0;
-    req.replace_chars_stderr = replace_chars_stderr > 0;
-    req.data_protocol_version = data_protocol_version;
-
-    req.sigchld = &sigchld;
-    req.sigusr1 = &sigusr1;
-
-    exit_code = process_io(&req);
-
-    if (type == MSG_EXEC_CMDLINE)
-        LOG(INFO, "pid %d exited with %d", pid, exit_code);
-
     libvchan_close(data_vchan);
     return exit_code;
 }
@@ -300,10 +593,63 @@ pid_t handle_new_process(int type, int connect_domain, int connect_port,
     exit(exit_code);
 }
 
+/* MSG_JUST_EXEC_NO_DATA: fork a process that starts the command and writes
+ * the outcome to status_fd, as int32_t: the status of struct exec_status, and
+ * then, if asked to (see struct just_exec_params), the exit code of the
+ * command. Returns its PID. */
+pid_t handle_just_exec_no_data(int status_fd, char *cmdline, size_t cmdline_len)
+{
+    struct just_exec_params params = { .flags = 0 };
+    int32_t status;
+    pid_t pid, cmd_pid;
+    char *end;
+    int wstatus;
+
+    switch (pid = fork()) {
+        case -1:
+            PERROR("fork");
+            return -1;
+        case 0:
+            break;
+        default:
+            return pid;
+    }
+
+    /* child process */
+    end = memchr(cmdline, 0, cmdline_len);
+    if (!end) {
+        end = cmdline + cmdline_len - 1;
+        *end = 0;
+    }
+    if ((size_t)(cmdline + cmdline_len - (end + 1)) >= sizeof(params))
+        memcpy(&params, end + 1, sizeof(params));
+    prepare_child_env();
+
+    cmd_pid = just_exec(cmdline, status_fd);
+    status = cmd_pid < 0 ? -1 : 0;
+    if (!write_all(status_fd, &status, sizeof(status)))
+        exit(1);
+    if (cmd_pid < 0 || !(params.flags & JUST_EXEC_NOTIFY_EXIT))
+        exit(0);
+
+    while (waitpid(cmd_pid, &wstatus, 0) < 0) {
+        if (errno != EINTR) {
+            PERROR("waitpid");
+            exit(1);
+        }
+    }
+    status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) :
+        128 + WTERMSIG(wstatus);
+    if (!write_all(status_fd, &status, sizeof(status)))
+        exit(1);
+    exit(0);
+}
+
 /* Returns exit code of remote process */
 int handle_data_client(
     int type, int connect_domain, int connect_port,
-    int stdin_fd, int stdout_fd, int stderr_fd, int buffer_size, pid_t pid)
+    int stdin_fd, int stdout_fd, int stderr_fd, int buffer_size, pid_t pid,
+    bool compress, int stripe_count, size_t max_chunk)
 {
     int exit_code;
     int data_protocol_version;
@@ -329,8 +675,16 @@ int handle_data_client(
 
     buffer_init(&stdin_buf);
 
+    req.stripes = NULL;
+    if (stripe_count > 0 && data_protocol_version >= QREXEC_PROTOCOL_V9)
+        req.stripes = stripes_listen(data_vchan, connect_domain, connect_port,
+                                     stripe_count, buffer_size);
+    req.stripe_domain = req.stripe_port = 0;
+    req.hello_pending = NULL;
+
     req.vchan = data_vchan;
     req.stdin_buf = &stdin_buf;
+    req.stdin_eof = false;
 
     req.stdin_fd = stdin_fd;
     req.stdout_fd = stdout_fd;
@@ -342,6 +696,8 @@ int handle_data_client(
     req.replace_chars_stdout = replace_chars_stdout > 0;
     req.replace_chars_stderr = replace_chars_stderr > 0;
     req.data_protocol_version = data_protocol_version;
+    req.compress = compress;
+    req.max_chunk = max_chunk;
 
     req.sigchld = &sigchld;
     req.sigusr1 = &sigusr1;
@@ -19,7 +19,7 @@
  *
  */
 
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdio.h>
@@ -52,6 +52,10 @@ struct _connection_info {
     int fd;  /* socket to the process handling the data (wait for EOF here) */
     int connect_domain;
     int connect_port;
+    /* MSG_JUST_EXEC_NO_DATA: fd carries the status (see
+     * handle_just_exec_no_data), and how many were received */
+    bool exec_status;
+    int exec_status_count;
 };
 
 /* structure describing a single request waiting for qubes.WaitForSession to
@@ -60,8 +64,8 @@ struct _waiting_request {
     int type;
     int connect_domain;
     int connect_port;
-    int padding;
     char *cmdline;
+    size_t cmdline_len;
 };
 
 /*  */
@@ -70,11 +74,45 @@ static struct _connection_info connection_info[MAX_FDS];
 static struct _waiting_request requests_waiting_for_session[MAX_FDS];
 
 static libvchan_t *ctrl_vchan;
+static int ctrl_protocol_version;
+
+/* The control connection is resumed when qrexec-daemon reconnects (protocol
+ * 4+), see MSG_CONNECTION_SYNC. Data written to the vchan is kept in ctrl_log,
+ * and ctrl_rx_bytes counts data received (excluding MSG_HELLO and
+ * MSG_CONNECTION_SYNC). Messages that cannot be sent right now are held in
+ * ctrl_out. */
+static bool ctrl_broken;
+static bool ctrl_connected_before;
+static bool ctrl_sync_sent;
+static bool ctrl_sync_received;
+/* waiting for MSG_CONNECTION_SYNC from the daemon, output is held */
+static bool ctrl_sync_pending;
+static uint64_t ctrl_rx_bytes;
+/* received on this connection */
+static uint64_t ctrl_conn_rx_bytes;
+static struct replay_log ctrl_log;
+static struct buffer ctrl_out;
+
+/* qrexec-client-vm connections with a service request sent to dom0, waiting
+ * for MSG_SERVICE_CONNECT or MSG_SERVICE_REFUSED */
+static int *pending_triggers;
+static int pending_triggers_count;
+static int pending_triggers_size;
 
 static pid_t wait_for_session_pid = -1;
 
 static int trigger_fd;
 
+/* The main event loop waits on main_epoll_fd, which contains the control
+ * vchan fd (keyed by fd) and local_epoll_fd. The latter contains trigger_fd
+ * (keyed by NULL pointer) and sockets of registered connections (keyed by
+ * pointer to their connection_info entry); it is disabled while there is no
+ * space in the vchan. */
+#define MAX_EPOLL_EVENTS 64
+static int main_epoll_fd = -1;
+static int local_epoll_fd = -1;
+static bool local_epoll_enabled;
+
 static int terminate_requested;
 
 static int meminfo_write_started = 0;
@@ -82,7 +120,12 @@ static int meminfo_write_started = 0;
 static const char *agent_trigger_path = QREXEC_AGENT_TRIGGER_PATH;
 static const char *fork_server_path = QREXEC_FORK_SERVER_SOCKET;
 
-static void handle_server_exec_request_do(int type, int connect_domain, int connect_port, char *cmdline);
+static void handle_server_exec_request_do(int type, int connect_domain, int connect_port,
+                                          char *cmdline, size_t cmdline_len);
+static void ctrl_peer_restarted(void);
+static void release_port(int connect_domain, int connect_port);
+static void send_exec_status(int connect_domain, int connect_port,
+                             uint32_t flags, int32_t status);
 
 const bool qrexec_is_fork_server = false;
 
@@ -331,6 +374,39 @@ _Noreturn void handle_vchan_error(const char *op)
     exit(1);
 }
 
+static void epoll_add(int epfd, int fd, epoll_data_t data)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data = data };
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        PERROR("epoll_ctl(EPOLL_CTL_ADD, %d)", fd);
+        exit(1);
+    }
+}
+
+static void epoll_del(int epfd, int fd)
+{
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+        PERROR("epoll_ctl(EPOLL_CTL_DEL, %d)", fd);
+}
+
+/* (Stop) reading local sockets - used to not overflow the vchan */
+static void set_local_epoll_enabled(bool enabled)
+{
+    struct epoll_event ev = {
+        .events = enabled ? EPOLLIN : 0,
+        .data.fd = local_epoll_fd,
+    };
+
+    if (enabled == local_epoll_enabled)
+        return;
+    if (epoll_ctl(main_epoll_fd, EPOLL_CTL_MOD, local_epoll_fd, &ev) < 0) {
+        PERROR("epoll_ctl(EPOLL_CTL_MOD)");
+        exit(1);
+    }
+    local_epoll_enabled = enabled;
+}
+
 int my_sd_notify(int unset_environment, const char *state) {
     struct sockaddr_un addr;
     int fd;
@@ -367,6 +443,230 @@ out:
     return ret;
 }
 
+static void pending_trigger_add(int fd)
+{
+    int *new_triggers;
+
+    if (pending_triggers_count == pending_triggers_size) {
+        pending_triggers_size = pending_triggers_size ? 2 * pending_triggers_size : 16;
+        new_triggers = realloc(pending_triggers,
+                               pending_triggers_size * sizeof(*pending_triggers));
+        if (!new_triggers) {
+            PERROR("realloc");
+            exit(1);
+        }
+        pending_triggers = new_triggers;
+    }
+    pending_triggers[pending_triggers_count++] = fd;
+}
+
+static void pending_trigger_remove(int fd)
+{
+    int i;
+
+    for (i = 0; i < pending_triggers_count; i++) {
+        if (pending_triggers[i] == fd) {
+            pending_triggers[i] = pending_triggers[--pending_triggers_count];
+            return;
+        }
+    }
+}
+
+/* Send the held messages, as long as the connection works. */
+static void ctrl_flush(void)
+{
+    struct msg_header hdr;
+    size_t len;
+
+    if (ctrl_broken || ctrl_sync_pending)
+        return;
+    while (buffer_len(&ctrl_out) > 0) {
+        memcpy(&hdr, buffer_data(&ctrl_out), sizeof(hdr));
+        len = sizeof(hdr) + hdr.len;
+        if (libvchan_send(ctrl_vchan, buffer_data(&ctrl_out), len) < 0) {
+            ctrl_broken = true;
+            return;
+        }
+        replay_log_append(&ctrl_log, buffer_data(&ctrl_out), len);
+        buffer_remove(&ctrl_out, len);
+    }
+}
+
+/* Send a message to the daemon (hdr->len bytes of data), or hold it until the
+ * connection works again. */
+static void ctrl_send(const struct msg_header *hdr, const void *data)
+{
+    buffer_append(&ctrl_out, (const char *)hdr, sizeof(*hdr));
+    buffer_append(&ctrl_out, data, hdr->len);
+    ctrl_flush();
+}
+
+static void send_connection_sync(uint32_t flags)
+{
+    struct {
+        struct msg_header hdr;
+        struct connection_sync sync;
+        struct connection_sync_port ports[MAX_FDS];
+    } msg;
+    uint32_t nports = 0;
+    int i;
+
+    /* ports that the daemon should not allocate again */
+    for (i = 0; i < MAX_FDS; i++) {
+        if (connection_info[i].pid == 0)
+            continue;
+        if (nports == MAX_FDS) {
+            flags |= CONNECTION_SYNC_NO_PORTS;
+            break;
+        }
+        msg.ports[nports].connect_domain = connection_info[i].connect_domain;
+        msg.ports[nports].connect_port = connection_info[i].connect_port;
+        nports++;
+    }
+    for (i = 0; i < MAX_FDS && !(flags & CONNECTION_SYNC_NO_PORTS); i++) {
+        if (!requests_waiting_for_session[i].cmdline)
+            continue;
+        if (nports == MAX_FDS) {
+            flags |= CONNECTION_SYNC_NO_PORTS;
+            break;
+        }
+        msg.ports[nports].connect_domain = requests_waiting_for_session[i].connect_domain;
+        msg.ports[nports].connect_port = requests_waiting_for_session[i].connect_port;
+        nports++;
+    }
+    if (flags & CONNECTION_SYNC_NO_PORTS)
+        nports = 0;
+
+    msg.hdr.type = MSG_CONNECTION_SYNC;
+    msg.hdr.len = sizeof(msg.sync) + nports * sizeof(msg.ports[0]);
+    msg.sync.flags = flags;
+    msg.sync.nports = nports;
+    msg.sync.rx_bytes = ctrl_rx_bytes;
+    if (libvchan_send(ctrl_vchan, &msg, sizeof(msg.hdr) + msg.hdr.len) < 0)
+        ctrl_broken = true;
+    ctrl_sync_sent = true;
+}
+
+static void end_sync_wait(void)
+{
+    ctrl_sync_pending = false;
+    ctrl_flush();
+}
+
+/* Called when qrexec-daemon connects. */
+static void start_ctrl_session(void)
+{
+    ctrl_sync_sent = false;
+    ctrl_sync_received = false;
+    ctrl_sync_pending = false;
+    ctrl_conn_rx_bytes = 0;
+    if (ctrl_protocol_version < QREXEC_PROTOCOL_V4) {
+        /* cannot tell, assume the worst */
+        ctrl_peer_restarted();
+        ctrl_flush();
+        return;
+    }
+    /* hold the output until the daemon tells what it has received */
+    send_connection_sync(0);
+    ctrl_sync_pending = true;
+}
+
+/* qrexec-daemon was restarted, service requests sent to it are lost. Requests
+ * not sent yet are still valid. */
+static void ctrl_peer_restarted(void)
+{
+    struct buffer kept;
+    struct msg_header hdr;
+    struct trigger_service_params3 params;
+    const char *msg = buffer_data(&ctrl_out);
+    const char *end = msg + buffer_len(&ctrl_out);
+    int i, fd, kept_fd;
+
+    LOG(WARNING, "qrexec-daemon was restarted");
+    buffer_init(&kept);
+    for (; msg < end; msg += sizeof(hdr) + hdr.len) {
+        memcpy(&hdr, msg, sizeof(hdr));
+        /* connections that are gone are not known to the new daemon */
+        if (hdr.type != MSG_TRIGGER_SERVICE3)
+            continue;
+        buffer_append(&kept, msg, sizeof(hdr) + hdr.len);
+    }
+    buffer_free(&ctrl_out);
+    ctrl_out = kept;
+
+    for (i = 0; i < pending_triggers_count; ) {
+        fd = pending_triggers[i];
+        for (msg = buffer_data(&ctrl_out), end = msg + buffer_len(&ctrl_out);
+                msg < end; msg += sizeof(hdr) + hdr.len) {
+            memcpy(&hdr, msg, sizeof(hdr));
+            memcpy(&params, msg + sizeof(hdr), sizeof(params));
+            if (sscanf(params.request_id.ident, "SOCKET%d", &kept_fd) == 1 &&
+                    kept_fd == fd)
+                break;
+        }
+        if (msg < end) {
+            i++;
+            continue;
+        }
+        /* looks like a refused call to qrexec-client-vm */
+        pending_triggers[i] = pending_triggers[--pending_triggers_count];
+        close(fd);
+    }
+
+    replay_log_free(&ctrl_log);
+    replay_log_init(&ctrl_log, 0);
+    ctrl_rx_bytes = ctrl_conn_rx_bytes;
+}
+
+/* The daemon kept the connection state, send again what it did not
+ * receive. */
+static void ctrl_resume(uint64_t daemon_rx_bytes)
+{
+    struct buffer out;
+
+    buffer_init(&out);
+    if (!replay_log_rewind(&ctrl_log, daemon_rx_bytes, &out)) {
+        LOG(ERROR, "Cannot resume connection: daemon received %llu bytes, "
+            "%llu-%llu available", (unsigned long long)daemon_rx_bytes,
+            (unsigned long long)ctrl_log.start,
+            (unsigned long long)ctrl_log.end);
+        exit(1);
+    }
+    buffer_append(&out, buffer_data(&ctrl_out), buffer_len(&ctrl_out));
+    buffer_free(&ctrl_out);
+    ctrl_out = out;
+    LOG(INFO, "Resumed connection to qrexec-daemon");
+}
+
+/* hdr and data parameters are received from dom0, so they are trusted */
+static void handle_connection_sync(struct msg_header *hdr, char *data)
+{
+    struct connection_sync sync;
+
+    if (hdr->len < sizeof(sync) || ctrl_protocol_version < QREXEC_PROTOCOL_V4 ||
+            ctrl_sync_received) {
+        LOG(ERROR, "Unexpected MSG_CONNECTION_SYNC from daemon");
+        exit(1);
+    }
+    memcpy(&sync, data, sizeof(sync));
+    ctrl_sync_received = true;
+
+    if (!ctrl_sync_sent) {
+        /* first connection, nothing to resume */
+        if (!(sync.flags & CONNECTION_SYNC_FRESH))
+            send_connection_sync(CONNECTION_SYNC_FRESH);
+        return;
+    }
+    if (!ctrl_sync_pending)
+        /* fresh daemon, already handled when it sent something else */
+        return;
+    if (sync.flags & CONNECTION_SYNC_FRESH)
+        ctrl_peer_restarted();
+    else
+        ctrl_resume(sync.rx_bytes);
+    end_sync_wait();
+}
+
 static void init(void)
 {
     mode_t old_umask;
@@ -374,13 +674,32 @@ static void init(void)
     ctrl_vchan = libvchan_server_init(0, VCHAN_BASE_PORT, 4096, 4096);
     if (!ctrl_vchan)
         handle_vchan_error("server_init");
-    if (handle_handshake(ctrl_vchan) < 0)
+    ctrl_protocol_version = handle_handshake(ctrl_vchan);
+    if (ctrl_protocol_version < 0)
         exit(1);
+    ctrl_connected_before = true;
+    replay_log_init(&ctrl_log, 0);
+    buffer_init(&ctrl_out);
     old_umask = umask(0);
     trigger_fd = get_server_socket(agent_trigger_path);
     umask(old_umask);
+    /* handle_trigger_io() accepts until there are no more connections */
+    set_nonblock(trigger_fd);
     register_exec_func(do_exec);
 
+    main_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    local_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (main_epoll_fd < 0 || local_epoll_fd < 0) {
+        PERROR("epoll_create1");
+        exit(1);
+    }
+    epoll_add(main_epoll_fd, local_epoll_fd,
+              (epoll_data_t){ .fd = local_epoll_fd });
+    local_epoll_enabled = true;
+    epoll_add(main_epoll_fd, libvchan_fd_for_select(ctrl_vchan),
+              (epoll_data_t){ .fd = libvchan_fd_for_select(ctrl_vchan) });
+    epoll_add(local_epoll_fd, trigger_fd, (epoll_data_t){ .ptr = NULL });
+
     /* wait for qrexec daemon */
     while (!libvchan_is_open(ctrl_vchan))
         libvchan_wait(ctrl_vchan);
@@ -432,7 +751,7 @@ static int try_fork_server(int type, int connect_domain, int connect_port,
     if (!fork_server_path)
         return -1;
 
-    if (cmdline_len > MAX_QREXEC_CMD_LEN)
+    if (cmdline_len > MAX_QREXEC_CMD_LEN + MAX_EXEC_EXTRA_LEN)
         return -1;
     char *username = malloc(cmdline_len);
     if (!username) {
@@ -494,7 +813,8 @@ fail:
 }
 
 
-static void register_vchan_connection(pid_t pid, int fd, int domain, int port)
+static void register_vchan_connection(pid_t pid, int fd, int domain, int port,
+                                      bool exec_status)
 {
     int i;
 
@@ -504,6 +824,11 @@ static void register_vchan_connection(pid_t pid, int fd, int domain, int port)
             connection_info[i].fd = fd;
             connection_info[i].connect_domain = domain;
             connection_info[i].connect_port = port;
+            connection_info[i].exec_status = exec_status;
+            connection_info[i].exec_status_count = 0;
+            if (fd >= 0)
+                epoll_add(local_epoll_fd, fd,
+                          (epoll_data_t){ .ptr = &connection_info[i] });
             return;
         }
     }
@@ -521,8 +846,8 @@ static void register_vchan_connection(pid_t pid, int fd, int domain, int port)
  */
 static int wait_for_session_maybe(char *cmdline) {
     struct qrexec_parsed_command *cmd;
+    struct qrexec_service_config config = { 0 };
     int stdin_pipe[2];
-    int wait_for_session = 0;
     int ret = 0;
     sigset_t sigmask;
 
@@ -540,9 +865,9 @@ static int wait_for_session_maybe(char *cmdline) {
         goto out;
 
     /* load service config - if it fails, use initial value */
-    load_service_config(cmd, &wait_for_session);
+    load_service_config_v2(cmd, &config);
 
-    if (!wait_for_session)
+    if (!config.wait_for_session)
         /* setting not set, or set to 0 */
         goto out;
 
@@ -590,22 +915,19 @@ out:
 }
 
 
-/* hdr parameter is received from dom0, so it is trusted */
-static void handle_server_exec_request_init(struct msg_header *hdr)
+/* hdr and data parameters are received from dom0, so they are trusted */
+static void handle_server_exec_request_init(struct msg_header *hdr, char *data)
 {
     struct exec_params params;
     int buf_len = hdr->len-sizeof(params);
-    char *buf = malloc(buf_len);
-    if (!buf) abort();
+    char *buf = data + sizeof(params);
 
     assert((hdr->len >= sizeof params));
 
-    if (libvchan_recv(ctrl_vchan, &params, sizeof(params)) < 0)
-        handle_vchan_error("read exec params");
-    if (libvchan_recv(ctrl_vchan, buf, buf_len) < 0)
-        handle_vchan_error("read exec cmd");
-
-    buf[buf_len-1] = 0;
+    memcpy(&params, data, sizeof(params));
+    /* keep what follows the null byte, if any (see qrexec.h) */
+    if (!memchr(buf, 0, buf_len))
+        buf[buf_len-1] = 0;
 
     if (hdr->type != MSG_SERVICE_CONNECT && wait_for_session_maybe(buf)) {
         /* waiting for session, postpone actual call */
@@ -620,25 +942,33 @@ static void handle_server_exec_request_init(struct msg_header *hdr)
             requests_waiting_for_session[slot_index].type = hdr->type;
             requests_waiting_for_session[slot_index].connect_domain = params.connect_domain;
             requests_waiting_for_session[slot_index].connect_port = params.connect_port;
-            requests_waiting_for_session[slot_index].cmdline = strdup(buf);
+            requests_waiting_for_session[slot_index].cmdline = malloc(buf_len);
+            if (!requests_waiting_for_session[slot_index].cmdline)
+                abort();
+            memcpy(requests_waiting_for_session[slot_index].cmdline, buf, buf_len);
+            requests_waiting_for_session[slot_index].cmdline_len = buf_len;
             /* nothing to do now, when we get GUI session, we'll continue */
             return;
         }
     }
 
-    handle_server_exec_request_do(hdr->type, params.connect_domain, params.connect_port, buf);
+    handle_server_exec_request_do(hdr->type, params.connect_domain, params.connect_port,
+                                  buf, buf_len);
 }
 
-static void handle_server_exec_request_do(int type, int connect_domain, int connect_port, char *cmdline) {
+/* cmdline_len includes the null byte, and anything after it (see
+ * handle_new_process) */
+static void handle_server_exec_request_do(int type, int connect_domain, int connect_port,
+                                          char *cmdline, size_t cmdline_len) {
     int client_fd;
     pid_t child_agent;
-    size_t cmdline_len = strlen(cmdline) + 1; // size of cmdline, including \0 at the end
     struct exec_params params = {
         .connect_domain = connect_domain,
         .connect_port = connect_port,
     };
 
-    if ((type == MSG_EXEC_CMDLINE || type == MSG_JUST_EXEC) &&
+    if ((type == MSG_EXEC_CMDLINE || type == MSG_JUST_EXEC ||
+                type == MSG_JUST_EXEC_NO_DATA) &&
             !strstr(cmdline, ":nogui:")) {
         int child_socket;
 
@@ -647,12 +977,33 @@ static void handle_server_exec_request_do(int type, int connect_domain, int conn
                 cmdline, cmdline_len);
         if (child_socket >= 0) {
             register_vchan_connection(-1, child_socket,
-                    params.connect_domain, params.connect_port);
+                    params.connect_domain, params.connect_port,
+                    type == MSG_JUST_EXEC_NO_DATA);
+            return;
+        }
+    }
+
+    if (type == MSG_JUST_EXEC_NO_DATA) {
+        int status_socket[2];
+
+        /* the same as with the fork server, only with a local process */
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+                       status_socket) < 0) {
+            PERROR("socketpair");
+            send_exec_status(connect_domain, connect_port, 0, -1);
+            release_port(connect_domain, connect_port);
             return;
         }
+        handle_just_exec_no_data(status_socket[1], cmdline, cmdline_len);
+        close(status_socket[1]);
+        /* if that failed, EOF reports it */
+        register_vchan_connection(-1, status_socket[0],
+                params.connect_domain, params.connect_port, true);
+        return;
     }
 
     if (type == MSG_SERVICE_CONNECT && sscanf(cmdline, "SOCKET%d", &client_fd)) {
+        pending_trigger_remove(client_fd);
         /* FIXME: Maybe add some check if client_fd is really FD to some
          * qrexec-client-vm process; but this data comes from qrexec-daemon
          * (which sends back what it got from us earlier), so it isn't critical.
@@ -675,7 +1026,7 @@ static void handle_server_exec_request_do(int type, int connect_domain, int conn
          * (close socket, send MSG_CONNECTION_TERMINATED) when qrexec-client-vm
          * will close the socket (terminate itself). */
         register_vchan_connection(-1, client_fd,
-                params.connect_domain, params.connect_port);
+                params.connect_domain, params.connect_port, false);
         return;
     }
 
@@ -685,10 +1036,10 @@ static void handle_server_exec_request_do(int type, int connect_domain, int conn
             cmdline, cmdline_len);
 
     register_vchan_connection(child_agent, -1,
-            params.connect_domain, params.connect_port);
+            params.connect_domain, params.connect_port, false);
 }
 
-static void handle_service_refused(struct msg_header *hdr)
+static void handle_service_refused(struct msg_header *hdr, char *data)
 {
     struct service_params params;
     int socket_fd;
@@ -697,22 +1048,26 @@ static void handle_service_refused(struct msg_header *hdr)
         LOG(ERROR, "Invalid msg 0x%x length (%d)", MSG_SERVICE_REFUSED, hdr->len);
         exit(1);
     }
+    memcpy(&params, data, sizeof(params));
 
-    if (libvchan_recv(ctrl_vchan, &params, sizeof(params)) < 0)
-        handle_vchan_error("read exec params");
-
-    if (sscanf(params.ident, "SOCKET%d", &socket_fd))
+    if (sscanf(params.ident, "SOCKET%d", &socket_fd)) {
+        pending_trigger_remove(socket_fd);
         close(socket_fd);
-    else
+    } else
         LOG(WARNING, "Received REFUSED for unknown service request '%s'", params.ident);
 }
 
 static void handle_server_cmd(void)
 {
     struct msg_header s_hdr;
+    char *data;
 
-    if (libvchan_recv(ctrl_vchan, &s_hdr, sizeof(s_hdr)) < 0)
-        handle_vchan_error("read s_hdr");
+    /* If the connection breaks in the middle of a message, the daemon will
+     * send it again. */
+    if (libvchan_recv(ctrl_vchan, &s_hdr, sizeof(s_hdr)) < 0) {
+        ctrl_broken = true;
+        return;
+    }
 
     //      fprintf(stderr, "got %x %x %x\n", s_hdr.type, s_hdr.client_id,
     //              s_hdr.len);
@@ -720,18 +1075,50 @@ static void handle_server_cmd(void)
     switch (s_hdr.type) {
         case MSG_EXEC_CMDLINE:
         case MSG_JUST_EXEC:
+        case MSG_JUST_EXEC_NO_DATA:
         case MSG_SERVICE_CONNECT:
-            wake_meminfo_writer();
-            handle_server_exec_request_init(&s_hdr);
-            break;
         case MSG_SERVICE_REFUSED:
-            handle_service_refused(&s_hdr);
+        case MSG_CONNECTION_SYNC:
             break;
         default:
             LOG(ERROR, "msg type from daemon is %d ?",
                 s_hdr.type);
             exit(1);
     }
+    data = malloc(s_hdr.len);
+    if (s_hdr.len && !data) abort();
+    if (libvchan_recv(ctrl_vchan, data, s_hdr.len) < 0) {
+        free(data);
+        ctrl_broken = true;
+        return;
+    }
+
+    if (s_hdr.type == MSG_CONNECTION_SYNC) {
+        handle_connection_sync(&s_hdr, data);
+        free(data);
+        return;
+    }
+    /* a daemon that was connected before sends MSG_CONNECTION_SYNC first */
+    if (ctrl_sync_pending) {
+        ctrl_peer_restarted();
+        end_sync_wait();
+    }
+    ctrl_rx_bytes += sizeof(s_hdr) + s_hdr.len;
+    ctrl_conn_rx_bytes += sizeof(s_hdr) + s_hdr.len;
+
+    switch (s_hdr.type) {
+        case MSG_EXEC_CMDLINE:
+        case MSG_JUST_EXEC:
+        case MSG_JUST_EXEC_NO_DATA:
+        case MSG_SERVICE_CONNECT:
+            wake_meminfo_writer();
+            handle_server_exec_request_init(&s_hdr, data);
+            break;
+        case MSG_SERVICE_REFUSED:
+            handle_service_refused(&s_hdr, data);
+            break;
+    }
+    free(data);
 }
 
 static volatile sig_atomic_t child_exited;
@@ -756,21 +1143,39 @@ static int find_connection(int pid)
     return -1;
 }
 
-static void release_connection(int id) {
+static void release_port(int connect_domain, int connect_port) {
     struct msg_header hdr;
     struct exec_params params;
 
     hdr.type = MSG_CONNECTION_TERMINATED;
     hdr.len = sizeof(struct exec_params);
-    params.connect_domain = connection_info[id].connect_domain;
-    params.connect_port = connection_info[id].connect_port;
-    if (libvchan_send(ctrl_vchan, &hdr, sizeof(hdr)) < 0)
-        handle_vchan_error("send (MSG_CONNECTION_TERMINATED hdr)");
-    if (libvchan_send(ctrl_vchan, &params, sizeof(params)) < 0)
-        handle_vchan_error("send (MSG_CONNECTION_TERMINATED data)");
+    params.connect_domain = connect_domain;
+    params.connect_port = connect_port;
+    ctrl_send(&hdr, &params);
+}
+
+static void release_connection(int id) {
+    release_port(connection_info[id].connect_domain,
+                 connection_info[id].connect_port);
     connection_info[id].pid = 0;
 }
 
+static void send_exec_status(int connect_domain, int connect_port,
+                             uint32_t flags, int32_t status) {
+    struct msg_header hdr = {
+        .type = MSG_EXEC_STATUS,
+        .len = sizeof(struct exec_status),
+    };
+    struct exec_status exec_status = {
+        .connect_domain = connect_domain,
+        .connect_port = connect_port,
+        .flags = flags,
+        .status = status,
+    };
+
+    ctrl_send(&hdr, &exec_status);
+}
+
 static void reap_children(void)
 {
     int status;
@@ -785,7 +1190,8 @@ static void reap_children(void)
                         requests_waiting_for_session[id].type,
                         requests_waiting_for_session[id].connect_domain,
                         requests_waiting_for_session[id].connect_port,
-                        requests_waiting_for_session[id].cmdline);
+                        requests_waiting_for_session[id].cmdline,
+                        requests_waiting_for_session[id].cmdline_len);
                 free(requests_waiting_for_session[id].cmdline);
                 requests_waiting_for_session[id].cmdline = NULL;
             }
@@ -800,38 +1206,14 @@ static void reap_children(void)
     child_exited = 0;
 }
 
-static int fill_fds_for_select(fd_set * rdset, fd_set * wrset)
-{
-    int max = -1;
-    int i;
-    FD_ZERO(rdset);
-    FD_ZERO(wrset);
-
-    FD_SET(trigger_fd, rdset);
-    if (trigger_fd > max)
-        max = trigger_fd;
-
-    for (i = 0; i < MAX_FDS; i++) {
-        if (connection_info[i].pid != 0 && connection_info[i].fd != -1) {
-            FD_SET(connection_info[i].fd, rdset);
-            if (connection_info[i].fd > max)
-                max = connection_info[i].fd;
-        }
-    }
-    return max;
-}
-
-static void handle_trigger_io()
+static void handle_trigger_request(int client_fd)
 {
     struct msg_header hdr;
     struct trigger_service_params3 params;
     char *command = NULL;
+    char *data;
     size_t command_len;
-    int client_fd;
 
-    client_fd = do_accept(trigger_fd);
-    if (client_fd < 0)
-        return;
     if (!read_all(client_fd, &hdr, sizeof(hdr)))
         goto error;
     if (hdr.type != MSG_TRIGGER_SERVICE3 ||
@@ -852,13 +1234,15 @@ static void handle_trigger_io()
         goto error;
 
     snprintf(params.request_id.ident, sizeof(params.request_id), "SOCKET%d", client_fd);
-    if (libvchan_send(ctrl_vchan, &hdr, sizeof(hdr)) < 0)
-        handle_vchan_error("write hdr");
-    if (libvchan_send(ctrl_vchan, &params, sizeof(params)) < 0)
-        handle_vchan_error("write params");
-    if (libvchan_send(ctrl_vchan, command, command_len) < 0)
-        handle_vchan_error("write command");
+    data = malloc(hdr.len);
+    if (!data)
+        goto error;
+    memcpy(data, &params, sizeof(params));
+    memcpy(data + sizeof(params), command, command_len);
+    pending_trigger_add(client_fd);
+    ctrl_send(&hdr, data);
 
+    free(data);
     free(command);
     /* do not close client_fd - we'll need it to send the connection details
      * later (when dom0 accepts the request) */
@@ -870,25 +1254,114 @@ error:
     close(client_fd);
 }
 
-static void handle_terminated_fork_client(fd_set *rdset) {
-    int i;
+/* Accept all pending requests, as long as they can be sent to dom0 right
+ * away. */
+static void handle_trigger_io(void)
+{
+    int client_fd;
+
+    while (!ctrl_broken && buffer_len(&ctrl_out) == 0 &&
+            (client_fd = do_accept(trigger_fd)) >= 0)
+        handle_trigger_request(client_fd);
+}
+
+/* MSG_JUST_EXEC_NO_DATA: pass on the status, if that is what is there;
+ * returns false at EOF */
+static bool handle_exec_status(int id) {
+    struct _connection_info *conn = &connection_info[id];
+    int32_t status;
+    ssize_t ret;
+
+    ret = read(conn->fd, &status, sizeof(status));
+    if (ret == sizeof(status) && conn->exec_status_count < 2) {
+        send_exec_status(conn->connect_domain, conn->connect_port,
+                         conn->exec_status_count ? EXEC_STATUS_EXITED : 0,
+                         status);
+        conn->exec_status_count++;
+        return true;
+    }
+    if (ret != 0 && !(ret == -1 && errno == ECONNRESET))
+        PERROR("Unexpected read on exec status connection: %zd", ret);
+    /* the process that should have started the command failed */
+    if (conn->exec_status_count == 0)
+        send_exec_status(conn->connect_domain, conn->connect_port, 0, -1);
+    return false;
+}
+
+static void handle_terminated_fork_client(int id) {
     ssize_t ret;
     char buf[2];
 
-    for (i = 0; i < MAX_FDS; i++) {
-        if (connection_info[i].pid && connection_info[i].fd >= 0 &&
-                FD_ISSET(connection_info[i].fd, rdset)) {
-            ret = read(connection_info[i].fd, buf, sizeof(buf));
-            if (ret == 0 || (ret == -1 && errno == ECONNRESET)) {
-                close(connection_info[i].fd);
-                release_connection(i);
-            } else {
-                PERROR("Unexpected read on fork-server connection: %zd", ret);
-                close(connection_info[i].fd);
-                release_connection(i);
-            }
-        }
+    if (connection_info[id].exec_status) {
+        if (handle_exec_status(id))
+            return;
+    } else {
+        ret = read(connection_info[id].fd, buf, sizeof(buf));
+        if (ret != 0 && !(ret == -1 && errno == ECONNRESET))
+            PERROR("Unexpected read on fork-server connection: %zd", ret);
     }
+    epoll_del(local_epoll_fd, connection_info[id].fd);
+    close(connection_info[id].fd);
+    release_connection(id);
+}
+
+/* dispatch events on local_epoll_fd */
+static void handle_local_events(void)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    struct _connection_info *conn;
+    int i, ret;
+
+    ret = epoll_wait(local_epoll_fd, events, MAX_EPOLL_EVENTS, 0);
+    if (ret < 0) {
+        PERROR("epoll_wait");
+        exit(1);
+    }
+    for (i = 0; i < ret; i++) {
+        conn = events[i].data.ptr;
+        if (!conn)
+            handle_trigger_io();
+        else if (conn->pid && conn->fd >= 0)
+            handle_terminated_fork_client(conn - connection_info);
+    }
+}
+
+/* qrexec-daemon has disconnected (e.g. it was restarted), wait for it to
+ * connect again. */
+static void reconnect_ctrl(void)
+{
+    sigset_t sigmask;
+
+    LOG(WARNING, "qrexec-daemon has disconnected, waiting for it to reconnect");
+    epoll_del(main_epoll_fd, libvchan_fd_for_select(ctrl_vchan));
+    libvchan_close(ctrl_vchan);
+
+    /* Restore default SIGTERM handling: waiting for the daemon might block
+     * indefinitely, so we want the program to be killable.
+     */
+    signal(SIGTERM, SIG_DFL);
+    if (terminate_requested)
+        exit(0);
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+
+    ctrl_vchan = libvchan_server_init(0, VCHAN_BASE_PORT, 4096, 4096);
+    if (!ctrl_vchan)
+        handle_vchan_error("server_init");
+    ctrl_protocol_version = handle_handshake(ctrl_vchan);
+    if (ctrl_protocol_version < 0)
+        exit(1);
+    while (!libvchan_is_open(ctrl_vchan))
+        libvchan_wait(ctrl_vchan);
+
+    signal(SIGTERM, sigterm_handler);
+    sigprocmask(SIG_BLOCK, &sigmask, NULL);
+
+    epoll_add(main_epoll_fd, libvchan_fd_for_select(ctrl_vchan),
+              (epoll_data_t){ .fd = libvchan_fd_for_select(ctrl_vchan) });
+    ctrl_broken = false;
+    start_ctrl_session();
 }
 
 struct option longopts[] = {
@@ -896,6 +1369,7 @@ struct option longopts[] = {
     { "agent-socket", required_argument, 0, 'a' },
     { "fork-server-socket", optional_argument, 0, 's' },
     { "no-fork-server", no_argument, 0, 'S' },
+    { "data-vchan-idle-timeout", required_argument, 0, 'i' + 128 },
     { NULL, 0, 0, 0 },
 };
 
@@ -910,6 +1384,8 @@ _Noreturn void usage(const char *argv0)
             QREXEC_FORK_SERVER_SOCKET);
     fprintf(stderr, "    (set empty to disable, use %%s as username)\n");
     fprintf(stderr, "  --no-fork-server - don't try to connect to fork server\n");
+    fprintf(stderr, "  --data-vchan-idle-timeout=SECONDS - keep data connections from dom0\n");
+    fprintf(stderr, "    open for reuse for this long after a call ends, default: 0 (disabled)\n");
     exit(2);
 }
 
@@ -934,6 +1410,9 @@ int main(int argc, char **argv)
             case 'S':
                 fork_server_path = NULL;
                 break;
+            case 'i' + 128:
+                data_vchan_idle_timeout = atoi(optarg);
+                break;
             case 'h':
             case '?':
                 usage(argv[0]);
@@ -945,38 +1424,63 @@ int main(int argc, char **argv)
     signal(SIGTERM, sigterm_handler);
     signal(SIGPIPE, SIG_IGN);
 
+    /* Deliver signals only while waiting for events, so there is no need for
+     * a periodic wakeup to notice them. */
     sigemptyset(&selectmask);
     sigaddset(&selectmask, SIGCHLD);
+    sigaddset(&selectmask, SIGTERM);
     sigprocmask(SIG_BLOCK, &selectmask, NULL);
     sigemptyset(&selectmask);
 
     while (!terminate_requested) {
-        struct timespec timeout = { 1, 0 };
-        fd_set rdset, wrset;
-        int ret, max;
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int timeout = -1;
+        bool local_ready = false;
+        int i, ret;
 
         if (child_exited)
             reap_children();
 
-        max = fill_fds_for_select(&rdset, &wrset);
-        if (libvchan_buffer_space(ctrl_vchan) <= (int)sizeof(struct msg_header))
-            FD_ZERO(&rdset);
+        if (ctrl_broken) {
+            reconnect_ctrl();
+            continue;
+        }
+
+        set_local_epoll_enabled(
+                !ctrl_sync_pending && buffer_len(&ctrl_out) == 0 &&
+                libvchan_buffer_space(ctrl_vchan) > (int)sizeof(struct msg_header));
 
-        ret = pselect_vchan(ctrl_vchan, max+1, &rdset, &wrset, &timeout, &selectmask);
+        if (libvchan_data_ready(ctrl_vchan) > 0)
+            /* check for other FDs, but exit immediately */
+            timeout = 0;
+        ret = epoll_pwait(main_epoll_fd, events, MAX_EPOLL_EVENTS, timeout,
+                          &selectmask);
         if (ret < 0) {
             if (errno == EINTR)
                 continue;
-            PERROR("pselect");
+            PERROR("epoll_pwait");
             return 1;
         }
 
-        while (libvchan_data_ready(ctrl_vchan))
-            handle_server_cmd();
+        for (i = 0; i < ret; i++) {
+            if (events[i].data.fd == local_epoll_fd)
+                local_ready = true;
+            else {
+                /* clear event pending flag, this shouldn't block */
+                libvchan_wait(ctrl_vchan);
+                if (!libvchan_is_open(ctrl_vchan))
+                    ctrl_broken = true;
+            }
+        }
 
-        if (FD_ISSET(trigger_fd, &rdset))
-            handle_trigger_io();
+        while (!ctrl_broken && libvchan_data_ready(ctrl_vchan))
+            handle_server_cmd();
+        if (ctrl_broken)
+            continue;
+        ctrl_flush();
 
-        handle_terminated_fork_client(&rdset);
+        if (local_ready)
+            handle_local_events();
     }
 
     libvchan_close(ctrl_vchan);
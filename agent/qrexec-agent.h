@@ -37,16 +37,29 @@ void prepare_child_env(void);
 extern int replace_chars_stdout;
 extern int replace_chars_stderr;
 
+/* seconds to keep a data connection from dom0 open for reuse, 0 to disable */
+extern int data_vchan_idle_timeout;
+
 /* true in qrexec-fork-server, false in qrexec-agent */
 extern const bool qrexec_is_fork_server;
 
+/* the most that can follow cmdline in an exec request (see qrexec.h) */
+#define MAX_EXEC_EXTRA_LEN (sizeof(struct peer_info) + \
+        sizeof(struct exec_stdin_params) + MAX_EXEC_STDIN_LEN)
+
+/* cmdline_len covers the whole request after struct exec_params, including
+ * struct peer_info and initial stdin after the null byte, if any */
 pid_t handle_new_process(int type,
         int connect_domain, int connect_port,
         char *cmdline, size_t cmdline_len);
+/* the status is written to status_fd (see qrexec-agent-data.c) */
+pid_t handle_just_exec_no_data(int status_fd,
+        char *cmdline, size_t cmdline_len);
 int handle_data_client(int type,
         int connect_domain, int connect_port,
         int stdin_fd, int stdout_fd, int stderr_fd,
-        int buffer_size, pid_t pid);
+        int buffer_size, pid_t pid, bool compress, int stripe_count,
+        size_t max_chunk);
 
 
 struct qrexec_cmd_info {
@@ -20,7 +20,6 @@
  */
 #include <sys/socket.h>
 #include <sys/wait.h>
-#include <sys/un.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -44,28 +43,6 @@ _Noreturn void do_exec(const char *cmd __attribute__((unused)), char const* user
     abort();
 }
 
-static int connect_unix_socket(const char *path)
-{
-    int s;
-    size_t len;
-    struct sockaddr_un remote;
-
-    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        PERROR("socket");
-        return -1;
-    }
-
-    remote.sun_family = AF_UNIX;
-    strncpy(remote.sun_path, path,
-            sizeof(remote.sun_path) - 1);
-    len = strlen(remote.sun_path) + sizeof(remote.sun_family);
-    if (connect(s, (struct sockaddr *) &remote, (socklen_t)len) == -1) {
-        PERROR("connect");
-        exit(1);
-    }
-    return s;
-}
-
 static char *get_program_name(char *prog)
 {
     char *basename = rindex(prog, '/');
@@ -88,9 +65,34 @@ static void convert_target_name_keyword(char *target)
             target[i] = '@';
 }
 
+/* rpc-config of the service called (the same file as for running it here)
+ * provides the defaults for the I/O options */
+static void load_called_service_config(char *service_name,
+                                       struct qrexec_service_config *config)
+{
+    struct qrexec_parsed_command cmd = { .service_descriptor = service_name };
+    char *plus = strchr(service_name, '+');
+
+    if (service_name[0] == '\0' || plus == service_name ||
+            strchr(service_name, '/') ||
+            strlen(service_name) > MAX_SERVICE_NAME_LEN)
+        return;
+    cmd.service_name = plus ?
+        strndup(service_name, plus - service_name) : service_name;
+    if (!cmd.service_name) {
+        PERROR("strndup");
+        return;
+    }
+    load_service_config_v2(&cmd, config);
+    if (plus)
+        free(cmd.service_name);
+}
+
 enum {
     opt_no_filter_stdout = 't'+128,
     opt_no_filter_stderr = 'T'+128,
+    opt_compress = 'c'+128,
+    opt_stripes = 's'+128,
 };
 
 static struct option longopts[] = {
@@ -100,6 +102,8 @@ static struct option longopts[] = {
     { "no-filter-escape-chars-stdout", no_argument, 0, opt_no_filter_stdout},
     { "no-filter-escape-chars-stderr", no_argument, 0, opt_no_filter_stderr},
     { "agent-socket", required_argument, 0, 'a'},
+    { "compress", no_argument, 0, opt_compress},
+    { "stripes", required_argument, 0, opt_stripes},
     { NULL, 0, 0, 0},
 };
 
@@ -115,16 +119,15 @@ _Noreturn static void usage(const char *argv0) {
     fprintf(stderr, "  --no-filter-escape-chars-stderr - opposite to --filter-escape-chars-stderr\n");
     fprintf(stderr, "  --agent-socket=PATH - path to connect to, default: %s\n",
             QREXEC_AGENT_TRIGGER_PATH);
+    fprintf(stderr, "  --compress - compress the data sent to the service, if supported\n");
+    fprintf(stderr, "  --stripes=N - spread the data over N more vchans in each direction, each handled by its own thread, if supported\n");
     exit(2);
 }
 
 int main(int argc, char **argv)
 {
     int trigger_fd;
-    struct msg_header hdr;
-    struct trigger_service_params3 params;
     struct exec_params exec_params;
-    size_t service_name_len;
     char *service_name;
     ssize_t ret;
     int i;
@@ -133,6 +136,9 @@ int main(int argc, char **argv)
     pid_t child_pid = 0;
     int inpipe[2], outpipe[2];
     int buffer_size = 0;
+    struct qrexec_service_config config = { .filter_escape_chars = -1 };
+    bool compress = false;
+    int stripe_count = 0;
     int opt;
     const char *agent_trigger_path = QREXEC_AGENT_TRIGGER_PATH;
 
@@ -164,6 +170,14 @@ int main(int argc, char **argv)
             case 'a':
                 agent_trigger_path = strdup(optarg);
                 break;
+            case opt_compress:
+                compress = true;
+                break;
+            case opt_stripes:
+                stripe_count = atoi(optarg);
+                if (stripe_count < 1 || stripe_count > MAX_STRIPES)
+                    usage(argv[0]);
+                break;
             case '?':
                 usage(argv[0]);
         }
@@ -176,6 +190,18 @@ int main(int argc, char **argv)
         start_local_process = 1;
     }
 
+    service_name = argv[optind + 1];
+
+    load_called_service_config(service_name, &config);
+    if (buffer_size == 0 && config.buffer_size > 0)
+        buffer_size = config.buffer_size;
+    if (config.filter_escape_chars >= 0) {
+        if (replace_chars_stdout == -1)
+            replace_chars_stdout = config.filter_escape_chars > 0;
+        if (replace_chars_stderr == -1)
+            replace_chars_stderr = config.filter_escape_chars > 0;
+    }
+
     if (!start_local_process) {
         if (replace_chars_stdout == -1 && isatty(1))
             replace_chars_stdout = 1;
@@ -183,43 +209,14 @@ int main(int argc, char **argv)
     if (replace_chars_stderr == -1 && isatty(2))
         replace_chars_stderr = 1;
 
-    service_name = argv[optind + 1];
-
-    service_name_len = strlen(service_name) + 1;
-
-    trigger_fd = connect_unix_socket(agent_trigger_path);
-
-    hdr.type = MSG_TRIGGER_SERVICE3;
-    hdr.len = sizeof(params) + service_name_len;
-
-    memset(&params, 0, sizeof(params));
-
     convert_target_name_keyword(argv[optind]);
-    strncpy(params.target_domain, argv[optind],
-            sizeof(params.target_domain) - 1);
-
-    snprintf(params.request_id.ident,
-            sizeof(params.request_id.ident), "SOCKET");
-
-    if (!write_all(trigger_fd, &hdr, sizeof(hdr))) {
-        PERROR("write(hdr) to agent");
-        exit(1);
-    }
-    if (!write_all(trigger_fd, &params, sizeof(params))) {
-        PERROR("write(params) to agent");
-        exit(1);
-    }
-    if (!write_all(trigger_fd, service_name, service_name_len)) {
-        PERROR("write(command) to agent");
-        exit(1);
-    }
-    ret = read(trigger_fd, &exec_params, sizeof(exec_params));
-    if (ret == 0) {
-        fprintf(stderr, "Request refused\n");
-        exit(126);
-    }
-    if (ret < 0 || ret != sizeof(exec_params)) {
-        PERROR("read");
+    trigger_fd = qrexec_agent_request(agent_trigger_path, argv[optind],
+                                      service_name, &exec_params);
+    if (trigger_fd < 0) {
+        if (errno == EACCES) {
+            fprintf(stderr, "Request refused\n");
+            exit(126);
+        }
         exit(1);
     }
 
@@ -266,11 +263,13 @@ int main(int argc, char **argv)
 
         ret = handle_data_client(MSG_SERVICE_CONNECT,
                 exec_params.connect_domain, exec_params.connect_port,
-                inpipe[1], outpipe[0], -1, buffer_size, child_pid);
+                inpipe[1], outpipe[0], -1, buffer_size, child_pid, compress,
+                stripe_count, config.max_chunk > 0 ? config.max_chunk : 0);
     } else {
         ret = handle_data_client(MSG_SERVICE_CONNECT,
                 exec_params.connect_domain, exec_params.connect_port,
-                1, 0, -1, buffer_size, 0);
+                1, 0, -1, buffer_size, 0, compress, stripe_count,
+                config.max_chunk > 0 ? config.max_chunk : 0);
     }
 
     close(trigger_fd);
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stddef.h>
@@ -69,6 +70,11 @@ static void handle_single_command(int fd, struct qrexec_cmd_info *info) {
         return;
     cmdline[info->cmdline_len] = 0;
 
+    if (info->type == MSG_JUST_EXEC_NO_DATA) {
+        /* the status goes back to qrexec-agent over fd */
+        handle_just_exec_no_data(fd, cmdline, info->cmdline_len);
+        return;
+    }
     handle_new_process(info->type, info->connect_domain,
             info->connect_port,
             cmdline, info->cmdline_len);
@@ -78,8 +84,6 @@ int main(int argc, char **argv) {
     int s, fd;
     char *socket_path;
     struct qrexec_cmd_info info;
-    struct sockaddr_un peer;
-    unsigned int addrlen;
 
     setup_logging("qrexec-fork-server");
 
@@ -97,10 +101,6 @@ int main(int argc, char **argv) {
     }
 
     s = get_server_socket(socket_path);
-    if (fcntl(s, F_SETFD, O_CLOEXEC) < 0) {
-        PERROR("fcntl");
-        exit(1);
-    }
     /* fork into background */
     switch (fork()) {
         case -1:
@@ -115,10 +115,13 @@ int main(int argc, char **argv) {
     register_exec_func(do_exec);
 
     while (1) {
-        addrlen = sizeof(peer);
-        fd = accept(s, (struct sockaddr *) &peer, &addrlen);
-        if (fd < 0)
+        fd = do_accept(s);
+        if (fd < 0) {
+            /* connection dropped (out of file descriptors) */
+            if (errno == EMFILE || errno == ENFILE)
+                continue;
             break;
+        }
         if (read_all(fd, &info, sizeof(info))) {
             handle_single_command(fd, &info);
         }
@@ -20,7 +20,6 @@
  */
 
 #include <sys/socket.h>
-#include <sys/un.h>
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
@@ -28,10 +27,12 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <time.h>
 #include <errno.h>
-#include <assert.h>
 #include "qrexec.h"
 #include <fcntl.h>
 
@@ -42,8 +43,19 @@ static int replace_chars_stdout = 0;
 static int replace_chars_stderr = 0;
 
 static int exit_with_code = 1;
+static bool wait_exit = false;
+
+/* concurrent calls in --batch mode, and by default with --targets */
+#define BATCH_MAX_JOBS 64
 
 #define VCHAN_BUFFER_SIZE 65536
+/* size of data vchan buffers, when we are the vchan server */
+static int buffer_size = VCHAN_BUFFER_SIZE;
+static bool compress = false;
+/* cache-ttl of the dom0 service run, see MSG_DATA_CACHE_TTL */
+static int cache_ttl = 0;
+/* number of stripes to ask for, when we are the data vchan server */
+static int stripe_count = 0;
 
 #define QREXEC_DATA_MIN_VERSION QREXEC_PROTOCOL_V2
 
@@ -125,66 +137,11 @@ static int handle_agent_handshake(libvchan_t *vchan, int remote_send_first)
     return data_protocol_version;
 }
 
-static int handle_daemon_handshake(int fd)
-{
-    struct msg_header hdr;
-    struct peer_info info;
-
-    /* daemon send MSG_HELLO first */
-    if (!read_all(fd, &hdr, sizeof(hdr))) {
-        PERROR("daemon handshake");
-        return -1;
-    }
-    if (hdr.type != MSG_HELLO || hdr.len != sizeof(info)) {
-        LOG(ERROR, "Invalid daemon MSG_HELLO");
-        return -1;
-    }
-    if (!read_all(fd, &info, sizeof(info))) {
-        PERROR("daemon handshake");
-        return -1;
-    }
-
-    if (info.version != QREXEC_PROTOCOL_VERSION) {
-        LOG(ERROR, "Incompatible daemon protocol version "
-            "(daemon %d, client %d)",
-            info.version, QREXEC_PROTOCOL_VERSION);
-        return -1;
-    }
-
-    hdr.type = MSG_HELLO;
-    hdr.len = sizeof(info);
-    info.version = QREXEC_PROTOCOL_VERSION;
-
-    if (!write_all(fd, &hdr, sizeof(hdr))) {
-        LOG(ERROR, "Failed to send MSG_HELLO hdr to daemon");
-        return -1;
-    }
-    if (!write_all(fd, &info, sizeof(info))) {
-        LOG(ERROR, "Failed to send MSG_HELLO to daemon");
-        return -1;
-    }
-    return 0;
-}
-
 static int connect_unix_socket(const char *domname)
 {
-    int s, len;
-    struct sockaddr_un remote;
+    int s = qrexec_daemon_connect(socket_dir, domname);
 
-    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        PERROR("socket");
-        return -1;
-    }
-
-    remote.sun_family = AF_UNIX;
-    snprintf(remote.sun_path, sizeof remote.sun_path,
-             "%s/qrexec.%s", socket_dir, domname);
-    len = strlen(remote.sun_path) + sizeof(remote.sun_family);
-    if (connect(s, (struct sockaddr *) &remote, len) == -1) {
-        PERROR("connect");
-        exit(1);
-    }
-    if (handle_daemon_handshake(s) < 0)
+    if (s < 0)
         exit(1);
     return s;
 }
@@ -208,10 +165,11 @@ static _Noreturn void do_exec(const char *prog, const char *username __attribute
 }
 
 
-/* See also qrexec-agent.c:wait_for_session_maybe() */
+/* See also qrexec-agent.c:wait_for_session_maybe(). Also enables compression
+ * and the cache TTL if the service config says so. */
 static void wait_for_session_maybe(char *cmdline)
 {
-    int wait_for_session = 0;
+    struct qrexec_service_config config = { 0 };
     struct qrexec_parsed_command *cmd;
     pid_t pid;
     int status;
@@ -220,14 +178,18 @@ static void wait_for_session_maybe(char *cmdline)
     if (!cmd)
         goto out;
 
-    if (cmd->nogui)
+    if (!cmd->service_descriptor)
         goto out;
 
-    if (!cmd->service_descriptor)
+    load_service_config_v2(cmd, &config);
+    if (config.compress > 0)
+        compress = true;
+    cache_ttl = config.cache_ttl;
+
+    if (cmd->nogui)
         goto out;
 
-    load_service_config(cmd, &wait_for_session);
-    if (!wait_for_session)
+    if (!config.wait_for_session)
         goto out;
 
     pid = fork();
@@ -300,35 +262,55 @@ static void negotiate_connection_params(int s, int other_domid, unsigned type,
         void *cmdline_param, int cmdline_size,
         int *data_domain, int *data_port)
 {
-    struct msg_header hdr;
     struct exec_params params;
-    hdr.type = type;
-    hdr.len = sizeof(params) + cmdline_size;
-    params.connect_domain = other_domid;
-    params.connect_port = 0;
-    if (!write_all(s, &hdr, sizeof(hdr))
-            || !write_all(s, &params, sizeof(params))
-            || !write_all(s, cmdline_param, cmdline_size)) {
-        PERROR("write daemon");
-        exit(1);
-    }
-    /* the daemon will respond with the same message with connect_port filled
-     * and empty cmdline */
-    if (!read_all(s, &hdr, sizeof(hdr))) {
-        PERROR("read daemon");
+
+    if (qrexec_daemon_request(s, type, other_domid, cmdline_param,
+                              cmdline_size, &params) < 0)
         exit(1);
-    }
-    assert(hdr.type == type);
-    if (hdr.len != sizeof(params)) {
-        LOG(ERROR, "Invalid response for 0x%x", type);
+    *data_port = params.connect_port;
+    *data_domain = params.connect_domain;
+}
+
+/* -e: start the command without a data connection (MSG_JUST_EXEC_NO_DATA),
+ * and exit as with the exit code from one; returns only if the agent is too
+ * old for that, with the data connection parameters for MSG_JUST_EXEC */
+static void run_just_exec(int s, int other_domid, const char *cmdline,
+                          int *data_domain, int *data_port)
+{
+    struct exec_params params;
+    struct exec_status status;
+    struct msg_header hdr;
+    int type;
+
+    type = qrexec_daemon_request_just_exec(s, other_domid, cmdline,
+            wait_exit ? JUST_EXEC_NOTIFY_EXIT : 0, &params);
+    if (type < 0)
         exit(1);
+    if (type == MSG_JUST_EXEC) {
+        *data_domain = params.connect_domain;
+        *data_port = params.connect_port;
+        return;
     }
-    if (!read_all(s, &params, sizeof(params))) {
-        PERROR("read daemon");
-        exit(1);
+    for (;;) {
+        if (!read_all(s, &hdr, sizeof(hdr))) {
+            LOG(ERROR, "Connection to the daemon lost");
+            exit(1);
+        }
+        if (hdr.type != MSG_EXEC_STATUS || hdr.len != sizeof(status) ||
+                !read_all(s, &status, sizeof(status))) {
+            LOG(ERROR, "Invalid MSG_EXEC_STATUS from daemon");
+            exit(1);
+        }
+        if (status.flags & EXEC_STATUS_EXITED)
+            break;
+        if (status.status != 0) {
+            LOG(ERROR, "Failed to start the command");
+            break;
+        }
+        if (!wait_exit)
+            break;
     }
-    *data_port = params.connect_port;
-    *data_domain = params.connect_domain;
+    exit(exit_with_code ? status.status : 0);
 }
 
 static void send_service_connect(int s, char *conn_ident,
@@ -354,13 +336,16 @@ static void send_service_connect(int s, char *conn_ident,
     }
 }
 
-static void select_loop(libvchan_t *vchan, int data_protocol_version, struct buffer *stdin_buf)
+static void select_loop(libvchan_t *vchan, int data_protocol_version,
+                        struct buffer *stdin_buf, struct stripes *stripes,
+                        int stripe_domain, int stripe_port)
 {
     struct process_io_request req;
     int exit_code;
 
     req.vchan = vchan;
     req.stdin_buf = stdin_buf;
+    req.stdin_eof = false;
     req.stdin_fd = local_stdin_fd;
     req.stdout_fd = local_stdout_fd;
     req.stderr_fd = -1;
@@ -369,6 +354,12 @@ static void select_loop(libvchan_t *vchan, int data_protocol_version, struct buf
     req.replace_chars_stdout = replace_chars_stdout;
     req.replace_chars_stderr = replace_chars_stderr;
     req.data_protocol_version = data_protocol_version;
+    req.compress = compress;
+    req.max_chunk = 0;
+    req.stripes = stripes;
+    req.stripe_domain = stripe_domain;
+    req.stripe_port = stripe_port;
+    req.hello_pending = NULL;
     req.sigchld = &sigchld;
     req.sigusr1 = NULL;
 
@@ -381,6 +372,13 @@ static struct option longopts[] = {
     { "help", no_argument, 0, 'h' },
     { "socket-dir", required_argument, 0, 'd'+128 },
     { "no-exit-code", no_argument, 0, 'E' },
+    { "batch", no_argument, 0, 'b'+128 },
+    { "buffer-size", required_argument, 0, 's'+128 },
+    { "compress", no_argument, 0, 'z'+128 },
+    { "stripes", required_argument, 0, 'S'+128 },
+    { "wait-exit", no_argument, 0, 'x'+128 },
+    { "targets", required_argument, 0, 't'+128 },
+    { "max-concurrent", required_argument, 0, 'j'+128 },
     { NULL, 0, 0, 0 },
 };
 
@@ -391,16 +389,33 @@ _Noreturn static void usage(const char *const name)
             "-l local_prog|"
             "-c request_id,src_domain_name,src_domain_id|"
             "-e] remote_cmdline\n"
+            "       %s [options] -d domain_name [-e] --batch\n"
+            "       %s [options] --targets=name,... remote_cmdline\n"
             "Options:\n"
             "  -h, --help - display usage\n"
             "  -e - exit after sending cmd\n"
+            "  --wait-exit - with -e, wait for the command to exit\n"
             "  -E, --no-exit-code - always exit with 0 after command exits\n"
             "  -t - enables replacing problematic bytes with '_' in command output, -T is the same for stderr\n"
             "  -W - waits for connection end even in case of VM-VM (-c)\n"
             "  -c - connect to existing process (response to trigger service call)\n"
             "  -w timeout - override default connection timeout of 5s (set 0 for no timeout)\n"
-            "  --socket-dir=PATH -  directory for qrexec socket, default: %s\n",
-            name, QREXEC_DAEMON_SOCKET_DIR);
+            "  --socket-dir=PATH -  directory for qrexec socket, default: %s\n"
+            "  --buffer-size=BUFFER_SIZE - minimum vchan buffer size (default: 64k)\n"
+            "  --compress - compress the data sent, if the other side supports it\n"
+            "  --stripes=N - spread the data over N more vchans in each direction,\n"
+            "    each handled by its own thread, if the other side supports it\n"
+            "  --batch - run commands read from stdin (one per line) concurrently,\n"
+            "    over a single connection to the daemon; output of each command is\n"
+            "    written when it finishes, exit with the highest exit code\n"
+            "  --targets=NAME,... - run the command in each of the domains\n"
+            "    concurrently, from one process; the output is written as records\n"
+            "    'NAME out|err LENGTH\\n' followed by LENGTH bytes of stdout or\n"
+            "    stderr, and 'NAME exit CODE\\n' when the command exits, exit with\n"
+            "    the highest exit code; -w applies to each domain separately\n"
+            "  --max-concurrent=N - with --targets, at most N calls at a time\n"
+            "    (default: %d)\n",
+            name, name, name, QREXEC_DAEMON_SOCKET_DIR, BATCH_MAX_JOBS);
     exit(1);
 }
 
@@ -449,45 +464,397 @@ static void sigalrm_handler(int x __attribute__((__unused__)))
     exit(1);
 }
 
+static void vchan_connection_timeout(struct qrexec_timer *timer __attribute__((__unused__))) {
+    LOG(ERROR, "vchan connection timeout");
+    exit(1);
+}
+
 static void wait_for_vchan_client_with_timeout(libvchan_t *conn, int timeout) {
-    struct timeval start_tv, now_tv, timeout_tv;
+    struct timer_wheel *timers = NULL;
+    struct qrexec_timer timer;
+    struct pollfd fds[2];
+
+    if (conn && timeout) {
+        timers = timer_wheel_new();
+        if (!timers) {
+            PERROR("timer_wheel_new");
+            exit(1);
+        }
+        timer_init(&timer, vchan_connection_timeout, NULL);
+        timer_start(timers, &timer, timeout * 1000);
+    }
+    while (conn && libvchan_is_open(conn) == VCHAN_WAITING) {
+        if (timers) {
+            fds[0].fd = libvchan_fd_for_select(conn);
+            fds[0].events = POLLIN;
+            fds[1].fd = timer_wheel_fd(timers);
+            fds[1].events = POLLIN;
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                LOG(ERROR, "vchan connection error");
+                exit(1);
+            }
+            if (fds[1].revents)
+                timer_wheel_run(timers);
+            if (!fds[0].revents)
+                continue;
+        }
+        libvchan_wait(conn);
+    }
+    if (timers)
+        timer_wheel_free(timers);
+}
 
-    if (timeout && gettimeofday(&start_tv, NULL) == -1) {
-        PERROR("gettimeofday");
+/* --batch mode */
+
+/* copy the whole content of a temporary file to fd */
+static void copy_output(int fd, int tmp_fd)
+{
+    char buf[4096];
+    ssize_t len;
+
+    if (lseek(tmp_fd, 0, SEEK_SET) < 0) {
+        PERROR("lseek");
+        return;
+    }
+    while ((len = read(tmp_fd, buf, sizeof(buf))) > 0) {
+        if (!write_all(fd, buf, len)) {
+            PERROR("write output");
+            return;
+        }
+    }
+    if (len < 0)
+        PERROR("read output");
+}
+
+/* Runs in a child process: handle the data connection of one command. The
+ * output is collected and written at the end, so that output of concurrent
+ * commands is not mixed. */
+static _Noreturn void run_batch_call(int data_domain, int data_port,
+                                     int connection_timeout, int lock_fd)
+{
+    struct process_io_request req = { 0 };
+    struct buffer stdin_buf;
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    libvchan_t *data_vchan;
+    int out_fd, err_fd, saved_stderr;
+    int data_protocol_version, exit_code;
+
+    out_fd = memfd_create("qrexec-client-stdout", MFD_CLOEXEC);
+    err_fd = memfd_create("qrexec-client-stderr", MFD_CLOEXEC);
+    saved_stderr = dup(2);
+    if (out_fd < 0 || err_fd < 0 || saved_stderr < 0) {
+        PERROR("memfd_create");
         exit(1);
     }
-    while (conn && libvchan_is_open(conn) == VCHAN_WAITING) {
-        if (timeout) {
-            fd_set rdset;
-            int fd = libvchan_fd_for_select(conn);
+    /* remote stderr (and our log) goes to fd 2 */
+    dup2(err_fd, 2);
+
+    data_vchan = libvchan_server_init(data_domain, data_port,
+            buffer_size, buffer_size);
+    if (!data_vchan) {
+        LOG(ERROR, "Failed to start data vchan server");
+        exit_code = 1;
+        goto out;
+    }
+    wait_for_vchan_client_with_timeout(data_vchan, connection_timeout);
+    if (!libvchan_is_open(data_vchan)) {
+        LOG(ERROR, "Failed to open data vchan connection");
+        exit_code = 1;
+        goto out;
+    }
+    data_protocol_version = handle_agent_handshake(data_vchan, 0);
+    if (data_protocol_version < 0) {
+        exit_code = 1;
+        goto out;
+    }
+
+    buffer_init(&stdin_buf);
+    req.vchan = data_vchan;
+    req.stdin_buf = &stdin_buf;
+    /* the names are from the point of view of the local process */
+    req.stdin_fd = dup(out_fd);
+    req.stdout_fd = open("/dev/null", O_RDONLY);
+    req.stderr_fd = -1;
+    req.replace_chars_stdout = replace_chars_stdout;
+    req.replace_chars_stderr = replace_chars_stderr;
+    req.data_protocol_version = data_protocol_version;
+    req.sigchld = &sigchld;
+    exit_code = process_io(&req);
+    libvchan_close(data_vchan);
+
+out:
+    if (fcntl(lock_fd, F_SETLKW, &lock) < 0)
+        PERROR("fcntl(F_SETLKW)");
+    copy_output(1, out_fd);
+    copy_output(saved_stderr, err_fd);
+    exit(exit_with_code ? exit_code : 0);
+}
+
+/* wait for one command to finish, return its exit code */
+static int wait_batch_call(void)
+{
+    int status;
+
+    while (wait(&status) < 0) {
+        if (errno != EINTR) {
+            PERROR("wait");
+            exit(1);
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Read commands from stdin and run them concurrently, using a single
+ * connection to qrexec-daemon in session mode. */
+static int run_batch(const char *domname, int just_exec,
+                     int connection_timeout)
+{
+    struct msg_header hdr = { .type = MSG_SESSION_START, .len = 0 };
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int s, lock_fd, data_domain, data_port;
+    int jobs = 0, ret = 0, code;
+    struct exec_params params;
 
-            /* calculate how much time left until connection timeout expire */
-            if (gettimeofday(&now_tv, NULL) == -1) {
-                PERROR("gettimeofday");
+    s = connect_unix_socket(domname);
+    if (!write_all(s, &hdr, sizeof(hdr))) {
+        PERROR("write daemon");
+        exit(1);
+    }
+    /* serializes writing output of the commands */
+    lock_fd = memfd_create("qrexec-client-lock", MFD_CLOEXEC);
+    if (lock_fd < 0) {
+        PERROR("memfd_create");
+        exit(1);
+    }
+    set_remote_domain(domname);
+
+    while ((len = getline(&line, &line_size, stdin)) > 0) {
+        if (line[len-1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if ((size_t)len + 1 > MAX_QREXEC_CMD_LEN) {
+            LOG(ERROR, "Command too long, skipping");
+            ret = 1;
+            continue;
+        }
+        if (jobs == BATCH_MAX_JOBS) {
+            code = wait_batch_call();
+            if (code > ret)
+                ret = code;
+            jobs--;
+        }
+        if (just_exec) {
+            /* no need for the data connection, even if the agent is too
+             * old for MSG_JUST_EXEC_NO_DATA */
+            if (qrexec_daemon_request_just_exec(s, 0, line, 0, &params) < 0)
                 exit(1);
-            }
-            timersub(&start_tv, &now_tv, &timeout_tv);
-            timeout_tv.tv_sec += timeout;
-            if (timeout_tv.tv_sec < 0) {
-                LOG(ERROR, "vchan connection timeout");
+            continue;
+        }
+        negotiate_connection_params(s, 0, MSG_EXEC_CMDLINE,
+                line, len + 1, &data_domain, &data_port);
+        fflush(stdout);
+        switch (fork()) {
+            case -1:
+                PERROR("fork");
                 exit(1);
+            case 0:
+                close(s);
+                run_batch_call(data_domain, data_port, connection_timeout,
+                               lock_fd);
+        }
+        jobs++;
+    }
+    free(line);
+    while (jobs > 0) {
+        code = wait_batch_call();
+        if (code > ret)
+            ret = code;
+        jobs--;
+    }
+    close(s);
+    return ret;
+}
+
+/* --targets mode */
+
+struct target_call {
+    const char *name;
+    struct qrexec_call *call;
+    /* CLOCK_MONOTONIC, in ms: fail if not connected by then (0 - never) */
+    int64_t deadline;
+};
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* write a record of the --targets output: name, what, and then either
+ * data length and the data, or (data NULL) the exit code */
+static void write_target_record(const char *name, const char *what,
+                                const char *data, size_t len, int code)
+{
+    char header[256];
+    int header_len;
+
+    if (data)
+        header_len = snprintf(header, sizeof(header), "%s %s %zu\n",
+                              name, what, len);
+    else
+        header_len = snprintf(header, sizeof(header), "%s %s %d\n",
+                              name, what, code);
+    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+        LOG(ERROR, "Target name too long");
+        exit(1);
+    }
+    if (!write_all(1, header, header_len) || (data && !write_all(1, data, len))) {
+        PERROR("write stdout");
+        exit(1);
+    }
+}
+
+/* pass on what the call has output so far */
+static void copy_target_output(struct target_call *target)
+{
+    static const char *const streams[] = { "out", "err" };
+    static char buf[MAX_DATA_CHUNK_V3];
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < 2; i++)
+        while ((len = qrexec_call_read(target->call, i + 1, buf,
+                                       sizeof(buf))) > 0)
+            write_target_record(target->name, streams[i], buf, len, 0);
+}
+
+/* start the call in the target domain, NULL if that failed */
+static struct qrexec_call *start_target_call(const char *name,
+                                             const char *cmdline)
+{
+    struct exec_params params;
+    struct qrexec_call *call;
+    int s;
+
+    s = qrexec_daemon_connect(socket_dir, name);
+    if (s < 0)
+        return NULL;
+    /* no stdin, and so nothing more to wait for before starting */
+    if (qrexec_daemon_request_exec(s, cmdline, NULL, 0, true, &params) < 0) {
+        close(s);
+        return NULL;
+    }
+    close(s);
+    call = qrexec_call_open(&params, buffer_size);
+    if (call && qrexec_call_initial_stdin(call, NULL, 0, true) < 0) {
+        qrexec_call_free(call);
+        return NULL;
+    }
+    return call;
+}
+
+/* Run the command in each of the comma separated targets, at most max_jobs
+ * at a time, all from one event loop. The output is written as records (see
+ * usage()), exit with the highest exit code. A target whose agent does not
+ * connect within connection_timeout seconds (0 - no limit) fails. */
+static int run_targets(char *targets, const char *cmdline, int max_jobs,
+                       int connection_timeout)
+{
+    struct target_call *jobs;
+    struct pollfd *fds;
+    char *name, *saveptr = NULL;
+    int njobs = 0, ret = 0, code, i, poll_timeout;
+    int64_t now;
+
+    jobs = calloc(max_jobs, sizeof(*jobs));
+    fds = calloc(max_jobs, sizeof(*fds));
+    if (!jobs || !fds) {
+        LOG(ERROR, "Out of memory");
+        exit(1);
+    }
+
+    name = strtok_r(targets, ",", &saveptr);
+    while (name || njobs > 0) {
+        while (name && njobs < max_jobs) {
+            jobs[njobs].name = name;
+            jobs[njobs].call = start_target_call(name, cmdline);
+            jobs[njobs].deadline = connection_timeout ?
+                monotonic_ms() + (int64_t)connection_timeout * 1000 : 0;
+            if (jobs[njobs].call) {
+                fds[njobs].fd = qrexec_call_fd(jobs[njobs].call);
+                fds[njobs].events = POLLIN;
+                njobs++;
+            } else {
+                LOG(ERROR, "Failed to start the call in %s", name);
+                write_target_record(name, "exit", NULL, 0, 1);
+                if (ret < 1)
+                    ret = 1;
             }
-            FD_ZERO(&rdset);
-            FD_SET(fd, &rdset);
-            switch (select(fd+1, &rdset, NULL, NULL, &timeout_tv)) {
-                case -1:
-                    if (errno == EINTR) {
-                        break;
-                    }
-                    LOG(ERROR, "vchan connection error");
-                    exit(1);
-                case 0:
-                    LOG(ERROR, "vchan connection timeout");
-                    exit(1);
+            name = strtok_r(NULL, ",", &saveptr);
+        }
+        if (njobs == 0)
+            continue;
+
+        /* wake up for the nearest deadline of the calls still connecting */
+        poll_timeout = -1;
+        now = monotonic_ms();
+        for (i = 0; i < njobs; i++) {
+            if (jobs[i].deadline && !qrexec_call_connected(jobs[i].call)) {
+                int64_t left = jobs[i].deadline > now ?
+                    jobs[i].deadline - now : 0;
+                if (poll_timeout < 0 || left < poll_timeout)
+                    poll_timeout = left;
             }
         }
-        libvchan_wait(conn);
+        if (poll(fds, njobs, poll_timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            PERROR("poll");
+            exit(1);
+        }
+        now = monotonic_ms();
+        for (i = 0; i < njobs; i++) {
+            if (fds[i].revents) {
+                switch (qrexec_call_step(jobs[i].call)) {
+                    case QREXEC_CALL_RUNNING:
+                        copy_target_output(&jobs[i]);
+                        continue;
+                    case QREXEC_CALL_DONE:
+                        copy_target_output(&jobs[i]);
+                        code = qrexec_call_exit_code(jobs[i].call);
+                        break;
+                    default:
+                        LOG(ERROR, "Call in %s failed", jobs[i].name);
+                        code = 1;
+                        break;
+                }
+            } else if (jobs[i].deadline && now >= jobs[i].deadline &&
+                       !qrexec_call_connected(jobs[i].call)) {
+                LOG(ERROR, "Connection to %s timed out", jobs[i].name);
+                code = 1;
+            } else
+                continue;
+            write_target_record(jobs[i].name, "exit", NULL, 0, code);
+            if (code > ret)
+                ret = code;
+            qrexec_call_free(jobs[i].call);
+            /* the last one takes its place, and is checked next */
+            njobs--;
+            jobs[i] = jobs[njobs];
+            fds[i] = fds[njobs];
+            i--;
+        }
     }
+    free(jobs);
+    free(fds);
+    return exit_with_code ? ret : 0;
 }
 
 static size_t compute_service_length(const char *const remote_cmdline, const char *const prog_name) {
@@ -521,6 +888,10 @@ int main(int argc, char **argv)
     struct service_params svc_params;
     int data_protocol_version;
     int prepare_ret;
+    int batch = 0;
+    char *targets = NULL;
+    int max_jobs = BATCH_MAX_JOBS;
+    struct stripes *stripes = NULL;
 
     setup_logging("qrexec-client");
 
@@ -558,11 +929,53 @@ int main(int argc, char **argv)
             case 'd' + 128:
                 socket_dir = strdup(optarg);
                 break;
+            case 'b' + 128:
+                batch = 1;
+                break;
+            case 's' + 128:
+                buffer_size = atoi(optarg);
+                if (buffer_size <= 0)
+                    usage(argv[0]);
+                break;
+            case 'z' + 128:
+                compress = true;
+                break;
+            case 'x' + 128:
+                wait_exit = true;
+                break;
+            case 't' + 128:
+                targets = xstrdup(optarg);
+                break;
+            case 'j' + 128:
+                max_jobs = atoi(optarg);
+                if (max_jobs <= 0)
+                    usage(argv[0]);
+                break;
+            case 'S' + 128:
+                stripe_count = atoi(optarg);
+                if (stripe_count < 1 || stripe_count > MAX_STRIPES)
+                    usage(argv[0]);
+                break;
             case 'h':
             default:
                 usage(argv[0]);
         }
     }
+    if (batch) {
+        if (optind < argc || !domname || connect_existing || local_cmdline)
+            usage(argv[0]);
+        signal(SIGPIPE, SIG_IGN);
+        return run_batch(domname, just_exec, connection_timeout);
+    }
+    if (targets) {
+        if (optind + 1 != argc || domname || batch || just_exec ||
+                connect_existing || local_cmdline)
+            usage(argv[0]);
+        compute_service_length(argv[optind], argv[0]);
+        signal(SIGPIPE, SIG_IGN);
+        return run_targets(targets, argv[optind], max_jobs,
+                           connection_timeout);
+    }
     if (optind >= argc || !domname)
         usage(argv[0]);
     remote_cmdline = argv[optind];
@@ -615,7 +1028,7 @@ int main(int argc, char **argv)
             signal(SIGALRM, old_handler);
         } else {
             data_vchan = libvchan_server_init(data_domain, data_port,
-                    VCHAN_BUFFER_SIZE, VCHAN_BUFFER_SIZE);
+                    buffer_size, buffer_size);
             wait_for_vchan_client_with_timeout(data_vchan, connection_timeout);
         }
         if (!data_vchan || !libvchan_is_open(data_vchan)) {
@@ -627,17 +1040,30 @@ int main(int argc, char **argv)
             exit(1);
         if (prepare_ret < 0)
             handle_failed_exec(data_vchan);
-        select_loop(data_vchan, data_protocol_version, &stdin_buffer);
+        /* as qrexec-agent does for the services in a VM */
+        if (cache_ttl > 0 && data_protocol_version >= QREXEC_PROTOCOL_V11)
+            send_cache_ttl(data_vchan, cache_ttl);
+        if (connect_existing)
+            select_loop(data_vchan, data_protocol_version, &stdin_buffer,
+                        NULL, data_domain, data_port);
+        else
+            select_loop(data_vchan, data_protocol_version, &stdin_buffer,
+                        NULL, 0, 0);
     } else {
         msg_type = just_exec ? MSG_JUST_EXEC : MSG_EXEC_CMDLINE;
         s = connect_unix_socket(domname);
-        negotiate_connection_params(s,
-                src_domain_id,
-                msg_type,
-                remote_cmdline,
-                compute_service_length(remote_cmdline, argv[0]),
-                &data_domain,
-                &data_port);
+        if (just_exec) {
+            compute_service_length(remote_cmdline, argv[0]);
+            run_just_exec(s, src_domain_id, remote_cmdline,
+                          &data_domain, &data_port);
+        } else
+            negotiate_connection_params(s,
+                    src_domain_id,
+                    msg_type,
+                    remote_cmdline,
+                    compute_service_length(remote_cmdline, argv[0]),
+                    &data_domain,
+                    &data_port);
         if (wait_connection_end && connect_existing)
             /* save socket fd, 's' will be reused for the other qrexec-daemon
              * connection */
@@ -661,7 +1087,7 @@ int main(int argc, char **argv)
             }
         } else {
             data_vchan = libvchan_server_init(data_domain, data_port,
-                    VCHAN_BUFFER_SIZE, VCHAN_BUFFER_SIZE);
+                    buffer_size, buffer_size);
             if (!data_vchan) {
                 LOG(ERROR, "Failed to start data vchan server");
                 exit(1);
@@ -676,7 +1102,12 @@ int main(int argc, char **argv)
                 exit(1);
             if (prepare_ret < 0)
                 handle_failed_exec(data_vchan);
-            select_loop(data_vchan, data_protocol_version, &stdin_buffer);
+            if (stripe_count > 0 &&
+                    data_protocol_version >= QREXEC_PROTOCOL_V9)
+                stripes = stripes_listen(data_vchan, data_domain, data_port,
+                                         stripe_count, buffer_size);
+            select_loop(data_vchan, data_protocol_version, &stdin_buffer,
+                        stripes, 0, 0);
         }
     }
     return 0;
@@ -19,7 +19,7 @@
  *
  */
 
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -34,6 +34,10 @@
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
 #include "qrexec.h"
 #include "libqrexec-utils.h"
 
@@ -48,15 +52,31 @@ enum client_state {
     CLIENT_INVALID = 0,	// table slot not used
     CLIENT_HELLO, // waiting for client hello
     CLIENT_CMDLINE,	// waiting for cmdline from client
-    CLIENT_RUNNING // waiting for client termination (to release vchan port)
+    CLIENT_RUNNING, // waiting for client termination (to release vchan port)
+    CLIENT_SESSION, // MSG_SESSION_START received, waiting for more requests
 };
 
 enum vchan_port_state {
     VCHAN_PORT_UNUSED = -1
 };
 
+struct domain;
+
+/* Limits on the service requests of one domain, see the options of the same
+ * name. In an attach request, -1 stands for the daemon's default. */
+struct domain_limits {
+    int32_t max_policy_evaluations;
+    int32_t max_queued;
+    int32_t rate_limit;	/* calls per second, 0 - no rate limit */
+    int32_t rate_burst;
+};
+
 struct _client {
     int state;		// enum client_state
+    struct domain *domain;
+    /* deadline for sending the request (CLIENT_HELLO and CLIENT_CMDLINE
+     * states), allocated separately as the clients table may be moved */
+    struct qrexec_timer *timer;
 };
 
 enum policy_response {
@@ -69,39 +89,220 @@ struct _policy_pending {
     pid_t pid;
     struct service_params params;
     enum policy_response response_sent;
+    struct domain *domain;
+    /* deadline for the policy response */
+    struct qrexec_timer timer;
 };
 
 #define VCHAN_BASE_DATA_PORT (VCHAN_BASE_PORT+1)
 
 /*
-   The "clients" array is indexed by client's fd.
-   Thus its size must be equal MAX_FDS; defining MAX_CLIENTS for clarity.
+   The "clients" array is indexed by client's fd. It is grown on demand, so
+   the number of connected clients is not limited by FD_SETSIZE.
+   MAX_CLIENTS limits the number of vchan ports (per domain), and of policy
+   programs running at a time (per process, shared by all the domains with
+   --multi).
    */
 
 #define MAX_CLIENTS MAX_FDS
-struct _client clients[MAX_CLIENTS];	// data on all qrexec_client connections
+struct _client *clients;	// data on all qrexec_client connections
+int clients_size;		// number of allocated entries in "clients"
 
 struct _policy_pending policy_pending[MAX_CLIENTS];
 int policy_pending_max = -1;
 
-/* indexed with vchan port number relative to VCHAN_BASE_DATA_PORT; stores
- * either VCHAN_PORT_* or remote domain id for used port */
-int used_vchan_ports[MAX_CLIENTS];
+/* Service requests that cannot be evaluated right away (too many concurrent
+ * policy evaluations, or over the rate limit) wait in a bounded FIFO queue
+ * of the source domain instead of being refused. The limits apply per
+ * domain, so a VM flooding qrexec-policy-daemon with calls slows down only
+ * itself; and all the domains of the process share
+ * max_total_policy_evaluations, which they are admitted to in turns (see
+ * process_admission_queues). */
+struct queued_request {
+    struct queued_request *next;
+    struct service_params request_id;
+    char *target_domain;
+    char *service_name;
+    /* CLOCK_MONOTONIC, for queue_timeout */
+    struct timespec enqueued;
+};
+
+/* Everything the main event loop waits for is registered in main_epoll_fd
+ * with a pointer to one of these. */
+enum event_source_type {
+    SOURCE_VCHAN,	// domain's control vchan
+    SOURCE_CLIENTS,	// domain's clients_epoll_fd
+    SOURCE_TIMERS,	// timer wheel
+    SOURCE_ATTACH_LISTEN,	// --multi: socket for --attach requests
+    SOURCE_ATTACH,	// --multi: --attach process waiting for the domain
+    SOURCE_CONNECTED,	// --multi: connect_pipe
+};
+
+struct event_source {
+    enum event_source_type type;
+    struct domain *domain;
+};
+
+enum domain_state {
+    DOMAIN_CONNECTING,	// waiting for the agent in connect_thread()
+    DOMAIN_CONNECTED,
+    DOMAIN_FAILED,	// to be removed at the end of main loop iteration
+};
+
+/* State of the connection to one domain's qrexec-agent. Without --multi,
+ * there is only one. */
+struct domain {
+    struct domain *next;
+    int id;
+    char *name;
+    char *default_user;
+    enum domain_state state;
+
+    libvchan_t *vchan;
+    int protocol_version;
+    struct event_source vchan_source;
+
+    /* Messages for the agent that did not fit in the vchan, or were sent
+     * while the agent was not connected. Reading from clients is stopped
+     * until it is sent. Only the first message may be partially written,
+     * out_sent bytes of it. */
+    struct buffer out_buf;
+    size_t out_sent;
+
+    /* The connection can be resumed after the agent reconnects (protocol
+     * 4+). Data written to the vchan is kept in sent_log, and rx_bytes
+     * counts data received (excluding MSG_HELLO and MSG_CONNECTION_SYNC);
+     * see MSG_CONNECTION_SYNC. */
+    bool connected_before;
+    /* MSG_CONNECTION_SYNC sent/received on this connection */
+    bool sync_sent;
+    bool sync_received;
+    /* waiting for MSG_CONNECTION_SYNC from the agent, output is held */
+    bool sync_pending;
+    uint64_t rx_bytes;
+    /* received on this connection */
+    uint64_t conn_rx_bytes;
+    struct replay_log sent_log;
+
+    /* Message from the agent being read. It is read only as far as data is
+     * available in the vchan, so an agent sending partial messages does not
+     * block the daemon. */
+    struct msg_header in_hdr;
+    size_t in_hdr_len;
+    char *in_data;
+    size_t in_data_len;
+
+    /* /var/run/qubes/qrexec.<id> descriptor, -1 if not listening */
+    int socket_fd;
+    /* Contains socket_fd and all the clients' sockets; it is disabled
+     * (without touching each client) while there is no space in the vchan
+     * for messages from clients. Entries are keyed by fd. */
+    int clients_epoll_fd;
+    bool clients_epoll_enabled;
+    struct event_source clients_source;
+
+    /* indexed with vchan port number relative to VCHAN_BASE_DATA_PORT; stores
+     * either VCHAN_PORT_* or remote domain id for used port */
+    int used_vchan_ports[MAX_CLIENTS];
+
+    /* notify client (close its connection) when connection initiated by it was
+     * terminated - used by qrexec-policy to cleanup (disposable) VM; indexed with
+     * vchan port number relative to VCHAN_BASE_DATA_PORT; stores fd of given
+     * client or -1 if none requested */
+    int vchan_port_notify_client[MAX_CLIENTS];
+
+    struct queued_request *queue_head, **queue_tail;
+    int queue_len;
+    /* for the queue_timeout of the first (oldest) request */
+    struct qrexec_timer queue_timer;
+    struct domain_limits limits;
+    /* evaluations in progress (response_sent == RESPONSE_PENDING) */
+    int policy_evaluations;
+    /* token bucket for limits.rate_limit */
+    double rate_tokens;
+    struct timespec rate_last_refill;
+    struct qrexec_timer rate_timer;
+
+    /* --multi: connection from qrexec-daemon --attach, waiting for the
+     * result of the first connection, or -1 */
+    int attach_fd;
+    struct event_source attach_source;
+    /* --multi: the connection attempt in progress (see connect_thread),
+     * limited by connect_timeout */
+    struct connect_job *connect_job;
+    struct qrexec_timer connect_timer;
+    /* --multi: detached or given up on, remove even if still connected */
+    bool remove;
+};
+
+struct domain *domains;
+
+#define MAX_EPOLL_EVENTS 64
+int main_epoll_fd = -1;
+
+/* Deadlines for pending policy requests and for clients that have not sent
+ * their request yet. */
+#define POLICY_TIMEOUT_DEFAULT 3600
+#define CLIENT_TIMEOUT_DEFAULT 60
+struct timer_wheel *timers;
+struct event_source timers_source = { .type = SOURCE_TIMERS };
+int policy_timeout = POLICY_TIMEOUT_DEFAULT; /* seconds, 0 - no timeout */
+int client_timeout = CLIENT_TIMEOUT_DEFAULT; /* seconds, 0 - no timeout */
+
+#define MAX_QUEUED_DEFAULT 1024
+#define QUEUE_TIMEOUT_DEFAULT 60
+#define RATE_BURST_DEFAULT 10
+int queue_timeout = QUEUE_TIMEOUT_DEFAULT; /* seconds, 0 - no timeout */
+struct domain_limits default_limits = {
+    .max_policy_evaluations = MAX_CLIENTS,
+    .max_queued = MAX_QUEUED_DEFAULT,
+    .rate_limit = 0,
+    .rate_burst = RATE_BURST_DEFAULT,
+};
+/* shared by all the domains */
+int max_total_policy_evaluations = MAX_CLIENTS;
+int total_policy_evaluations;
+/* the domain whose request was admitted last */
+struct domain *last_admitted;
+
+/* --multi mode: one process serving many domains. Domains are added by
+ * "qrexec-daemon --attach", which connects to attach_socket_fd, and removed
+ * by "qrexec-daemon --detach". As libvchan_client_init() may block,
+ * connecting to an agent is done in a separate thread, which then writes
+ * the result to connect_pipe. */
+#define ATTACH_SOCKET_NAME "qrexec-daemon.sock"
+#define CONNECT_TIMEOUT_DEFAULT 60
+int connect_timeout = CONNECT_TIMEOUT_DEFAULT; /* seconds, 0 - no timeout */
+int attach_socket_fd = -1;
+struct event_source attach_listen_source = { .type = SOURCE_ATTACH_LISTEN };
+int connect_pipe[2] = { -1, -1 };
+struct event_source connected_source = { .type = SOURCE_CONNECTED };
+
+struct attach_request {
+    uint32_t domain_id;
+    char domain_name[256];	/* null terminated */
+    char default_user[256];	/* null terminated */
+    uint32_t flags;
+    struct domain_limits limits;
+};
+
+/* remove the domain instead of adding it */
+#define ATTACH_DETACH 1
 
-/* notify client (close its connection) when connection initiated by it was
- * terminated - used by qrexec-policy to cleanup (disposable) VM; indexed with
- * vchan port number relative to VCHAN_BASE_DATA_PORT; stores fd of given
- * client or -1 if none requested */
-int vchan_port_notify_client[MAX_CLIENTS];
+/* Sent to the waiting parent process (or qrexec-daemon --attach) once the
+ * agent handshake is completed, or failed. */
+struct startup_status {
+    int32_t status;	/* 0 - connected */
+    uint32_t handshake_ms;	/* time spent connecting to the agent */
+};
 
-int max_client_fd = -1;		// current max fd of all clients; so that we need not to scan all the "clients" table
-int qrexec_daemon_unix_socket_fd;	// /var/run/qubes/qrexec.xid descriptor
 const char *default_user = "user";
 const char default_user_keyword[] = "DEFAULT:";
 #define default_user_keyword_len_without_colon (sizeof(default_user_keyword)-2)
 
 int opt_quiet = 0;
 int opt_direct = 0;
+int opt_multi = 0;
 
 const char *socket_dir = QREXEC_DAEMON_SOCKET_DIR;
 const char *policy_program = QREXEC_POLICY_PROGRAM;
@@ -112,53 +313,130 @@ const char *policy_program = QREXEC_POLICY_PROGRAM;
 #  define UNUSED(x) UNUSED_ ## x
 #endif
 
-volatile int children_count;
 volatile int child_exited;
 volatile int terminate_requested;
 
-libvchan_t *vchan;
-int protocol_version;
+static void sigchld_handler(int UNUSED(x));
+static void sigterm_handler(int UNUSED(x));
 
-void sigusr1_handler(int UNUSED(x))
+static void unlink_qrexec_socket(const struct domain *d)
 {
-    if (!opt_quiet)
-        LOG(INFO, "Connected to VM");
-    exit(0);
+    char socket_address[40];
+    char link_to_socket_name[strlen(d->name) + sizeof(socket_address)];
+
+    snprintf(socket_address, sizeof(socket_address),
+             "%s/qrexec.%d", socket_dir, d->id);
+    snprintf(link_to_socket_name, sizeof link_to_socket_name,
+             "%s/qrexec.%s", socket_dir, d->name);
+    unlink(socket_address);
+    unlink(link_to_socket_name);
 }
 
-void sigchld_parent_handler(int UNUSED(x))
+static void unlink_qrexec_sockets(void)
 {
-    children_count--;
-    /* starting value is 0 so we see dead real qrexec-daemon as -1 */
-    if (children_count < 0) {
-        LOG(ERROR, "Connection to the VM failed");
+    struct domain *d;
+
+    for (d = domains; d; d = d->next)
+        if (d->socket_fd >= 0)
+            unlink_qrexec_socket(d);
+}
+
+/* A fatal error in communication with the agent. Without --multi, exit;
+ * otherwise disconnect just this domain. */
+static void handle_vchan_error(struct domain *d, const char *op)
+{
+    if (!opt_multi) {
+        LOG(ERROR, "Error while vchan %s, exiting", op);
         exit(1);
     }
+    LOG(ERROR, "Error while vchan %s, disconnecting domain %s", op, d->name);
+    d->state = DOMAIN_FAILED;
 }
 
-static void sigchld_handler(int UNUSED(x));
-static void sigterm_handler(int UNUSED(x));
+static void epoll_add_fd(int epfd, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
 
-char *remote_domain_name;	// guess what
-int remote_domain_id;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        PERROR("epoll_ctl(EPOLL_CTL_ADD, %d)", fd);
+        exit(1);
+    }
+}
 
-void unlink_qrexec_socket()
+static void epoll_add_source(int fd, struct event_source *source)
 {
-    char socket_address[40];
-    char link_to_socket_name[strlen(remote_domain_name) + sizeof(socket_address)];
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = source };
 
-    snprintf(socket_address, sizeof(socket_address),
-             "%s/qrexec.%d", socket_dir, remote_domain_id);
-    snprintf(link_to_socket_name, sizeof link_to_socket_name,
-             "%s/qrexec.%s", socket_dir, remote_domain_name);
-    unlink(socket_address);
-    unlink(link_to_socket_name);
+    if (epoll_ctl(main_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        PERROR("epoll_ctl(EPOLL_CTL_ADD, %d)", fd);
+        exit(1);
+    }
 }
 
-void handle_vchan_error(const char *op)
+static void epoll_del_fd(int epfd, int fd)
 {
-    LOG(ERROR, "Error while vchan %s, exiting", op);
-    exit(1);
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+        PERROR("epoll_ctl(EPOLL_CTL_DEL, %d)", fd);
+}
+
+/* (Stop) reading from clients - used to not overflow the vchan */
+static void set_clients_epoll_enabled(struct domain *d, bool enabled)
+{
+    struct epoll_event ev = {
+        .events = enabled ? EPOLLIN : 0,
+        .data.ptr = &d->clients_source,
+    };
+
+    if (enabled == d->clients_epoll_enabled)
+        return;
+    if (epoll_ctl(main_epoll_fd, EPOLL_CTL_MOD, d->clients_epoll_fd, &ev) < 0) {
+        PERROR("epoll_ctl(EPOLL_CTL_MOD)");
+        exit(1);
+    }
+    d->clients_epoll_enabled = enabled;
+}
+
+static void update_clients_epoll(struct domain *d)
+{
+    /* vchan full - don't read from clients */
+    set_clients_epoll_enabled(d,
+            d->state == DOMAIN_CONNECTED &&
+            buffer_len(&d->out_buf) == 0 &&
+            libvchan_buffer_space(d->vchan) > (int)sizeof(struct msg_header));
+}
+
+static void init_epoll(void)
+{
+    main_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (main_epoll_fd < 0) {
+        PERROR("epoll_create1");
+        exit(1);
+    }
+}
+
+/* make sure clients[fd] is a valid entry */
+static void grow_clients_table(int fd)
+{
+    int i, new_size;
+    struct _client *new_clients;
+
+    if (fd < clients_size)
+        return;
+    new_size = clients_size ? clients_size : MAX_CLIENTS;
+    while (fd >= new_size)
+        new_size *= 2;
+    new_clients = realloc(clients, new_size * sizeof(*clients));
+    if (!new_clients) {
+        LOG(ERROR, "Failed to allocate memory for %d clients", new_size);
+        exit(1);
+    }
+    for (i = clients_size; i < new_size; i++) {
+        new_clients[i].state = CLIENT_INVALID;
+        new_clients[i].domain = NULL;
+        new_clients[i].timer = NULL;
+    }
+    clients = new_clients;
+    clients_size = new_size;
 }
 
 
@@ -180,11 +458,74 @@ int create_qrexec_socket(int domid, const char *domname)
     }
     int fd = get_server_socket(socket_address);
     umask(0077);
+    /* handle_new_clients() accepts until there are no more connections */
+    set_nonblock(fd);
     return fd;
 }
 
 #define MAX_STARTUP_TIME_DEFAULT 60
 
+static int get_startup_timeout(void)
+{
+    const char *startup_timeout_str = getenv("QREXEC_STARTUP_TIMEOUT");
+    int startup_timeout;
+
+    if (!startup_timeout_str)
+        return MAX_STARTUP_TIME_DEFAULT;
+    startup_timeout = atoi(startup_timeout_str);
+    if (startup_timeout <= 0)
+        // invalid or negative number
+        return MAX_STARTUP_TIME_DEFAULT;
+    return startup_timeout;
+}
+
+static uint32_t elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+        (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Wait for struct startup_status on fd, until the startup timeout. Returns
+ * the exit code for the waiting process. */
+static int wait_for_startup(int fd, const char *domain_name)
+{
+    int startup_timeout = get_startup_timeout();
+    struct startup_status status;
+    struct timespec start;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int remaining, ret;
+
+    if (!opt_quiet)
+        LOG(ERROR, "Waiting for VM's qrexec agent.");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        remaining = startup_timeout * 1000 - (int)elapsed_ms(&start);
+        if (remaining <= 0) {
+            LOG(ERROR, "Cannot connect to '%s' qrexec agent for %d seconds, giving up", domain_name, startup_timeout);
+            return 3;
+        }
+        ret = poll(&pfd, 1, remaining);
+        if (ret < 0 && errno != EINTR) {
+            PERROR("poll");
+            return 1;
+        }
+        if (ret > 0)
+            break;
+    }
+    /* EOF if the daemon died before connecting */
+    if (!read_all(fd, &status, sizeof(status)) || status.status != 0) {
+        LOG(ERROR, "Connection to the VM failed");
+        return 1;
+    }
+    if (!opt_quiet)
+        LOG(INFO, "Connected to VM (agent handshake took %u ms)",
+            status.handshake_ms);
+    return 0;
+}
+
 static void incompatible_protocol_error_message(
         const char *domain_name, int remote_version)
 {
@@ -257,52 +598,125 @@ int handle_agent_hello(libvchan_t *ctrl, const char *domain_name)
     return actual_version;
 }
 
+static void policy_request_expired(struct qrexec_timer *timer);
+static void rate_timer_expired(struct qrexec_timer *timer);
+static void queue_timer_expired(struct qrexec_timer *timer);
+static void connect_timer_expired(struct qrexec_timer *timer);
+
+static struct domain *domain_new(int id, const char *name, const char *user)
+{
+    struct domain *d;
+    int i;
+
+    d = calloc(1, sizeof(*d));
+    if (!d) {
+        PERROR("calloc");
+        exit(1);
+    }
+    d->id = id;
+    d->name = strdup(name);
+    d->default_user = strdup(user);
+    if (!d->name || !d->default_user) {
+        PERROR("strdup");
+        exit(1);
+    }
+    d->state = DOMAIN_CONNECTING;
+    d->vchan_source = (struct event_source) { SOURCE_VCHAN, d };
+    d->clients_source = (struct event_source) { SOURCE_CLIENTS, d };
+    d->attach_source = (struct event_source) { SOURCE_ATTACH, d };
+    d->socket_fd = -1;
+    d->attach_fd = -1;
+    buffer_init(&d->out_buf);
+    replay_log_init(&d->sent_log, 0);
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        d->used_vchan_ports[i] = VCHAN_PORT_UNUSED;
+        d->vchan_port_notify_client[i] = VCHAN_PORT_UNUSED;
+    }
+    d->queue_tail = &d->queue_head;
+    timer_init(&d->rate_timer, rate_timer_expired, d);
+    timer_init(&d->queue_timer, queue_timer_expired, d);
+    timer_init(&d->connect_timer, connect_timer_expired, d);
+    d->limits = default_limits;
+    d->rate_tokens = d->limits.rate_burst;
+    clock_gettime(CLOCK_MONOTONIC, &d->rate_last_refill);
+
+    d->clients_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (d->clients_epoll_fd < 0) {
+        PERROR("epoll_create1");
+        exit(1);
+    }
+    epoll_add_source(d->clients_epoll_fd, &d->clients_source);
+    d->clients_epoll_enabled = true;
+
+    d->next = domains;
+    domains = d;
+    return d;
+}
+
+static void handle_message_from_agent(struct domain *d);
+static void start_session(struct domain *d);
+static void flush_domain_output(struct domain *d);
+
+/* the agent has connected, start serving the domain */
+static void domain_connected(struct domain *d, libvchan_t *vchan,
+                             int protocol_version)
+{
+    d->vchan = vchan;
+    d->protocol_version = protocol_version;
+    d->state = DOMAIN_CONNECTED;
+    epoll_add_source(libvchan_fd_for_select(vchan), &d->vchan_source);
+    start_session(d);
+    flush_domain_output(d);
+
+    d->socket_fd = create_qrexec_socket(d->id, d->name);
+    grow_clients_table(d->socket_fd);
+    clients[d->socket_fd].domain = d;
+    epoll_add_fd(d->clients_epoll_fd, d->socket_fd);
+
+    /* the agent may have already sent something, but the event was
+     * consumed during the handshake */
+    while (d->state == DOMAIN_CONNECTED && libvchan_data_ready(d->vchan) > 0)
+        handle_message_from_agent(d);
+    update_clients_epoll(d);
+}
+
 /* do the preparatory tasks, needed before entering the main event loop */
-void init(int xid)
+void init(int xid, const char *domain_name)
 {
     char qrexec_error_log_name[256];
     int logfd;
-    int i;
-    pid_t pid;
-    int startup_timeout = MAX_STARTUP_TIME_DEFAULT;
-    const char *startup_timeout_str = NULL;
+    int ready_pipe[2] = { -1, -1 };
+    struct startup_status status = { 0 };
+    struct timespec start;
+    libvchan_t *vchan;
+    int protocol_version;
+    struct domain *d;
 
     if (xid <= 0) {
         LOG(ERROR, "domain id=0?");
         exit(1);
     }
-    startup_timeout_str = getenv("QREXEC_STARTUP_TIMEOUT");
-    if (startup_timeout_str) {
-        startup_timeout = atoi(startup_timeout_str);
-        if (startup_timeout <= 0)
-            // invalid or negative number
-            startup_timeout = MAX_STARTUP_TIME_DEFAULT;
-    }
 
     if (!opt_direct) {
-        signal(SIGUSR1, sigusr1_handler);
-        signal(SIGCHLD, sigchld_parent_handler);
-        switch (pid=fork()) {
+        /* The child reports the result of the agent handshake through the
+         * pipe; if it dies before that, the parent gets EOF. */
+        if (pipe2(ready_pipe, O_CLOEXEC)) {
+            PERROR("pipe2");
+            exit(1);
+        }
+        switch (fork()) {
             case -1:
                 PERROR("fork");
                 exit(1);
             case 0:
+                close(ready_pipe[0]);
                 break;
             default:
                 if (getenv("QREXEC_STARTUP_NOWAIT"))
                     exit(0);
-                if (!opt_quiet)
-                    LOG(ERROR, "Waiting for VM's qrexec agent.");
-                for (i=0;i<startup_timeout;i++) {
-                    sleep(1);
-                    if (!opt_quiet)
-                        fprintf(stderr, ".");
-                    if (i==startup_timeout-1) {
-                        break;
-                    }
-                }
-                LOG(ERROR, "Cannot connect to '%s' qrexec agent for %d seconds, giving up", remote_domain_name, startup_timeout);
-                exit(3);
+                close(ready_pipe[1]);
+                exit(wait_for_startup(ready_pipe[0], domain_name));
         }
     }
 
@@ -310,7 +724,7 @@ void init(int xid)
 
     if (!opt_direct) {
         snprintf(qrexec_error_log_name, sizeof(qrexec_error_log_name),
-                 "/var/log/qubes/qrexec.%s.log", remote_domain_name);
+                 "/var/log/qubes/qrexec.%s.log", domain_name);
         umask(0007);        // make the log readable by the "qubes" group
         logfd =
             open(qrexec_error_log_name, O_WRONLY | O_CREAT | O_TRUNC,
@@ -334,16 +748,19 @@ void init(int xid)
         }
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     vchan = libvchan_client_init(xid, VCHAN_BASE_PORT);
     if (!vchan) {
         PERROR("cannot connect to qrexec agent");
         exit(1);
     }
 
-    protocol_version = handle_agent_hello(vchan, remote_domain_name);
+    protocol_version = handle_agent_hello(vchan, domain_name);
     if (protocol_version < 0) {
         exit(1);
     }
+    status.handshake_ms = elapsed_ms(&start);
+    LOG(INFO, "Connected to qrexec agent in %u ms", status.handshake_ms);
 
     if (setgid(getgid()) < 0) {
         PERROR("setgid()");
@@ -354,25 +771,31 @@ void init(int xid)
         exit(1);
     }
 
-    /* initialize clients state arrays */
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        clients[i].state = CLIENT_INVALID;
-        policy_pending[i].pid = 0;
-        used_vchan_ports[i] = VCHAN_PORT_UNUSED;
-        vchan_port_notify_client[i] = VCHAN_PORT_UNUSED;
+    grow_clients_table(0);
+
+    timers = timer_wheel_new();
+    if (!timers) {
+        PERROR("timer_wheel_new");
+        exit(1);
     }
 
-    atexit(unlink_qrexec_socket);
-    qrexec_daemon_unix_socket_fd =
-        create_qrexec_socket(xid, remote_domain_name);
+    init_epoll();
+    epoll_add_source(timer_wheel_fd(timers), &timers_source);
+
+    atexit(unlink_qrexec_sockets);
+    d = domain_new(xid, domain_name, default_user);
+    domain_connected(d, vchan, protocol_version);
 
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, sigchld_handler);
-    signal(SIGUSR1, SIG_DFL);
     signal(SIGTERM, sigterm_handler);
 
-    if (!opt_direct)
-        kill(getppid(), SIGUSR1);   // let the parent know we are ready
+    if (!opt_direct) {
+        // let the parent know we are ready
+        if (!write_all(ready_pipe[1], &status, sizeof(status)))
+            LOG(WARNING, "Failed to notify the parent process");
+        close(ready_pipe[1]);
+    }
 }
 
 static int send_client_hello(int fd)
@@ -395,7 +818,7 @@ static int send_client_hello(int fd)
     return 0;
 }
 
-static int allocate_vchan_port(int connect_domain)
+static int allocate_vchan_port(struct domain *d, int connect_domain)
 {
     /*
       Make sure the allocated ports numbers are unique for a given {domX, domY}
@@ -421,27 +844,42 @@ static int allocate_vchan_port(int connect_domain)
         i = 0;
         step = 1;
     } else {
-        i = connect_domain > remote_domain_id ? 1 : 0;
+        i = connect_domain > d->id ? 1 : 0;
         step = 2;
     }
 
     for (; i < MAX_CLIENTS; i += step) {
-        if (used_vchan_ports[i] == VCHAN_PORT_UNUSED) {
-            used_vchan_ports[i] = connect_domain;
+        if (d->used_vchan_ports[i] == VCHAN_PORT_UNUSED) {
+            d->used_vchan_ports[i] = connect_domain;
             return VCHAN_BASE_DATA_PORT+i;
         }
     }
     return -1;
 }
 
-static void handle_new_client()
+static void terminate_client(int fd);
+
+static void client_request_expired(struct qrexec_timer *timer)
 {
-    int fd = do_accept(qrexec_daemon_unix_socket_fd);
-    if (fd >= MAX_CLIENTS) {
-        LOG(ERROR, "too many clients ?");
-        exit(1);
+    int fd = (int)(intptr_t)timer->data;
+
+    LOG(ERROR, "Client %d did not send a request in %d seconds, disconnecting",
+        fd, client_timeout);
+    terminate_client(fd);
+}
+
+static void cancel_client_timer(int fd)
+{
+    if (clients[fd].timer) {
+        timer_cancel(clients[fd].timer);
+        free(clients[fd].timer);
+        clients[fd].timer = NULL;
     }
+}
 
+static void handle_new_client(struct domain *d, int fd)
+{
+    grow_clients_table(fd);
     if (send_client_hello(fd) < 0) {
         close(fd);
         clients[fd].state = CLIENT_INVALID;
@@ -449,39 +887,152 @@ static void handle_new_client()
     }
 
     clients[fd].state = CLIENT_HELLO;
-    if (fd > max_client_fd)
-        max_client_fd = fd;
+    clients[fd].domain = d;
+    epoll_add_fd(d->clients_epoll_fd, fd);
+    if (client_timeout) {
+        clients[fd].timer = malloc(sizeof(*clients[fd].timer));
+        if (!clients[fd].timer) {
+            PERROR("malloc");
+            exit(1);
+        }
+        timer_init(clients[fd].timer, client_request_expired,
+                   (void *)(intptr_t)fd);
+        timer_start(timers, clients[fd].timer, client_timeout * 1000);
+    }
+}
+
+/* Accept all pending connections, so that a burst of clients does not need a
+ * wakeup for each one. */
+static void handle_new_clients(struct domain *d)
+{
+    int fd;
+
+    while ((fd = do_accept4(d->socket_fd, SOCK_NONBLOCK)) >= 0)
+        handle_new_client(d, fd);
 }
 
 static void terminate_client(int fd)
 {
+    struct domain *d = clients[fd].domain;
     int port;
     clients[fd].state = CLIENT_INVALID;
+    clients[fd].domain = NULL;
+    cancel_client_timer(fd);
+    epoll_del_fd(d->clients_epoll_fd, fd);
     close(fd);
     /* if client requested vchan connection end notify, cancel it */
     for (port = 0; port < MAX_CLIENTS; port++) {
-        if (vchan_port_notify_client[port] == fd)
-            vchan_port_notify_client[port] = VCHAN_PORT_UNUSED;
+        if (d->vchan_port_notify_client[port] == fd)
+            d->vchan_port_notify_client[port] = VCHAN_PORT_UNUSED;
+    }
+}
+
+/* Tell the client that the connection on a port has ended: close the
+ * connection, or send MSG_CONNECTION_TERMINATED in session mode. */
+static void notify_client_port_terminated(struct domain *d, int port,
+                                          int remote_id)
+{
+    int fd = d->vchan_port_notify_client[port-VCHAN_BASE_DATA_PORT];
+    struct msg_header hdr = {
+        .type = MSG_CONNECTION_TERMINATED,
+        .len = sizeof(struct exec_params),
+    };
+    struct exec_params params = {
+        .connect_domain = remote_id,
+        .connect_port = port,
+    };
+
+    if (clients[fd].state != CLIENT_SESSION) {
+        /* it will clear notification request */
+        terminate_client(fd);
+        return;
     }
+    d->vchan_port_notify_client[port-VCHAN_BASE_DATA_PORT] = VCHAN_PORT_UNUSED;
+    if (!write_all(fd, &hdr, sizeof(hdr)) ||
+            !write_all(fd, &params, sizeof(params)))
+        terminate_client(fd);
 }
 
-static void release_vchan_port(int port, int expected_remote_id)
+static void release_vchan_port(struct domain *d, int port, int expected_remote_id)
 {
     /* release only if was reserved for connection to given domain */
-    if (used_vchan_ports[port-VCHAN_BASE_DATA_PORT] == expected_remote_id) {
-        used_vchan_ports[port-VCHAN_BASE_DATA_PORT] = VCHAN_PORT_UNUSED;
-        /* notify client if requested - it will clear notification request */
-        if (vchan_port_notify_client[port-VCHAN_BASE_DATA_PORT] != VCHAN_PORT_UNUSED)
-            terminate_client(vchan_port_notify_client[port-VCHAN_BASE_DATA_PORT]);
+    if (d->used_vchan_ports[port-VCHAN_BASE_DATA_PORT] == expected_remote_id) {
+        d->used_vchan_ports[port-VCHAN_BASE_DATA_PORT] = VCHAN_PORT_UNUSED;
+        /* notify client if requested */
+        if (d->vchan_port_notify_client[port-VCHAN_BASE_DATA_PORT] != VCHAN_PORT_UNUSED)
+            notify_client_port_terminated(d, port, expected_remote_id);
+    }
+}
+
+/* write to the vchan, there must be enough space */
+static bool vchan_write(struct domain *d, uint32_t type,
+                        const void *data, size_t len)
+{
+    if (libvchan_send(d->vchan, data, len) < 0) {
+        handle_vchan_error(d, "send");
+        return false;
+    }
+    if (type != MSG_CONNECTION_SYNC &&
+            d->protocol_version >= QREXEC_PROTOCOL_V4)
+        replay_log_append(&d->sent_log, data, len);
+    return true;
+}
+
+/* Send a message to the agent (hdr->len bytes of data), or queue it if it
+ * cannot be sent right now. Never blocks. */
+static void domain_send(struct domain *d, const struct msg_header *hdr,
+                        const void *data)
+{
+    if (d->state == DOMAIN_CONNECTED && !d->sync_pending &&
+            buffer_len(&d->out_buf) == 0 &&
+            libvchan_buffer_space(d->vchan) >= (int)(sizeof(*hdr) + hdr->len)) {
+        if (vchan_write(d, hdr->type, hdr, sizeof(*hdr)))
+            vchan_write(d, hdr->type, data, hdr->len);
+        return;
+    }
+    buffer_append(&d->out_buf, (const char *)hdr, sizeof(*hdr));
+    buffer_append(&d->out_buf, data, hdr->len);
+}
+
+static void flush_domain_output(struct domain *d)
+{
+    struct msg_header hdr;
+    size_t msg_len, len;
+    int space;
+
+    if (d->state != DOMAIN_CONNECTED || d->sync_pending)
+        return;
+    while (buffer_len(&d->out_buf) > 0) {
+        memcpy(&hdr, buffer_data(&d->out_buf), sizeof(hdr));
+        msg_len = sizeof(hdr) + hdr.len;
+        space = libvchan_buffer_space(d->vchan);
+        if (space <= 0)
+            return;
+        len = msg_len - d->out_sent;
+        if (len > (size_t)space)
+            len = space;
+        if (!vchan_write(d, hdr.type,
+                         (char *)buffer_data(&d->out_buf) + d->out_sent, len))
+            return;
+        d->out_sent += len;
+        if (d->out_sent < msg_len)
+            return;
+        buffer_remove(&d->out_buf, msg_len);
+        d->out_sent = 0;
     }
 }
 
+static void end_policy_evaluation(int i);
+
 static int handle_cmdline_body_from_client(int fd, struct msg_header *hdr)
 {
+    struct domain *d = clients[fd].domain;
     struct exec_params params;
     int len = hdr->len-sizeof(params);
     char buf[len];
-    int use_default_user = 0;
+    char *msg_data;
+    char *end;
+    size_t user_len, pos, cmdline_len;
     int i;
 
     if (!read_all(fd, &params, sizeof(params))) {
@@ -492,6 +1043,42 @@ static int handle_cmdline_body_from_client(int fd, struct msg_header *hdr)
         terminate_client(fd);
         return 0;
     }
+    /* anything after the cmdline is initial stdin, or struct
+     * just_exec_params (see qrexec.h) */
+    end = hdr->type == MSG_SERVICE_CONNECT ? NULL : memchr(buf, 0, len);
+    if (end && end + 1 < buf + len && hdr->type == MSG_JUST_EXEC_NO_DATA) {
+        if ((size_t)(buf + len - (end + 1)) != sizeof(struct just_exec_params)) {
+            LOG(ERROR, "Unexpected data after cmdline");
+            terminate_client(fd);
+            return 0;
+        }
+    } else if (end && end + 1 < buf + len) {
+        struct exec_stdin_params stdin_params;
+        size_t extra_len = buf + len - (end + 1);
+
+        if (hdr->type != MSG_EXEC_CMDLINE || params.connect_domain != 0 ||
+                extra_len < sizeof(stdin_params)) {
+            LOG(ERROR, "Unexpected data after cmdline");
+            terminate_client(fd);
+            return 0;
+        }
+        memcpy(&stdin_params, end + 1, sizeof(stdin_params));
+        if (stdin_params.len > MAX_EXEC_STDIN_LEN ||
+                extra_len != sizeof(stdin_params) + stdin_params.len) {
+            LOG(ERROR, "Invalid initial stdin (%u bytes)", stdin_params.len);
+            terminate_client(fd);
+            return 0;
+        }
+    }
+
+    if (hdr->type == MSG_JUST_EXEC_NO_DATA &&
+            d->protocol_version < QREXEC_PROTOCOL_V10) {
+        /* the agent does not know it: go on as MSG_JUST_EXEC, and tell the
+         * client so, so that it serves the data connection */
+        hdr->type = MSG_JUST_EXEC;
+        if (end)
+            len = end + 1 - buf;
+    }
 
     if (hdr->type == MSG_SERVICE_CONNECT) {
         /* if the service was accepted, do not send spurious
@@ -499,42 +1086,47 @@ static int handle_cmdline_body_from_client(int fd, struct msg_header *hdr)
          * code. Avoid also sending MSG_SERVICE_CONNECT twice. */
         for (i = 0; i <= policy_pending_max; i++) {
             if (policy_pending[i].pid &&
+                    policy_pending[i].domain == d &&
                     policy_pending[i].response_sent == RESPONSE_PENDING &&
                     strncmp(policy_pending[i].params.ident, buf, len) == 0) {
                 break;
             }
         }
         if (i > policy_pending_max) {
-            LOG(ERROR, "Connection with ident %s not requested or already handled",
-                    policy_pending[i].params.ident);
+            LOG(ERROR, "Connection with ident %.*s not requested or already handled",
+                    (int)strnlen(buf, len), buf);
             terminate_client(fd);
             return 0;
         }
+        end_policy_evaluation(i);
         policy_pending[i].response_sent = RESPONSE_ALLOW;
+        /* the policy child may legitimately run for as long as the call
+         * (e.g. to clean up a DispVM) */
+        timer_cancel(&policy_pending[i].timer);
     }
 
     if (!params.connect_port) {
         struct exec_params client_params;
         /* allocate port and send it to the client */
-        params.connect_port = allocate_vchan_port(params.connect_domain);
+        params.connect_port = allocate_vchan_port(d, params.connect_domain);
         if (params.connect_port <= 0) {
             LOG(ERROR, "Failed to allocate new vchan port, too many clients?");
             terminate_client(fd);
             return 0;
         }
         /* notify the client when this connection got terminated */
-        vchan_port_notify_client[params.connect_port-VCHAN_BASE_DATA_PORT] = fd;
+        d->vchan_port_notify_client[params.connect_port-VCHAN_BASE_DATA_PORT] = fd;
         client_params.connect_port = params.connect_port;
-        client_params.connect_domain = remote_domain_id;
+        client_params.connect_domain = d->id;
         hdr->len = sizeof(client_params);
         if (!write_all(fd, hdr, sizeof(*hdr))) {
             terminate_client(fd);
-            release_vchan_port(params.connect_port, params.connect_domain);
+            release_vchan_port(d, params.connect_port, params.connect_domain);
             return 0;
         }
         if (!write_all(fd, &client_params, sizeof(client_params))) {
             terminate_client(fd);
-            release_vchan_port(params.connect_port, params.connect_domain);
+            release_vchan_port(d, params.connect_port, params.connect_domain);
             return 0;
         }
         /* restore original len value */
@@ -544,24 +1136,45 @@ static int handle_cmdline_body_from_client(int fd, struct msg_header *hdr)
         assert(params.connect_port < VCHAN_BASE_DATA_PORT+MAX_CLIENTS);
     }
 
+    msg_data = malloc(hdr->len + strlen(d->default_user) +
+                      sizeof(struct peer_info));
+    if (!msg_data) {
+        PERROR("malloc");
+        exit(1);
+    }
+    memcpy(msg_data, &params, sizeof(params));
+    pos = sizeof(params);
+    cmdline_len = end ? (size_t)(end + 1 - buf) : (size_t)len;
     if (!strncmp(buf, default_user_keyword, default_user_keyword_len_without_colon+1)) {
-        use_default_user = 1;
-        hdr->len -= default_user_keyword_len_without_colon;
-        hdr->len += strlen(default_user);
-    }
-    if (libvchan_send(vchan, hdr, sizeof(*hdr)) < 0)
-        handle_vchan_error("send");
-    if (libvchan_send(vchan, &params, sizeof(params)) < 0)
-        handle_vchan_error("send params");
-    if (use_default_user) {
-        if (libvchan_send(vchan, default_user, strlen(default_user)) < 0)
-            handle_vchan_error("send default_user");
-        if (libvchan_send(vchan, buf+default_user_keyword_len_without_colon,
-                    len-default_user_keyword_len_without_colon) < 0)
-            handle_vchan_error("send buf");
-    } else
-        if (libvchan_send(vchan, buf, len) < 0)
-            handle_vchan_error("send buf");
+        user_len = strlen(d->default_user);
+        memcpy(msg_data + pos, d->default_user, user_len);
+        pos += user_len;
+        memcpy(msg_data + pos, buf + default_user_keyword_len_without_colon,
+               cmdline_len - default_user_keyword_len_without_colon);
+        pos += cmdline_len - default_user_keyword_len_without_colon;
+    } else {
+        memcpy(msg_data + pos, buf, cmdline_len);
+        pos += cmdline_len;
+    }
+    /* the data connection peer is a dom0 client, which uses the same protocol
+     * version as we do (see handle_client_hello) */
+    if ((hdr->type == MSG_EXEC_CMDLINE || hdr->type == MSG_JUST_EXEC) &&
+            params.connect_domain == 0 && end) {
+        struct peer_info info = { .version = QREXEC_PROTOCOL_VERSION };
+
+        memcpy(msg_data + pos, &info, sizeof(info));
+        pos += sizeof(info);
+        /* initial stdin, already validated above */
+        memcpy(msg_data + pos, buf + cmdline_len, len - cmdline_len);
+        pos += len - cmdline_len;
+    } else if (hdr->type == MSG_JUST_EXEC_NO_DATA) {
+        /* struct just_exec_params, if any, already validated above */
+        memcpy(msg_data + pos, buf + cmdline_len, len - cmdline_len);
+        pos += len - cmdline_len;
+    }
+    hdr->len = pos;
+    domain_send(d, hdr, msg_data);
+    free(msg_data);
     return 1;
 }
 
@@ -575,8 +1188,17 @@ static void handle_cmdline_message_from_client(int fd)
     switch (hdr.type) {
         case MSG_EXEC_CMDLINE:
         case MSG_JUST_EXEC:
+        case MSG_JUST_EXEC_NO_DATA:
         case MSG_SERVICE_CONNECT:
             break;
+        case MSG_SESSION_START:
+            if (clients[fd].state != CLIENT_CMDLINE || hdr.len != 0) {
+                terminate_client(fd);
+                return;
+            }
+            clients[fd].state = CLIENT_SESSION;
+            cancel_client_timer(fd);
+            return;
         default:
             terminate_client(fd);
             return;
@@ -586,7 +1208,10 @@ static void handle_cmdline_message_from_client(int fd)
         // client disconnected while sending cmdline, above call already
         // cleaned up client info
         return;
-    clients[fd].state = CLIENT_RUNNING;
+    if (clients[fd].state == CLIENT_CMDLINE) {
+        clients[fd].state = CLIENT_RUNNING;
+        cancel_client_timer(fd);
+    }
 }
 
 static void handle_client_hello(int fd)
@@ -626,6 +1251,7 @@ static void handle_message_from_client(int fd)
             handle_client_hello(fd);
             return;
         case CLIENT_CMDLINE:
+        case CLIENT_SESSION:
             handle_cmdline_message_from_client(fd);
             return;
         case CLIENT_RUNNING:
@@ -659,57 +1285,98 @@ static void sigterm_handler(int UNUSED(x))
     terminate_requested = 1;
 }
 
-static void send_service_refused(libvchan_t *vchan, const struct service_params *params) {
+static void send_service_refused(struct domain *d, const struct service_params *params) {
     struct msg_header hdr;
 
     hdr.type = MSG_SERVICE_REFUSED;
     hdr.len = sizeof(*params);
 
-    if (libvchan_send(vchan, &hdr, sizeof(hdr)) != sizeof(hdr)) {
-        LOG(ERROR, "Failed to send MSG_SERVICE_REFUSED hdr to agent");
-        exit(1);
+    domain_send(d, &hdr, params);
+}
+
+/* the policy program has responded, or is no longer waited for */
+static void end_policy_evaluation(int i)
+{
+    if (policy_pending[i].pid &&
+            policy_pending[i].response_sent == RESPONSE_PENDING) {
+        policy_pending[i].domain->policy_evaluations--;
+        total_policy_evaluations--;
     }
+}
 
-    if (libvchan_send(vchan, params, sizeof(*params)) != sizeof(*params)) {
-        LOG(ERROR, "Failed to send MSG_SERVICE_REFUSED to agent");
-        exit(1);
+static void release_policy_pending_slot(int i)
+{
+    end_policy_evaluation(i);
+    policy_pending[i].pid = 0;
+    policy_pending[i].domain = NULL;
+    timer_cancel(&policy_pending[i].timer);
+    while (policy_pending_max >= 0 &&
+            policy_pending[policy_pending_max].pid == 0)
+        policy_pending_max--;
+}
+
+/* Forget the domain's pending requests, the answers are not expected any
+ * more. The policy programs are left to finish. */
+static void abort_policy_requests(struct domain *d)
+{
+    int i;
+
+    for (i = 0; i <= policy_pending_max; i++) {
+        if (policy_pending[i].pid && policy_pending[i].domain == d)
+            release_policy_pending_slot(i);
     }
 }
 
+/* policy evaluation hangs, kill it and refuse the call */
+static void policy_request_expired(struct qrexec_timer *timer)
+{
+    struct _policy_pending *req = timer->data;
+
+    LOG(ERROR, "qrexec-policy-exec for connection %s did not respond in %d seconds, killing it",
+            req->params.ident, policy_timeout);
+    kill(req->pid, SIGKILL);
+    if (req->response_sent == RESPONSE_PENDING)
+        send_service_refused(req->domain, &req->params);
+    release_policy_pending_slot(req - policy_pending);
+}
+
 /* clean zombies, check for denied service calls */
 static void reap_children()
 {
     int status;
     int i;
+    struct domain *d;
 
     pid_t pid;
     while ((pid=waitpid(-1, &status, WNOHANG)) > 0) {
         for (i = 0; i <= policy_pending_max; i++) {
-            if (policy_pending[i].pid == pid) {
-                status = WEXITSTATUS(status);
-                if (status != 0) {
-                    if (policy_pending[i].response_sent != RESPONSE_PENDING) {
-                        LOG(ERROR, "qrexec-policy-exec for connection %s exited with code %d, but the response (%s) was already sent",
-                                policy_pending[i].params.ident, status,
-                                policy_pending[i].response_sent == RESPONSE_ALLOW ? "allow" : "deny");
-                    } else {
-                        send_service_refused(vchan, &policy_pending[i].params);
-                    }
-                }
-                /* in case of allowed calls, we will do the rest in
-                 * MSG_SERVICE_CONNECT from client handler */
-                policy_pending[i].pid = 0;
-                while (policy_pending_max > 0 &&
-                        policy_pending[policy_pending_max].pid == 0)
-                    policy_pending_max--;
+            if (policy_pending[i].pid == pid)
                 break;
+        }
+        if (i > policy_pending_max)
+            continue;
+        d = policy_pending[i].domain;
+        status = WEXITSTATUS(status);
+        if (status != 0) {
+            if (policy_pending[i].response_sent != RESPONSE_PENDING) {
+                LOG(ERROR, "qrexec-policy-exec for connection %s exited with code %d, but the response (%s) was already sent",
+                        policy_pending[i].params.ident, status,
+                        policy_pending[i].response_sent == RESPONSE_ALLOW ? "allow" : "deny");
+            } else {
+                send_service_refused(d, &policy_pending[i].params);
             }
         }
+        /* in case of allowed calls, we will do the rest in
+         * MSG_SERVICE_CONNECT from client handler */
+        release_policy_pending_slot(i);
     }
     child_exited = 0;
 }
 
-static int find_policy_pending_slot() {
+/* The slots are shared by all the domains, so that one process does not run
+ * more than MAX_CLIENTS policy programs at a time, however many domains it
+ * serves. */
+static int find_policy_pending_slot(void) {
     int i;
 
     for (i = 0; i < MAX_CLIENTS; i++) {
@@ -753,7 +1420,7 @@ static int connect_daemon_socket(
         const char *remote_domain_name,
         const char *target_domain,
         const char *service_name,
-        const struct service_params *request_id
+        const char *request_ident
 ) {
     int result;
     int command_size;
@@ -784,7 +1451,7 @@ static int connect_daemon_socket(
         "service_and_arg=%s\n"
         "process_ident=%s\n\n",
         remote_domain_id, remote_domain_name, target_domain,
-        service_name, request_id->ident);
+        service_name, request_ident);
     if (command_size < 0) {
          PERROR("failed to construct request");
          return -1;
@@ -815,49 +1482,31 @@ static int connect_daemon_socket(
 }
 
 
-static void handle_execute_service(
-        const int remote_domain_id,
+/* Ask qrexec-policy-daemon about the request, or if it is not available,
+ * exec qrexec-policy-exec. Runs in a child process, the result is the exit
+ * status. */
+_Noreturn static void run_policy_request(
+        int remote_domain_id,
         const char *remote_domain_name,
         const char *target_domain,
         const char *service_name,
-        const struct service_params *request_id)
+        const char *request_ident)
 {
     int i;
     int result;
-    int policy_pending_slot;
-    pid_t pid;
-    char remote_domain_id_str[10];
+    char remote_domain_id_str[12];
     sigset_t sigmask;
 
-    policy_pending_slot = find_policy_pending_slot();
-    if (policy_pending_slot < 0) {
-        LOG(ERROR, "Service request denied, too many pending requests");
-        send_service_refused(vchan, request_id);
-        return;
-    }
-
-    switch (pid=fork()) {
-        case -1:
-            PERROR("fork");
-            exit(1);
-        case 0:
-            break;
-        default:
-            policy_pending[policy_pending_slot].pid = pid;
-            policy_pending[policy_pending_slot].params = *request_id;
-            policy_pending[policy_pending_slot].response_sent = RESPONSE_PENDING;
-            return;
-    }
-
     result = connect_daemon_socket(remote_domain_id, remote_domain_name,
-                                   target_domain, service_name, request_id);
+                                   target_domain, service_name, request_ident);
     if (result >= 0) {
         _exit(result);
     }
 
     LOG(ERROR, "couldn't invoke qrexec-policy-daemon, using qrexec-policy-exec");
 
-    for (i = 3; i < MAX_FDS; i++)
+    /* clients' fds may be above MAX_FDS */
+    for (i = 3; i < MAX_FDS || i < clients_size; i++)
         close(i);
     sigemptyset(&sigmask);
     sigprocmask(SIG_SETMASK, &sigmask, NULL);
@@ -870,98 +1519,685 @@ static void handle_execute_service(
             remote_domain_name,
             target_domain,
             service_name,
-            request_id->ident,
+            request_ident,
             NULL);
     PERROR("execl");
     _exit(1);
 }
 
-
-static void handle_connection_terminated()
+static void handle_execute_service(
+        struct domain *d,
+        const char *target_domain,
+        const char *service_name,
+        const struct service_params *request_id)
 {
-    struct exec_params untrusted_params, params;
+    int i;
+    int policy_pending_slot;
+    pid_t pid;
+    char remote_domain_id_str[12];
+    sigset_t sigmask;
+    char *argv[] = {
+        "qrexec-daemon", "--policy-request", "-p", (char *)policy_program,
+        "--", remote_domain_id_str, d->name, (char *)target_domain,
+        (char *)service_name, (char *)request_id->ident, NULL,
+    };
 
-    if (libvchan_recv(vchan, &untrusted_params, sizeof(untrusted_params)) < 0)
-        handle_vchan_error("recv params");
-    /* sanitize start */
-    if (untrusted_params.connect_port < VCHAN_BASE_DATA_PORT ||
-            untrusted_params.connect_port >= VCHAN_BASE_DATA_PORT+MAX_CLIENTS) {
-        LOG(ERROR, "Invalid port in MSG_CONNECTION_TERMINATED (%d)",
-                untrusted_params.connect_port);
-        exit(1);
+    policy_pending_slot = find_policy_pending_slot();
+    if (policy_pending_slot < 0) {
+        LOG(ERROR, "Service request denied, too many pending requests");
+        send_service_refused(d, request_id);
+        return;
     }
-    /* untrusted_params.connect_domain even if invalid will not harm - in worst
-     * case the port will not be released */
-    params = untrusted_params;
-    /* sanitize end */
-    release_vchan_port(params.connect_port, params.connect_domain);
-}
+    snprintf(remote_domain_id_str, sizeof(remote_domain_id_str), "%d", d->id);
 
-static void sanitize_message_from_agent(struct msg_header *untrusted_header)
-{
-    switch (untrusted_header->type) {
-        case MSG_TRIGGER_SERVICE:
-            if (protocol_version >= QREXEC_PROTOCOL_V3) {
-                LOG(ERROR, "agent sent (old) MSG_TRIGGER_SERVICE "
-                    "although it uses protocol %d", protocol_version);
-                exit(1);
-            }
-            if (untrusted_header->len != sizeof(struct trigger_service_params)) {
+    switch (pid=fork()) {
+        case -1:
+            PERROR("fork");
+            exit(1);
+        case 0:
+            break;
+        default:
+            policy_pending[policy_pending_slot].pid = pid;
+            policy_pending[policy_pending_slot].domain = d;
+            policy_pending[policy_pending_slot].params = *request_id;
+            policy_pending[policy_pending_slot].response_sent = RESPONSE_PENDING;
+            d->policy_evaluations++;
+            total_policy_evaluations++;
+            if (policy_timeout)
+                timer_start(timers, &policy_pending[policy_pending_slot].timer,
+                            policy_timeout * 1000);
+            return;
+    }
+
+    if (opt_multi) {
+        /* There may be other threads (see connect_thread), so only
+         * async-signal-safe functions can be used until exec. Let a new
+         * instance do the rest, see run_policy_request. */
+        for (i = 3; i < MAX_FDS || i < clients_size; i++)
+            close(i);
+        sigemptyset(&sigmask);
+        sigprocmask(SIG_SETMASK, &sigmask, NULL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        execve("/proc/self/exe", argv, environ);
+        _exit(1);
+    }
+    run_policy_request(d->id, d->name, target_domain, service_name,
+                       request_id->ident);
+}
+
+/* Refill the token bucket; return how long (in ms) until a call can be
+ * admitted, 0 if it can be admitted now. */
+static unsigned int rate_limit_delay(struct domain *d)
+{
+    struct timespec now;
+    double elapsed;
+
+    if (!d->limits.rate_limit)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - d->rate_last_refill.tv_sec) +
+        (now.tv_nsec - d->rate_last_refill.tv_nsec) / 1e9;
+    d->rate_last_refill = now;
+    d->rate_tokens += elapsed * d->limits.rate_limit;
+    if (d->rate_tokens > d->limits.rate_burst)
+        d->rate_tokens = d->limits.rate_burst;
+    if (d->rate_tokens >= 1)
+        return 0;
+    return (unsigned int)((1 - d->rate_tokens) * 1000 / d->limits.rate_limit) + 1;
+}
+
+/* Check if another policy evaluation can be started now. If not, this will
+ * be retried when some evaluation finishes, or when rate_timer expires. */
+static bool can_admit(struct domain *d)
+{
+    unsigned int delay;
+
+    if (d->policy_evaluations >= d->limits.max_policy_evaluations ||
+            total_policy_evaluations >= max_total_policy_evaluations ||
+            find_policy_pending_slot() < 0)
+        return false;
+    delay = rate_limit_delay(d);
+    if (delay) {
+        if (!timer_is_active(&d->rate_timer))
+            timer_start(timers, &d->rate_timer, delay);
+        return false;
+    }
+    return true;
+}
+
+static void admit(
+        struct domain *d,
+        const char *target_domain,
+        const char *service_name,
+        const struct service_params *request_id)
+{
+    if (d->limits.rate_limit)
+        d->rate_tokens -= 1;
+    handle_execute_service(d, target_domain, service_name, request_id);
+}
+
+static struct queued_request *queue_pop(struct domain *d)
+{
+    struct queued_request *req = d->queue_head;
+
+    d->queue_head = req->next;
+    if (!d->queue_head)
+        d->queue_tail = &d->queue_head;
+    d->queue_len--;
+    return req;
+}
+
+static void queued_request_free(struct queued_request *req)
+{
+    free(req->target_domain);
+    free(req->service_name);
+    free(req);
+}
+
+/* milliseconds the first queued request has waited */
+static long queue_head_waited_ms(struct domain *d)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - d->queue_head->enqueued.tv_sec) * 1000 +
+        (now.tv_nsec - d->queue_head->enqueued.tv_nsec) / 1000000;
+}
+
+/* The queue is FIFO, so the first request is always the next one to time
+ * out; keep queue_timer running for it. */
+static void arm_queue_timer(struct domain *d)
+{
+    long remaining_ms;
+
+    if (!queue_timeout || !d->queue_head) {
+        timer_cancel(&d->queue_timer);
+        return;
+    }
+    remaining_ms = queue_timeout * 1000L - queue_head_waited_ms(d);
+    timer_start(timers, &d->queue_timer,
+                remaining_ms > 0 ? (unsigned int)remaining_ms : 0);
+}
+
+/* refuse the requests that waited for longer than queue_timeout */
+static void queue_timer_expired(struct qrexec_timer *timer)
+{
+    struct domain *d = timer->data;
+    struct queued_request *req;
+
+    while (d->queue_head &&
+            queue_head_waited_ms(d) >= queue_timeout * 1000L) {
+        req = queue_pop(d);
+        LOG(ERROR, "Service request %s refused, queued for more than %d seconds",
+            req->request_id.ident, queue_timeout);
+        send_service_refused(d, &req->request_id);
+        queued_request_free(req);
+    }
+    arm_queue_timer(d);
+}
+
+static void admit_queued(struct domain *d)
+{
+    struct queued_request *req = queue_pop(d);
+
+    admit(d, req->target_domain, req->service_name, &req->request_id);
+    queued_request_free(req);
+    arm_queue_timer(d);
+}
+
+/* Start policy evaluation of queued requests, as far as the limits allow.
+ * The domains take turns, one request each, starting after the one admitted
+ * last, so that one with a long queue does not get all of
+ * max_total_policy_evaluations as it frees up. */
+static void process_admission_queues(void)
+{
+    struct domain *start, *d;
+    bool admitted;
+
+    start = last_admitted ? last_admitted->next : NULL;
+    if (!start)
+        start = domains;
+    do {
+        admitted = false;
+        for (d = start; d; d = d->next ? d->next : domains) {
+            if (d->state == DOMAIN_CONNECTED && d->queue_head &&
+                    can_admit(d)) {
+                admit_queued(d);
+                last_admitted = d;
+                admitted = true;
+            }
+            if ((d->next ? d->next : domains) == start)
+                break;
+        }
+    } while (admitted &&
+             total_policy_evaluations < max_total_policy_evaluations);
+}
+
+static void rate_timer_expired(struct qrexec_timer *UNUSED(timer))
+{
+    process_admission_queues();
+}
+
+static void queue_service_request(
+        struct domain *d,
+        const char *target_domain,
+        const char *service_name,
+        const struct service_params *request_id)
+{
+    struct queued_request *req;
+
+    if (!d->queue_head && can_admit(d)) {
+        admit(d, target_domain, service_name, request_id);
+        return;
+    }
+    if (d->queue_len >= d->limits.max_queued) {
+        LOG(ERROR, "Service request denied, too many queued requests");
+        send_service_refused(d, request_id);
+        return;
+    }
+    req = malloc(sizeof(*req));
+    if (!req) {
+        PERROR("malloc");
+        exit(1);
+    }
+    req->next = NULL;
+    req->request_id = *request_id;
+    req->target_domain = strdup(target_domain);
+    req->service_name = strdup(service_name);
+    if (!req->target_domain || !req->service_name) {
+        PERROR("strdup");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &req->enqueued);
+    *d->queue_tail = req;
+    d->queue_tail = &req->next;
+    d->queue_len++;
+    if (d->queue_head == req)
+        arm_queue_timer(d);
+}
+
+/* drop queued requests without an answer, the agent has gone away */
+static void flush_admission_queue(struct domain *d)
+{
+    struct queued_request *req;
+
+    while ((req = d->queue_head)) {
+        d->queue_head = req->next;
+        queued_request_free(req);
+    }
+    d->queue_tail = &d->queue_head;
+    d->queue_len = 0;
+    timer_cancel(&d->rate_timer);
+    timer_cancel(&d->queue_timer);
+}
+
+
+static void handle_connection_terminated(struct domain *d,
+        const struct exec_params *untrusted_params)
+{
+    struct exec_params params;
+
+    /* sanitize start */
+    if (untrusted_params->connect_port < VCHAN_BASE_DATA_PORT ||
+            untrusted_params->connect_port >= VCHAN_BASE_DATA_PORT+MAX_CLIENTS) {
+        LOG(ERROR, "Invalid port in MSG_CONNECTION_TERMINATED (%d)",
+                untrusted_params->connect_port);
+        handle_vchan_error(d, "recv params");
+        return;
+    }
+    /* untrusted_params.connect_domain even if invalid will not harm - in worst
+     * case the port will not be released */
+    params = *untrusted_params;
+    /* sanitize end */
+    release_vchan_port(d, params.connect_port, params.connect_domain);
+}
+
+/* pass MSG_EXEC_STATUS on to the client that made the call */
+static void handle_exec_status(struct domain *d,
+        const struct exec_status *untrusted_status)
+{
+    struct msg_header hdr = {
+        .type = MSG_EXEC_STATUS,
+        .len = sizeof(struct exec_status),
+    };
+    struct exec_status status;
+    int port, fd;
+
+    /* sanitize start */
+    if (untrusted_status->connect_port < VCHAN_BASE_DATA_PORT ||
+            untrusted_status->connect_port >= VCHAN_BASE_DATA_PORT+MAX_CLIENTS) {
+        LOG(ERROR, "Invalid port in MSG_EXEC_STATUS (%d)",
+                untrusted_status->connect_port);
+        handle_vchan_error(d, "recv params");
+        return;
+    }
+    status = *untrusted_status;
+    /* sanitize end */
+    port = status.connect_port - VCHAN_BASE_DATA_PORT;
+    /* only for a call in progress, to the client that made it */
+    if (d->used_vchan_ports[port] != (int)status.connect_domain)
+        return;
+    fd = d->vchan_port_notify_client[port];
+    if (fd == VCHAN_PORT_UNUSED)
+        return;
+    if (!write_all(fd, &hdr, sizeof(hdr)) ||
+            !write_all(fd, &status, sizeof(status)))
+        terminate_client(fd);
+}
+
+/* Resuming the control connection (protocol 4+), see MSG_CONNECTION_SYNC.
+ * Clients, pending requests and messages not received by the agent survive
+ * the agent reconnecting. */
+
+static void domain_agent_restarted(struct domain *d);
+
+static void send_connection_sync(struct domain *d, uint32_t flags)
+{
+    struct {
+        struct msg_header hdr;
+        struct connection_sync sync;
+    } msg = {
+        .hdr = { .type = MSG_CONNECTION_SYNC, .len = sizeof(msg.sync) },
+        .sync = { .flags = flags, .nports = 0, .rx_bytes = d->rx_bytes },
+    };
+
+    /* the vchan is empty right after the handshake */
+    vchan_write(d, MSG_CONNECTION_SYNC, &msg, sizeof(msg));
+    d->sync_sent = true;
+}
+
+static void end_sync_wait(struct domain *d)
+{
+    d->sync_pending = false;
+    flush_domain_output(d);
+    update_clients_epoll(d);
+}
+
+/* Called when the agent connects. */
+static void start_session(struct domain *d)
+{
+    d->sync_sent = false;
+    d->sync_received = false;
+    d->sync_pending = false;
+    d->conn_rx_bytes = 0;
+    if (!d->connected_before) {
+        d->connected_before = true;
+        return;
+    }
+    if (d->protocol_version < QREXEC_PROTOCOL_V4) {
+        /* cannot tell, assume the worst */
+        domain_agent_restarted(d);
+        return;
+    }
+    /* hold the output until the agent tells what it has received */
+    send_connection_sync(d, 0);
+    d->sync_pending = true;
+}
+
+/* Port of a message that uses a data vchan, or -1. */
+static int message_port(const struct msg_header *hdr, const char *data)
+{
+    const struct exec_params *params = (const struct exec_params *)data;
+
+    switch (hdr->type) {
+        case MSG_EXEC_CMDLINE:
+        case MSG_JUST_EXEC:
+        case MSG_JUST_EXEC_NO_DATA:
+        case MSG_SERVICE_CONNECT:
+            if (params->connect_port >= VCHAN_BASE_DATA_PORT &&
+                    params->connect_port < VCHAN_BASE_DATA_PORT+MAX_CLIENTS)
+                return params->connect_port - VCHAN_BASE_DATA_PORT;
+            break;
+    }
+    return -1;
+}
+
+/* The agent was restarted, everything it got from us is lost. Calls from the
+ * domain cannot be completed anymore, but commands not sent yet can still be
+ * started by the new agent. */
+static void domain_agent_restarted(struct domain *d)
+{
+    struct buffer kept;
+    struct msg_header hdr;
+    const char *msg = buffer_data(&d->out_buf);
+    const char *end = msg + buffer_len(&d->out_buf);
+    bool port_kept[MAX_CLIENTS] = { false };
+    int i, port;
+
+    LOG(WARNING, "qrexec-agent of domain %s was restarted", d->name);
+    buffer_init(&kept);
+    for (; msg < end; msg += sizeof(hdr) + hdr.len) {
+        memcpy(&hdr, msg, sizeof(hdr));
+        if (hdr.type != MSG_EXEC_CMDLINE && hdr.type != MSG_JUST_EXEC &&
+                hdr.type != MSG_JUST_EXEC_NO_DATA)
+            continue;
+        buffer_append(&kept, msg, sizeof(hdr) + hdr.len);
+        port = message_port(&hdr, msg + sizeof(hdr));
+        if (port >= 0)
+            port_kept[port] = true;
+    }
+    buffer_free(&d->out_buf);
+    d->out_buf = kept;
+    d->out_sent = 0;
+
+    /* Disconnect clients whose connections were handled by the old agent.
+     * This will look like those qrexec connections were terminated, which
+     * isn't necessary true (established qrexec connection may survive
+     * qrexec-agent restart), but we won't be notified about their
+     * termination. This may kill DispVM prematurely (if anyone restarts
+     * qrexec-agent inside DispVM), but it's better than the alternative
+     * (leaking DispVMs).
+     *
+     * But, do not mark related vchan ports as unused. Since we won't get call
+     * end notification, we don't know when such ports will really be unused.
+     */
+    for (i = 0; i < clients_size; i++) {
+        if (clients[i].state != CLIENT_RUNNING || clients[i].domain != d)
+            continue;
+        for (port = 0; port < MAX_CLIENTS; port++)
+            if (port_kept[port] && d->vchan_port_notify_client[port] == i)
+                break;
+        if (port == MAX_CLIENTS)
+            terminate_client(i);
+    }
+    /* the rest of notification requests are from session clients */
+    for (port = 0; port < MAX_CLIENTS; port++) {
+        if (!port_kept[port] &&
+                d->vchan_port_notify_client[port] != VCHAN_PORT_UNUSED)
+            notify_client_port_terminated(d, port + VCHAN_BASE_DATA_PORT,
+                                          d->used_vchan_ports[port]);
+    }
+
+    abort_policy_requests(d);
+    flush_admission_queue(d);
+
+    replay_log_free(&d->sent_log);
+    replay_log_init(&d->sent_log, 0);
+    d->rx_bytes = d->conn_rx_bytes;
+}
+
+/* The agent kept the connection state, send again what it did not receive. */
+static bool domain_resume(struct domain *d, uint64_t agent_rx_bytes)
+{
+    struct buffer out;
+
+    buffer_init(&out);
+    if (!replay_log_rewind(&d->sent_log, agent_rx_bytes, &out)) {
+        LOG(ERROR, "Cannot resume connection to domain %s: agent received "
+            "%llu bytes, %llu-%llu available", d->name,
+            (unsigned long long)agent_rx_bytes,
+            (unsigned long long)d->sent_log.start,
+            (unsigned long long)d->sent_log.end);
+        buffer_free(&out);
+        return false;
+    }
+    buffer_append(&out, (char *)buffer_data(&d->out_buf) + d->out_sent,
+                  buffer_len(&d->out_buf) - d->out_sent);
+    buffer_free(&d->out_buf);
+    d->out_buf = out;
+    d->out_sent = 0;
+    LOG(INFO, "Resumed connection to domain %s", d->name);
+    return true;
+}
+
+static bool handle_connection_sync(struct domain *d,
+        const struct connection_sync *untrusted_sync, size_t len)
+{
+    const struct connection_sync_port *untrusted_ports =
+        (const struct connection_sync_port *)(untrusted_sync + 1);
+    struct connection_sync sync;
+    uint32_t i, port;
+
+    /* sanitize start */
+    sync = *untrusted_sync;
+    if (sync.nports != (len - sizeof(sync)) / sizeof(*untrusted_ports)) {
+        LOG(ERROR, "agent sent invalid MSG_CONNECTION_SYNC packet");
+        return false;
+    }
+    if (!(sync.flags & CONNECTION_SYNC_FRESH) && d->conn_rx_bytes > 0) {
+        LOG(ERROR, "agent sent MSG_CONNECTION_SYNC too late");
+        return false;
+    }
+    /* sanitize end */
+
+    if (!d->sync_sent) {
+        /* We are the fresh side (daemon restarted): the ports are still in
+         * use by connections started before, do not allocate them. */
+        for (i = 0; i < sync.nports; i++) {
+            port = untrusted_ports[i].connect_port - VCHAN_BASE_DATA_PORT;
+            if (port < MAX_CLIENTS &&
+                    d->used_vchan_ports[port] == VCHAN_PORT_UNUSED)
+                d->used_vchan_ports[port] = untrusted_ports[i].connect_domain;
+        }
+        if (!(sync.flags & CONNECTION_SYNC_FRESH))
+            send_connection_sync(d, CONNECTION_SYNC_FRESH);
+        return true;
+    }
+    if (!d->sync_pending)
+        /* fresh agent, already handled when it sent something else */
+        return true;
+    if (sync.flags & CONNECTION_SYNC_FRESH)
+        domain_agent_restarted(d);
+    else if (!domain_resume(d, sync.rx_bytes))
+        return false;
+    end_sync_wait(d);
+    return true;
+}
+
+static bool sanitize_message_from_agent(struct domain *d,
+        struct msg_header *untrusted_header)
+{
+    switch (untrusted_header->type) {
+        case MSG_TRIGGER_SERVICE:
+            if (d->protocol_version >= QREXEC_PROTOCOL_V3) {
+                LOG(ERROR, "agent sent (old) MSG_TRIGGER_SERVICE "
+                    "although it uses protocol %d", d->protocol_version);
+                return false;
+            }
+            if (untrusted_header->len != sizeof(struct trigger_service_params)) {
                 LOG(ERROR, "agent sent invalid MSG_TRIGGER_SERVICE packet");
-                exit(1);
+                return false;
             }
             break;
         case MSG_TRIGGER_SERVICE3:
-            if (protocol_version < QREXEC_PROTOCOL_V3) {
+            if (d->protocol_version < QREXEC_PROTOCOL_V3) {
                 LOG(ERROR, "agent sent (new) MSG_TRIGGER_SERVICE3 "
-                    "although it uses protocol %d", protocol_version);
-                exit(1);
+                    "although it uses protocol %d", d->protocol_version);
+                return false;
             }
-            if (untrusted_header->len < sizeof(struct trigger_service_params3)) {
+            if (untrusted_header->len <= sizeof(struct trigger_service_params3)) {
                 LOG(ERROR, "agent sent invalid MSG_TRIGGER_SERVICE3 packet");
-                exit(1);
+                return false;
             }
             if (untrusted_header->len - sizeof(struct trigger_service_params3)
                     > MAX_SERVICE_NAME_LEN) {
                 LOG(ERROR, "agent sent too large MSG_TRIGGER_SERVICE3 packet");
-                exit(1);
+                return false;
             }
             break;
         case MSG_CONNECTION_TERMINATED:
             if (untrusted_header->len != sizeof(struct exec_params)) {
                 LOG(ERROR, "agent sent invalid MSG_CONNECTION_TERMINATED packet");
-                exit(1);
+                return false;
+            }
+            break;
+        case MSG_EXEC_STATUS:
+            if (d->protocol_version < QREXEC_PROTOCOL_V10) {
+                LOG(ERROR, "agent sent MSG_EXEC_STATUS "
+                    "although it uses protocol %d", d->protocol_version);
+                return false;
+            }
+            if (untrusted_header->len != sizeof(struct exec_status)) {
+                LOG(ERROR, "agent sent invalid MSG_EXEC_STATUS packet");
+                return false;
+            }
+            break;
+        case MSG_CONNECTION_SYNC:
+            if (d->protocol_version < QREXEC_PROTOCOL_V4) {
+                LOG(ERROR, "agent sent MSG_CONNECTION_SYNC "
+                    "although it uses protocol %d", d->protocol_version);
+                return false;
+            }
+            if (d->sync_received) {
+                LOG(ERROR, "agent sent MSG_CONNECTION_SYNC twice");
+                return false;
+            }
+            if (untrusted_header->len < sizeof(struct connection_sync) ||
+                    (untrusted_header->len - sizeof(struct connection_sync)) %
+                    sizeof(struct connection_sync_port) != 0 ||
+                    untrusted_header->len - sizeof(struct connection_sync) >
+                    MAX_CLIENTS * sizeof(struct connection_sync_port)) {
+                LOG(ERROR, "agent sent invalid MSG_CONNECTION_SYNC packet");
+                return false;
             }
             break;
         default:
             LOG(ERROR, "unknown mesage type 0x%x from agent",
                     untrusted_header->type);
-            exit(1);
+            return false;
     }
+    return true;
 }
 
-static void handle_message_from_agent(void)
+/* Read the next message from the agent, as far as it is available, and handle
+ * it once complete. */
+static void handle_message_from_agent(struct domain *d)
 {
-    struct msg_header hdr, untrusted_hdr;
+    struct msg_header hdr;
     struct trigger_service_params untrusted_params, params;
     struct trigger_service_params3 untrusted_params3, params3;
-    char *untrusted_service_name = NULL, *service_name = NULL;
+    char *untrusted_service_name, *service_name;
     size_t service_name_len;
+    size_t avail = libvchan_data_ready(d->vchan);
+    size_t len;
+
+    if (d->in_hdr_len < sizeof(d->in_hdr)) {
+        len = sizeof(d->in_hdr) - d->in_hdr_len;
+        if (len > avail)
+            len = avail;
+        if (libvchan_recv(d->vchan, (char *)&d->in_hdr + d->in_hdr_len, len) < 0) {
+            handle_vchan_error(d, "recv hdr");
+            return;
+        }
+        d->in_hdr_len += len;
+        if (d->in_hdr_len < sizeof(d->in_hdr))
+            return;
+        /* sanitize start */
+        if (!sanitize_message_from_agent(d, &d->in_hdr)) {
+            if (!opt_multi)
+                exit(1);
+            d->state = DOMAIN_FAILED;
+            return;
+        }
+        /* sanitize end */
+        d->in_data = malloc(d->in_hdr.len);
+        if (!d->in_data) {
+            PERROR("malloc");
+            exit(1);
+        }
+        d->in_data_len = 0;
+        avail = libvchan_data_ready(d->vchan);
+    }
 
-    if (libvchan_recv(vchan, &untrusted_hdr, sizeof(untrusted_hdr)) < 0)
-        handle_vchan_error("recv hdr");
-    /* sanitize start */
-    sanitize_message_from_agent(&untrusted_hdr);
-    hdr = untrusted_hdr;
-    /* sanitize end */
+    len = d->in_hdr.len - d->in_data_len;
+    if (len > avail)
+        len = avail;
+    if (len > 0 && libvchan_recv(d->vchan, d->in_data + d->in_data_len, len) < 0) {
+        handle_vchan_error(d, "recv data");
+        return;
+    }
+    d->in_data_len += len;
+    if (d->in_data_len < d->in_hdr.len)
+        return;
+
+    /* the whole message is there */
+    hdr = d->in_hdr;
+    d->in_hdr_len = 0;
 
-    //      fprintf(stderr, "got %x %x %x\n", hdr.type, hdr.client_id,
-    //              hdr.len);
+    if (hdr.type == MSG_CONNECTION_SYNC) {
+        d->sync_received = true;
+        if (!handle_connection_sync(d, (struct connection_sync *)d->in_data,
+                                    hdr.len)) {
+            if (!opt_multi)
+                exit(1);
+            d->state = DOMAIN_FAILED;
+        }
+        free(d->in_data);
+        d->in_data = NULL;
+        return;
+    }
+    /* an agent that was connected before sends MSG_CONNECTION_SYNC first */
+    if (d->sync_pending) {
+        domain_agent_restarted(d);
+        end_sync_wait(d);
+    }
+    d->rx_bytes += sizeof(hdr) + hdr.len;
+    d->conn_rx_bytes += sizeof(hdr) + hdr.len;
 
     switch (hdr.type) {
         case MSG_TRIGGER_SERVICE:
-            if (libvchan_recv(vchan, &untrusted_params, sizeof(untrusted_params)) < 0)
-                handle_vchan_error("recv params");
+            memcpy(&untrusted_params, d->in_data, sizeof(untrusted_params));
 
             /* sanitize start */
             ENSURE_NULL_TERMINATED(untrusted_params.service_name);
@@ -973,21 +2209,14 @@ static void handle_message_from_agent(void)
             params = untrusted_params;
             /* sanitize end */
 
-            handle_execute_service(remote_domain_id, remote_domain_name,
-                    params.target_domain,
+            queue_service_request(d, params.target_domain,
                     params.service_name,
                     &params.request_id);
-            return;
+            break;
         case MSG_TRIGGER_SERVICE3:
             service_name_len = hdr.len - sizeof(untrusted_params3);
-            untrusted_service_name = malloc(service_name_len);
-            if (!untrusted_service_name)
-                handle_vchan_error("malloc(service_name)");
-
-            if (libvchan_recv(vchan, &untrusted_params3, sizeof(untrusted_params3)) < 0)
-                handle_vchan_error("recv params3");
-            if (libvchan_recv(vchan, untrusted_service_name, service_name_len) < 0)
-                handle_vchan_error("recv params3(service_name)");
+            memcpy(&untrusted_params3, d->in_data, sizeof(untrusted_params3));
+            untrusted_service_name = d->in_data + sizeof(untrusted_params3);
 
             /* sanitize start */
             ENSURE_NULL_TERMINATED(untrusted_params3.target_domain);
@@ -998,83 +2227,101 @@ static void handle_message_from_agent(void)
             sanitize_name(untrusted_service_name, "+");
             params3 = untrusted_params3;
             service_name = untrusted_service_name;
-            untrusted_service_name = NULL;
             /* sanitize end */
 
-            handle_execute_service(remote_domain_id, remote_domain_name,
-                    params3.target_domain,
+            queue_service_request(d, params3.target_domain,
                     service_name,
                     &params3.request_id);
-            free(service_name);
-            return;
+            break;
         case MSG_CONNECTION_TERMINATED:
-            handle_connection_terminated();
-            return;
+            handle_connection_terminated(d, (struct exec_params *)d->in_data);
+            break;
+        case MSG_EXEC_STATUS:
+            handle_exec_status(d, (struct exec_status *)d->in_data);
+            break;
     }
+    free(d->in_data);
+    d->in_data = NULL;
 }
 
-/*
- * Scan the "clients" table, add ones we want to read from (because the other
- * end has not send MSG_XOFF on them) to read_fdset, add ones we want to write
- * to (because its pipe is full) to write_fdset. Return the highest used file
- * descriptor number, needed for the first select() parameter.
- */
-static int fill_fdsets_for_select(fd_set * read_fdset, fd_set * write_fdset)
+/* dispatch events on the domain's clients_epoll_fd */
+static void handle_clients_events(struct domain *d)
 {
-    int i;
-    int max = -1;
-
-    FD_ZERO(read_fdset);
-    FD_ZERO(write_fdset);
-    for (i = 0; i <= max_client_fd; i++) {
-        if (clients[i].state != CLIENT_INVALID) {
-            FD_SET(i, read_fdset);
-            max = i;
-        }
-    }
-
-    FD_SET(qrexec_daemon_unix_socket_fd, read_fdset);
-    if (qrexec_daemon_unix_socket_fd > max)
-        max = qrexec_daemon_unix_socket_fd;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int i, ret, fd;
 
-    return max;
+    ret = epoll_wait(d->clients_epoll_fd, events, MAX_EPOLL_EVENTS, 0);
+    if (ret < 0) {
+        PERROR("epoll_wait");
+        exit(1);
+    }
+    for (i = 0; i < ret && d->state == DOMAIN_CONNECTED; i++) {
+        fd = events[i].data.fd;
+        if (fd == d->socket_fd)
+            handle_new_clients(d);
+        else if (clients[fd].state != CLIENT_INVALID)
+            handle_message_from_client(fd);
+    }
 }
 
-/* qrexec-agent has disconnected, cleanup local state and try to connect again.
- * If remote domain dies, terminate qrexec-daemon.
- */
-static int handle_agent_restart(int xid) {
-    size_t i;
-
+/* The agent has disconnected (or failed). Messages not sent yet, clients and
+ * pending requests are kept, in case the connection can be resumed. The domain
+ * still needs to be removed or reconnected. */
+static void domain_disconnect(struct domain *d)
+{
     // Stop listening.
-    unlink_qrexec_socket();
-    close(qrexec_daemon_unix_socket_fd);
+    if (d->socket_fd >= 0) {
+        unlink_qrexec_socket(d);
+        epoll_del_fd(d->clients_epoll_fd, d->socket_fd);
+        close(d->socket_fd);
+        d->socket_fd = -1;
+    }
 
     /* Close old (dead) vchan connection. */
-    libvchan_close(vchan);
-    vchan = NULL;
-
-    /* Disconnect all local clients. This will look like all the qrexec
-     * connections were terminated, which isn't necessary true (established
-     * qrexec connection may survive qrexec-agent and qrexec-daemon restart),
-     * but we won't be notified about its termination. This may kill DispVM
-     * prematurely (if anyone restarts qrexec-agent inside DispVM), but it's
-     * better than the alternative (leaking DispVMs).
-     *
-     * But, do not mark related vchan ports as unused. Since we won't get call
-     * end notification, we don't know when such ports will really be unused.
-     */
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].state != CLIENT_INVALID)
-            terminate_client(i);
+    if (d->vchan) {
+        epoll_del_fd(main_epoll_fd, libvchan_fd_for_select(d->vchan));
+        libvchan_close(d->vchan);
+        d->vchan = NULL;
     }
+    /* a partially received message will be sent again */
+    free(d->in_data);
+    d->in_data = NULL;
+    d->in_hdr_len = 0;
+    d->sync_pending = false;
+}
 
-    /* Abort pending qrexec requests */
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (policy_pending[i].pid != 0)
-            policy_pending[i].pid = 0;
+/* Drop all the connection state, nothing will be resumed. */
+static void domain_drop_session(struct domain *d)
+{
+    int i;
+
+    buffer_free(&d->out_buf);
+    buffer_init(&d->out_buf);
+    d->out_sent = 0;
+    replay_log_free(&d->sent_log);
+    replay_log_init(&d->sent_log, 0);
+    d->rx_bytes = 0;
+    d->connected_before = false;
+
+    /* Disconnect all local clients, see domain_agent_restarted(). */
+    for (i = 0; i < clients_size; i++) {
+        if (clients[i].state != CLIENT_INVALID && clients[i].domain == d)
+            terminate_client(i);
     }
-    policy_pending_max = -1;
+
+    abort_policy_requests(d);
+    flush_admission_queue(d);
+}
+
+/* qrexec-agent has disconnected, cleanup local state and try to connect again.
+ * If remote domain dies, terminate qrexec-daemon.
+ */
+static int handle_agent_restart(struct domain *d) {
+    sigset_t sigmask;
+    libvchan_t *vchan;
+    int protocol_version;
+
+    domain_disconnect(d);
 
     /* Restore default SIGTERM handling: libvchan_client_init() might block
      * indefinitely, so we want the program to be killable.
@@ -1082,43 +2329,492 @@ static int handle_agent_restart(int xid) {
     signal(SIGTERM, SIG_DFL);
     if (terminate_requested)
         return -1;
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
 
 #ifdef COVERAGE
     /* Dump coverage in case we are killed here. */
     __gcov_flush();
 #endif
 
-    vchan = libvchan_client_init(remote_domain_id, VCHAN_BASE_PORT);
+    vchan = libvchan_client_init(d->id, VCHAN_BASE_PORT);
     if (!vchan) {
         PERROR("cannot connect to qrexec agent");
         return -1;
     }
-    if (handle_agent_hello(vchan, remote_domain_name) < 0) {
+    protocol_version = handle_agent_hello(vchan, d->name);
+    if (protocol_version < 0) {
         libvchan_close(vchan);
-        vchan = NULL;
         return -1;
     }
     LOG(INFO, "qrexec-agent has reconnected");
 
     signal(SIGTERM, sigterm_handler);
+    sigprocmask(SIG_BLOCK, &sigmask, NULL);
 
-    qrexec_daemon_unix_socket_fd =
-        create_qrexec_socket(xid, remote_domain_name);
+    domain_connected(d, vchan, protocol_version);
     return 0;
 }
 
+/* --multi mode */
+
+/* A connection attempt. The thread uses only id and name; domain is
+ * touched only by the main thread, and set to NULL if the domain is removed
+ * before the attempt finishes, as the thread cannot be interrupted. Such an
+ * attempt is taken over by the next domain with the same id, otherwise it
+ * could get the agent's connection first. */
+struct connect_job {
+    struct domain *domain;
+    int id;
+    char *name;
+    struct connect_job *next;
+};
+
+/* all the attempts in progress */
+static struct connect_job *connect_jobs;
+
+struct connect_result {
+    struct connect_job *job;
+    libvchan_t *vchan;
+    int protocol_version;
+    uint32_t handshake_ms;
+};
+
+/* Runs in a separate thread, as libvchan_client_init() may block. */
+static void *connect_thread(void *arg)
+{
+    struct connect_result result = { .job = arg, .protocol_version = -1 };
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result.vchan = libvchan_client_init(result.job->id, VCHAN_BASE_PORT);
+    if (!result.vchan) {
+        LOG(ERROR, "Cannot connect to domain %s qrexec agent",
+            result.job->name);
+    } else {
+        result.protocol_version =
+            handle_agent_hello(result.vchan, result.job->name);
+    }
+    result.handshake_ms = elapsed_ms(&start);
+    if (write(connect_pipe[1], &result, sizeof(result)) != sizeof(result)) {
+        PERROR("write to connect pipe");
+        abort();
+    }
+    return NULL;
+}
+
+static void start_connecting(struct domain *d)
+{
+    struct connect_job *job;
+    pthread_t thread;
+    int ret;
+
+    d->state = DOMAIN_CONNECTING;
+    update_clients_epoll(d);
+    if (connect_timeout)
+        timer_start(timers, &d->connect_timer, connect_timeout * 1000);
+    for (job = connect_jobs; job; job = job->next) {
+        if (!job->domain && job->id == d->id) {
+            job->domain = d;
+            d->connect_job = job;
+            return;
+        }
+    }
+    job = malloc(sizeof(*job));
+    if (!job || !(job->name = strdup(d->name))) {
+        PERROR("malloc");
+        exit(1);
+    }
+    job->domain = d;
+    job->id = d->id;
+    job->next = connect_jobs;
+    connect_jobs = job;
+    d->connect_job = job;
+    ret = pthread_create(&thread, NULL, connect_thread, job);
+    if (ret) {
+        errno = ret;
+        PERROR("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/* Remove the domain at the end of this main loop iteration (see
+ * remove_failed_domains), as its event sources may still be pending. */
+static void schedule_domain_removal(struct domain *d)
+{
+    d->state = DOMAIN_FAILED;
+    d->remove = true;
+}
+
+static void connect_timer_expired(struct qrexec_timer *timer)
+{
+    struct domain *d = timer->data;
+
+    LOG(ERROR, "Domain %s qrexec agent did not connect in %d seconds",
+        d->name, connect_timeout);
+    schedule_domain_removal(d);
+}
+
+static void report_attach_result(struct domain *d, int32_t status,
+                                 uint32_t handshake_ms)
+{
+    struct startup_status msg = {
+        .status = status,
+        .handshake_ms = handshake_ms,
+    };
+
+    if (d->attach_fd < 0)
+        return;
+    if (!write_all(d->attach_fd, &msg, sizeof(msg)))
+        LOG(WARNING, "Failed to send the connection status for domain %s",
+            d->name);
+    epoll_del_fd(main_epoll_fd, d->attach_fd);
+    close(d->attach_fd);
+    d->attach_fd = -1;
+}
+
+static void domain_free(struct domain *d)
+{
+    struct domain **p;
+
+    for (p = &domains; *p != d; p = &(*p)->next)
+        ;
+    *p = d->next;
+    if (last_admitted == d)
+        last_admitted = NULL;
+    /* the result of the attempt will be dropped in handle_connect_result */
+    if (d->connect_job)
+        d->connect_job->domain = NULL;
+    timer_cancel(&d->connect_timer);
+    epoll_del_fd(main_epoll_fd, d->clients_epoll_fd);
+    close(d->clients_epoll_fd);
+    free(d->name);
+    free(d->default_user);
+    free(d);
+}
+
+static void handle_connect_result(void)
+{
+    struct connect_result result;
+    struct connect_job **p;
+    struct domain *d;
+
+    if (!read_all(connect_pipe[0], &result, sizeof(result))) {
+        PERROR("read from connect pipe");
+        exit(1);
+    }
+    for (p = &connect_jobs; *p != result.job; p = &(*p)->next)
+        ;
+    *p = result.job->next;
+    d = result.job->domain;
+    free(result.job->name);
+    free(result.job);
+    if (!d) {
+        /* the domain was removed in the meantime */
+        if (result.vchan)
+            libvchan_close(result.vchan);
+        return;
+    }
+    d->connect_job = NULL;
+    timer_cancel(&d->connect_timer);
+    if (d->state != DOMAIN_CONNECTING) {
+        /* to be removed, see schedule_domain_removal */
+        if (result.vchan)
+            libvchan_close(result.vchan);
+        return;
+    }
+    if (result.protocol_version < 0) {
+        if (result.vchan)
+            libvchan_close(result.vchan);
+        /* domain is gone, or its agent is broken */
+        d->state = DOMAIN_FAILED;
+        return;
+    }
+    LOG(INFO, "Connected to domain %s in %u ms", d->name,
+        result.handshake_ms);
+    domain_connected(d, result.vchan, result.protocol_version);
+    report_attach_result(d, 0, result.handshake_ms);
+}
+
+/* Agent disconnected. Without --multi, reconnect synchronously; otherwise
+ * in the background. */
+static void handle_agent_disconnected(struct domain *d)
+{
+    if (!opt_multi) {
+        if (handle_agent_restart(d) < 0) {
+            LOG(ERROR, "Failed to reconnect to qrexec-agent, terminating");
+            exit(1);
+        }
+        return;
+    }
+    LOG(WARNING, "qrexec-agent of domain %s has disconnected", d->name);
+    domain_disconnect(d);
+    start_connecting(d);
+}
+
+static void handle_vchan_event(struct domain *d)
+{
+    if (d->state != DOMAIN_CONNECTED)
+        return;
+    /* clear event pending flag, this shouldn't block */
+    libvchan_wait(d->vchan);
+    if (!libvchan_is_open(d->vchan)) {
+        if (!opt_multi)
+            LOG(WARNING, "qrexec-agent has disconnected");
+        handle_agent_disconnected(d);
+        return;
+    }
+    flush_domain_output(d);
+    while (d->state == DOMAIN_CONNECTED && libvchan_data_ready(d->vchan) > 0)
+        handle_message_from_agent(d);
+}
+
+/* override the limits that are set (not -1) */
+static void set_limits(struct domain_limits *limits,
+                       const struct domain_limits *set)
+{
+    if (set->max_policy_evaluations >= 0)
+        limits->max_policy_evaluations = set->max_policy_evaluations;
+    if (set->max_queued >= 0)
+        limits->max_queued = set->max_queued;
+    if (set->rate_limit >= 0)
+        limits->rate_limit = set->rate_limit;
+    if (set->rate_burst >= 0)
+        limits->rate_burst = set->rate_burst;
+}
+
+/* the same ranges as for the options */
+static bool limits_valid(const struct domain_limits *limits)
+{
+    return (limits->max_policy_evaluations == -1 ||
+            (limits->max_policy_evaluations >= 1 &&
+             limits->max_policy_evaluations <= MAX_CLIENTS)) &&
+        limits->max_queued >= -1 &&
+        limits->rate_limit >= -1 &&
+        (limits->rate_burst == -1 || limits->rate_burst >= 1);
+}
+
+static void handle_attach_request(void)
+{
+    struct attach_request req;
+    struct domain *d;
+    int fd = do_accept(attach_socket_fd);
+    struct startup_status status = { .status = 1 };
+    const char *refused = NULL;
+
+    if (fd < 0)
+        return;
+    if (!read_all(fd, &req, sizeof(req))) {
+        LOG(ERROR, "Failed to read attach request");
+        close(fd);
+        return;
+    }
+    ENSURE_NULL_TERMINATED(req.domain_name);
+    ENSURE_NULL_TERMINATED(req.default_user);
+    for (d = domains; d; d = d->next) {
+        /* the ones to be removed do not count */
+        if (d->remove)
+            continue;
+        if (d->id == (int)req.domain_id || !strcmp(d->name, req.domain_name))
+            break;
+    }
+    if (req.flags & ATTACH_DETACH) {
+        if (d) {
+            LOG(INFO, "Detaching domain %s", d->name);
+            schedule_domain_removal(d);
+            status.status = 0;
+        } else
+            LOG(ERROR, "Cannot detach domain %s (%u): not attached",
+                req.domain_name, req.domain_id);
+        if (!write_all(fd, &status, sizeof(status)))
+            PERROR("write");
+        close(fd);
+        return;
+    }
+    if (d && d->state != DOMAIN_CONNECTED) {
+        /* for example the domain was restarted (with a new id) before its
+         * agent connected to us again */
+        LOG(INFO, "Replacing domain %s (%d), its agent has not connected",
+            d->name, d->id);
+        schedule_domain_removal(d);
+        d = NULL;
+    }
+    if (d)
+        refused = "already attached";
+    else if (req.domain_id == 0 || req.domain_id > INT_MAX)
+        refused = "invalid domain id";
+    else if (!limits_valid(&req.limits))
+        refused = "invalid limits";
+    if (refused) {
+        LOG(ERROR, "Refusing to attach domain %s (%u): %s",
+            req.domain_name, req.domain_id, refused);
+        if (!write_all(fd, &status, sizeof(status)))
+            PERROR("write");
+        close(fd);
+        return;
+    }
+    LOG(INFO, "Attaching domain %s (%u)", req.domain_name, req.domain_id);
+    d = domain_new(req.domain_id, req.domain_name, req.default_user);
+    set_limits(&d->limits, &req.limits);
+    d->rate_tokens = d->limits.rate_burst;
+    d->attach_fd = fd;
+    epoll_add_source(fd, &d->attach_source);
+    start_connecting(d);
+}
+
+/* qrexec-daemon --attach exited before the domain connected. There is nobody
+ * to report the result to, but keep trying. */
+static void handle_attach_hangup(struct domain *d)
+{
+    epoll_del_fd(main_epoll_fd, d->attach_fd);
+    close(d->attach_fd);
+    d->attach_fd = -1;
+}
+
+static void remove_failed_domains(void)
+{
+    struct domain *d, *next;
+
+    for (d = domains; d; d = next) {
+        next = d->next;
+        if (d->state != DOMAIN_FAILED)
+            continue;
+        if (!d->remove && d->vchan && libvchan_is_open(d->vchan)) {
+            /* fatal protocol error, but the agent may still be alive;
+             * disconnect and wait for it to reconnect */
+            domain_disconnect(d);
+            domain_drop_session(d);
+            start_connecting(d);
+            continue;
+        }
+        LOG(INFO, "Removing domain %s", d->name);
+        domain_disconnect(d);
+        domain_drop_session(d);
+        report_attach_result(d, 1, 0);
+        domain_free(d);
+    }
+}
+
+static void init_multi(void)
+{
+    char socket_path[strlen(socket_dir) + sizeof("/" ATTACH_SOCKET_NAME)];
+
+    close(0);
+    grow_clients_table(0);
+    timers = timer_wheel_new();
+    if (!timers) {
+        PERROR("timer_wheel_new");
+        exit(1);
+    }
+    init_epoll();
+    epoll_add_source(timer_wheel_fd(timers), &timers_source);
+
+    if (pipe2(connect_pipe, O_CLOEXEC)) {
+        PERROR("pipe2");
+        exit(1);
+    }
+    epoll_add_source(connect_pipe[0], &connected_source);
+
+    snprintf(socket_path, sizeof(socket_path), "%s/%s", socket_dir,
+             ATTACH_SOCKET_NAME);
+    umask(0077);
+    attach_socket_fd = get_server_socket(socket_path);
+    epoll_add_source(attach_socket_fd, &attach_listen_source);
+
+    atexit(unlink_qrexec_sockets);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, sigchld_handler);
+    signal(SIGTERM, sigterm_handler);
+}
+
+/* qrexec-daemon --attach: hand over the domain to a qrexec-daemon --multi
+ * process, with the given limits (-1 for the default), and wait until it
+ * connects to the agent; or with ATTACH_DETACH in flags (--detach), have it
+ * removed */
+static int attach_domain(int xid, const char *domain_name, uint32_t flags,
+                         const struct domain_limits *limits)
+{
+    struct attach_request req = {
+        .domain_id = xid, .flags = flags, .limits = *limits,
+    };
+    struct startup_status status;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd, ret;
+
+    if (xid <= 0) {
+        LOG(ERROR, "domain id=0?");
+        return 1;
+    }
+    if (strlen(domain_name) >= sizeof(req.domain_name) ||
+            strlen(default_user) >= sizeof(req.default_user)) {
+        LOG(ERROR, "Domain name or default user too long");
+        return 1;
+    }
+    strcpy(req.domain_name, domain_name);
+    strcpy(req.default_user, default_user);
+
+    ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", socket_dir,
+                   ATTACH_SOCKET_NAME);
+    if (ret < 0 || (size_t)ret >= sizeof(addr.sun_path)) {
+        LOG(ERROR, "Socket path too long");
+        return 1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        PERROR("socket");
+        return 1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        PERROR("connect %s", addr.sun_path);
+        return 1;
+    }
+    if (!write_all(fd, &req, sizeof(req))) {
+        PERROR("write");
+        return 1;
+    }
+    if (flags & ATTACH_DETACH) {
+        if (!read_all(fd, &status, sizeof(status)) || status.status != 0) {
+            LOG(ERROR, "Failed to detach domain %s", domain_name);
+            return 1;
+        }
+        return 0;
+    }
+    if (getenv("QREXEC_STARTUP_NOWAIT"))
+        return 0;
+    return wait_for_startup(fd, domain_name);
+}
+
 struct option longopts[] = {
     { "help", no_argument, 0, 'h' },
     { "quiet", no_argument, 0, 'q' },
     { "socket-dir", required_argument, 0, 'd' + 128 },
     { "policy-program", required_argument, 0, 'p' },
     { "direct", no_argument, 0, 'D' },
+    { "policy-timeout", required_argument, 0, 't' + 128 },
+    { "client-timeout", required_argument, 0, 'c' + 128 },
+    { "max-policy-evaluations", required_argument, 0, 'e' + 128 },
+    { "max-total-policy-evaluations", required_argument, 0, 'E' + 128 },
+    { "max-queued", required_argument, 0, 'm' + 128 },
+    { "queue-timeout", required_argument, 0, 'w' + 128 },
+    { "rate-limit", required_argument, 0, 'r' + 128 },
+    { "rate-burst", required_argument, 0, 'b' + 128 },
+    { "multi", no_argument, 0, 'M' + 128 },
+    { "attach", no_argument, 0, 'A' + 128 },
+    { "detach", no_argument, 0, 'X' + 128 },
+    { "connect-timeout", required_argument, 0, 'T' + 128 },
+    /* internal, see handle_execute_service */
+    { "policy-request", no_argument, 0, 'P' + 128 },
     { NULL, 0, 0, 0 },
 };
 
 _Noreturn void usage(const char *argv0)
 {
     fprintf(stderr, "usage: %s [options] domainid domain-name [default user]\n", argv0);
+    fprintf(stderr, "       %s --multi [options]\n", argv0);
+    fprintf(stderr, "       %s --attach [options] domainid domain-name [default user]\n", argv0);
+    fprintf(stderr, "       %s --detach [options] domainid domain-name\n", argv0);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -h, --help - display usage\n");
     fprintf(stderr, "  -q, --quiet - quiet mode\n");
@@ -1127,13 +2823,62 @@ _Noreturn void usage(const char *argv0)
     fprintf(stderr, "  -p, --policy-program=PATH - program to execute to check policy, default: %s\n",
             QREXEC_POLICY_PROGRAM);
     fprintf(stderr, "  -D, --direct - run directly, don't daemonize, log to stderr\n");
+    fprintf(stderr, "  --policy-timeout=SECONDS - refuse the call if policy evaluation takes longer, 0 to disable, default: %d\n",
+            POLICY_TIMEOUT_DEFAULT);
+    fprintf(stderr, "  --client-timeout=SECONDS - disconnect clients that do not send a request in time, 0 to disable, default: %d\n",
+            CLIENT_TIMEOUT_DEFAULT);
+    fprintf(stderr, "  --max-policy-evaluations=N - evaluate at most N calls of the domain at a time, queue the others, default: %d\n",
+            MAX_CLIENTS);
+    fprintf(stderr, "  --max-total-policy-evaluations=N - with --multi, evaluate at most N calls of all the domains at a time, default: %d\n",
+            MAX_CLIENTS);
+    fprintf(stderr, "  --max-queued=N - refuse calls when N calls are already queued, default: %d\n",
+            MAX_QUEUED_DEFAULT);
+    fprintf(stderr, "  --queue-timeout=SECONDS - refuse calls queued for longer, 0 to disable, default: %d\n",
+            QUEUE_TIMEOUT_DEFAULT);
+    fprintf(stderr, "  --rate-limit=N - start evaluation of at most N calls per second on average, 0 for no limit, default: 0\n");
+    fprintf(stderr, "  --rate-burst=N - allow bursts of N calls above the rate limit, default: %d\n",
+            RATE_BURST_DEFAULT);
+    fprintf(stderr, "  --multi - serve domains attached with --attach in a single process, log to stderr;\n"
+                    "            it runs at most %d policy programs at a time, for all the domains\n",
+            MAX_CLIENTS);
+    fprintf(stderr, "  --attach - let a running --multi daemon serve the domain, and wait for its agent\n");
+    fprintf(stderr, "  --detach - make a running --multi daemon stop serving the domain\n");
+    fprintf(stderr, "  --connect-timeout=SECONDS - with --multi, remove domains whose agent does not connect in time, 0 to disable, default: %d\n",
+            CONNECT_TIMEOUT_DEFAULT);
+    fprintf(stderr, "With --attach, --max-policy-evaluations, --max-queued, --rate-limit and --rate-burst\n"
+                    "set the limits for the domain, instead of the defaults of the --multi daemon.\n");
     exit(1);
 }
 
+static int parse_limit(const char *str, int min, int max, const char *argv0)
+{
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(str, &end, 10);
+    if (errno || *end || end == str || value < min || value > max) {
+        LOG(ERROR, "Invalid value: %s", str);
+        usage(argv0);
+    }
+    return (int)value;
+}
+
+static int parse_timeout(const char *str, const char *argv0)
+{
+    /* the timer wheel holds timeouts up to about 46 hours */
+    return parse_limit(str, 0, 24 * 3600, argv0);
+}
+
 int main(int argc, char **argv)
 {
     int i, opt;
     sigset_t selectmask;
+    int opt_attach = 0;
+    uint32_t attach_flags = 0;
+    int opt_policy_request = 0;
+    struct domain_limits opt_limits = { -1, -1, -1, -1 };
+    struct domain *d, *next;
 
     setup_logging("qrexec-daemon");
 
@@ -1151,22 +2896,84 @@ int main(int argc, char **argv)
             case 'D':
                 opt_direct = 1;
                 break;
+            case 't' + 128:
+                policy_timeout = parse_timeout(optarg, argv[0]);
+                break;
+            case 'c' + 128:
+                client_timeout = parse_timeout(optarg, argv[0]);
+                break;
+            case 'e' + 128:
+                opt_limits.max_policy_evaluations = parse_limit(optarg, 1, MAX_CLIENTS, argv[0]);
+                break;
+            case 'E' + 128:
+                max_total_policy_evaluations = parse_limit(optarg, 1, MAX_CLIENTS, argv[0]);
+                break;
+            case 'm' + 128:
+                opt_limits.max_queued = parse_limit(optarg, 0, INT_MAX, argv[0]);
+                break;
+            case 'w' + 128:
+                queue_timeout = parse_timeout(optarg, argv[0]);
+                break;
+            case 'r' + 128:
+                opt_limits.rate_limit = parse_limit(optarg, 0, INT_MAX, argv[0]);
+                break;
+            case 'b' + 128:
+                opt_limits.rate_burst = parse_limit(optarg, 1, INT_MAX, argv[0]);
+                break;
+            case 'M' + 128:
+                opt_multi = 1;
+                break;
+            case 'A' + 128:
+                opt_attach = 1;
+                break;
+            case 'X' + 128:
+                opt_attach = 1;
+                attach_flags |= ATTACH_DETACH;
+                break;
+            case 'T' + 128:
+                connect_timeout = parse_timeout(optarg, argv[0]);
+                break;
+            case 'P' + 128:
+                opt_policy_request = 1;
+                break;
             case 'h':
             default: /* '?' */
                 usage(argv[0]);
         }
     }
-    if (argc - optind < 2 || argc - optind > 3) {
-        usage(argv[0]);
+    if (opt_policy_request) {
+        if (argc - optind != 5)
+            usage(argv[0]);
+        run_policy_request(atoi(argv[optind]), argv[optind+1],
+                           argv[optind+2], argv[optind+3], argv[optind+4]);
+    }
+    set_limits(&default_limits, &opt_limits);
+    for (i = 0; i < MAX_CLIENTS; i++)
+        timer_init(&policy_pending[i].timer, policy_request_expired,
+                   &policy_pending[i]);
+    if (opt_multi) {
+        if (opt_attach || argc != optind)
+            usage(argv[0]);
+        init_multi();
+    } else {
+        if (argc - optind < 2 || argc - optind > 3) {
+            usage(argv[0]);
+        }
+        if (argc - optind >= 3)
+            default_user = argv[optind+2];
+        if (opt_attach)
+            return attach_domain(atoi(argv[optind]), argv[optind+1],
+                                 attach_flags, &opt_limits);
+        init(atoi(argv[optind]), argv[optind+1]);
     }
-    remote_domain_id = atoi(argv[optind]);
-    remote_domain_name = argv[optind+1];
-    if (argc - optind >= 3)
-        default_user = argv[optind+2];
-    init(remote_domain_id);
 
+    /* Signals are delivered only while waiting for events, so the flags set
+     * by handlers are always checked before going to sleep again. There is
+     * no periodic wakeup. Threads started later inherit the mask, so the
+     * signals are always handled by the main thread. */
     sigemptyset(&selectmask);
     sigaddset(&selectmask, SIGCHLD);
+    sigaddset(&selectmask, SIGTERM);
     sigprocmask(SIG_BLOCK, &selectmask, NULL);
     sigemptyset(&selectmask);
 
@@ -1175,52 +2982,70 @@ int main(int argc, char **argv)
      * - message from client
      * - message from agent
      * - new client
+     * - timer expired
      * - child exited
+     * - termination requested
+     * - (--multi) domain attached, connected or disconnected
      */
     while (!terminate_requested) {
-        struct timespec timeout = { 1, 0 };
-        fd_set rdset, wrset;
-        int ret, max;
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        bool timers_ready = false;
+        struct event_source *source;
+        int ret;
 
         if (child_exited)
             reap_children();
 
-        max = fill_fdsets_for_select(&rdset, &wrset);
-        if (libvchan_buffer_space(vchan) <= (int)sizeof(struct msg_header))
-            FD_ZERO(&rdset);	// vchan full - don't read from clients
+        /* some policy evaluation may have finished */
+        process_admission_queues();
+        for (d = domains; d; d = d->next)
+            update_clients_epoll(d);
 
-        ret = pselect_vchan(vchan, max+1, &rdset, &wrset, &timeout, &selectmask);
+        ret = epoll_pwait(main_epoll_fd, events, MAX_EPOLL_EVENTS, -1,
+                          &selectmask);
         if (ret < 0) {
             if (errno == EINTR)
                 continue;
-            PERROR("pselect");
+            PERROR("epoll_pwait");
             return 1;
         }
 
-        if (!libvchan_is_open(vchan)) {
-            LOG(WARNING, "qrexec-agent has disconnected");
-            if (handle_agent_restart(remote_domain_id) < 0) {
-                LOG(ERROR, "Failed to reconnect to qrexec-agent, terminating");
-                return 1;
+        for (i = 0; i < ret; i++) {
+            source = events[i].data.ptr;
+            switch (source->type) {
+                case SOURCE_VCHAN:
+                    handle_vchan_event(source->domain);
+                    break;
+                case SOURCE_CLIENTS:
+                    if (source->domain->state == DOMAIN_CONNECTED)
+                        handle_clients_events(source->domain);
+                    break;
+                case SOURCE_TIMERS:
+                    timers_ready = true;
+                    break;
+                case SOURCE_ATTACH_LISTEN:
+                    handle_attach_request();
+                    break;
+                case SOURCE_ATTACH:
+                    handle_attach_hangup(source->domain);
+                    break;
+                case SOURCE_CONNECTED:
+                    handle_connect_result();
+                    break;
             }
-            /* rdset may be outdated at this point, calculate it again. */
-            continue;
         }
 
-        if (FD_ISSET(qrexec_daemon_unix_socket_fd, &rdset))
-            handle_new_client();
+        if (timers_ready)
+            timer_wheel_run(timers);
 
-        while (libvchan_data_ready(vchan))
-            handle_message_from_agent();
-
-        for (i = 0; i <= max_client_fd; i++)
-            if (clients[i].state != CLIENT_INVALID
-                && FD_ISSET(i, &rdset))
-                handle_message_from_client(i);
+        remove_failed_domains();
     }
 
-    if (vchan)
-        libvchan_close(vchan);
+    for (d = domains; d; d = next) {
+        next = d->next;
+        if (d->vchan)
+            libvchan_close(d->vchan);
+    }
 }
 
 // vim:ts=4:sw=4:et:
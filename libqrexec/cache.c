@@ -0,0 +1,298 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Response cache of the client API (see client.c): the output and exit code
+ * of calls to services that declared them reusable (MSG_DATA_CACHE_TTL).
+ *
+ * An entry is keyed by the target, the command line and all of stdin, and
+ * is found by a hash of that; the key itself is compared too, so a hash
+ * collision cannot return another call's output. The memory used (entries,
+ * keys and output) is kept under the size set by qrexec_cache_set_size(), by
+ * dropping the least recently used entries.
+ *
+ * The cache is shared by all threads (qrexec.client frees calls from a
+ * thread pool), so the entry points take cache_lock.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libqrexec-utils.h"
+
+#define CACHE_BUCKETS 1024
+
+struct cache_entry {
+    /* in the same bucket */
+    struct cache_entry *hash_next;
+    /* least recently used first */
+    struct cache_entry *lru_prev, *lru_next;
+    uint64_t hash;
+    /* CLOCK_MONOTONIC, in milliseconds */
+    uint64_t expires;
+    size_t size;
+    size_t key_len;
+    /* service name, within the command line in the key */
+    size_t service_offset, service_len;
+    size_t output_len[2];
+    int exit_code;
+    /* key, then stdout and stderr */
+    char data[];
+};
+
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static struct cache_entry *lru_first, *lru_last;
+static size_t cache_max_size;
+static struct qrexec_cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a */
+static uint64_t key_hash(const char *key, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+char *response_cache_key(const char *target, const char *cmdline,
+                         const void *stdin_data, size_t stdin_len,
+                         size_t *key_len)
+{
+    size_t target_len = strlen(target) + 1;
+    size_t cmdline_len = strlen(cmdline) + 1;
+    char *key;
+
+    *key_len = target_len + cmdline_len + stdin_len;
+    key = malloc(*key_len ? *key_len : 1);
+    if (!key) {
+        PERROR("malloc");
+        return NULL;
+    }
+    memcpy(key, target, target_len);
+    memcpy(key + target_len, cmdline, cmdline_len);
+    if (stdin_len)
+        memcpy(key + target_len + cmdline_len, stdin_data, stdin_len);
+    return key;
+}
+
+size_t response_cache_max_size(void)
+{
+    size_t max_size;
+
+    pthread_mutex_lock(&cache_lock);
+    max_size = cache_max_size;
+    pthread_mutex_unlock(&cache_lock);
+    return max_size;
+}
+
+static void lru_unlink(struct cache_entry *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        lru_first = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        lru_last = entry->lru_prev;
+}
+
+static void lru_append(struct cache_entry *entry)
+{
+    entry->lru_prev = lru_last;
+    entry->lru_next = NULL;
+    if (lru_last)
+        lru_last->lru_next = entry;
+    else
+        lru_first = entry;
+    lru_last = entry;
+}
+
+static void entry_remove(struct cache_entry *entry)
+{
+    struct cache_entry **ep;
+
+    for (ep = &buckets[entry->hash % CACHE_BUCKETS]; *ep != entry;
+            ep = &(*ep)->hash_next)
+        ;
+    *ep = entry->hash_next;
+    lru_unlink(entry);
+    stats.entries--;
+    stats.bytes -= entry->size;
+    free(entry);
+}
+
+static struct cache_entry *entry_find(const char *key, size_t key_len,
+                                      uint64_t hash)
+{
+    struct cache_entry *entry;
+
+    for (entry = buckets[hash % CACHE_BUCKETS]; entry;
+            entry = entry->hash_next)
+        if (entry->hash == hash && entry->key_len == key_len &&
+                memcmp(entry->data, key, key_len) == 0)
+            return entry;
+    return NULL;
+}
+
+bool response_cache_lookup(const char *key, size_t key_len,
+                           struct buffer output[2], int *exit_code)
+{
+    struct cache_entry *entry;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_max_size == 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return false;
+    }
+    entry = entry_find(key, key_len, key_hash(key, key_len));
+    if (entry && entry->expires <= monotonic_ms()) {
+        entry_remove(entry);
+        stats.expired++;
+        entry = NULL;
+    }
+    if (!entry) {
+        stats.misses++;
+        pthread_mutex_unlock(&cache_lock);
+        return false;
+    }
+    lru_unlink(entry);
+    lru_append(entry);
+    buffer_append(&output[0], entry->data + key_len, entry->output_len[0]);
+    buffer_append(&output[1], entry->data + key_len + entry->output_len[0],
+                  entry->output_len[1]);
+    *exit_code = entry->exit_code;
+    stats.hits++;
+    pthread_mutex_unlock(&cache_lock);
+    return true;
+}
+
+/* The service name in the command line part of a key: after "QUBESRPC "
+ * (dom0 calls), or at the start (calls from a VM, where it is the whole
+ * "service+argument"), up to the argument. */
+static void key_service(const char *key, size_t *offset, size_t *len)
+{
+    const char *cmdline = key + strlen(key) + 1;
+    const char *service = strstr(cmdline, "QUBESRPC ");
+
+    service = service ? service + strlen("QUBESRPC ") : cmdline;
+    *offset = service - key;
+    *len = strcspn(service, "+ ");
+}
+
+void response_cache_store(const char *key, size_t key_len, uint32_t ttl,
+                          struct buffer output[2], int exit_code)
+{
+    struct cache_entry *entry;
+    size_t size;
+    uint64_t hash = key_hash(key, key_len);
+
+    size = sizeof(*entry) + key_len + buffer_len(&output[0]) +
+        buffer_len(&output[1]);
+    pthread_mutex_lock(&cache_lock);
+    if (ttl == 0 || size > cache_max_size)
+        goto out;
+
+    entry = entry_find(key, key_len, hash);
+    if (entry)
+        entry_remove(entry);
+    while (stats.bytes + size > cache_max_size) {
+        entry_remove(lru_first);
+        stats.evictions++;
+    }
+
+    entry = malloc(size);
+    if (!entry) {
+        PERROR("malloc");
+        goto out;
+    }
+    entry->hash = hash;
+    entry->expires = monotonic_ms() + (uint64_t)ttl * 1000;
+    entry->size = size;
+    entry->key_len = key_len;
+    entry->output_len[0] = buffer_len(&output[0]);
+    entry->output_len[1] = buffer_len(&output[1]);
+    entry->exit_code = exit_code;
+    memcpy(entry->data, key, key_len);
+    memcpy(entry->data + key_len, buffer_data(&output[0]),
+           entry->output_len[0]);
+    memcpy(entry->data + key_len + entry->output_len[0],
+           buffer_data(&output[1]), entry->output_len[1]);
+    key_service(entry->data, &entry->service_offset, &entry->service_len);
+
+    entry->hash_next = buckets[hash % CACHE_BUCKETS];
+    buckets[hash % CACHE_BUCKETS] = entry;
+    lru_append(entry);
+    stats.entries++;
+    stats.bytes += size;
+    stats.stores++;
+out:
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void qrexec_cache_set_size(size_t max_bytes)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_max_size = max_bytes;
+    while (stats.bytes > cache_max_size) {
+        entry_remove(lru_first);
+        stats.evictions++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void qrexec_cache_invalidate(const char *target, const char *service)
+{
+    struct cache_entry *entry, *next;
+
+    pthread_mutex_lock(&cache_lock);
+    entry = lru_first;
+    while (entry) {
+        next = entry->lru_next;
+        if ((!target || strcmp(entry->data, target) == 0) &&
+                (!service || (strlen(service) == entry->service_len &&
+                              memcmp(entry->data + entry->service_offset,
+                                     service, entry->service_len) == 0)))
+            entry_remove(entry);
+        entry = next;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void qrexec_cache_get_stats(struct qrexec_cache_stats *out)
+{
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,1299 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Client side of a qrexec call, for use without running qrexec-client or
+ * qrexec-client-vm: requesting a connection from qrexec-daemon (dom0) or
+ * qrexec-agent (VM), and then exchanging data with the remote process over
+ * the data vchan.
+ *
+ * The data connection (struct qrexec_call) does not block and does not
+ * touch any file descriptors except its own, so it can be driven from an
+ * external event loop: wait for qrexec_call_fd() to become readable, then
+ * call qrexec_call_step().
+ *
+ * Calls from dom0 can keep their data connections in a pool when they end (if
+ * enabled in qrexec-agent), so that the next command in the same domain can
+ * be started right away (qrexec_call_reuse()). A pooled connection can also
+ * be turned into a session, which runs any number of concurrent calls over
+ * the one data vchan (qrexec_session_open()).
+ *
+ * Output of services that allow it can be kept in a response cache (see
+ * cache.c), and used for identical calls instead (qrexec_call_cached()).
+ *
+ * A call or session is used by one thread at a time, but the pool is shared
+ * by all of them, so it is only accessed with pool_lock held.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libqrexec-utils.h"
+
+#define VCHAN_BUFFER_SIZE 65536
+
+#define QREXEC_DATA_MIN_VERSION QREXEC_PROTOCOL_V2
+
+/* how long to wait for MSG_DATA_IDLE after MSG_DATA_EXIT_CODE */
+#define POOL_IDLE_WAIT_MS 100
+/* do not reuse a connection this close to the end of its idle timeout */
+#define POOL_EXPIRY_MARGIN_MS 500
+
+enum {
+    CALL_CONNECTING,
+    CALL_HANDSHAKE,
+    CALL_RUNNING,
+    CALL_DONE,
+    CALL_ERROR,
+};
+
+struct qrexec_call {
+    libvchan_t *vchan;
+    /* remote domain id */
+    int domain;
+    int state;
+    int protocol_version;
+    /* stdin not sent yet */
+    struct buffer stdin_buf;
+    bool stdin_closed;
+    bool stdin_eof_sent;
+    /* the start of stdin_buf (and EOF) already passed in the request */
+    size_t stdin_initial_len;
+    bool stdin_initial_eof;
+    /* stdout and stderr not read by the caller yet */
+    struct buffer output[2];
+    /* header of a message whose data is not available yet */
+    struct msg_header hdr;
+    bool have_hdr;
+    int exit_code;
+
+    /* response cache key (NULL if none), and the output kept for it, once
+     * the service allowed that (cache_ttl) */
+    char *cache_key;
+    size_t cache_key_len;
+    uint32_t cache_ttl;
+    struct buffer cache_output[2];
+
+    /* stream of a session (NULL if none), which owns vchan */
+    struct qrexec_session *session;
+    uint32_t stream;
+    /* how much more stdin can be sent */
+    uint32_t send_credit;
+    /* stdout and stderr received, but not credited back yet */
+    uint32_t recv_unacked;
+    /* freed by the caller before the end, the session frees it later */
+    bool detached;
+    struct qrexec_call *next_stream;
+};
+
+/* multiplexed data connection, see struct stream_header */
+struct qrexec_session {
+    libvchan_t *vchan;
+    int domain;
+    int protocol_version;
+    uint32_t next_stream;
+    struct qrexec_call *calls;
+    /* header of a message whose data is not available yet */
+    struct stream_header hdr;
+    bool have_hdr;
+    bool failed;
+};
+
+/* idle data connections */
+struct pooled_vchan {
+    libvchan_t *vchan;
+    int domain;
+    int protocol_version;
+    /* CLOCK_MONOTONIC, in milliseconds */
+    uint64_t expires;
+};
+
+static struct pooled_vchan *pool;
+static int pool_len;
+static int pool_size;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int connect_unix_socket(const char *path)
+{
+    struct sockaddr_un remote = { .sun_family = AF_UNIX };
+    int s;
+
+    if (strlen(path) >= sizeof(remote.sun_path)) {
+        LOG(ERROR, "Socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(remote.sun_path, path);
+    if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        PERROR("socket");
+        return -1;
+    }
+    if (connect(s, (struct sockaddr *) &remote, sizeof(remote)) == -1) {
+        PERROR("connect %s", path);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static int handle_daemon_handshake(int fd)
+{
+    struct msg_header hdr;
+    struct peer_info info;
+
+    /* daemon send MSG_HELLO first */
+    if (!read_all(fd, &hdr, sizeof(hdr))) {
+        PERROR("daemon handshake");
+        return -1;
+    }
+    if (hdr.type != MSG_HELLO || hdr.len != sizeof(info)) {
+        LOG(ERROR, "Invalid daemon MSG_HELLO");
+        return -1;
+    }
+    if (!read_all(fd, &info, sizeof(info))) {
+        PERROR("daemon handshake");
+        return -1;
+    }
+
+    if (info.version != QREXEC_PROTOCOL_VERSION) {
+        LOG(ERROR, "Incompatible daemon protocol version "
+            "(daemon %d, client %d)",
+            info.version, QREXEC_PROTOCOL_VERSION);
+        return -1;
+    }
+
+    hdr.type = MSG_HELLO;
+    hdr.len = sizeof(info);
+    info.version = QREXEC_PROTOCOL_VERSION;
+
+    if (!write_all(fd, &hdr, sizeof(hdr))) {
+        LOG(ERROR, "Failed to send MSG_HELLO hdr to daemon");
+        return -1;
+    }
+    if (!write_all(fd, &info, sizeof(info))) {
+        LOG(ERROR, "Failed to send MSG_HELLO to daemon");
+        return -1;
+    }
+    return 0;
+}
+
+int qrexec_daemon_connect(const char *socket_dir, const char *domain_name)
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int s;
+
+    if ((size_t)snprintf(path, sizeof(path), "%s/qrexec.%s",
+                         socket_dir, domain_name) >= sizeof(path)) {
+        LOG(ERROR, "Socket path too long");
+        return -1;
+    }
+    s = connect_unix_socket(path);
+    if (s < 0)
+        return -1;
+    if (handle_daemon_handshake(s) < 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* Returns the type of the response, see qrexec_daemon_request_just_exec() */
+static int daemon_request(int fd, int type, int domid,
+                          const void *data, size_t len,
+                          struct exec_params *params)
+{
+    struct msg_header hdr;
+
+    hdr.type = type;
+    hdr.len = sizeof(*params) + len;
+    params->connect_domain = domid;
+    params->connect_port = 0;
+    if (!write_all(fd, &hdr, sizeof(hdr))
+            || !write_all(fd, params, sizeof(*params))
+            || !write_all(fd, data, len)) {
+        PERROR("write daemon");
+        return -1;
+    }
+    /* the daemon will respond with the same message with connect_port filled
+     * and empty cmdline; in session mode, notifications about earlier
+     * connections may come first */
+    for (;;) {
+        struct exec_status status;
+
+        if (!read_all(fd, &hdr, sizeof(hdr))) {
+            PERROR("read daemon");
+            return -1;
+        }
+        if (hdr.type == MSG_CONNECTION_TERMINATED) {
+            if (hdr.len != sizeof(*params) || !read_all(fd, params, sizeof(*params))) {
+                LOG(ERROR, "Invalid MSG_CONNECTION_TERMINATED from daemon");
+                return -1;
+            }
+        } else if (hdr.type == MSG_EXEC_STATUS) {
+            if (hdr.len != sizeof(status) || !read_all(fd, &status, sizeof(status))) {
+                LOG(ERROR, "Invalid MSG_EXEC_STATUS from daemon");
+                return -1;
+            }
+        } else
+            break;
+    }
+    if (!(hdr.type == (uint32_t)type ||
+          (type == MSG_JUST_EXEC_NO_DATA && hdr.type == MSG_JUST_EXEC)) ||
+            hdr.len != sizeof(*params)) {
+        LOG(ERROR, "Invalid response for 0x%x", type);
+        return -1;
+    }
+    if (!read_all(fd, params, sizeof(*params))) {
+        PERROR("read daemon");
+        return -1;
+    }
+    return hdr.type;
+}
+
+int qrexec_daemon_request(int fd, int type, int domid,
+                          const void *data, size_t len,
+                          struct exec_params *params)
+{
+    return daemon_request(fd, type, domid, data, len, params) < 0 ? -1 : 0;
+}
+
+int qrexec_daemon_request_just_exec(int fd, int domid, const char *cmdline,
+                                    uint32_t flags, struct exec_params *params)
+{
+    struct just_exec_params just_exec_params = { .flags = flags };
+    size_t cmdline_len = strlen(cmdline) + 1;
+    size_t len = cmdline_len + sizeof(just_exec_params);
+    char *data;
+    int ret;
+
+    data = malloc(len);
+    if (!data)
+        return -1;
+    memcpy(data, cmdline, cmdline_len);
+    memcpy(data + cmdline_len, &just_exec_params, sizeof(just_exec_params));
+    ret = daemon_request(fd, MSG_JUST_EXEC_NO_DATA, domid, data, len, params);
+    free(data);
+    return ret;
+}
+
+int qrexec_daemon_request_exec(int fd, const char *cmdline,
+                               const void *stdin_data, size_t stdin_len,
+                               bool stdin_eof, struct exec_params *params)
+{
+    struct exec_stdin_params stdin_params = {
+        .flags = stdin_eof ? EXEC_STDIN_EOF : 0,
+        .len = stdin_len,
+    };
+    size_t cmdline_len = strlen(cmdline) + 1;
+    size_t len = cmdline_len + sizeof(stdin_params) + stdin_len;
+    char *data;
+    int ret;
+
+    if (stdin_len > MAX_EXEC_STDIN_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+    data = malloc(len);
+    if (!data)
+        return -1;
+    memcpy(data, cmdline, cmdline_len);
+    memcpy(data + cmdline_len, &stdin_params, sizeof(stdin_params));
+    memcpy(data + cmdline_len + sizeof(stdin_params), stdin_data, stdin_len);
+    ret = qrexec_daemon_request(fd, MSG_EXEC_CMDLINE, 0, data, len, params);
+    free(data);
+    return ret;
+}
+
+int qrexec_agent_request(const char *agent_socket, const char *target,
+                         const char *service_name, struct exec_params *params)
+{
+    struct msg_header hdr;
+    struct trigger_service_params3 trigger = { 0 };
+    size_t service_name_len = strlen(service_name) + 1;
+    ssize_t ret;
+    int s;
+
+    s = connect_unix_socket(agent_socket);
+    if (s < 0)
+        return -1;
+
+    hdr.type = MSG_TRIGGER_SERVICE3;
+    hdr.len = sizeof(trigger) + service_name_len;
+    strncpy(trigger.target_domain, target, sizeof(trigger.target_domain) - 1);
+    snprintf(trigger.request_id.ident, sizeof(trigger.request_id.ident),
+             "SOCKET");
+
+    if (!write_all(s, &hdr, sizeof(hdr)) ||
+            !write_all(s, &trigger, sizeof(trigger)) ||
+            !write_all(s, service_name, service_name_len)) {
+        PERROR("write to agent");
+        goto fail;
+    }
+    do {
+        ret = read(s, params, sizeof(*params));
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0) {
+        /* EOF - the agent refused the call */
+        close(s);
+        errno = EACCES;
+        return -1;
+    }
+    if (ret != sizeof(*params)) {
+        PERROR("read from agent");
+        goto fail;
+    }
+    return s;
+
+fail:
+    close(s);
+    errno = EIO;
+    return -1;
+}
+
+struct qrexec_call *qrexec_call_open(const struct exec_params *params,
+                                     size_t buffer_size)
+{
+    struct qrexec_call *call;
+
+    call = calloc(1, sizeof(*call));
+    if (!call)
+        return NULL;
+    if (buffer_size == 0)
+        buffer_size = VCHAN_BUFFER_SIZE;
+    call->vchan = libvchan_server_init(params->connect_domain,
+                                       params->connect_port,
+                                       buffer_size, buffer_size);
+    if (!call->vchan) {
+        LOG(ERROR, "Failed to start data vchan server");
+        free(call);
+        return NULL;
+    }
+    call->domain = params->connect_domain;
+    call->state = CALL_CONNECTING;
+    call->exit_code = -1;
+    buffer_init(&call->stdin_buf);
+    buffer_init(&call->output[0]);
+    buffer_init(&call->output[1]);
+    return call;
+}
+
+static void pool_remove(int i)
+{
+    pool[i] = pool[--pool_len];
+}
+
+/* close expired and broken connections */
+static void pool_prune(void)
+{
+    uint64_t now = monotonic_ms();
+    int i = 0;
+
+    while (i < pool_len) {
+        /* nothing is expected on an idle connection */
+        if (pool[i].expires <= now || !libvchan_is_open(pool[i].vchan) ||
+                libvchan_data_ready(pool[i].vchan) > 0) {
+            libvchan_close(pool[i].vchan);
+            pool_remove(i);
+        } else
+            i++;
+    }
+}
+
+/* Take the most recently used idle connection to domain (it has the most
+ * time left), of at least min_version, with buffer space for len bytes */
+static libvchan_t *pool_take(int domain, int min_version, size_t len,
+                             int *protocol_version)
+{
+    libvchan_t *vchan = NULL;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_prune();
+    for (i = pool_len - 1; i >= 0; i--)
+        if (pool[i].domain == domain &&
+                pool[i].protocol_version >= min_version)
+            break;
+    if (i >= 0 && libvchan_buffer_space(pool[i].vchan) >= (int)len) {
+        vchan = pool[i].vchan;
+        *protocol_version = pool[i].protocol_version;
+        pool_remove(i);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return vchan;
+}
+
+void qrexec_pool_set_size(int max_idle)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_prune();
+    while (pool_len > max_idle)
+        libvchan_close(pool[--pool_len].vchan);
+    if (max_idle > pool_size) {
+        struct pooled_vchan *new_pool;
+
+        new_pool = realloc(pool, max_idle * sizeof(*pool));
+        if (!new_pool) {
+            PERROR("realloc");
+            goto out;
+        }
+        pool = new_pool;
+    }
+    pool_size = max_idle;
+out:
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* After the exit code, qrexec-agent may offer to keep the connection open
+ * (MSG_DATA_IDLE). Returns the time until which it can be reused (0 if it
+ * cannot). */
+static uint64_t call_wait_idle(struct qrexec_call *call)
+{
+    struct pollfd pfd = {
+        .fd = libvchan_fd_for_select(call->vchan),
+        .events = POLLIN,
+    };
+    uint64_t deadline = monotonic_ms() + POOL_IDLE_WAIT_MS;
+    uint64_t now;
+    uint32_t idle_ms;
+    int is_open;
+
+    for (;;) {
+        /* check this first, it may read more data */
+        is_open = libvchan_is_open(call->vchan);
+        if (!call->have_hdr &&
+                libvchan_data_ready(call->vchan) >= (int)sizeof(call->hdr)) {
+            if (libvchan_recv(call->vchan, &call->hdr, sizeof(call->hdr)) < 0)
+                return 0;
+            call->have_hdr = true;
+        }
+        if (call->have_hdr) {
+            if (call->hdr.type != MSG_DATA_IDLE ||
+                    call->hdr.len != sizeof(idle_ms))
+                return 0;
+            if (libvchan_data_ready(call->vchan) >= (int)sizeof(idle_ms)) {
+                if (libvchan_recv(call->vchan, &idle_ms, sizeof(idle_ms)) < 0 ||
+                        idle_ms <= POOL_EXPIRY_MARGIN_MS)
+                    return 0;
+                call->have_hdr = false;
+                return monotonic_ms() + idle_ms - POOL_EXPIRY_MARGIN_MS;
+            }
+        }
+        if (is_open != VCHAN_CONNECTED)
+            return 0;
+        now = monotonic_ms();
+        if (now >= deadline)
+            return 0;
+        if (poll(&pfd, 1, deadline - now) > 0)
+            libvchan_wait(call->vchan);
+    }
+}
+
+/* Keep the connection of a finished call in the pool, if possible */
+static bool call_release(struct qrexec_call *call)
+{
+    uint64_t expires;
+    bool kept;
+
+    /* unsent stdin is discarded, as usual when the remote process exits */
+    if (call->state != CALL_DONE)
+        return false;
+    pthread_mutex_lock(&pool_lock);
+    pool_prune();
+    kept = pool_len < pool_size;
+    pthread_mutex_unlock(&pool_lock);
+    if (!kept)
+        return false;
+    /* not under pool_lock: it can take POOL_IDLE_WAIT_MS */
+    expires = call_wait_idle(call);
+    if (!expires)
+        return false;
+    pthread_mutex_lock(&pool_lock);
+    /* the pool may have filled up, or shrunk, in the meantime */
+    kept = pool_len < pool_size;
+    if (kept)
+        pool[pool_len++] = (struct pooled_vchan) {
+            .vchan = call->vchan,
+            .domain = call->domain,
+            .protocol_version = call->protocol_version,
+            .expires = expires,
+        };
+    pthread_mutex_unlock(&pool_lock);
+    return kept;
+}
+
+/* "DEFAULT:" is replaced with the domain's default user by qrexec-daemon,
+ * which calls over an existing connection do not go through. */
+static bool uses_default_user(const char *cmdline)
+{
+    return !strncmp(cmdline, "DEFAULT:", sizeof("DEFAULT:") - 1);
+}
+
+struct qrexec_call *qrexec_call_reuse(int domain, const char *cmdline)
+{
+    struct qrexec_call *call;
+    struct msg_header hdr = {
+        .type = MSG_DATA_EXEC_CMDLINE,
+        .len = strlen(cmdline) + 1,
+    };
+    libvchan_t *vchan;
+    int protocol_version;
+
+    if (uses_default_user(cmdline))
+        return NULL;
+    vchan = pool_take(domain, 0, sizeof(hdr) + hdr.len, &protocol_version);
+    if (!vchan)
+        return NULL;
+
+    call = calloc(1, sizeof(*call));
+    if (!call) {
+        libvchan_close(vchan);
+        return NULL;
+    }
+    call->vchan = vchan;
+    call->domain = domain;
+    call->protocol_version = protocol_version;
+    if (libvchan_send(call->vchan, &hdr, sizeof(hdr)) < 0 ||
+            libvchan_send(call->vchan, cmdline, hdr.len) < 0) {
+        libvchan_close(call->vchan);
+        free(call);
+        return NULL;
+    }
+    call->state = CALL_RUNNING;
+    call->exit_code = -1;
+    buffer_init(&call->stdin_buf);
+    buffer_init(&call->output[0]);
+    buffer_init(&call->output[1]);
+    return call;
+}
+
+static void session_unlink(struct qrexec_session *session,
+                           struct qrexec_call *call)
+{
+    struct qrexec_call **cp;
+
+    for (cp = &session->calls; *cp != call; cp = &(*cp)->next_stream)
+        ;
+    *cp = call->next_stream;
+}
+
+static bool call_flush_stdin(struct qrexec_call *call);
+static void call_send_credit(struct qrexec_call *call);
+
+void qrexec_call_free(struct qrexec_call *call)
+{
+    if (call->session && call->state == CALL_RUNNING) {
+        /* the process is still running: let it finish, without its stdin,
+         * and discard the output */
+        call->detached = true;
+        buffer_remove(&call->stdin_buf, buffer_len(&call->stdin_buf));
+        call->stdin_closed = true;
+        buffer_remove(&call->output[0], buffer_len(&call->output[0]));
+        buffer_remove(&call->output[1], buffer_len(&call->output[1]));
+        call_flush_stdin(call);
+        call_send_credit(call);
+        return;
+    }
+    if (call->session)
+        session_unlink(call->session, call);
+    else if (call->vchan && !call_release(call))
+        libvchan_close(call->vchan);
+    buffer_free(&call->stdin_buf);
+    buffer_free(&call->output[0]);
+    buffer_free(&call->output[1]);
+    buffer_free(&call->cache_output[0]);
+    buffer_free(&call->cache_output[1]);
+    free(call->cache_key);
+    free(call);
+}
+
+int qrexec_call_fd(const struct qrexec_call *call)
+{
+    if (!call->vchan)
+        return -1;
+    return libvchan_fd_for_select(call->vchan);
+}
+
+static int call_fail(struct qrexec_call *call)
+{
+    call->state = CALL_ERROR;
+    return QREXEC_CALL_ERROR;
+}
+
+/* both sides send MSG_HELLO right away, the client (us) as the vchan server */
+static bool call_send_hello(struct qrexec_call *call)
+{
+    struct {
+        struct msg_header hdr;
+        struct peer_info info;
+    } hello = {
+        .hdr = { .type = MSG_HELLO, .len = sizeof(struct peer_info) },
+        .info = { .version = QREXEC_PROTOCOL_VERSION },
+    };
+
+    return libvchan_send(call->vchan, &hello, sizeof(hello)) == sizeof(hello);
+}
+
+static bool call_recv_hello(struct qrexec_call *call)
+{
+    struct peer_info info;
+
+    if (libvchan_data_ready(call->vchan) < (int)(sizeof(call->hdr) + sizeof(info)))
+        return true;
+    if (libvchan_recv(call->vchan, &call->hdr, sizeof(call->hdr)) < 0 ||
+            call->hdr.type != MSG_HELLO || call->hdr.len != sizeof(info) ||
+            libvchan_recv(call->vchan, &info, sizeof(info)) < 0) {
+        LOG(ERROR, "Invalid MSG_HELLO on data vchan");
+        return false;
+    }
+    call->protocol_version = info.version < QREXEC_PROTOCOL_VERSION ?
+        info.version : QREXEC_PROTOCOL_VERSION;
+    if (call->protocol_version < QREXEC_DATA_MIN_VERSION) {
+        LOG(ERROR, "Incompatible remote protocol version "
+            "(remote %d, local %d)", info.version, QREXEC_PROTOCOL_VERSION);
+        return false;
+    }
+    /* otherwise the agent ignored it, send it again */
+    if (call->protocol_version >= QREXEC_PROTOCOL_V5) {
+        buffer_remove(&call->stdin_buf, call->stdin_initial_len);
+        if (call->stdin_initial_eof)
+            call->stdin_eof_sent = true;
+    }
+    call->state = CALL_RUNNING;
+    return true;
+}
+
+/* send as much of the queued stdin as fits in the vchan (and in the credit of
+ * a stream) */
+static bool call_flush_stdin(struct qrexec_call *call)
+{
+    struct msg_header hdr = { .type = MSG_DATA_STDIN };
+    size_t max_chunk = max_data_chunk_size(call->protocol_version);
+    int hdr_size = call->session ?
+        (int)sizeof(struct stream_header) : (int)sizeof(hdr);
+    int space;
+
+    while (buffer_len(&call->stdin_buf) > 0 ||
+            (call->stdin_closed && !call->stdin_eof_sent)) {
+        space = libvchan_buffer_space(call->vchan) - hdr_size;
+        if (space <= 0)
+            return true;
+        hdr.len = buffer_len(&call->stdin_buf);
+        if (hdr.len > (uint32_t)space)
+            hdr.len = space;
+        if (hdr.len > max_chunk)
+            hdr.len = max_chunk;
+        if (call->session) {
+            if (hdr.len > call->send_credit) {
+                hdr.len = call->send_credit;
+                if (hdr.len == 0)
+                    return true;
+            }
+            if (send_stream_msg(call->vchan, MSG_DATA_STDIN, call->stream,
+                                buffer_data(&call->stdin_buf), hdr.len) < 0)
+                return false;
+            call->send_credit -= hdr.len;
+        } else if (libvchan_send(call->vchan, &hdr, sizeof(hdr)) < 0 ||
+                libvchan_send(call->vchan, buffer_data(&call->stdin_buf),
+                              hdr.len) < 0)
+            return false;
+        if (hdr.len == 0)
+            call->stdin_eof_sent = true;
+        else
+            buffer_remove(&call->stdin_buf, hdr.len);
+    }
+    return true;
+}
+
+/* stdout or stderr for the caller, and for the cache */
+static void call_output(struct qrexec_call *call, int type,
+                        const char *data, size_t len)
+{
+    int i = type == MSG_DATA_STDERR;
+
+    buffer_append(&call->output[i], data, len);
+    if (!call->cache_ttl)
+        return;
+    if (buffer_len(&call->cache_output[0]) + buffer_len(&call->cache_output[1]) +
+            len > response_cache_max_size()) {
+        /* too big to be cached anyway */
+        call->cache_ttl = 0;
+        buffer_free(&call->cache_output[0]);
+        buffer_free(&call->cache_output[1]);
+        return;
+    }
+    buffer_append(&call->cache_output[i], data, len);
+}
+
+static bool call_recv_data(struct qrexec_call *call)
+{
+    size_t max_chunk = max_data_chunk_size(call->protocol_version);
+    char *buf, *data = NULL;
+    size_t data_size = 0;
+    struct compressed_params params;
+    uint32_t status, ttl;
+
+    for (;;) {
+        if (!call->have_hdr) {
+            if (libvchan_data_ready(call->vchan) < (int)sizeof(call->hdr))
+                return true;
+            if (libvchan_recv(call->vchan, &call->hdr, sizeof(call->hdr)) < 0)
+                return false;
+            if (call->hdr.len > max_chunk) {
+                LOG(ERROR, "Too big data chunk received: %" PRIu32 " > %zu",
+                    call->hdr.len, max_chunk);
+                return false;
+            }
+            call->have_hdr = true;
+        }
+        if (libvchan_data_ready(call->vchan) < (int)call->hdr.len)
+            return true;
+        call->have_hdr = false;
+
+        switch (call->hdr.type) {
+            case MSG_DATA_STDOUT:
+            case MSG_DATA_STDERR:
+                buf = malloc(call->hdr.len ? call->hdr.len : 1);
+                if (!buf) {
+                    PERROR("malloc");
+                    return false;
+                }
+                if (libvchan_recv(call->vchan, buf, call->hdr.len) < 0) {
+                    free(buf);
+                    return false;
+                }
+                call_output(call, call->hdr.type, buf, call->hdr.len);
+                free(buf);
+                break;
+            case MSG_DATA_COMPRESSED:
+                if (call->protocol_version < QREXEC_PROTOCOL_V8)
+                    goto unknown;
+                buf = malloc(call->hdr.len ? call->hdr.len : 1);
+                if (!buf) {
+                    PERROR("malloc");
+                    return false;
+                }
+                if (libvchan_recv(call->vchan, buf, call->hdr.len) < 0 ||
+                        !decompress_data(buf, call->hdr.len, max_chunk, &params,
+                                         &data, &data_size) ||
+                        params.type == MSG_DATA_STDIN) {
+                    free(buf);
+                    free(data);
+                    return false;
+                }
+                call_output(call, params.type, data, params.len);
+                free(buf);
+                free(data);
+                data = NULL;
+                data_size = 0;
+                break;
+            case MSG_DATA_EXIT_CODE:
+                if (call->hdr.len < sizeof(status) ||
+                        libvchan_recv(call->vchan, &status, sizeof(status)) < 0) {
+                    LOG(ERROR, "Invalid MSG_DATA_EXIT_CODE");
+                    return false;
+                }
+                call->exit_code = status;
+                call->state = CALL_DONE;
+                if (call->cache_ttl)
+                    response_cache_store(call->cache_key, call->cache_key_len,
+                                         call->cache_ttl, call->cache_output,
+                                         call->exit_code);
+                return true;
+            case MSG_DATA_CACHE_TTL:
+                if (call->protocol_version < QREXEC_PROTOCOL_V11)
+                    goto unknown;
+                if (call->hdr.len != sizeof(ttl) ||
+                        libvchan_recv(call->vchan, &ttl, sizeof(ttl)) < 0) {
+                    LOG(ERROR, "Invalid MSG_DATA_CACHE_TTL");
+                    return false;
+                }
+                if (call->cache_key && response_cache_max_size() > 0)
+                    call->cache_ttl = ttl;
+                break;
+            default:
+            unknown:
+                LOG(ERROR, "unknown msg %d", call->hdr.type);
+                return false;
+        }
+    }
+}
+
+int qrexec_call_step(struct qrexec_call *call)
+{
+    struct pollfd pfd = {
+        .fd = qrexec_call_fd(call),
+        .events = POLLIN,
+    };
+    int is_open;
+
+    if (call->state == CALL_RUNNING && call->session)
+        qrexec_session_step(call->session);
+    if (call->state == CALL_DONE)
+        return QREXEC_CALL_DONE;
+    if (call->state == CALL_ERROR || call->session)
+        return call->state == CALL_ERROR ?
+            QREXEC_CALL_ERROR : QREXEC_CALL_RUNNING;
+
+    /* clear event pending flag; do not block if there is none */
+    if (poll(&pfd, 1, 0) > 0)
+        libvchan_wait(call->vchan);
+
+    if (call->state == CALL_CONNECTING) {
+        switch (libvchan_is_open(call->vchan)) {
+            case VCHAN_WAITING:
+                return QREXEC_CALL_RUNNING;
+            case VCHAN_CONNECTED:
+                if (!call_send_hello(call))
+                    return call_fail(call);
+                call->state = CALL_HANDSHAKE;
+                break;
+            case VCHAN_DISCONNECTED:
+                /* A quick remote may have connected, sent everything and
+                 * closed before we got to look; it did not need our
+                 * MSG_HELLO, just process what it sent. */
+                if (libvchan_data_ready(call->vchan) > 0) {
+                    call->state = CALL_HANDSHAKE;
+                    break;
+                }
+                /* fallthrough */
+            default:
+                LOG(ERROR, "Failed to open data vchan connection");
+                return call_fail(call);
+        }
+    }
+    if (call->state == CALL_HANDSHAKE) {
+        if (!call_recv_hello(call))
+            return call_fail(call);
+        if (call->state == CALL_HANDSHAKE)
+            return QREXEC_CALL_RUNNING;
+    }
+    /* Check this first, it may read more data (which will not be signalled
+     * again). Data received before the connection was closed is still
+     * processed. */
+    is_open = libvchan_is_open(call->vchan);
+    if (!call_recv_data(call))
+        return call_fail(call);
+    if (call->state == CALL_DONE)
+        return QREXEC_CALL_DONE;
+    if (!is_open) {
+        LOG(ERROR, "vchan connection closed early");
+        return call_fail(call);
+    }
+    if (!call_flush_stdin(call))
+        return call_fail(call);
+    return QREXEC_CALL_RUNNING;
+}
+
+int qrexec_call_write(struct qrexec_call *call, const void *data, size_t len)
+{
+    if (call->stdin_closed || call->state >= CALL_DONE) {
+        errno = EPIPE;
+        return -1;
+    }
+    buffer_append(&call->stdin_buf, data, len);
+    if (call->state == CALL_RUNNING && !call_flush_stdin(call)) {
+        call_fail(call);
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+int qrexec_call_close_stdin(struct qrexec_call *call)
+{
+    if (call->stdin_closed)
+        return 0;
+    call->stdin_closed = true;
+    if (call->state == CALL_RUNNING && !call_flush_stdin(call)) {
+        call_fail(call);
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+int qrexec_call_initial_stdin(struct qrexec_call *call,
+                              const void *data, size_t len, bool eof)
+{
+    if (call->state != CALL_CONNECTING || buffer_len(&call->stdin_buf) > 0 ||
+            call->stdin_closed) {
+        errno = EINVAL;
+        return -1;
+    }
+    buffer_append(&call->stdin_buf, data, len);
+    call->stdin_initial_len = len;
+    call->stdin_initial_eof = eof;
+    call->stdin_closed = eof;
+    return 0;
+}
+
+ssize_t qrexec_call_read(struct qrexec_call *call, int stream,
+                         void *data, size_t len)
+{
+    struct buffer *b;
+
+    if (stream != 1 && stream != 2) {
+        errno = EINVAL;
+        return -1;
+    }
+    b = &call->output[stream - 1];
+    if ((size_t)buffer_len(b) < len)
+        len = buffer_len(b);
+    memcpy(data, buffer_data(b), len);
+    buffer_remove(b, len);
+    if (call->session)
+        call_send_credit(call);
+    return len;
+}
+
+int qrexec_call_exit_code(const struct qrexec_call *call)
+{
+    return call->exit_code;
+}
+
+bool qrexec_call_connected(const struct qrexec_call *call)
+{
+    return call->state == CALL_RUNNING || call->state == CALL_DONE;
+}
+
+int qrexec_call_cache_key(struct qrexec_call *call, const char *target,
+                          const char *cmdline, const void *stdin_data,
+                          size_t stdin_len)
+{
+    char *key;
+
+    if (response_cache_max_size() == 0)
+        return 0;
+    key = response_cache_key(target, cmdline, stdin_data, stdin_len,
+                             &call->cache_key_len);
+    if (!key)
+        return -1;
+    free(call->cache_key);
+    call->cache_key = key;
+    return 0;
+}
+
+struct qrexec_call *qrexec_call_cached(const char *target, const char *cmdline,
+                                       const void *stdin_data,
+                                       size_t stdin_len)
+{
+    struct qrexec_call *call;
+    char *key;
+    size_t key_len;
+
+    if (response_cache_max_size() == 0)
+        return NULL;
+    key = response_cache_key(target, cmdline, stdin_data, stdin_len, &key_len);
+    if (!key)
+        return NULL;
+    call = calloc(1, sizeof(*call));
+    if (!call) {
+        PERROR("calloc");
+        free(key);
+        return NULL;
+    }
+    buffer_init(&call->stdin_buf);
+    buffer_init(&call->output[0]);
+    buffer_init(&call->output[1]);
+    if (!response_cache_lookup(key, key_len, call->output, &call->exit_code)) {
+        free(key);
+        qrexec_call_free(call);
+        return NULL;
+    }
+    free(key);
+    call->state = CALL_DONE;
+    call->stdin_closed = true;
+    return call;
+}
+
+/* Credit back the output read by the caller, in chunks of half the window,
+ * so that the agent does not have to wait. */
+static void call_send_credit(struct qrexec_call *call)
+{
+    uint32_t consumed = call->recv_unacked;
+    uint32_t buffered = buffer_len(&call->output[0]) +
+        buffer_len(&call->output[1]);
+
+    consumed = consumed > buffered ? consumed - buffered : 0;
+    if (consumed < STREAM_WINDOW / 2 || call->state != CALL_RUNNING ||
+            libvchan_buffer_space(call->vchan) <
+            (int)(sizeof(struct stream_header) + sizeof(consumed)))
+        return;
+    if (send_stream_msg(call->vchan, MSG_DATA_CREDIT, call->stream,
+                        &consumed, sizeof(consumed)) < 0) {
+        call->session->failed = true;
+        return;
+    }
+    call->recv_unacked -= consumed;
+}
+
+struct qrexec_session *qrexec_session_open(int domain)
+{
+    struct qrexec_session *session;
+    struct msg_header hdr = { .type = MSG_DATA_MUX, .len = 0 };
+    libvchan_t *vchan;
+    int protocol_version;
+
+    vchan = pool_take(domain, QREXEC_PROTOCOL_V7, sizeof(hdr),
+                      &protocol_version);
+    if (!vchan)
+        return NULL;
+
+    session = calloc(1, sizeof(*session));
+    if (!session) {
+        libvchan_close(vchan);
+        return NULL;
+    }
+    session->vchan = vchan;
+    session->domain = domain;
+    session->protocol_version = protocol_version;
+    if (libvchan_send(session->vchan, &hdr, sizeof(hdr)) < 0) {
+        libvchan_close(session->vchan);
+        free(session);
+        return NULL;
+    }
+    return session;
+}
+
+void qrexec_session_free(struct qrexec_session *session)
+{
+    struct qrexec_call *call, *next;
+
+    libvchan_close(session->vchan);
+    for (call = session->calls; call; call = next) {
+        next = call->next_stream;
+        call->session = NULL;
+        call->vchan = NULL;
+        if (call->state != CALL_DONE)
+            call->state = CALL_ERROR;
+        if (call->detached)
+            qrexec_call_free(call);
+    }
+    free(session);
+}
+
+int qrexec_session_fd(const struct qrexec_session *session)
+{
+    return libvchan_fd_for_select(session->vchan);
+}
+
+struct qrexec_call *qrexec_session_call(struct qrexec_session *session,
+                                        const char *cmdline)
+{
+    struct qrexec_call *call;
+    size_t len = strlen(cmdline) + 1;
+
+    if (uses_default_user(cmdline)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (session->failed) {
+        errno = EPIPE;
+        return NULL;
+    }
+    if (libvchan_buffer_space(session->vchan) <
+            (int)(sizeof(struct stream_header) + len)) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    call = calloc(1, sizeof(*call));
+    if (!call)
+        return NULL;
+    if (send_stream_msg(session->vchan, MSG_DATA_EXEC_CMDLINE,
+                        session->next_stream, cmdline, len) < 0) {
+        session->failed = true;
+        free(call);
+        errno = EPIPE;
+        return NULL;
+    }
+    call->vchan = session->vchan;
+    call->domain = session->domain;
+    call->protocol_version = session->protocol_version;
+    call->state = CALL_RUNNING;
+    call->exit_code = -1;
+    call->session = session;
+    call->stream = session->next_stream++;
+    call->send_credit = STREAM_WINDOW;
+    buffer_init(&call->stdin_buf);
+    buffer_init(&call->output[0]);
+    buffer_init(&call->output[1]);
+    call->next_stream = session->calls;
+    session->calls = call;
+    return call;
+}
+
+static struct qrexec_call *session_find(struct qrexec_session *session,
+                                        uint32_t stream)
+{
+    struct qrexec_call *call;
+
+    for (call = session->calls; call; call = call->next_stream)
+        if (call->stream == stream)
+            return call;
+    return NULL;
+}
+
+/* pass all complete messages to the calls */
+static bool session_recv(struct qrexec_session *session)
+{
+    size_t max_chunk = max_data_chunk_size(session->protocol_version);
+    struct qrexec_call *call;
+    char *buf;
+    uint32_t value;
+
+    for (;;) {
+        if (!session->have_hdr) {
+            if (libvchan_data_ready(session->vchan) <
+                    (int)sizeof(session->hdr))
+                return true;
+            if (libvchan_recv(session->vchan, &session->hdr,
+                              sizeof(session->hdr)) < 0)
+                return false;
+            if (session->hdr.len > max_chunk) {
+                LOG(ERROR, "Too big data chunk received: %" PRIu32 " > %zu",
+                    session->hdr.len, max_chunk);
+                return false;
+            }
+            session->have_hdr = true;
+        }
+        if (libvchan_data_ready(session->vchan) < (int)session->hdr.len)
+            return true;
+        session->have_hdr = false;
+
+        buf = malloc(session->hdr.len ? session->hdr.len : 1);
+        if (!buf) {
+            PERROR("malloc");
+            return false;
+        }
+        if (libvchan_recv(session->vchan, buf, session->hdr.len) < 0) {
+            free(buf);
+            return false;
+        }
+        call = session_find(session, session->hdr.stream);
+        switch (session->hdr.type) {
+            case MSG_DATA_STDOUT:
+            case MSG_DATA_STDERR:
+                if (!call)
+                    break;
+                if (session->hdr.len > STREAM_WINDOW - call->recv_unacked) {
+                    LOG(ERROR, "Stream %" PRIu32 " window exceeded",
+                        call->stream);
+                    goto fail;
+                }
+                call->recv_unacked += session->hdr.len;
+                if (!call->detached)
+                    buffer_append(
+                        &call->output[session->hdr.type == MSG_DATA_STDERR],
+                        buf, session->hdr.len);
+                break;
+            case MSG_DATA_EXIT_CODE:
+            case MSG_DATA_CREDIT:
+                if (session->hdr.len != sizeof(value)) {
+                    LOG(ERROR, "Invalid message 0x%" PRIx32 " on stream",
+                        session->hdr.type);
+                    goto fail;
+                }
+                memcpy(&value, buf, sizeof(value));
+                if (!call)
+                    break;
+                if (session->hdr.type == MSG_DATA_CREDIT) {
+                    if (value > STREAM_WINDOW - call->send_credit) {
+                        LOG(ERROR, "Stream %" PRIu32 " credit exceeded",
+                            call->stream);
+                        goto fail;
+                    }
+                    call->send_credit += value;
+                    break;
+                }
+                call->exit_code = value;
+                call->state = CALL_DONE;
+                if (call->detached) {
+                    call->detached = false;
+                    qrexec_call_free(call);
+                }
+                break;
+            default:
+                LOG(ERROR, "unknown msg %" PRIu32 " on stream %" PRIu32,
+                    session->hdr.type, session->hdr.stream);
+                goto fail;
+        }
+        free(buf);
+    }
+
+fail:
+    free(buf);
+    return false;
+}
+
+int qrexec_session_step(struct qrexec_session *session)
+{
+    struct pollfd pfd = {
+        .fd = libvchan_fd_for_select(session->vchan),
+        .events = POLLIN,
+    };
+    struct qrexec_call *call;
+    int is_open;
+
+    if (session->failed)
+        goto fail;
+
+    /* clear event pending flag; do not block if there is none */
+    if (poll(&pfd, 1, 0) > 0)
+        libvchan_wait(session->vchan);
+
+    /* as in qrexec_call_step() */
+    is_open = libvchan_is_open(session->vchan);
+    if (!session_recv(session))
+        goto fail;
+    if (!is_open) {
+        LOG(ERROR, "vchan connection closed early");
+        goto fail;
+    }
+    for (call = session->calls; call; call = call->next_stream) {
+        if (call->state != CALL_RUNNING)
+            continue;
+        if (!call_flush_stdin(call))
+            goto fail;
+        call_send_credit(call);
+    }
+    if (session->failed)
+        goto fail;
+    return 0;
+
+fail:
+    session->failed = true;
+    for (call = session->calls; call; call = call->next_stream)
+        if (call->state != CALL_DONE)
+            call->state = CALL_ERROR;
+    return -1;
+}
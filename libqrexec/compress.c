@@ -0,0 +1,150 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Compressed data messages (MSG_DATA_COMPRESSED). Each message is compressed
+ * on its own, so that the receiver does not have to keep any state, with the
+ * fastest zlib level.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "libqrexec-utils.h"
+
+/* compressing is not worth it if it saves less than 1/8 */
+#define MIN_SAVING_SHIFT 3
+/* after this many messages in a row that did not compress, skip some */
+#define MAX_FAILURES 4
+/* ... up to this many, doubling each time */
+#define MAX_SKIP 64
+
+struct compressor {
+    z_stream zs;
+    int failures;
+    int skip, next_skip;
+};
+
+struct compressor *compressor_new(void)
+{
+    struct compressor *c = calloc(1, sizeof(*c));
+
+    if (!c) {
+        PERROR("calloc");
+        return NULL;
+    }
+    if (deflateInit(&c->zs, Z_BEST_SPEED) != Z_OK) {
+        LOG(ERROR, "deflateInit failed");
+        free(c);
+        return NULL;
+    }
+    c->next_skip = 1;
+    return c;
+}
+
+void compressor_free(struct compressor *c)
+{
+    if (!c)
+        return;
+    deflateEnd(&c->zs);
+    free(c);
+}
+
+size_t compress_data(struct compressor *c, const void *data, size_t len,
+                     void *out)
+{
+    /* the message has to be shorter than the data */
+    size_t max_out = len - (len >> MIN_SAVING_SHIFT);
+    size_t out_len;
+
+    if (max_out <= sizeof(struct compressed_params))
+        return 0;
+    max_out -= sizeof(struct compressed_params);
+    if (c->skip > 0) {
+        c->skip--;
+        return 0;
+    }
+
+    deflateReset(&c->zs);
+    c->zs.next_in = (Bytef *)data;
+    c->zs.avail_in = len;
+    c->zs.next_out = out;
+    c->zs.avail_out = max_out;
+    if (deflate(&c->zs, Z_FINISH) == Z_STREAM_END) {
+        out_len = max_out - c->zs.avail_out;
+        c->failures = 0;
+        c->next_skip = 1;
+        return out_len;
+    }
+    /* did not fit: most likely already compressed data, back off (and once
+     * backing off, skip more after each failed attempt) */
+    if (++c->failures >= MAX_FAILURES) {
+        c->skip = c->next_skip;
+        if (c->next_skip < MAX_SKIP)
+            c->next_skip *= 2;
+    }
+    return 0;
+}
+
+bool decompress_data(const void *data, size_t len, size_t max_len,
+                     struct compressed_params *params, char **out,
+                     size_t *out_size)
+{
+    uLongf out_len;
+
+    if (len < sizeof(*params)) {
+        LOG(ERROR, "MSG_DATA_COMPRESSED too short");
+        return false;
+    }
+    memcpy(params, data, sizeof(*params));
+    if (params->len == 0 || params->len > max_len) {
+        LOG(ERROR, "Invalid compressed data length %" PRIu32, params->len);
+        return false;
+    }
+    switch (params->type) {
+        case MSG_DATA_STDIN:
+        case MSG_DATA_STDOUT:
+        case MSG_DATA_STDERR:
+            break;
+        default:
+            LOG(ERROR, "Invalid compressed message type %" PRIu32, params->type);
+            return false;
+    }
+    if (params->len > *out_size) {
+        char *new_out = realloc(*out, params->len);
+
+        if (!new_out) {
+            PERROR("realloc");
+            return false;
+        }
+        *out = new_out;
+        *out_size = params->len;
+    }
+    out_len = params->len;
+    if (uncompress((Bytef *)*out, &out_len,
+                   (const Bytef *)data + sizeof(*params),
+                   len - sizeof(*params)) != Z_OK ||
+            out_len != params->len) {
+        LOG(ERROR, "Invalid compressed data");
+        return false;
+    }
+    return true;
+}
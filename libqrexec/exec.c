@@ -26,8 +26,11 @@
 #include <errno.h>
 #include <stddef.h>
 #include <limits.h>
+#include <sched.h>
 
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -95,14 +98,28 @@ void fix_fds(int fdin, int fdout, int fderr)
     }
 }
 
+/* stdio_buffer_size in the service config; only logs errors, the default
+ * sizes work too */
+static void set_socket_buffers(int fd, int size)
+{
+    if (size <= 0)
+        return;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+        PERROR("setsockopt");
+}
+
+/* config may be NULL (legacy commands) */
 static int do_fork_exec(const char *user,
         const char *cmdline,
         int *pid,
         int *stdin_fd,
         int *stdout_fd,
-        int *stderr_fd)
+        int *stderr_fd,
+        const struct qrexec_service_config *config)
 {
-    int inpipe[2], outpipe[2], errpipe[2], statuspipe[2], retval;
+    int inpipe[2], outpipe[2], errpipe[2], statuspipe[2], retval, i;
+    int stdio_buffer_size = config ? config->stdio_buffer_size : 0;
 #ifndef SOCK_CLOEXEC
 #define SOCK_CLOEXEC 0
 #endif
@@ -113,6 +130,14 @@ static int do_fork_exec(const char *user,
         PERROR("socketpair");
         exit(1);
     }
+    /* both ends: a unix socket queues what is written to it against the
+     * writer's SO_SNDBUF */
+    for (i = 0; i < 2; i++) {
+        set_socket_buffers(inpipe[i], stdio_buffer_size);
+        set_socket_buffers(outpipe[i], stdio_buffer_size);
+        if (stderr_fd)
+            set_socket_buffers(errpipe[i], stdio_buffer_size);
+    }
     switch (*pid = fork()) {
         case -1:
             PERROR("fork");
@@ -127,6 +152,9 @@ static int do_fork_exec(const char *user,
                 fix_fds(inpipe[0], outpipe[1], 2);
 
             close(statuspipe[0]);
+            /* before exec_func, which may drop privileges */
+            if (config)
+                set_service_scheduling(config);
 #if !SOCK_CLOEXEC
             status = fcntl(statuspipe[1], F_GETFD);
             fcntl(statuspipe[1], F_SETFD, status | FD_CLOEXEC);
@@ -252,8 +280,39 @@ static int find_file(
     return -1;
 }
 
-int load_service_config(const struct qrexec_parsed_command *cmd,
-                        int *wait_for_session) {
+static int sched_policy_by_name(const char *name)
+{
+    if (strcmp(name, "other") == 0)
+        return SCHED_OTHER;
+    if (strcmp(name, "batch") == 0)
+        return SCHED_BATCH;
+    if (strcmp(name, "idle") == 0)
+        return SCHED_IDLE;
+    LOG(ERROR, "Unknown scheduling-policy: %s", name);
+    return SCHED_OTHER;
+}
+
+/* from linux/ioprio.h, which older kernel headers do not have */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+static int io_class_by_name(const char *name)
+{
+    if (strcmp(name, "realtime") == 0)
+        return IOPRIO_CLASS_RT;
+    if (strcmp(name, "best-effort") == 0)
+        return IOPRIO_CLASS_BE;
+    if (strcmp(name, "idle") == 0)
+        return IOPRIO_CLASS_IDLE;
+    LOG(ERROR, "Unknown io-class: %s", name);
+    return 0;
+}
+
+int load_service_config_v2(const struct qrexec_parsed_command *cmd,
+                           struct qrexec_service_config *service_config) {
     assert(cmd->service_descriptor);
 
     const char *config_path = getenv("QUBES_RPC_CONFIG_PATH");
@@ -275,6 +334,7 @@ int load_service_config(const struct qrexec_parsed_command *cmd,
     FILE *config_file;
     size_t read_count;
     char *current_line;
+    char value[64];
 
     config_file = fopen(config_full_path, "re");
     if (!config_file) {
@@ -297,7 +357,26 @@ int load_service_config(const struct qrexec_parsed_command *cmd,
         // ignore comments
         if (current_line[0] == '#')
             continue;
-        sscanf(current_line, "wait-for-session=%d", wait_for_session);
+        sscanf(current_line, "wait-for-session=%d", &service_config->wait_for_session);
+        sscanf(current_line, "compress=%d", &service_config->compress);
+        sscanf(current_line, "cache-ttl=%d", &service_config->cache_ttl);
+        sscanf(current_line, "buffer-size=%d", &service_config->buffer_size);
+        sscanf(current_line, "max-chunk=%d", &service_config->max_chunk);
+        sscanf(current_line, "stdio-buffer-size=%d",
+               &service_config->stdio_buffer_size);
+        sscanf(current_line, "filter-escape-chars=%d",
+               &service_config->filter_escape_chars);
+        sscanf(current_line, "nice=%d", &service_config->nice);
+        if (sscanf(current_line, "scheduling-policy=%63s", value) == 1)
+            service_config->sched_policy = sched_policy_by_name(value);
+        if (sscanf(current_line, "io-class=%63s", value) == 1)
+            service_config->io_class = io_class_by_name(value);
+        sscanf(current_line, "io-level=%d", &service_config->io_level);
+        sscanf(current_line, "cpu-affinity=%63s",
+               service_config->cpu_affinity);
+        sscanf(current_line, "cgroup=%63s", service_config->cgroup);
+        sscanf(current_line, "cpu-weight=%d", &service_config->cpu_weight);
+        sscanf(current_line, "io-weight=%d", &service_config->io_weight);
     }
 
     fclose(config_file);
@@ -420,6 +499,122 @@ void destroy_qrexec_parsed_command(struct qrexec_parsed_command *cmd) {
     free(cmd);
 }
 
+/* CPU list as in taskset(1), e.g. "0-3,6" */
+static bool parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    unsigned long first, last;
+    char *end;
+
+    CPU_ZERO(set);
+    while (*list) {
+        first = last = strtoul(list, &end, 10);
+        if (end == list)
+            return false;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if (end == list || last < first)
+                return false;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return false;
+        list = end;
+    }
+    return true;
+}
+
+static void write_cgroup_file(const char *dir, const char *name, int value)
+{
+    char path[PATH_MAX], buf[16];
+    int fd, len;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    len = snprintf(buf, sizeof(buf), "%d\n", value);
+    fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd < 0) {
+        PERROR("open %s", path);
+        return;
+    }
+    if (!write_all(fd, buf, len))
+        PERROR("write %s", path);
+    close(fd);
+}
+
+/* Move the calling process to the named cgroup, created at the top of the
+ * hierarchy if needed. The cpu and io controllers need to be enabled there
+ * (cgroup.subtree_control of the root) for the weights. */
+static void set_cgroup(const struct qrexec_service_config *config)
+{
+    const char *root = getenv("QREXEC_CGROUP_ROOT");
+    char dir[PATH_MAX];
+
+    if (!root)
+        root = QREXEC_CGROUP_ROOT;
+    if (config->cgroup[0] == '.' || strchr(config->cgroup, '/')) {
+        LOG(ERROR, "Invalid cgroup name: %s", config->cgroup);
+        return;
+    }
+    if (snprintf(dir, sizeof(dir), "%s/%s", root, config->cgroup) >=
+            (int)sizeof(dir)) {
+        LOG(ERROR, "cgroup path too long: %s/%s", root, config->cgroup);
+        return;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        PERROR("mkdir %s", dir);
+        return;
+    }
+    /* shared by all the services in this cgroup, the last one wins */
+    if (config->cpu_weight > 0)
+        write_cgroup_file(dir, "cpu.weight", config->cpu_weight);
+    if (config->io_weight > 0)
+        write_cgroup_file(dir, "io.weight", config->io_weight);
+    write_cgroup_file(dir, "cgroup.procs", getpid());
+}
+
+int set_service_scheduling(const struct qrexec_service_config *config)
+{
+    struct sched_param param = { .sched_priority = 0 };
+    cpu_set_t cpus;
+    int ret = 0;
+
+    if (config->cgroup[0]) {
+        set_cgroup(config);
+        ret = 1;
+    }
+    /* before the nice value, in case changing the policy resets it */
+    if (config->sched_policy != SCHED_OTHER) {
+        if (sched_setscheduler(0, config->sched_policy, &param) < 0)
+            PERROR("sched_setscheduler");
+        ret = 1;
+    }
+    if (config->nice != 0) {
+        if (setpriority(PRIO_PROCESS, 0, config->nice) < 0)
+            PERROR("setpriority");
+        ret = 1;
+    }
+    if (config->io_class) {
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                    config->io_class << IOPRIO_CLASS_SHIFT |
+                    config->io_level) < 0)
+            PERROR("ioprio_set");
+        ret = 1;
+    }
+    if (config->cpu_affinity[0]) {
+        if (!parse_cpu_list(config->cpu_affinity, &cpus))
+            LOG(ERROR, "Invalid cpu-affinity: %s", config->cpu_affinity);
+        else if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+            PERROR("sched_setaffinity");
+        ret = 1;
+    }
+    return ret;
+}
+
 int execute_qubes_rpc_command(const char *cmdline, int *pid, int *stdin_fd,
         int *stdout_fd, int *stderr_fd, bool strip_username, struct buffer *stdin_buffer) {
 
@@ -438,7 +633,7 @@ int execute_qubes_rpc_command(const char *cmdline, int *pid, int *stdin_fd,
     } else {
         // Legacy qrexec behavior: spawn shell directly
         ret = do_fork_exec(cmd->username, cmd->command,
-                           pid, stdin_fd, stdout_fd, stderr_fd);
+                           pid, stdin_fd, stdout_fd, stderr_fd, NULL);
     }
 
     destroy_qrexec_parsed_command(cmd);
@@ -456,6 +651,9 @@ static int execute_parsed_qubes_rpc_command(
     if (!qrexec_service_path)
         qrexec_service_path = QREXEC_SERVICE_PATH;
 
+    struct qrexec_service_config config = { 0 };
+    load_service_config_v2(cmd, &config);
+
     char service_full_path[QUBES_SOCKADDR_UN_MAX_PATH_LEN];
     struct stat statbuf;
 
@@ -490,6 +688,7 @@ static int execute_parsed_qubes_rpc_command(
             *stderr_fd = -1;
         *pid = 0;
         set_nonblock(s);
+        set_socket_buffers(s, config.stdio_buffer_size);
 
         /* send part after "QUBESRPC ", including trailing NUL */
         const char *desc = cmd->command + RPC_REQUEST_COMMAND_LEN + 1;
@@ -505,7 +704,7 @@ static int execute_parsed_qubes_rpc_command(
           moment, searches for the right file again.
         */
         return do_fork_exec(cmd->username, cmd->command,
-                            pid, stdin_fd, stdout_fd, stderr_fd);
+                            pid, stdin_fd, stdout_fd, stderr_fd, &config);
     }
 
     LOG(ERROR, "Unknown service type (not executable, not a socket): %s",
@@ -0,0 +1,265 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Sending data read from a regular file (think: qrexec-client-vm ... < file)
+ * straight from a mapping of the file, instead of read() into a buffer and
+ * copying it to the vchan from there.
+ *
+ * The file is mapped a window at a time. Its size is checked before each
+ * chunk, so a file truncated while it is sent fails the transfer instead of
+ * sending the pages past the end, which read as zeros. If it gets truncated
+ * in the middle of a chunk, accessing those pages would raise SIGBUS; the
+ * handler puts zero pages in place of the window instead, and the transfer
+ * fails as well (after a part of the chunk went out as zeros). The handler
+ * is installed once and stays, passing on the faults outside of the windows
+ * to the handler that was there before. SIGBUS is delivered to the thread
+ * that faulted, so each thread has its own window to check.
+ *
+ * Files that cannot be mapped (procfs, sysfs, some FUSE file systems) are
+ * read() as any other input.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libqrexec-utils.h"
+
+#define WINDOW_SIZE (16 << 20)
+
+struct file_input {
+    int fd;
+    off_t offset; /* of the next byte to send */
+    char *map;
+    off_t map_offset;
+    size_t map_size;
+    /* the file cannot be mapped, send it with handle_input() */
+    bool use_read;
+};
+
+/* the window mapped by this thread, for the SIGBUS handler; initial-exec,
+ * as the general-dynamic model may allocate on the first access from a
+ * thread when the library is dlopen()ed (qrexec.libqrexec) */
+#define SIGNAL_SAFE_TLS __thread __attribute__((tls_model("initial-exec")))
+static SIGNAL_SAFE_TLS char *volatile bus_map;
+static SIGNAL_SAFE_TLS volatile size_t bus_map_size;
+static SIGNAL_SAFE_TLS volatile sig_atomic_t bus_error;
+
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+static struct sigaction old_sigbus;
+static bool sigbus_installed;
+
+static void sigbus_handler(int sig, siginfo_t *info, void *context)
+{
+    char *addr = info->si_addr;
+
+    if (bus_map && addr >= bus_map && addr < bus_map + bus_map_size &&
+            mmap(bus_map, bus_map_size, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+        bus_error = 1;
+        return;
+    }
+    /* not ours */
+    if (old_sigbus.sa_flags & SA_SIGINFO)
+        old_sigbus.sa_sigaction(sig, info, context);
+    else if (old_sigbus.sa_handler != SIG_DFL &&
+             old_sigbus.sa_handler != SIG_IGN)
+        old_sigbus.sa_handler(sig);
+    else
+        /* fault again without the handler */
+        signal(sig, SIG_DFL);
+}
+
+static void install_sigbus_handler(void)
+{
+    struct sigaction sa = {
+        .sa_sigaction = sigbus_handler,
+        .sa_flags = SA_SIGINFO,
+    };
+
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, &old_sigbus) < 0) {
+        PERROR("sigaction");
+        return;
+    }
+    sigbus_installed = true;
+}
+
+struct file_input *file_input_new(int fd)
+{
+    struct file_input *input;
+    struct stat st;
+    off_t offset;
+
+    /* files in procfs and sysfs have no size, read() them */
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
+    /* the data is sent from where the file is at, e.g. after something
+     * else has read a part of it */
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0)
+        return NULL;
+
+    input = calloc(1, sizeof(*input));
+    if (!input) {
+        PERROR("calloc");
+        return NULL;
+    }
+    input->fd = fd;
+    input->offset = offset;
+    pthread_once(&sigbus_once, install_sigbus_handler);
+    if (!sigbus_installed) {
+        free(input);
+        return NULL;
+    }
+    bus_error = 0;
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+    return input;
+}
+
+static void unmap_window(struct file_input *input)
+{
+    if (!input->map)
+        return;
+    bus_map = NULL;
+    munmap(input->map, input->map_size);
+    input->map = NULL;
+}
+
+void file_input_free(struct file_input *input)
+{
+    if (!input)
+        return;
+    unmap_window(input);
+    /* leave the file where a read() would have; with use_read it is
+     * there already */
+    if (!input->use_read && lseek(input->fd, input->offset, SEEK_SET) < 0)
+        PERROR("lseek");
+    free(input);
+}
+
+/* Map the window with the next byte to send; returns 0 at the end of the
+ * file, -1 on error, 2 if the file cannot be mapped (use_read is set) */
+static int map_window(struct file_input *input)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    char *map;
+
+    unmap_window(input);
+    if (fstat(input->fd, &st) < 0) {
+        PERROR("fstat");
+        return -1;
+    }
+    if (input->offset >= st.st_size)
+        return 0;
+    input->map_offset = input->offset & ~(off_t)(page_size - 1);
+    input->map_size = WINDOW_SIZE;
+    if ((off_t)input->map_size > st.st_size - input->map_offset)
+        input->map_size = st.st_size - input->map_offset;
+    map = mmap(NULL, input->map_size, PROT_READ, MAP_PRIVATE, input->fd,
+               input->map_offset);
+    if (map == MAP_FAILED) {
+        if (errno != ENODEV && errno != EINVAL && errno != EACCES) {
+            PERROR("mmap");
+            return -1;
+        }
+        /* go on with read() from where the data sent ends */
+        if (lseek(input->fd, input->offset, SEEK_SET) < 0) {
+            PERROR("lseek");
+            return -1;
+        }
+        input->use_read = true;
+        return 2;
+    }
+    madvise(map, input->map_size, MADV_SEQUENTIAL);
+    input->map = map;
+    bus_map_size = input->map_size;
+    bus_map = map;
+    return 1;
+}
+
+int handle_file_input(libvchan_t *vchan, struct file_input *input,
+                      int msg_type, int data_protocol_version,
+                      size_t max_chunk)
+{
+    size_t max_len = max_data_chunk_size(data_protocol_version);
+    struct msg_header hdr = { .type = msg_type };
+    struct stat st;
+    size_t len;
+    int ret;
+
+    if (input->use_read)
+        return handle_input(vchan, input->fd, msg_type, data_protocol_version,
+                            max_chunk, NULL);
+    if (max_chunk > 0 && max_chunk < max_len)
+        max_len = max_chunk;
+    while (libvchan_buffer_space(vchan) > (int)sizeof(struct msg_header)) {
+        len = libvchan_buffer_space(vchan) - sizeof(struct msg_header);
+        if (len > max_len)
+            len = max_len;
+        if (!input->map ||
+                input->offset >= input->map_offset + (off_t)input->map_size) {
+            ret = map_window(input);
+            if (ret < 0)
+                return REMOTE_ERROR;
+            if (ret == 2)
+                return handle_input(vchan, input->fd, msg_type,
+                                    data_protocol_version, max_chunk, NULL);
+            if (ret == 0) {
+                hdr.len = 0;
+                /* see handle_input() */
+                libvchan_send(vchan, &hdr, sizeof(hdr));
+                return REMOTE_EOF;
+            }
+        }
+        if ((off_t)len > input->map_offset + (off_t)input->map_size - input->offset)
+            len = input->map_offset + input->map_size - input->offset;
+        /* the window is as large as the file was when mapped */
+        if (fstat(input->fd, &st) < 0) {
+            PERROR("fstat");
+            return REMOTE_ERROR;
+        }
+        if (input->offset >= st.st_size) {
+            LOG(ERROR, "File truncated while being sent");
+            return REMOTE_ERROR;
+        }
+        if ((off_t)len > st.st_size - input->offset)
+            len = st.st_size - input->offset;
+
+        hdr.len = (uint32_t)len;
+        if (libvchan_send(vchan, &hdr, sizeof(hdr)) < 0 ||
+                !write_vchan_all(vchan,
+                                 input->map + (input->offset - input->map_offset),
+                                 len))
+            return REMOTE_ERROR;
+        if (bus_error) {
+            LOG(ERROR, "File truncated while being sent");
+            return REMOTE_ERROR;
+        }
+        input->offset += len;
+    }
+    return REMOTE_OK;
+}
@@ -82,16 +82,55 @@ struct qrexec_parsed_command *parse_qubes_rpc_command(
     const char *cmdline, bool strip_username);
 void destroy_qrexec_parsed_command(struct qrexec_parsed_command *cmd);
 
-/* Load service configuration, currently only wait-for-session option
- * supported.
+/* Service configuration, see qubes-rpc-config/README. Fields not set in the
+ * config file are left as they are. */
+struct qrexec_service_config {
+    int wait_for_session;
+    int compress;
+    /* seconds the output may be reused for, see MSG_DATA_CACHE_TTL */
+    int cache_ttl;
+    /* I/O tunables, 0 if not set: data vchan ring size (applied by the
+     * caller, which sets up the vchan), the largest data message sent, and
+     * SO_SNDBUF/SO_RCVBUF of the stdio sockets of the service process */
+    int buffer_size;
+    int max_chunk;
+    int stdio_buffer_size;
+    /* caller: whether to filter escape characters from the output when not
+     * given on the command line; initialize to -1 for "only on a terminal" */
+    int filter_escape_chars;
+    /* scheduling of the service process and of the data pump of the call,
+     * 0 or empty if not set (see set_service_scheduling): nice value,
+     * SCHED_BATCH or SCHED_IDLE, ionice class (IOPRIO_CLASS_*) and level,
+     * CPU list as in taskset(1), and a cgroup (v2) to put the processes in,
+     * with its cpu.weight and io.weight */
+    int nice;
+    int sched_policy;
+    int io_class;
+    int io_level;
+    char cpu_affinity[64];
+    char cgroup[64];
+    int cpu_weight;
+    int io_weight;
+};
+
+/* Load service configuration.
  *
  * Return:
  *  1  - config successfuly loaded
  *  0  - config not found
  *  -1 - other error
  */
-int load_service_config(const struct qrexec_parsed_command *cmd_name,
-                        int *wait_for_session);
+int load_service_config_v2(const struct qrexec_parsed_command *cmd_name,
+                           struct qrexec_service_config *service_config);
+
+/* Apply the scheduling options of a service config to the calling process,
+ * before it runs the service (or passes data for it); only logs errors.
+ *
+ * Return:
+ *  1  - some option was set
+ *  0  - none are set in the config
+ */
+int set_service_scheduling(const struct qrexec_service_config *service_config);
 
 typedef void (do_exec_t)(const char *cmdline, const char *user);
 void register_exec_func(do_exec_t *func);
@@ -150,7 +189,14 @@ void fix_fds(int fdin, int fdout, int fderr);
 void set_nonblock(int fd);
 void set_block(int fd);
 
+/* Listen on a unix socket. The backlog is SOMAXCONN, or
+ * $QREXEC_SOCKET_BACKLOG if set. */
 int get_server_socket(const char *);
+/* Accept a connection; the flags (SOCK_NONBLOCK) are passed to accept4(), the
+ * new descriptor is always close-on-exec. Returns -1 if there are no more
+ * pending connections (non-blocking socket) or on error. When out of file
+ * descriptors, a pending connection is dropped instead. */
+int do_accept4(int s, int flags);
 int do_accept(int s);
 
 void set_nonblock(int fd);
@@ -158,15 +204,49 @@ void set_nonblock(int fd);
 static inline size_t max_data_chunk_size(int protocol_version) {
     if (protocol_version < QREXEC_PROTOCOL_V3)
         return MAX_DATA_CHUNK_V2;
-    else
+    else if (protocol_version < QREXEC_PROTOCOL_V6)
         return MAX_DATA_CHUNK_V3;
+    else
+        return MAX_DATA_CHUNK_V6;
 }
 #define ARRAY_SIZE(s) (sizeof(s)/sizeof(s[0]))
 
 /* Replace all non-printable characters by '_' */
 void do_replace_chars(char *buf, int len);
 
+/*
+ * Compressed data messages (MSG_DATA_COMPRESSED), see compress.c.
+ */
+struct compressor;
+struct compressor *compressor_new(void);
+void compressor_free(struct compressor *c);
+/* Compress len bytes of data to out (which has room for len bytes), return
+ * the compressed length, or 0 if the data should be sent as it is - because
+ * it does not compress well, or did not recently. */
+size_t compress_data(struct compressor *c, const void *data, size_t len,
+                     void *out);
+/* Check and decompress the data of a MSG_DATA_COMPRESSED message, at most
+ * max_len bytes, to *out (grown with realloc() as needed). */
+bool decompress_data(const void *data, size_t len, size_t max_len,
+                     struct compressed_params *params, char **out,
+                     size_t *out_size);
+
+/*
+ * Response cache of the client API, see cache.c. Keys are made by
+ * response_cache_key() (malloc()ed); response_cache_lookup() appends the
+ * cached stdout and stderr to output[0] and output[1].
+ */
+char *response_cache_key(const char *target, const char *cmdline,
+                         const void *stdin_data, size_t stdin_len,
+                         size_t *key_len);
+size_t response_cache_max_size(void);
+bool response_cache_lookup(const char *key, size_t key_len,
+                           struct buffer output[2], int *exit_code);
+void response_cache_store(const char *key, size_t key_len, uint32_t ttl,
+                          struct buffer output[2], int exit_code);
+
 /* return codes for handle_remote_data and handle_input */
+#define REMOTE_STRIPES -3
 #define REMOTE_EXITED -2
 #define REMOTE_ERROR  -1
 #define REMOTE_EOF     0
@@ -183,6 +263,11 @@ void do_replace_chars(char *buf, int len);
  *   REMOTE_EOF - EOF received, do not access this FD again
  *   REMOTE_OK - maybe some data processed, call again when buffer space and
  *     more data available
+ *   REMOTE_STRIPES - MSG_DATA_STRIPES received ("stripes" will be set to the
+ *     count), only if "stripes" is not NULL
+ *
+ * MSG_HELLO is accepted only as the first message, while "hello_pending" (if
+ * not NULL) is true; any message clears it.
  *
  * Options:
  *   replace_chars_stdout, replace_chars_stderr - remove non-printable
@@ -191,11 +276,14 @@ void do_replace_chars(char *buf, int len);
 int handle_remote_data(
     libvchan_t *data_vchan, int stdin_fd, int *status,
     struct buffer *stdin_buf, int data_protocol_version,
-    bool replace_chars_stdout, bool replace_chars_stderr);
+    bool replace_chars_stdout, bool replace_chars_stderr,
+    uint32_t *stripes, bool *hello_pending);
 
 /*
  * Handle data from the specified FD (cannot be -1) and send it over vchan
- * with a given message type (MSG_DATA_STDIN/STDOUT/STDERR).
+ * with a given message type (MSG_DATA_STDIN/STDOUT/STDERR), compressed if
+ * compressor is not NULL (protocol 8+ only), in messages of at most
+ * max_chunk bytes (0 for what the protocol allows).
  *
  * Return codes:
  *   REMOTE_ERROR - vchan error occured
@@ -205,14 +293,73 @@ int handle_remote_data(
  */
 int handle_input(
     libvchan_t *vchan, int fd, int msg_type,
-    int data_protocol_version);
+    int data_protocol_version, size_t max_chunk,
+    struct compressor *compressor);
+
+/*
+ * Like handle_input(), for a regular file: the data is sent straight from a
+ * mapping of it, see file-input.c. file_input_new() returns NULL if the FD is
+ * not a regular file. file_input_free() leaves the file offset after the data
+ * sent.
+ */
+struct file_input;
+struct file_input *file_input_new(int fd);
+void file_input_free(struct file_input *input);
+int handle_file_input(libvchan_t *vchan, struct file_input *input,
+                      int msg_type, int data_protocol_version,
+                      size_t max_chunk);
 
 int send_exit_code(libvchan_t *vchan, int status);
+/* Service side, protocol 11+: tell the caller that the output can be reused
+ * for ttl seconds (cache-ttl in the service config), before sending any */
+int send_cache_ttl(libvchan_t *vchan, uint32_t ttl);
+
+/*
+ * Striped data connection (MSG_DATA_STRIPES), see stripe.c. Each stripe vchan
+ * is pumped by its own thread.
+ */
+struct stripes;
+/* vchan server side: set up count stripes in each direction for the data
+ * connection to domain on port, and ask the peer to connect them */
+struct stripes *stripes_listen(libvchan_t *vchan, int domain, int port,
+                               int count, int buffer_size);
+/* vchan client side, on MSG_DATA_STRIPES: connect the stripes and reply;
+ * on failure, reply with 0 and return NULL */
+struct stripes *stripes_connect(libvchan_t *vchan, int domain, int port,
+                                uint32_t count);
+/* Start sending the data read from fd, until EOF or stripes_stop_sending().
+ * The fd is not closed; it is not used any more once stripes_sending() is
+ * false. */
+bool stripes_start_sending(struct stripes *s, int fd, int data_protocol_version);
+/* Start writing the data received to fd (-1 to discard it), likewise until
+ * stripes_receiving() is false */
+bool stripes_start_receiving(struct stripes *s, int fd, bool replace_chars,
+                             int data_protocol_version);
+/* Stop reading the data to send (and send EOF) */
+void stripes_stop_sending(struct stripes *s);
+/* Discard the rest of the data received */
+void stripes_stop_receiving(struct stripes *s);
+/* Readable when a thread has finished; call stripes_clear_notify() then */
+int stripes_notify_fd(struct stripes *s);
+void stripes_clear_notify(struct stripes *s);
+int stripes_count(struct stripes *s);
+bool stripes_sending(struct stripes *s);
+bool stripes_receiving(struct stripes *s);
+bool stripes_failed(struct stripes *s);
+/* Wait for the threads to finish, close the stripes */
+void stripes_free(struct stripes *s);
+
+/* Send a message on a multiplexed data connection (see struct stream_header);
+ * check libvchan_buffer_space() first, so that it does not block. */
+int send_stream_msg(libvchan_t *vchan, uint32_t type, uint32_t stream,
+                    const void *data, uint32_t len);
 
 /* Set of options for process_io(). */
 struct process_io_request {
     libvchan_t *vchan;
     struct buffer *stdin_buf;
+    // no more data for stdin_fd after stdin_buf: close it once written out
+    bool stdin_eof;
 
     // stderr_fd can be -1
     int stdin_fd, stdout_fd, stderr_fd;
@@ -237,6 +384,19 @@ struct process_io_request {
     bool replace_chars_stdout;
     bool replace_chars_stderr;
     int data_protocol_version;
+    // compress the data sent, if the peer supports it
+    bool compress;
+    // largest data message sent, 0 for what the protocol allows
+    size_t max_chunk;
+    // vchan server: stripes set up with stripes_listen() (freed by
+    // process_io()), or NULL
+    struct stripes *stripes;
+    // vchan client: where to connect the stripes if the peer asks for them;
+    // 0 port to refuse
+    int stripe_domain, stripe_port;
+    // the protocol version was known up front (see struct peer_info), and
+    // the peer's MSG_HELLO is still to come while true; NULL otherwise
+    bool *hello_pending;
 
     volatile sig_atomic_t *sigchld;
     // can be NULL
@@ -251,6 +411,27 @@ struct process_io_request {
  */
 int process_io(const struct process_io_request *req);
 
+/* Set of options for process_io_mux(). */
+struct process_io_mux_request {
+    libvchan_t *vchan;
+    int data_protocol_version;
+    // passed to execute_qubes_rpc_command()
+    bool strip_username;
+
+    volatile sig_atomic_t *sigchld;
+};
+
+/*
+ * Service side of a multiplexed data connection (see struct stream_header in
+ * qrexec.h): start the processes requested over vchan, pass IO between them
+ * and their streams, and send their exit codes, until vchan is closed.
+ * Processes cannot switch to a single socket for stdin and stdout
+ * (SIGUSR1), as in process_io().
+ *
+ * Returns 0, but calls exit() on errors.
+ */
+int process_io_mux(const struct process_io_mux_request *req);
+
 // Logging
 
 #define DEBUG    1
@@ -279,4 +460,208 @@ void qrexec_log(int level, int errnoval, const char *file, int line,
 
 void setup_logging(const char *program_name);
 
+/*
+ * Timers, kept in a hierarchical timer wheel (see timer.c). Starting and
+ * cancelling a timer is O(1). Add timer_wheel_fd() to the event loop and call
+ * timer_wheel_run() when it is readable; callbacks of expired timers are
+ * called from there. The fd is armed only while some timer is running.
+ *
+ * Timer resolution is 10ms, timeouts are never shorter than requested.
+ */
+struct timer_wheel;
+struct qrexec_timer;
+typedef void (qrexec_timer_func)(struct qrexec_timer *timer);
+
+struct qrexec_timer {
+    qrexec_timer_func *func;
+    void *data;
+
+    /* private */
+    struct qrexec_timer *next, *prev;
+    struct timer_wheel *wheel;
+    uint64_t expires;
+};
+
+/* Returns NULL on error, with errno set. */
+struct timer_wheel *timer_wheel_new(void);
+/* Running timers are cancelled. */
+void timer_wheel_free(struct timer_wheel *wheel);
+int timer_wheel_fd(const struct timer_wheel *wheel);
+void timer_wheel_run(struct timer_wheel *wheel);
+
+void timer_init(struct qrexec_timer *timer, qrexec_timer_func *func, void *data);
+/* (Re)start a timer. The timer must not be freed until it expires or is
+ * cancelled. */
+void timer_start(struct timer_wheel *wheel, struct qrexec_timer *timer,
+                 unsigned int timeout_ms);
+/* Cancel a timer, no-op if it is not running. */
+void timer_cancel(struct qrexec_timer *timer);
+bool timer_is_active(const struct qrexec_timer *timer);
+
+/*
+ * Replay log - the most recent data written to the control vchan, identified
+ * by stream offset. After reconnecting, the peer reports how much it has
+ * received, and the rest can be sent again (see replay-log.c).
+ */
+struct replay_log {
+    char *data;
+    uint64_t start;	/* offset of the oldest byte still in the log */
+    uint64_t end;	/* offset just after the last byte written */
+};
+
+void replay_log_init(struct replay_log *log, uint64_t start);
+void replay_log_free(struct replay_log *log);
+void replay_log_append(struct replay_log *log, const void *data, size_t len);
+/* Append data from *offset* onwards to *out*, and drop it from the log, so it
+ * can be written again. Returns false (and does nothing) if the data is no
+ * longer in the log. */
+bool replay_log_rewind(struct replay_log *log, uint64_t offset,
+                       struct buffer *out);
+
+/*
+ * Client API - making qrexec calls without running qrexec-client or
+ * qrexec-client-vm (see client.c). Errors are logged, and -1 (or NULL) is
+ * returned.
+ */
+
+/* dom0: connect to qrexec-daemon of *domain_name* and do the handshake;
+ * returns the socket */
+int qrexec_daemon_connect(const char *socket_dir, const char *domain_name);
+/* dom0: ask qrexec-daemon for a connection (MSG_EXEC_CMDLINE, MSG_JUST_EXEC
+ * or MSG_SERVICE_CONNECT, with *data* as the command line or service_params);
+ * the data connection parameters are returned in *params*. */
+int qrexec_daemon_request(int fd, int type, int domid,
+                          const void *data, size_t len,
+                          struct exec_params *params);
+/* dom0: like qrexec_daemon_request() with MSG_EXEC_CMDLINE for a call from
+ * dom0, passing also the first *stdin_len* (at most MAX_EXEC_STDIN_LEN) bytes
+ * of stdin, and EOF if *stdin_eof*, so that the process does not have to wait
+ * for the data connection; pass the same to qrexec_call_initial_stdin(). */
+int qrexec_daemon_request_exec(int fd, const char *cmdline,
+                               const void *stdin_data, size_t stdin_len,
+                               bool stdin_eof, struct exec_params *params);
+/* dom0: like qrexec_daemon_request() with MSG_JUST_EXEC_NO_DATA, passing
+ * *flags* (JUST_EXEC_*) in struct just_exec_params. Returns the type of the
+ * response: MSG_JUST_EXEC_NO_DATA, after which MSG_EXEC_STATUS follows, or
+ * MSG_JUST_EXEC if the agent is too old, and the call needs a data
+ * connection after all (see qrexec.h). */
+int qrexec_daemon_request_just_exec(int fd, int domid, const char *cmdline,
+                                    uint32_t flags, struct exec_params *params);
+/* VM: ask qrexec-agent to call a service; the data connection parameters are
+ * returned in *params*. Returns the socket, which should be kept open until
+ * the call ends, or -1 with errno set to EACCES if the call was refused. */
+int qrexec_agent_request(const char *agent_socket, const char *target,
+                         const char *service_name, struct exec_params *params);
+
+/* return codes for qrexec_call_step() */
+#define QREXEC_CALL_ERROR   -1
+#define QREXEC_CALL_RUNNING  0
+#define QREXEC_CALL_DONE     1
+
+/*
+ * Data connection of a call. Wait until qrexec_call_fd() is readable, then
+ * call qrexec_call_step(), until it returns QREXEC_CALL_DONE (the exit code
+ * is known) or QREXEC_CALL_ERROR. Nothing blocks: stdin is queued, and
+ * stdout and stderr (stream 1 and 2) are kept until read by the caller.
+ */
+struct qrexec_call;
+
+/* Start the data vchan server; buffer_size 0 means the default. */
+struct qrexec_call *qrexec_call_open(const struct exec_params *params,
+                                     size_t buffer_size);
+void qrexec_call_free(struct qrexec_call *call);
+int qrexec_call_fd(const struct qrexec_call *call);
+int qrexec_call_step(struct qrexec_call *call);
+int qrexec_call_write(struct qrexec_call *call, const void *data, size_t len);
+int qrexec_call_close_stdin(struct qrexec_call *call);
+/* Queue stdin (and close it if *eof*) that was passed in the request (see
+ * qrexec_daemon_request_exec()); it is sent over the data connection only if
+ * the agent turns out not to support that. Call before any other stdin. */
+int qrexec_call_initial_stdin(struct qrexec_call *call,
+                              const void *data, size_t len, bool eof);
+/* Returns the number of bytes read, 0 if nothing is available. */
+ssize_t qrexec_call_read(struct qrexec_call *call, int stream,
+                         void *data, size_t len);
+/* -1 if not known yet */
+int qrexec_call_exit_code(const struct qrexec_call *call);
+/* Whether the remote has connected and the handshake is done. */
+bool qrexec_call_connected(const struct qrexec_call *call);
+
+/*
+ * dom0: pool of idle data connections (disabled by default). When a call
+ * ends and qrexec-agent offers to keep the connection open (see its
+ * --data-vchan-idle-timeout option), qrexec_call_free() keeps it, up to
+ * max_idle connections, until the agent's idle timeout. The pool is shared
+ * by all threads, so a call that is not part of a session can be freed
+ * from any thread.
+ */
+void qrexec_pool_set_size(int max_idle);
+/* Start a command in domain (id) over an idle connection from the pool,
+ * without qrexec-daemon; NULL if there is none, or if the command is for
+ * the default user ("DEFAULT:..."), which only qrexec-daemon knows. The call
+ * is already connected, so it can be used right away. */
+struct qrexec_call *qrexec_call_reuse(int domain, const char *cmdline);
+
+/*
+ * Response cache (disabled by default). A service can allow its output to be
+ * reused for a while (cache-ttl=SECONDS in its rpc-config, sent to the caller
+ * as MSG_DATA_CACHE_TTL). Calls given a key with qrexec_call_cache_key() keep
+ * their stdout, stderr and exit code then, and an identical call (same
+ * target, command line and stdin) can be answered by qrexec_call_cached()
+ * until that time is up, without a connection. The memory used is kept under
+ * max_bytes, dropping the least recently used responses. The cache can be
+ * used from any thread.
+ */
+struct qrexec_cache_stats {
+    uint64_t hits;
+    uint64_t misses;        /* including expired */
+    uint64_t expired;
+    uint64_t stores;
+    uint64_t evictions;     /* dropped to make room */
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+void qrexec_cache_set_size(size_t max_bytes);
+/* The call runs *cmdline* in *target* (any name that identifies it, as long
+ * as the same is used for lookups), and stdin_data is all of its stdin. Call
+ * before qrexec_call_step(). */
+int qrexec_call_cache_key(struct qrexec_call *call, const char *target,
+                          const char *cmdline, const void *stdin_data,
+                          size_t stdin_len);
+/* A finished call with the cached response, or NULL if there is none. It has
+ * no file descriptor (qrexec_call_fd() returns -1), the output can be read
+ * right away. */
+struct qrexec_call *qrexec_call_cached(const char *target, const char *cmdline,
+                                       const void *stdin_data,
+                                       size_t stdin_len);
+/* Drop the cached responses from *target*, for *service* (name without the
+ * argument); NULL matches any. */
+void qrexec_cache_invalidate(const char *target, const char *service);
+void qrexec_cache_get_stats(struct qrexec_cache_stats *stats);
+
+/*
+ * dom0: session - any number of concurrent calls over one data connection,
+ * without setting up a vchan for each (see struct stream_header in qrexec.h).
+ * It is started from an idle connection in the pool (protocol 7+ only), and
+ * lasts until qrexec_session_free(). Calls from qrexec_session_call() are used
+ * as any other, but all share qrexec_session_fd(): when it is readable, call
+ * qrexec_session_step() (or qrexec_call_step() on any of them), then check
+ * each call. A call freed before it ends is left to finish in the background.
+ */
+struct qrexec_session;
+
+/* NULL if there is no suitable idle connection to domain (id) */
+struct qrexec_session *qrexec_session_open(int domain);
+/* Closes the connection; calls that did not end fail. */
+void qrexec_session_free(struct qrexec_session *session);
+int qrexec_session_fd(const struct qrexec_session *session);
+/* Returns 0, or -1 if the connection failed (and so did all its calls). */
+int qrexec_session_step(struct qrexec_session *session);
+/* Start a command; NULL with errno set to EAGAIN if the vchan is full (step
+ * the session and try again), or to EINVAL if the command is for the default
+ * user ("DEFAULT:..."), as in qrexec_call_reuse(). */
+struct qrexec_call *qrexec_session_call(struct qrexec_session *session,
+                                        const char *cmdline);
+
 #endif /* _LIBQREXEC_UTILS_H */
@@ -25,8 +25,10 @@
 #include <sys/poll.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "libqrexec-utils.h"
@@ -94,20 +96,53 @@ enum {
     FD_STDOUT,
     FD_STDERR,
     FD_VCHAN,
+    FD_STRIPES,
     FD_NUM
 };
 
+/* Write out what is buffered for stdin_fd before the stripes write there too
+ * (see struct stripes_params). Returns false if stdin_fd is closed. */
+static bool flush_stdin_buf(int stdin_fd, struct buffer *stdin_buf)
+{
+    struct pollfd pfd = { .fd = stdin_fd, .events = POLLOUT };
+
+    if (stdin_fd < 0)
+        return false;
+    for (;;) {
+        switch (flush_client_data(stdin_fd, stdin_buf)) {
+            case WRITE_STDIN_OK:
+                return true;
+            case WRITE_STDIN_BUFFERED:
+                poll(&pfd, 1, -1);
+                break;
+            case WRITE_STDIN_ERROR:
+                if (!(errno == EPIPE || errno == ECONNRESET))
+                    PERROR("write");
+                return false;
+        }
+    }
+}
+
 int process_io(const struct process_io_request *req) {
     libvchan_t *vchan = req->vchan;
     int stdin_fd = req->stdin_fd;
     int stdout_fd = req->stdout_fd;
     int stderr_fd = req->stderr_fd;
     struct buffer *stdin_buf = req->stdin_buf;
+    bool stdin_eof = req->stdin_eof;
 
     bool is_service = req->is_service;
     bool replace_chars_stdout = req->replace_chars_stdout;
     bool replace_chars_stderr = req->replace_chars_stderr;
     int data_protocol_version = req->data_protocol_version;
+    struct compressor *compressor = NULL;
+    struct file_input *file_input = NULL;
+    struct stripes *stripes = req->stripes;
+    /* vchan server: waiting for the reply to MSG_DATA_STRIPES */
+    bool stripes_pending = stripes != NULL;
+    /* the FDs handed over to the stripes, closed once they are done */
+    int stripes_in_fd = -1, stripes_out_fd = -1;
+    uint32_t stripes_count_recv;
 
     pid_t local_pid = req->local_pid;
     volatile sig_atomic_t *sigchld = req->sigchld;
@@ -122,13 +157,20 @@ int process_io(const struct process_io_request *req) {
     struct pollfd fds[FD_NUM];
     sigset_t pollmask;
     struct timespec zero_timeout = { 0, 0 };
-    struct timespec normal_timeout = { 10, 0 };
 
+    /* Unblock the signals only in ppoll(), so that no flag set by a signal
+     * handler gets missed - there is no periodic wakeup. */
     sigemptyset(&pollmask);
     sigaddset(&pollmask, SIGCHLD);
+    if (sigusr1)
+        sigaddset(&pollmask, SIGUSR1);
     sigprocmask(SIG_BLOCK, &pollmask, NULL);
     sigemptyset(&pollmask);
 
+    if (req->compress && data_protocol_version >= QREXEC_PROTOCOL_V8)
+        /* if this fails, just send the data as it is */
+        compressor = compressor_new();
+
     set_nonblock(stdin_fd);
     if (stdout_fd != stdin_fd)
         set_nonblock(stdout_fd);
@@ -136,6 +178,8 @@ int process_io(const struct process_io_request *req) {
         abort(); // not worth handling running out of file descriptors
     if (stderr_fd >= 0)
         set_nonblock(stderr_fd);
+    if (!compressor)
+        file_input = file_input_new(stdout_fd);
 
     while(1) {
         /* React to SIGCHLD */
@@ -150,12 +194,33 @@ int process_io(const struct process_io_request *req) {
                     close_stdin(stdin_fd, !use_stdio_socket);
                     stdin_fd = -1;
                 }
+                if (stripes_out_fd >= 0)
+                    stripes_stop_receiving(stripes);
             }
             *sigchld = 0;
         }
 
-        /* if all done, exit the loop */
-        if (stdin_fd == -1 && stdout_fd == -1 && stderr_fd == -1) {
+        if (stripes && stripes_failed(stripes))
+            handle_vchan_error("stripes");
+        if (stripes_in_fd >= 0 && !stripes_sending(stripes)) {
+            close_stdout(stripes_in_fd, !use_stdio_socket);
+            stripes_in_fd = -1;
+        }
+        if (stripes_out_fd >= 0 && !stripes_receiving(stripes)) {
+            close_stdin(stripes_out_fd, !use_stdio_socket);
+            stripes_out_fd = -1;
+        }
+
+        if (stdin_eof && stdin_fd >= 0 && !buffer_len(stdin_buf)) {
+            close_stdin(stdin_fd, !use_stdio_socket);
+            stdin_fd = -1;
+        }
+
+        /* if all done, exit the loop; a service does not wait for its stdin
+         * to be done, as without the stripes */
+        if (stdin_fd == -1 && stdout_fd == -1 && stderr_fd == -1 &&
+                !stripes_pending && stripes_in_fd == -1 &&
+                (is_service || stripes_out_fd == -1)) {
             if (is_service) {
                 /* wait for local process, send exit code */
                 if (!local_pid || local_status >= 0) {
@@ -192,7 +257,13 @@ int process_io(const struct process_io_request *req) {
         }
 
         /* child signaled desire to use single socket for both stdin and stdout */
-        if (sigusr1 && *sigusr1) {
+        if (sigusr1 && *sigusr1 && stripes && !stripes_pending) {
+            LOG(WARNING, "Single socket for stdin and stdout not supported "
+                "with stripes, ignoring");
+            *sigusr1 = 0;
+        } else if (sigusr1 && *sigusr1) {
+            file_input_free(file_input);
+            file_input = NULL;
             if (stdout_fd != -1) {
                 do
                     errno = 0;
@@ -228,7 +299,8 @@ int process_io(const struct process_io_request *req) {
         fds[FD_STDOUT].fd = -1;
         fds[FD_STDERR].fd = -1;
         if (libvchan_buffer_space(vchan) > (int)sizeof(struct msg_header)) {
-            if (stdout_fd >= 0) {
+            /* the data goes to the stripes once they are there */
+            if (stdout_fd >= 0 && !stripes_pending) {
                 fds[FD_STDOUT].fd = stdout_fd;
                 fds[FD_STDOUT].events = POLLIN;
             }
@@ -241,11 +313,14 @@ int process_io(const struct process_io_request *req) {
         fds[FD_VCHAN].fd = libvchan_fd_for_select(vchan);
         fds[FD_VCHAN].events = POLLIN;
 
+        fds[FD_STRIPES].fd = stripes ? stripes_notify_fd(stripes) : -1;
+        fds[FD_STRIPES].events = POLLIN;
+
         if (!buffer_len(stdin_buf) && libvchan_data_ready(vchan) > 0)
             /* check for other FDs, but exit immediately */
             ret = ppoll(fds, FD_NUM, &zero_timeout, &pollmask);
         else
-            ret = ppoll(fds, FD_NUM, &normal_timeout, &pollmask);
+            ret = ppoll(fds, FD_NUM, NULL, &pollmask);
 
         if (ret < 0) {
             if (errno == EINTR)
@@ -262,6 +337,9 @@ int process_io(const struct process_io_request *req) {
             if (libvchan_wait(vchan) < 0)
                 handle_vchan_error("wait");
 
+        if (fds[FD_STRIPES].revents)
+            stripes_clear_notify(stripes);
+
         if (stdin_fd >= 0 && fds[FD_STDIN].revents & (POLLHUP | POLLERR)) {
             close_stdin(stdin_fd, !use_stdio_socket);
             stdin_fd = -1;
@@ -274,10 +352,50 @@ int process_io(const struct process_io_request *req) {
                     stdin_buf,
                     data_protocol_version,
                     replace_chars_stdout > 0,
-                    replace_chars_stderr > 0)) {
+                    replace_chars_stderr > 0,
+                    stripes_pending || (!stripes && req->stripe_port > 0) ?
+                        &stripes_count_recv : NULL,
+                    req->hello_pending)) {
             case REMOTE_ERROR:
                 handle_vchan_error("read");
                 break;
+            case REMOTE_STRIPES:
+                if (stripes_pending) {
+                    /* the reply */
+                    stripes_pending = false;
+                    if (stripes_count_recv == 0) {
+                        LOG(WARNING, "Peer refused stripes, going on without them");
+                        stripes_free(stripes);
+                        stripes = NULL;
+                        break;
+                    }
+                    if (stripes_count_recv != (uint32_t)stripes_count(stripes))
+                        handle_vchan_error("MSG_DATA_STRIPES reply");
+                } else {
+                    stripes = stripes_connect(vchan, req->stripe_domain,
+                                              req->stripe_port,
+                                              stripes_count_recv);
+                    if (!stripes)
+                        break;
+                }
+                file_input_free(file_input);
+                file_input = NULL;
+                if (!stripes_start_sending(stripes, stdout_fd,
+                                           data_protocol_version))
+                    handle_vchan_error("stripes");
+                stripes_in_fd = stdout_fd;
+                stdout_fd = -1;
+                if (!flush_stdin_buf(stdin_fd, stdin_buf)) {
+                    close_stdin(stdin_fd, !use_stdio_socket);
+                    stdin_fd = -1;
+                }
+                if (!stripes_start_receiving(stripes, stdin_fd,
+                                             replace_chars_stdout > 0,
+                                             data_protocol_version))
+                    handle_vchan_error("stripes");
+                stripes_out_fd = stdin_fd;
+                stdin_fd = -1;
+                break;
             case REMOTE_EOF:
                 close_stdin(stdin_fd, !use_stdio_socket);
                 stdin_fd = -1;
@@ -287,6 +405,16 @@ int process_io(const struct process_io_request *req) {
                  * local FDs. However, don't exit yet, because there might
                  * still be some data in stdin_buf waiting to be flushed.
                  */
+                if (stripes_pending) {
+                    /* no reply coming */
+                    stripes_pending = false;
+                    stripes_free(stripes);
+                    stripes = NULL;
+                }
+                if (stripes_in_fd >= 0)
+                    stripes_stop_sending(stripes);
+                file_input_free(file_input);
+                file_input = NULL;
                 close_stdout(stdout_fd, !use_stdio_socket);
                 stdout_fd = -1;
                 close_stderr(stderr_fd);
@@ -294,13 +422,20 @@ int process_io(const struct process_io_request *req) {
                 break;
         }
         if (stdout_fd >= 0 && fds[FD_STDOUT].revents) {
-            switch (handle_input(
+            switch (file_input ?
+                    handle_file_input(
+                        vchan, file_input, stdout_msg_type,
+                        data_protocol_version, req->max_chunk) :
+                    handle_input(
                         vchan, stdout_fd, stdout_msg_type,
-                        data_protocol_version)) {
+                        data_protocol_version, req->max_chunk,
+                        compressor)) {
                 case REMOTE_ERROR:
                     handle_vchan_error("send(handle_input stdout)");
                     break;
                 case REMOTE_EOF:
+                    file_input_free(file_input);
+                    file_input = NULL;
                     close_stdout(stdout_fd, !use_stdio_socket);
                     stdout_fd = -1;
                     break;
@@ -309,7 +444,8 @@ int process_io(const struct process_io_request *req) {
         if (stderr_fd >= 0 && fds[FD_STDERR].revents) {
             switch (handle_input(
                         vchan, stderr_fd, MSG_DATA_STDERR,
-                        data_protocol_version)) {
+                        data_protocol_version, req->max_chunk,
+                        compressor)) {
                 case REMOTE_ERROR:
                     handle_vchan_error("send(handle_input stderr)");
                     break;
@@ -323,8 +459,14 @@ int process_io(const struct process_io_request *req) {
     /* make sure that all the pipes/sockets are closed, so the child process
      * (if any) will know that the connection is terminated */
     close_stdin(stdin_fd, true);
+    file_input_free(file_input);
     close_stdout(stdout_fd, true);
     close_stderr(stderr_fd);
+    compressor_free(compressor);
+    /* a service's stdin is done only when the peer sends nothing more */
+    stripes_free(stripes);
+    close_stdin(stripes_out_fd, !use_stdio_socket);
+    close_stdout(stripes_in_fd, !use_stdio_socket);
 
     /* wait for local process, in case we exited early */
     if (local_pid && local_status < 0) {
@@ -342,3 +484,425 @@ int process_io(const struct process_io_request *req) {
         return remote_status;
     return local_pid ? local_status : 0;
 }
+
+/*
+ * Multiplexed data connection (see struct stream_header in qrexec.h). Each
+ * stream is one process, handled like in process_io() with is_service set.
+ */
+
+struct mux_stream {
+    uint32_t id;
+    pid_t pid;
+    /* exit status, -1 while running */
+    int status;
+    int stdin_fd, stdout_fd, stderr_fd;
+    /* MSG_DATA_STDIN not written yet */
+    struct buffer stdin_buf;
+    bool stdin_eof;
+    /* MSG_DATA_STDIN received, but not credited back yet */
+    uint32_t recv_unacked;
+    /* how much more stdout and stderr can be sent */
+    uint32_t send_credit;
+    /* the process could not be started */
+    bool failed;
+    struct mux_stream *next;
+};
+
+struct mux {
+    libvchan_t *vchan;
+    int data_protocol_version;
+    bool strip_username;
+    struct mux_stream *streams;
+    int nstreams;
+};
+
+static struct mux_stream *mux_find(struct mux *mux, uint32_t id)
+{
+    struct mux_stream *s;
+
+    for (s = mux->streams; s; s = s->next)
+        if (s->id == id)
+            return s;
+    return NULL;
+}
+
+static bool mux_space(struct mux *mux, size_t len)
+{
+    return libvchan_buffer_space(mux->vchan) >=
+        (int)(sizeof(struct stream_header) + len);
+}
+
+static void mux_send(struct mux *mux, uint32_t type, uint32_t stream,
+                     const void *data, uint32_t len)
+{
+    if (send_stream_msg(mux->vchan, type, stream, data, len) < 0)
+        handle_vchan_error("send");
+}
+
+static void mux_close_stdin(struct mux_stream *s)
+{
+    close_stdin(s->stdin_fd, true);
+    s->stdin_fd = -1;
+    /* nobody will read it, but it still counts as consumed */
+    buffer_remove(&s->stdin_buf, buffer_len(&s->stdin_buf));
+}
+
+static void mux_start(struct mux *mux, uint32_t id, char *cmdline)
+{
+    struct mux_stream *s;
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        PERROR("calloc");
+        exit(1);
+    }
+    s->id = id;
+    s->status = -1;
+    s->send_credit = STREAM_WINDOW;
+    buffer_init(&s->stdin_buf);
+    s->next = mux->streams;
+    mux->streams = s;
+    mux->nstreams++;
+    if (execute_qubes_rpc_command(cmdline, &s->pid, &s->stdin_fd,
+                                  &s->stdout_fd, &s->stderr_fd,
+                                  mux->strip_username, &s->stdin_buf) < 0) {
+        LOG(ERROR, "failed to spawn process");
+        /* mux_update() sends the EOFs and exit code */
+        s->failed = true;
+        s->pid = 0;
+        s->stdin_fd = s->stdout_fd = s->stderr_fd = -1;
+        buffer_remove(&s->stdin_buf, buffer_len(&s->stdin_buf));
+        return;
+    }
+    LOG(INFO, "executed: %s (pid %d, stream %" PRIu32 ")", cmdline, s->pid, id);
+
+    set_nonblock(s->stdin_fd);
+    if (s->stdout_fd != s->stdin_fd)
+        set_nonblock(s->stdout_fd);
+    else if ((s->stdout_fd = fcntl(s->stdin_fd, F_DUPFD_CLOEXEC, 3)) < 0)
+        abort(); // not worth handling running out of file descriptors
+    if (s->stderr_fd >= 0)
+        set_nonblock(s->stderr_fd);
+}
+
+/* read from stdout or stderr of a stream, within its credit */
+static void mux_send_output(struct mux *mux, struct mux_stream *s, int *fd,
+                            uint32_t type, char *buf)
+{
+    ssize_t len = libvchan_buffer_space(mux->vchan) -
+        (ssize_t)sizeof(struct stream_header);
+
+    if (len <= 0)
+        return;
+    if ((size_t)len > max_data_chunk_size(mux->data_protocol_version))
+        len = max_data_chunk_size(mux->data_protocol_version);
+    if ((size_t)len > s->send_credit)
+        len = s->send_credit;
+    len = read(*fd, buf, len);
+    if (len < 0 && errno == ECONNRESET)
+        len = 0;
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            PERROR("read");
+            len = 0;
+        } else
+            return;
+    }
+    mux_send(mux, type, s->id, buf, len);
+    s->send_credit -= len;
+    if (len == 0) {
+        if (type == MSG_DATA_STDOUT)
+            close_stdout(*fd, true);
+        else
+            close_stderr(*fd);
+        *fd = -1;
+    }
+}
+
+static void mux_recv_stdin(struct mux_stream *s, const char *data, uint32_t len)
+{
+    if (len > STREAM_WINDOW - s->recv_unacked) {
+        LOG(ERROR, "Stream %" PRIu32 " window exceeded", s->id);
+        exit(1);
+    }
+    s->recv_unacked += len;
+    if (len == 0) {
+        s->stdin_eof = true;
+        return;
+    }
+    if (s->stdin_fd < 0)
+        /* discard the data */
+        return;
+    if (write_stdin(s->stdin_fd, data, len, &s->stdin_buf) ==
+            WRITE_STDIN_ERROR) {
+        if (!(errno == EPIPE || errno == ECONNRESET))
+            PERROR("write");
+        mux_close_stdin(s);
+    }
+}
+
+/* process all complete messages from vchan */
+static void mux_recv(struct mux *mux, char **buf, size_t *buf_size)
+{
+    size_t max_len = max_data_chunk_size(mux->data_protocol_version);
+    struct stream_header hdr;
+    struct mux_stream *s;
+    uint32_t credit;
+
+    if (max_len < MAX_QREXEC_CMD_LEN)
+        max_len = MAX_QREXEC_CMD_LEN;
+    while (libvchan_data_ready(mux->vchan) >= (int)sizeof(hdr)) {
+        if (libvchan_recv(mux->vchan, &hdr, sizeof(hdr)) != sizeof(hdr))
+            handle_vchan_error("read");
+        if (hdr.len > max_len) {
+            LOG(ERROR, "Too big message received: %" PRIu32 " > %zu",
+                hdr.len, max_len);
+            exit(1);
+        }
+        if (hdr.len >= *buf_size) {
+            char *new_buf = realloc(*buf, hdr.len + 1);
+
+            if (!new_buf) {
+                PERROR("realloc");
+                exit(1);
+            }
+            *buf = new_buf;
+            *buf_size = hdr.len + 1;
+        }
+        if (!read_vchan_all(mux->vchan, *buf, hdr.len))
+            handle_vchan_error("read");
+
+        s = mux_find(mux, hdr.stream);
+        switch (hdr.type) {
+            case MSG_DATA_EXEC_CMDLINE:
+                if (s || hdr.len == 0) {
+                    LOG(ERROR, "Invalid command for stream %" PRIu32,
+                        hdr.stream);
+                    exit(1);
+                }
+                (*buf)[hdr.len] = '\0';
+                mux_start(mux, hdr.stream, *buf);
+                break;
+            case MSG_DATA_STDIN:
+                if (s)
+                    mux_recv_stdin(s, *buf, hdr.len);
+                break;
+            case MSG_DATA_CREDIT:
+                if (hdr.len != sizeof(credit)) {
+                    LOG(ERROR, "Invalid MSG_DATA_CREDIT");
+                    exit(1);
+                }
+                memcpy(&credit, *buf, sizeof(credit));
+                if (!s)
+                    break;
+                if (credit > STREAM_WINDOW - s->send_credit) {
+                    LOG(ERROR, "Stream %" PRIu32 " credit exceeded", s->id);
+                    exit(1);
+                }
+                s->send_credit += credit;
+                break;
+            default:
+                LOG(ERROR, "unknown msg %" PRIu32 " on stream %" PRIu32,
+                    hdr.type, hdr.stream);
+                exit(1);
+        }
+    }
+}
+
+/* Credit back consumed stdin, and send the exit code when done. Returns false
+ * if the stream has ended. */
+static bool mux_update(struct mux *mux, struct mux_stream *s)
+{
+    uint32_t consumed, status;
+
+    if (s->stdin_fd >= 0 && s->stdin_eof && !buffer_len(&s->stdin_buf))
+        mux_close_stdin(s);
+
+    consumed = s->recv_unacked;
+    if ((uint32_t)buffer_len(&s->stdin_buf) < consumed)
+        consumed -= buffer_len(&s->stdin_buf);
+    else
+        consumed = 0;
+    /* half the window, so that the peer does not have to wait */
+    if (consumed >= STREAM_WINDOW / 2 && mux_space(mux, sizeof(consumed))) {
+        mux_send(mux, MSG_DATA_CREDIT, s->id, &consumed, sizeof(consumed));
+        s->recv_unacked -= consumed;
+    }
+
+    if (s->stdin_fd != -1 || s->stdout_fd != -1 || s->stderr_fd != -1 ||
+            (s->pid && s->status < 0))
+        return true;
+    if (s->failed) {
+        /* as in handle_exec_cmdline(): stdout and stderr EOF first */
+        if (!mux_space(mux, 2 * sizeof(struct stream_header) + sizeof(status)))
+            return true;
+        mux_send(mux, MSG_DATA_STDOUT, s->id, NULL, 0);
+        mux_send(mux, MSG_DATA_STDERR, s->id, NULL, 0);
+        status = 127;
+    } else {
+        if (!mux_space(mux, sizeof(status)))
+            return true;
+        status = s->pid ? s->status : 0;
+        LOG(INFO, "pid %d exited with %d", s->pid, status);
+    }
+    mux_send(mux, MSG_DATA_EXIT_CODE, s->id, &status, sizeof(status));
+    return false;
+}
+
+static void mux_reap(struct mux *mux)
+{
+    struct mux_stream *s;
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (s = mux->streams; s; s = s->next)
+            if (s->pid == pid)
+                break;
+        if (!s)
+            continue;
+        if (WIFSIGNALED(status))
+            s->status = 128 + WTERMSIG(status);
+        else
+            s->status = WEXITSTATUS(status);
+        if (s->stdin_fd >= 0)
+            mux_close_stdin(s);
+    }
+}
+
+int process_io_mux(const struct process_io_mux_request *req)
+{
+    struct mux mux = {
+        .vchan = req->vchan,
+        .data_protocol_version = req->data_protocol_version,
+        .strip_username = req->strip_username,
+    };
+    volatile sig_atomic_t *sigchld = req->sigchld;
+    struct mux_stream *s, **sp;
+    struct pollfd *fds = NULL;
+    struct mux_stream **fd_streams = NULL;
+    size_t fds_size = 0, nfds, i;
+    char *buf, *recv_buf = NULL;
+    size_t recv_buf_size = 0;
+    sigset_t pollmask;
+    struct timespec zero_timeout = { 0, 0 };
+    bool space;
+    int ret;
+
+    buf = malloc(max_data_chunk_size(mux.data_protocol_version));
+    if (!buf) {
+        PERROR("malloc");
+        exit(1);
+    }
+
+    sigemptyset(&pollmask);
+    sigaddset(&pollmask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &pollmask, NULL);
+    sigemptyset(&pollmask);
+
+    for (;;) {
+        if (*sigchld) {
+            *sigchld = 0;
+            mux_reap(&mux);
+        }
+
+        for (sp = &mux.streams; (s = *sp); ) {
+            if (mux_update(&mux, s)) {
+                sp = &s->next;
+                continue;
+            }
+            *sp = s->next;
+            mux.nstreams--;
+            buffer_free(&s->stdin_buf);
+            free(s);
+        }
+
+        /* check libvchan_is_open() first, see process_io() */
+        if (!libvchan_is_open(mux.vchan) && !libvchan_data_ready(mux.vchan))
+            break;
+
+        if (fds_size < 1 + 3 * (size_t)mux.nstreams) {
+            fds_size = 1 + 3 * (size_t)mux.nstreams;
+            fds = realloc(fds, fds_size * sizeof(*fds));
+            fd_streams = realloc(fd_streams, fds_size * sizeof(*fd_streams));
+            if (!fds || !fd_streams) {
+                PERROR("realloc");
+                exit(1);
+            }
+        }
+        fds[0].fd = libvchan_fd_for_select(mux.vchan);
+        fds[0].events = POLLIN;
+        nfds = 1;
+        space = libvchan_buffer_space(mux.vchan) >
+            (int)sizeof(struct stream_header);
+        for (s = mux.streams; s; s = s->next) {
+            if (s->stdin_fd >= 0) {
+                fd_streams[nfds] = s;
+                fds[nfds].fd = s->stdin_fd;
+                /* if no data to be written, still monitor for stdin close */
+                fds[nfds++].events = buffer_len(&s->stdin_buf) ? POLLOUT : 0;
+            }
+            if (!space || !s->send_credit)
+                continue;
+            if (s->stdout_fd >= 0) {
+                fd_streams[nfds] = s;
+                fds[nfds].fd = s->stdout_fd;
+                fds[nfds++].events = POLLIN;
+            }
+            if (s->stderr_fd >= 0) {
+                fd_streams[nfds] = s;
+                fds[nfds].fd = s->stderr_fd;
+                fds[nfds++].events = POLLIN;
+            }
+        }
+
+        ret = ppoll(fds, nfds, libvchan_data_ready(mux.vchan) > 0 ?
+                    &zero_timeout : NULL, &pollmask);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            PERROR("poll");
+            exit(1);
+        }
+
+        /* clear event pending flag */
+        if (fds[0].revents && libvchan_wait(mux.vchan) < 0)
+            handle_vchan_error("wait");
+
+        for (i = 1; i < nfds; i++) {
+            s = fd_streams[i];
+            if (!fds[i].revents)
+                continue;
+            if (fds[i].fd == s->stdin_fd) {
+                if (fds[i].revents & (POLLHUP | POLLERR) ||
+                        flush_client_data(s->stdin_fd, &s->stdin_buf) ==
+                        WRITE_STDIN_ERROR)
+                    mux_close_stdin(s);
+            } else if (fds[i].fd == s->stdout_fd) {
+                mux_send_output(&mux, s, &s->stdout_fd, MSG_DATA_STDOUT, buf);
+            } else if (fds[i].fd == s->stderr_fd) {
+                mux_send_output(&mux, s, &s->stderr_fd, MSG_DATA_STDERR, buf);
+            }
+        }
+
+        mux_recv(&mux, &recv_buf, &recv_buf_size);
+    }
+
+    /* make sure that all the pipes/sockets are closed, so the processes will
+     * know that the connection is terminated, and wait for them */
+    while ((s = mux.streams)) {
+        mux.streams = s->next;
+        close_stdin(s->stdin_fd, true);
+        close_stdout(s->stdout_fd, true);
+        close_stderr(s->stderr_fd);
+        if (s->pid && s->status < 0 && waitpid(s->pid, NULL, 0) < 0)
+            PERROR("waitpid");
+        buffer_free(&s->stdin_buf);
+        free(s);
+    }
+    free(fds);
+    free(fd_streams);
+    free(recv_buf);
+    free(buf);
+    return 0;
+}
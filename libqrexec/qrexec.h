@@ -29,12 +29,15 @@
 
 #include <stdint.h>
 
-#define QREXEC_PROTOCOL_VERSION 3
+#define QREXEC_PROTOCOL_VERSION 11
 #define MAX_FDS 256
 /* protocol version 2 */
 #define MAX_DATA_CHUNK_V2 4096
 /* protocol version 3+ */
 #define MAX_DATA_CHUNK_V3 65536
+/* protocol version 6+; a chunk must also fit in the vchan buffer, so this
+ * matters only with a larger one (see --buffer-size) */
+#define MAX_DATA_CHUNK_V6 (1024 * 1024)
 
 /* large, but arbitrary; make it fit in vchan buffer (64k), together with
  * message header */
@@ -67,6 +70,46 @@ enum {
      * Qubes >= R4.1
      */
     QREXEC_PROTOCOL_V3 = 3,
+
+    /* Changes:
+     *  - MSG_CONNECTION_SYNC after re-establishing the control channel
+     */
+    QREXEC_PROTOCOL_V4 = 4,
+
+    /* Changes:
+     *  - initial stdin passed in MSG_EXEC_CMDLINE (struct exec_stdin_params)
+     */
+    QREXEC_PROTOCOL_V5 = 5,
+
+    /* Changes:
+     *  - MAX_DATA_CHUNK increased to 1M
+     */
+    QREXEC_PROTOCOL_V6 = 6,
+
+    /* Changes:
+     *  - multiplexed data connections (MSG_DATA_MUX)
+     */
+    QREXEC_PROTOCOL_V7 = 7,
+
+    /* Changes:
+     *  - compressed data messages (MSG_DATA_COMPRESSED)
+     */
+    QREXEC_PROTOCOL_V8 = 8,
+
+    /* Changes:
+     *  - striped data connections (MSG_DATA_STRIPES)
+     */
+    QREXEC_PROTOCOL_V9 = 9,
+
+    /* Changes:
+     *  - MSG_JUST_EXEC_NO_DATA and MSG_EXEC_STATUS
+     */
+    QREXEC_PROTOCOL_V10 = 10,
+
+    /* Changes:
+     *  - MSG_DATA_CACHE_TTL
+     */
+    QREXEC_PROTOCOL_V11 = 11,
 };
 
 /* Messages sent over control vchan between daemon(dom0) and agent(vm).
@@ -92,6 +135,12 @@ enum {
      * refused */
     MSG_SERVICE_REFUSED,
 
+    /* (protocol 10+) start process in VM like MSG_JUST_EXEC, but without a
+     * data connection: connect_port in struct exec_params only identifies the
+     * call, and the outcome is reported with MSG_EXEC_STATUS, see struct
+     * just_exec_params; also client->daemon */
+    MSG_JUST_EXEC_NO_DATA,
+
     /* agent->daemon messages */
     /* call Qubes RPC service (protocol 2)
      * struct trigger_service_params passed as data */
@@ -107,10 +156,28 @@ enum {
      * struct trigger_service_params3 passed as data */
     MSG_TRIGGER_SERVICE3,
 
+    /* (protocol 10+) outcome of MSG_JUST_EXEC_NO_DATA, struct exec_status
+     * passed as data; also daemon->client */
+    MSG_EXEC_STATUS,
+
+    /* client->daemon messages (local socket only) */
+    /* keep the connection open for more requests: MSG_EXEC_CMDLINE,
+     * MSG_JUST_EXEC and MSG_SERVICE_CONNECT can be sent repeatedly, and are
+     * answered as usual; instead of closing the connection when a data
+     * connection ends, the daemon sends MSG_CONNECTION_TERMINATED for it; no
+     * data */
+    MSG_SESSION_START = 0x280,
+
     /* common messages */
     /* initialize connection, struct peer_info passed as data
      * should be sent as the first message (server first, then client) */
     MSG_HELLO = 0x300,
+
+    /* control channel only (protocol 4+): resume the connection after
+     * reconnecting, struct connection_sync passed as data; sent right after
+     * MSG_HELLO by a peer that was connected before, and in reply by the
+     * other one */
+    MSG_CONNECTION_SYNC,
 };
 
 /* uniform for all peers, data type depends on message type */
@@ -146,6 +213,82 @@ struct peer_info {
     uint32_t version; /* qrexec protocol version */
 };
 
+/* MSG_EXEC_CMDLINE and MSG_JUST_EXEC sent to the agent, for a data
+ * connection with dom0, have struct peer_info (of the dom0 side) appended
+ * after the terminating null byte of cmdline. The agent then knows the data
+ * protocol version up front, and can start the process without waiting for
+ * MSG_HELLO on the data vchan (it is still sent, and checked when it
+ * arrives). Older agents ignore it. */
+
+/* MSG_EXEC_CMDLINE for a data connection with dom0 can also carry the first
+ * part of the process' stdin, so that a small request does not have to wait
+ * for the data connection. The client appends struct exec_stdin_params and
+ * the data after the terminating null byte of cmdline, and qrexec-daemon
+ * inserts struct peer_info before it. The agent feeds it to the process before
+ * anything received over the data vchan. An agent (or fork server) older than
+ * protocol 5 ignores it, so if the data protocol version turns out to be
+ * lower, the client sends the data over the data vchan as usual. */
+struct exec_stdin_params {
+    uint32_t flags;           /* EXEC_STDIN_* */
+    uint32_t len;             /* data length, at most MAX_EXEC_STDIN_LEN */
+    // char data[len];
+};
+
+/* there is no more stdin after the data */
+#define EXEC_STDIN_EOF 1
+/* small, as it goes over the control channel, shared by all calls */
+#define MAX_EXEC_STDIN_LEN 4096
+
+/* MSG_JUST_EXEC_NO_DATA may have struct just_exec_params appended after the
+ * terminating null byte of cmdline. The agent sends MSG_EXEC_STATUS once the
+ * process is started (or failed to start), then, with JUST_EXEC_NOTIFY_EXIT,
+ * another one with EXEC_STATUS_EXITED when it exits, and then
+ * MSG_CONNECTION_TERMINATED for the port, as for any other call.
+ *
+ * qrexec-daemon passes MSG_JUST_EXEC_NO_DATA on to an agent older than
+ * protocol 10 as MSG_JUST_EXEC (without the flags), and answers the client
+ * with MSG_JUST_EXEC, so that it serves the data connection as usual. */
+struct just_exec_params {
+    uint32_t flags;           /* JUST_EXEC_* */
+};
+
+/* report when the process exits, with its exit code */
+#define JUST_EXEC_NOTIFY_EXIT 1
+
+struct exec_status {
+    uint32_t connect_domain;  /* as in the request */
+    uint32_t connect_port;
+    uint32_t flags;           /* EXEC_STATUS_* */
+    /* 0 if the process was started, else what MSG_DATA_EXIT_CODE would
+     * report for MSG_JUST_EXEC; with EXEC_STATUS_EXITED, the exit code */
+    int32_t status;
+};
+
+/* the process has exited */
+#define EXEC_STATUS_EXITED 1
+
+/* flags for struct connection_sync */
+/* the sender has not been connected before (e.g. it was restarted), so
+ * nothing can be resumed */
+#define CONNECTION_SYNC_FRESH 1
+/* the list of vchan ports in use is not included */
+#define CONNECTION_SYNC_NO_PORTS 2
+
+struct connection_sync_port {
+    uint32_t connect_domain;
+    uint32_t connect_port;
+};
+
+struct connection_sync {
+    uint32_t flags;
+    uint32_t nports;
+    /* number of bytes received from the peer so far (not counting MSG_HELLO
+     * and MSG_CONNECTION_SYNC); the peer sends the rest again */
+    uint64_t rx_bytes;
+    /* agent only: vchan ports in use by running connections */
+    // struct connection_sync_port ports[nports];
+};
+
 /* data vchan client<->agent, separate for each VM process */
 enum {
     /* stdin dom0->VM */
@@ -156,8 +299,92 @@ enum {
     MSG_DATA_STDERR,
     /* VM process exit code VM->dom0 (uint32_t) */
     MSG_DATA_EXIT_CODE,
+    /* VM->dom0, after MSG_DATA_EXIT_CODE: the connection will be kept open
+     * for reuse for this many milliseconds (uint32_t); only sent to dom0, if
+     * enabled in qrexec-agent */
+    MSG_DATA_IDLE,
+    /* dom0->VM, on a connection after MSG_DATA_IDLE: start another process,
+     * command line (as for MSG_EXEC_CMDLINE, null terminated) passed as data;
+     * the call then goes on as usual, without another MSG_HELLO */
+    MSG_DATA_EXEC_CMDLINE,
+    /* dom0->VM (protocol 7+), on a connection after MSG_DATA_IDLE: from now
+     * on, the connection carries any number of concurrent processes (streams),
+     * see struct stream_header; no data */
+    MSG_DATA_MUX,
+    /* stream only, both directions: the receiver has consumed this many more
+     * bytes (uint32_t) of the stream's data, see STREAM_WINDOW */
+    MSG_DATA_CREDIT,
+    /* both directions (protocol 8+, not on a multiplexed connection):
+     * MSG_DATA_STDIN, MSG_DATA_STDOUT or MSG_DATA_STDERR with the data
+     * compressed, struct compressed_params passed as data */
+    MSG_DATA_COMPRESSED,
+    /* both directions (protocol 9+, not on a multiplexed connection):
+     * struct stripes_params, see there */
+    MSG_DATA_STRIPES,
+    /* VM->dom0 or VM->VM (protocol 11+, not on a multiplexed connection),
+     * before any output: the service has cache-ttl set in its config, so
+     * its output and exit code may be reused for identical calls (same
+     * target, command and stdin) for this many seconds (uint32_t) */
+    MSG_DATA_CACHE_TTL,
+};
+
+/* Data compressed with zlib (RFC 1950) follows. It is sent only if the
+ * sender has compression enabled for the call, and only if it is shorter
+ * than the data itself, so the message is never longer than the data chunk
+ * limit. The receiver rejects data that does not decompress to exactly len
+ * bytes. */
+struct compressed_params {
+    uint32_t type; /* MSG_DATA_STDIN, MSG_DATA_STDOUT or MSG_DATA_STDERR */
+    uint32_t len;  /* length after decompression, 1 to max data chunk */
+    // char data[];
+};
+
+/* Striped data connection: the vchan server of a data connection sends
+ * MSG_DATA_STRIPES (before any data) to ask for count more vchans in each
+ * direction, on ports VCHAN_STRIPE_PORT(port, i), where port is the data
+ * connection's own port. Stripes 0 to count-1 carry data from the vchan
+ * server, the others data to it. The vchan client connects them and replies
+ * with MSG_DATA_STRIPES with the same count, or with 0 to go on without them.
+ *
+ * After the reply (and only after, in each direction) all MSG_DATA_STDIN and
+ * MSG_DATA_STDOUT data goes over the stripes instead, as struct
+ * stripe_header and data, with the chunks spread over the stripes in any
+ * order. A stripe ends with len 0; the data ends (EOF) when all stripes in
+ * that direction have ended. Everything else stays on the data connection. */
+struct stripes_params {
+    uint32_t count; /* 1 to MAX_STRIPES, or 0 in a reply */
 };
 
+struct stripe_header {
+    uint32_t seq; /* chunk number, counted over all stripes in a direction */
+    uint32_t len; /* at most the max data chunk size; 0 = end of the stripe */
+    // char data[];
+};
+
+#define MAX_STRIPES 16
+/* Above the ports used by qrexec-daemon for data connections */
+#define VCHAN_STRIPE_PORT(port, i) (((port) << 5) | (i))
+
+/* Multiplexed data connection (after MSG_DATA_MUX): each message is struct
+ * stream_header followed by data. dom0 starts a process with
+ * MSG_DATA_EXEC_CMDLINE on an unused stream id, then MSG_DATA_STDIN,
+ * MSG_DATA_STDOUT, MSG_DATA_STDERR and MSG_DATA_EXIT_CODE go as on a separate
+ * connection; the stream ends with MSG_DATA_EXIT_CODE, and its id is not used
+ * again. Messages for an unknown stream are ignored.
+ *
+ * So that a process that does not read its input, or a caller that does not
+ * read the output, cannot block the other streams on the shared vchan, the
+ * receiver always drains the vchan, and the sender of MSG_DATA_STDIN (or
+ * MSG_DATA_STDOUT and MSG_DATA_STDERR together) has at most STREAM_WINDOW
+ * bytes not yet confirmed with MSG_DATA_CREDIT, per stream. */
+struct stream_header {
+    uint32_t type;   /* MSG_DATA_* */
+    uint32_t len;    /* data length */
+    uint32_t stream; /* stream id, chosen by dom0 */
+};
+
+#define STREAM_WINDOW 65536
+
 // linux-specific stuff below
 
 #define QREXEC_AGENT_TRIGGER_PATH "/var/run/qubes/qrexec-agent"
@@ -170,6 +397,8 @@ enum {
 
 // directory for services configuration (for example 'wait-for-session' flag)
 #define QUBES_RPC_CONFIG_PATH "/etc/qubes/rpc-config"
+// where the cgroup v2 hierarchy is mounted, for the 'cgroup' option
+#define QREXEC_CGROUP_ROOT "/sys/fs/cgroup"
 // support only very small configuration files,
 #define MAX_CONFIG_SIZE 4096
 
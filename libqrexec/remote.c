@@ -34,11 +34,19 @@
 int handle_remote_data(
     libvchan_t *data_vchan, int stdin_fd, int *status,
     struct buffer *stdin_buf, int data_protocol_version,
-    bool replace_chars_stdout, bool replace_chars_stderr)
+    bool replace_chars_stdout, bool replace_chars_stderr,
+    uint32_t *stripes, bool *hello_pending)
 {
+    bool hello_allowed;
     struct msg_header hdr;
+    struct peer_info info;
+    struct compressed_params params;
+    struct stripes_params stripes_params;
     const size_t max_len = max_data_chunk_size(data_protocol_version);
-    char *buf;
+    char *buf = NULL, *data;
+    size_t buf_size = 0;
+    char *zbuf = NULL;
+    size_t zbuf_size = 0;
     int rc = REMOTE_ERROR;
 
     /* do not receive any data if we have something already buffered */
@@ -52,12 +60,6 @@ int handle_remote_data(
             return REMOTE_EOF;
     }
 
-    buf = malloc(max_len);
-    if (!buf) {
-        PERROR("malloc");
-        return REMOTE_ERROR;
-    }
-
     while (libvchan_data_ready(data_vchan) > 0) {
         if (libvchan_recv(data_vchan, &hdr, sizeof(hdr)) < 0)
             goto out;
@@ -66,8 +68,35 @@ int handle_remote_data(
                 hdr.len, max_len);
             goto out;
         }
+        /* sized for the actual chunks, max_len can be large */
+        if (hdr.len > buf_size) {
+            char *new_buf = realloc(buf, hdr.len);
+
+            if (!new_buf) {
+                PERROR("realloc");
+                goto out;
+            }
+            buf = new_buf;
+            buf_size = hdr.len;
+        }
         if (!read_vchan_all(data_vchan, buf, hdr.len))
             goto out;
+        data = buf;
+
+        if (hdr.type == MSG_DATA_COMPRESSED &&
+                data_protocol_version >= QREXEC_PROTOCOL_V8) {
+            if (!decompress_data(buf, hdr.len, max_len, &params,
+                                 &zbuf, &zbuf_size))
+                goto out;
+            hdr.type = params.type;
+            hdr.len = params.len;
+            data = zbuf;
+        }
+
+        /* only before anything else */
+        hello_allowed = hello_pending && *hello_pending;
+        if (hello_pending)
+            *hello_pending = false;
 
         switch (hdr.type) {
             /* handle both directions because this can be either server or client
@@ -82,8 +111,8 @@ int handle_remote_data(
                     goto out;
                 } else {
                     if (replace_chars_stdout)
-                        do_replace_chars(buf, hdr.len);
-                    switch (write_stdin(stdin_fd, buf, hdr.len, stdin_buf)) {
+                        do_replace_chars(data, hdr.len);
+                    switch (write_stdin(stdin_fd, data, hdr.len, stdin_buf)) {
                         case WRITE_STDIN_OK:
                             break;
                         case WRITE_STDIN_BUFFERED:
@@ -100,13 +129,33 @@ int handle_remote_data(
                 break;
             case MSG_DATA_STDERR:
                 if (replace_chars_stderr)
-                    do_replace_chars(buf, hdr.len);
+                    do_replace_chars(data, hdr.len);
                 /* stderr of remote service, log locally */
-                if (!write_all(2, buf, hdr.len)) {
+                if (!write_all(2, data, hdr.len)) {
                     PERROR("write");
                     /* only log the error */
                 }
                 break;
+            case MSG_HELLO:
+                /* Sent before any data. Only here if the protocol version was
+                 * known up front (see struct peer_info in qrexec.h), so just
+                 * check that it matches. */
+                if (!hello_allowed)
+                    goto unknown;
+                if (hdr.len != sizeof(info)) {
+                    LOG(ERROR, "Invalid HELLO packet received: len %" PRIu32,
+                        hdr.len);
+                    goto out;
+                }
+                memcpy(&info, buf, sizeof(info));
+                if ((info.version < QREXEC_PROTOCOL_VERSION ?
+                            (int)info.version : QREXEC_PROTOCOL_VERSION) !=
+                        data_protocol_version) {
+                    LOG(ERROR, "Unexpected remote protocol version %" PRIu32,
+                        info.version);
+                    goto out;
+                }
+                break;
             case MSG_DATA_EXIT_CODE:
                 /* remote process exited, so there is no sense to send any data
                  * to it */
@@ -118,7 +167,24 @@ int handle_remote_data(
                     memcpy(status, buf, sizeof(*status));
                 rc = REMOTE_EXITED;
                 goto out;
+            case MSG_DATA_STRIPES:
+                if (!stripes || data_protocol_version < QREXEC_PROTOCOL_V9)
+                    goto unknown;
+                if (hdr.len != sizeof(stripes_params)) {
+                    LOG(ERROR, "Invalid MSG_DATA_STRIPES: len %" PRIu32, hdr.len);
+                    goto out;
+                }
+                memcpy(&stripes_params, buf, sizeof(stripes_params));
+                *stripes = stripes_params.count;
+                rc = REMOTE_STRIPES;
+                goto out;
+            case MSG_DATA_CACHE_TTL:
+                /* only of use to a caller that keeps a cache (see cache.c) */
+                if (data_protocol_version < QREXEC_PROTOCOL_V11)
+                    goto unknown;
+                break;
             default:
+            unknown:
                 LOG(ERROR, "unknown msg %d", hdr.type);
                 rc = REMOTE_ERROR;
                 goto out;
@@ -127,22 +193,40 @@ int handle_remote_data(
     rc = REMOTE_OK;
 out:
     free(buf);
+    free(zbuf);
     return rc;
 }
 
 int handle_input(
     libvchan_t *vchan, int fd, int msg_type,
-    int data_protocol_version)
+    int data_protocol_version, size_t max_chunk,
+    struct compressor *compressor)
 {
-    const size_t max_len = max_data_chunk_size(data_protocol_version);
-    char *buf;
+    size_t max_len = max_data_chunk_size(data_protocol_version);
+    char *buf, *zbuf = NULL;
     ssize_t len;
+    size_t zlen;
     struct msg_header hdr;
+    struct compressed_params params = { .type = msg_type };
     int rc = REMOTE_ERROR;
 
+    if (max_chunk > 0 && max_chunk < max_len)
+        max_len = max_chunk;
+    /* no chunk can be bigger than the vchan buffer */
+    len = libvchan_buffer_space(vchan) - (ssize_t)sizeof(struct msg_header);
+    if (len <= 0)
+        return REMOTE_OK;
+    if ((size_t)len < max_len)
+        max_len = len;
     buf = malloc(max_len);
-    if (!buf) {
+    if (compressor && data_protocol_version >= QREXEC_PROTOCOL_V8)
+        zbuf = malloc(max_len);
+    else
+        compressor = NULL;
+    if (!buf || (compressor && !zbuf)) {
         PERROR("malloc");
+        free(buf);
+        free(zbuf);
         return REMOTE_ERROR;
     }
 
@@ -164,6 +248,19 @@ int handle_input(
             /* otherwise keep rc = REMOTE_ERROR */
             goto out;
         }
+        if (compressor && len > 0 &&
+                (zlen = compress_data(compressor, buf, len, zbuf)) > 0) {
+            /* shorter than the data, so it fits */
+            hdr.type = MSG_DATA_COMPRESSED;
+            hdr.len = sizeof(params) + zlen;
+            params.len = len;
+            if (libvchan_send(vchan, &hdr, sizeof(hdr)) < 0 ||
+                    libvchan_send(vchan, &params, sizeof(params)) < 0 ||
+                    !write_vchan_all(vchan, zbuf, zlen))
+                goto out;
+            hdr.type = msg_type;
+            continue;
+        }
         hdr.len = (uint32_t)len;
         /* do not fail on sending EOF (think: close()), it will be handled just below */
         if (libvchan_send(vchan, &hdr, sizeof(hdr)) < 0 && hdr.len != 0)
@@ -180,6 +277,7 @@ int handle_input(
     rc = REMOTE_OK;
 out:
     free(buf);
+    free(zbuf);
     return rc;
 }
 
@@ -199,3 +297,34 @@ int send_exit_code(libvchan_t *vchan, int status)
     }
     return 0;
 }
+
+int send_cache_ttl(libvchan_t *vchan, uint32_t ttl)
+{
+    struct msg_header hdr = {
+        .type = MSG_DATA_CACHE_TTL,
+        .len = sizeof(ttl),
+    };
+
+    if (libvchan_send(vchan, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            libvchan_send(vchan, &ttl, sizeof(ttl)) != sizeof(ttl)) {
+        PERROR("send_cache_ttl");
+        return -1;
+    }
+    return 0;
+}
+
+int send_stream_msg(libvchan_t *vchan, uint32_t type, uint32_t stream,
+                    const void *data, uint32_t len)
+{
+    struct stream_header hdr = { .type = type, .len = len, .stream = stream };
+
+    if (libvchan_send(vchan, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        PERROR("send_stream_msg hdr");
+        return -1;
+    }
+    if (len && !write_vchan_all(vchan, data, len)) {
+        PERROR("send_stream_msg data");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Log of the most recent data written to the control vchan, used to send
+ * again whatever the peer did not receive before the connection broke. It is
+ * a ring of REPLAY_LOG_SIZE bytes, allocated on first use. The peer counts
+ * only complete messages as received, so the log needs to hold the largest
+ * message plus whatever fits in the vchan ring.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "libqrexec-utils.h"
+
+#define REPLAY_LOG_SIZE (2 * 65536)
+
+void replay_log_init(struct replay_log *log, uint64_t start)
+{
+    log->data = NULL;
+    log->start = log->end = start;
+}
+
+void replay_log_free(struct replay_log *log)
+{
+    free(log->data);
+    replay_log_init(log, log->end);
+}
+
+void replay_log_append(struct replay_log *log, const void *data, size_t len)
+{
+    size_t pos, chunk;
+
+    if (!log->data) {
+        log->data = malloc(REPLAY_LOG_SIZE);
+        if (!log->data) {
+            PERROR("malloc");
+            exit(1);
+        }
+    }
+    if (len > REPLAY_LOG_SIZE) {
+        data = (const char *)data + len - REPLAY_LOG_SIZE;
+        log->end += len - REPLAY_LOG_SIZE;
+        len = REPLAY_LOG_SIZE;
+    }
+    while (len > 0) {
+        pos = log->end % REPLAY_LOG_SIZE;
+        chunk = REPLAY_LOG_SIZE - pos;
+        if (chunk > len)
+            chunk = len;
+        memcpy(log->data + pos, data, chunk);
+        data = (const char *)data + chunk;
+        log->end += chunk;
+        len -= chunk;
+    }
+    if (log->end - log->start > REPLAY_LOG_SIZE)
+        log->start = log->end - REPLAY_LOG_SIZE;
+}
+
+bool replay_log_rewind(struct replay_log *log, uint64_t offset,
+                       struct buffer *out)
+{
+    uint64_t pos;
+    size_t chunk;
+
+    if (offset < log->start || offset > log->end)
+        return false;
+    for (pos = offset; pos < log->end; pos += chunk) {
+        chunk = REPLAY_LOG_SIZE - pos % REPLAY_LOG_SIZE;
+        if (chunk > log->end - pos)
+            chunk = log->end - pos;
+        buffer_append(out, log->data + pos % REPLAY_LOG_SIZE, chunk);
+    }
+    log->end = offset;
+    return true;
+}
@@ -0,0 +1,554 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Striped data connections (MSG_DATA_STRIPES, see qrexec.h). Each stripe
+ * vchan is pumped by its own thread, so that copying the data in and out of
+ * the vchan rings is spread over several CPUs.
+ *
+ * Sending: the threads take turns reading a chunk from the local FD (with
+ * read_lock held, so that the chunk numbers follow the data), then send it
+ * over their own stripe in parallel.
+ *
+ * Receiving: each thread receives a chunk from its stripe, then waits until
+ * all the chunks before it have been written to the local FD. A thread
+ * holds one chunk at most, so if all of them wait and none has the next
+ * chunk (a thread just woken up may not have taken it yet), the peer is
+ * broken.
+ *
+ * The main thread only takes the lock for a moment, never while one of the
+ * threads blocks on a local FD.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libqrexec-utils.h"
+
+struct stripe {
+    struct stripes *stripes;
+    libvchan_t *vchan;
+    pthread_t thread;
+    bool started;
+    /* receiving: waiting to write chunk seq (with the lock held) */
+    bool waiting;
+    uint32_t seq;
+};
+
+struct stripes {
+    int count;
+    bool server;
+    /* stripes 0 to count-1 carry data from the vchan server */
+    struct stripe stripe[2 * MAX_STRIPES];
+    size_t buffer_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int notify_pipe[2];
+    bool failed;
+
+    /* sending */
+    pthread_mutex_t read_lock;
+    int stop_pipe[2];
+    int in_fd;
+    size_t send_chunk;
+    uint32_t send_seq;
+    bool in_done;
+    int senders;
+
+    /* receiving */
+    int discard_pipe[2];
+    int out_fd;
+    size_t max_chunk;
+    bool replace_chars;
+    uint32_t recv_seq;
+    bool out_done;
+    int receivers, waiting;
+};
+
+static bool is_sending(const struct stripes *s, int i)
+{
+    return (i < s->count) == s->server;
+}
+
+static int send_stripes_msg(libvchan_t *vchan, uint32_t count)
+{
+    struct msg_header hdr = {
+        .type = MSG_DATA_STRIPES,
+        .len = sizeof(struct stripes_params),
+    };
+    struct stripes_params params = { .count = count };
+
+    if (libvchan_send(vchan, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            libvchan_send(vchan, &params, sizeof(params)) != sizeof(params)) {
+        LOG(ERROR, "Failed to send MSG_DATA_STRIPES");
+        return -1;
+    }
+    return 0;
+}
+
+static struct stripes *stripes_new(int count, bool server)
+{
+    struct stripes *s = calloc(1, sizeof(*s));
+
+    if (!s) {
+        PERROR("calloc");
+        return NULL;
+    }
+    s->count = count;
+    s->server = server;
+    s->in_fd = s->out_fd = -1;
+    s->in_done = s->out_done = true;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->read_lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->notify_pipe[0] = s->notify_pipe[1] = -1;
+    s->stop_pipe[0] = s->stop_pipe[1] = -1;
+    s->discard_pipe[0] = s->discard_pipe[1] = -1;
+    if (pipe2(s->notify_pipe, O_CLOEXEC | O_NONBLOCK) < 0 ||
+            pipe2(s->stop_pipe, O_CLOEXEC) < 0 ||
+            pipe2(s->discard_pipe, O_CLOEXEC) < 0) {
+        PERROR("pipe2");
+        stripes_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+struct stripes *stripes_listen(libvchan_t *vchan, int domain, int port,
+                               int count, int buffer_size)
+{
+    struct stripes *s;
+    int i;
+
+    if (count < 1 || count > MAX_STRIPES) {
+        LOG(ERROR, "Invalid number of stripes: %d", count);
+        return NULL;
+    }
+    s = stripes_new(count, true);
+    if (!s)
+        return NULL;
+    s->buffer_size = buffer_size;
+    for (i = 0; i < 2 * count; i++) {
+        s->stripe[i].stripes = s;
+        s->stripe[i].vchan = libvchan_server_init(
+            domain, VCHAN_STRIPE_PORT(port, i), buffer_size, buffer_size);
+        if (!s->stripe[i].vchan) {
+            LOG(ERROR, "Failed to start stripe vchan server");
+            stripes_free(s);
+            return NULL;
+        }
+    }
+    if (send_stripes_msg(vchan, count) < 0) {
+        stripes_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+struct stripes *stripes_connect(libvchan_t *vchan, int domain, int port,
+                                uint32_t count)
+{
+    struct stripes *s = NULL;
+    int i;
+
+    if (count < 1 || count > MAX_STRIPES || port <= 0) {
+        LOG(ERROR, "Invalid MSG_DATA_STRIPES (%" PRIu32 " stripes)", count);
+        goto refuse;
+    }
+    s = stripes_new(count, false);
+    if (!s)
+        goto refuse;
+    for (i = 0; i < 2 * (int)count; i++) {
+        s->stripe[i].stripes = s;
+        s->stripe[i].vchan = libvchan_client_init(
+            domain, VCHAN_STRIPE_PORT(port, i));
+        if (!s->stripe[i].vchan) {
+            LOG(ERROR, "Stripe vchan connection failed");
+            goto refuse;
+        }
+    }
+    s->buffer_size = libvchan_buffer_space(s->stripe[0].vchan);
+    if (send_stripes_msg(vchan, count) < 0) {
+        stripes_free(s);
+        return NULL;
+    }
+    return s;
+
+refuse:
+    if (s)
+        stripes_free(s);
+    send_stripes_msg(vchan, 0);
+    return NULL;
+}
+
+static void notify(struct stripes *s)
+{
+    if (write(s->notify_pipe[1], "", 1) < 0 && errno != EAGAIN)
+        PERROR("write notify");
+}
+
+/* with the lock held */
+static bool next_chunk_waiting(struct stripes *s)
+{
+    int i;
+
+    for (i = 0; i < 2 * s->count; i++)
+        if (s->stripe[i].waiting && s->stripe[i].seq == s->recv_seq)
+            return true;
+    return false;
+}
+
+/* with the lock held */
+static void fail_locked(struct stripes *s)
+{
+    s->failed = true;
+    pthread_cond_broadcast(&s->cond);
+}
+
+/* Read the next chunk to send, with read_lock held. Returns its length, 0 on
+ * EOF or when stopped, -1 on error. */
+static ssize_t read_chunk(struct stripes *s, void *buf)
+{
+    struct pollfd fds[2] = {
+        { .fd = s->in_fd, .events = POLLIN },
+        { .fd = s->stop_pipe[0], .events = POLLIN },
+    };
+    ssize_t len;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            PERROR("poll");
+            return -1;
+        }
+        if (fds[1].revents)
+            return 0;
+        len = read(s->in_fd, buf, s->send_chunk);
+        if (len >= 0)
+            return len;
+        /* see handle_input() */
+        if (errno == ECONNRESET)
+            return 0;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            PERROR("read");
+            return -1;
+        }
+    }
+}
+
+static void *send_thread(void *arg)
+{
+    struct stripe *st = arg;
+    struct stripes *s = st->stripes;
+    struct stripe_header hdr;
+    char *buf = malloc(sizeof(hdr) + s->send_chunk);
+    ssize_t len;
+    bool ok = buf != NULL;
+
+    if (!buf)
+        PERROR("malloc");
+    while (ok) {
+        pthread_mutex_lock(&s->read_lock);
+        len = 0;
+        if (!s->in_done) {
+            len = read_chunk(s, buf + sizeof(hdr));
+            if (len <= 0)
+                s->in_done = true;
+        }
+        hdr.seq = s->send_seq;
+        if (len > 0)
+            s->send_seq++;
+        pthread_mutex_unlock(&s->read_lock);
+
+        if (len < 0) {
+            ok = false;
+            len = 0;
+        }
+        hdr.len = (uint32_t)len;
+        memcpy(buf, &hdr, sizeof(hdr));
+        if (!write_vchan_all(st->vchan, buf, sizeof(hdr) + len)) {
+            LOG(ERROR, "Failed to send to a stripe");
+            ok = false;
+        }
+        if (len == 0)
+            break;
+    }
+    free(buf);
+
+    pthread_mutex_lock(&s->lock);
+    if (!ok)
+        fail_locked(s);
+    s->senders--;
+    pthread_mutex_unlock(&s->lock);
+    notify(s);
+    return NULL;
+}
+
+/* Write a chunk to the local FD; false if it failed, or the rest of the data
+ * is to be discarded */
+static bool write_out(struct stripes *s, const char *buf, size_t len)
+{
+    struct pollfd fds[2] = {
+        { .fd = s->out_fd, .events = POLLOUT },
+        { .fd = s->discard_pipe[0], .events = POLLIN },
+    };
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(s->out_fd, buf, len);
+        if (ret >= 0) {
+            buf += ret;
+            len -= ret;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            if (poll(fds, 2, -1) > 0 && fds[1].revents)
+                return false;
+        } else {
+            if (errno != EPIPE && errno != ECONNRESET)
+                PERROR("write");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *recv_thread(void *arg)
+{
+    struct stripe *st = arg;
+    struct stripes *s = st->stripes;
+    struct stripe_header hdr;
+    char *buf = malloc(s->max_chunk);
+    bool ok = buf != NULL;
+
+    if (!buf)
+        PERROR("malloc");
+    while (ok) {
+        if (!read_vchan_all(st->vchan, &hdr, sizeof(hdr))) {
+            LOG(ERROR, "Stripe closed early");
+            ok = false;
+            break;
+        }
+        if (hdr.len == 0)
+            break;
+        if (hdr.len > s->max_chunk) {
+            LOG(ERROR, "Too big stripe chunk received: %" PRIu32 " > %zu",
+                hdr.len, s->max_chunk);
+            ok = false;
+            break;
+        }
+        if (!read_vchan_all(st->vchan, buf, hdr.len)) {
+            LOG(ERROR, "Stripe closed early");
+            ok = false;
+            break;
+        }
+        if (s->replace_chars)
+            do_replace_chars(buf, hdr.len);
+
+        pthread_mutex_lock(&s->lock);
+        s->waiting++;
+        st->waiting = true;
+        st->seq = hdr.seq;
+        while (!s->failed && hdr.seq != s->recv_seq) {
+            if (s->waiting == s->receivers && !next_chunk_waiting(s)) {
+                LOG(ERROR, "Invalid stripe chunk %" PRIu32 ", expected %" PRIu32,
+                    hdr.seq, s->recv_seq);
+                fail_locked(s);
+                break;
+            }
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        s->waiting--;
+        st->waiting = false;
+        if (s->failed) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        /* the others wait for this chunk, so it is written in order */
+        if (!s->out_done && !write_out(s, buf, hdr.len))
+            s->out_done = true;
+
+        pthread_mutex_lock(&s->lock);
+        s->recv_seq++;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(buf);
+
+    pthread_mutex_lock(&s->lock);
+    if (!ok)
+        fail_locked(s);
+    s->receivers--;
+    /* the others may be waiting for this one */
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    notify(s);
+    return NULL;
+}
+
+static bool start_threads(struct stripes *s, bool sending,
+                          void *(*func)(void *), int *running)
+{
+    sigset_t all, old;
+    int i, ret;
+    bool ok = true;
+
+    /* signals are for the main thread (see process_io()) */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < 2 * s->count; i++) {
+        if (is_sending(s, i) != sending)
+            continue;
+        ret = pthread_create(&s->stripe[i].thread, NULL, func, &s->stripe[i]);
+        if (ret != 0) {
+            errno = ret;
+            PERROR("pthread_create");
+            fail_locked(s);
+            ok = false;
+            break;
+        }
+        s->stripe[i].started = true;
+        (*running)++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ok;
+}
+
+bool stripes_start_sending(struct stripes *s, int fd, int data_protocol_version)
+{
+    s->in_fd = fd;
+    s->in_done = fd < 0;
+    s->send_chunk = max_data_chunk_size(data_protocol_version);
+    if (s->buffer_size > sizeof(struct stripe_header) &&
+            s->send_chunk > s->buffer_size - sizeof(struct stripe_header))
+        s->send_chunk = s->buffer_size - sizeof(struct stripe_header);
+    return start_threads(s, true, send_thread, &s->senders);
+}
+
+bool stripes_start_receiving(struct stripes *s, int fd, bool replace_chars,
+                             int data_protocol_version)
+{
+    s->out_fd = fd;
+    s->out_done = fd < 0;
+    s->replace_chars = replace_chars;
+    s->max_chunk = max_data_chunk_size(data_protocol_version);
+    return start_threads(s, false, recv_thread, &s->receivers);
+}
+
+/* The stop and discard pipes are never read, so once written to, they stay
+ * readable and wake up read_chunk() and write_out() for good */
+
+void stripes_stop_sending(struct stripes *s)
+{
+    if (write(s->stop_pipe[1], "", 1) < 0)
+        PERROR("write stop");
+}
+
+void stripes_stop_receiving(struct stripes *s)
+{
+    if (write(s->discard_pipe[1], "", 1) < 0)
+        PERROR("write discard");
+}
+
+int stripes_notify_fd(struct stripes *s)
+{
+    return s->notify_pipe[0];
+}
+
+void stripes_clear_notify(struct stripes *s)
+{
+    char buf[16];
+
+    while (read(s->notify_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+int stripes_count(struct stripes *s)
+{
+    return s->count;
+}
+
+bool stripes_sending(struct stripes *s)
+{
+    bool ret;
+
+    pthread_mutex_lock(&s->lock);
+    ret = s->senders > 0;
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+bool stripes_receiving(struct stripes *s)
+{
+    bool ret;
+
+    pthread_mutex_lock(&s->lock);
+    ret = s->receivers > 0;
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+bool stripes_failed(struct stripes *s)
+{
+    bool ret;
+
+    pthread_mutex_lock(&s->lock);
+    ret = s->failed;
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+void stripes_free(struct stripes *s)
+{
+    int i;
+
+    if (!s)
+        return;
+    if (s->stop_pipe[1] >= 0)
+        stripes_stop_sending(s);
+    for (i = 0; i < 2 * s->count; i++) {
+        if (s->stripe[i].started)
+            pthread_join(s->stripe[i].thread, NULL);
+        if (s->stripe[i].vchan)
+            libvchan_close(s->stripe[i].vchan);
+    }
+    for (i = 0; i < 2; i++) {
+        if (s->notify_pipe[i] >= 0)
+            close(s->notify_pipe[i]);
+        if (s->stop_pipe[i] >= 0)
+            close(s->stop_pipe[i]);
+        if (s->discard_pipe[i] >= 0)
+            close(s->discard_pipe[i]);
+    }
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->read_lock);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
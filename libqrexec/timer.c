@@ -0,0 +1,332 @@
+/*
+ * The Qubes OS Project, http://www.qubes-os.org
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ */
+
+/*
+ * Hierarchical timer wheel. Level 0 has one slot per tick, each next level
+ * has slots WHEEL_SIZE times longer than the previous one. Timers in higher
+ * levels are moved ("cascaded") to a lower level when the wheel gets to
+ * their slot. Starting and cancelling a timer is O(1), a tick costs O(1)
+ * plus the number of timers expired or cascaded in it.
+ *
+ * The wheel is driven by a single timerfd, armed (in absolute
+ * CLOCK_MONOTONIC time) for the next tick that has any work to do, and
+ * disarmed when there are no running timers, so an idle process is not
+ * woken up at all.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "libqrexec-utils.h"
+
+#define TIMER_TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+/* longest timeout the wheel can hold, in ticks (about 46 hours) */
+#define WHEEL_MAX_DELTA ((UINT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer_wheel {
+    int fd;
+    /* next tick to process */
+    uint64_t now;
+    /* tick the timerfd is armed for, 0 if disarmed */
+    uint64_t armed;
+    /* number of running timers */
+    unsigned int count;
+    /* list heads, only next and prev are used */
+    struct qrexec_timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static uint64_t current_tick(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        PERROR("clock_gettime");
+        exit(1);
+    }
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+static void list_init(struct qrexec_timer *head)
+{
+    head->next = head->prev = head;
+}
+
+static bool list_empty(const struct qrexec_timer *head)
+{
+    return head->next == head;
+}
+
+static void list_add_tail(struct qrexec_timer *head, struct qrexec_timer *timer)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_del(struct qrexec_timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/* Move all entries of *from* to *to* (which must be uninitialized). */
+static void list_move(struct qrexec_timer *from, struct qrexec_timer *to)
+{
+    if (list_empty(from)) {
+        list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+static void wheel_add(struct timer_wheel *wheel, struct qrexec_timer *timer)
+{
+    uint64_t delta;
+    int level;
+
+    if (timer->expires < wheel->now)
+        timer->expires = wheel->now;
+    delta = timer->expires - wheel->now;
+    if (delta > WHEEL_MAX_DELTA) {
+        timer->expires = wheel->now + WHEEL_MAX_DELTA;
+        delta = WHEEL_MAX_DELTA;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < (UINT64_C(1) << (WHEEL_BITS * (level + 1))))
+            break;
+    list_add_tail(&wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK],
+                  timer);
+}
+
+static void cascade(struct timer_wheel *wheel, int level, int index)
+{
+    struct qrexec_timer list, *timer;
+
+    list_move(&wheel->slots[level][index], &list);
+    while (!list_empty(&list)) {
+        timer = list.next;
+        list_del(timer);
+        wheel_add(wheel, timer);
+    }
+}
+
+/* Process tick wheel->now and advance it. */
+static void run_tick(struct timer_wheel *wheel)
+{
+    struct qrexec_timer list, *timer;
+    int index = wheel->now & WHEEL_MASK;
+    int level, i;
+
+    if (index == 0) {
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            i = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            cascade(wheel, level, i);
+            if (i != 0)
+                break;
+        }
+    }
+    wheel->now++;
+
+    /* Callbacks may start and cancel timers, including the expired ones. */
+    list_move(&wheel->slots[0][index], &list);
+    while (!list_empty(&list)) {
+        timer = list.next;
+        list_del(timer);
+        timer->wheel = NULL;
+        wheel->count--;
+        timer->func(timer);
+    }
+}
+
+/*
+ * Find the earliest tick that needs processing: either expiry of a level 0
+ * slot, or a cascade of a non-empty slot in a higher level. The latter may be
+ * earlier than the actual expiry, but that costs only one spurious wakeup.
+ */
+static uint64_t next_tick(const struct timer_wheel *wheel)
+{
+    uint64_t next = UINT64_MAX, block;
+    int level, shift, i;
+
+    for (i = 0; i < WHEEL_SIZE; i++) {
+        if (!list_empty(&wheel->slots[0][(wheel->now + i) & WHEEL_MASK])) {
+            next = wheel->now + i;
+            break;
+        }
+    }
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        shift = WHEEL_BITS * level;
+        /* first block boundary not processed yet */
+        block = (wheel->now + (UINT64_C(1) << shift) - 1) >> shift;
+        for (i = 0; i < WHEEL_SIZE; i++) {
+            if (!list_empty(&wheel->slots[level][(block + i) & WHEEL_MASK])) {
+                if (((block + i) << shift) < next)
+                    next = (block + i) << shift;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+static void wheel_arm(struct timer_wheel *wheel)
+{
+    struct itimerspec its = { 0 };
+    uint64_t next = 0, ms;
+
+    if (wheel->count > 0)
+        next = next_tick(wheel);
+    if (next == wheel->armed)
+        return;
+    if (next) {
+        ms = next * TIMER_TICK_MS;
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    }
+    if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+        PERROR("timerfd_settime");
+        exit(1);
+    }
+    wheel->armed = next;
+}
+
+struct timer_wheel *timer_wheel_new(void)
+{
+    struct timer_wheel *wheel;
+    int level, i;
+
+    wheel = malloc(sizeof(*wheel));
+    if (!wheel)
+        return NULL;
+    wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->fd < 0) {
+        free(wheel);
+        return NULL;
+    }
+    wheel->now = current_tick();
+    wheel->armed = 0;
+    wheel->count = 0;
+    for (level = 0; level < WHEEL_LEVELS; level++)
+        for (i = 0; i < WHEEL_SIZE; i++)
+            list_init(&wheel->slots[level][i]);
+    return wheel;
+}
+
+void timer_wheel_free(struct timer_wheel *wheel)
+{
+    struct qrexec_timer *timer;
+    int level, i;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (i = 0; i < WHEEL_SIZE; i++) {
+            while (!list_empty(&wheel->slots[level][i])) {
+                timer = wheel->slots[level][i].next;
+                list_del(timer);
+                timer->wheel = NULL;
+            }
+        }
+    }
+    close(wheel->fd);
+    free(wheel);
+}
+
+int timer_wheel_fd(const struct timer_wheel *wheel)
+{
+    return wheel->fd;
+}
+
+void timer_wheel_run(struct timer_wheel *wheel)
+{
+    uint64_t expirations, target, next;
+
+    if (read(wheel->fd, &expirations, sizeof(expirations)) < 0 &&
+            errno != EAGAIN) {
+        PERROR("read timerfd");
+        exit(1);
+    }
+    /* the timerfd was consumed, force re-arming it */
+    wheel->armed = 0;
+    target = current_tick();
+    /* Go straight to the ticks with work to do: after a suspend or a long
+     * stall there can be very many ticks to catch up on. The ones skipped
+     * have no timers to expire or cascade (see next_tick). */
+    while (wheel->count > 0 && (next = next_tick(wheel)) <= target) {
+        wheel->now = next;
+        run_tick(wheel);
+    }
+    if (wheel->now <= target)
+        wheel->now = target + 1;
+    wheel_arm(wheel);
+}
+
+void timer_init(struct qrexec_timer *timer, qrexec_timer_func *func, void *data)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->func = func;
+    timer->data = data;
+}
+
+void timer_start(struct timer_wheel *wheel, struct qrexec_timer *timer,
+                 unsigned int timeout_ms)
+{
+    uint64_t now;
+
+    timer_cancel(timer);
+    now = current_tick();
+    if (wheel->count == 0 && wheel->now < now)
+        wheel->now = now;
+    /* round up, and add one tick since the current one has already started */
+    timer->expires = now + (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS + 1;
+    timer->wheel = wheel;
+    wheel_add(wheel, timer);
+    wheel->count++;
+    if (!wheel->armed || timer->expires < wheel->armed)
+        wheel_arm(wheel);
+}
+
+void timer_cancel(struct qrexec_timer *timer)
+{
+    struct timer_wheel *wheel = timer->wheel;
+
+    if (!timer_is_active(timer))
+        return;
+    list_del(timer);
+    timer->wheel = NULL;
+    wheel->count--;
+    /* Otherwise leave the timerfd armed, waking up early is harmless. */
+    if (wheel->count == 0)
+        wheel_arm(wheel);
+}
+
+bool timer_is_active(const struct qrexec_timer *timer)
+{
+    return timer->next != NULL;
+}
@@ -26,9 +26,34 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include "libqrexec-utils.h"
 
+/* Descriptor kept open to be closed when we run out of descriptors, so that a
+ * pending connection can still be accepted (and closed right away), instead
+ * of waiting in the backlog forever and waking up the caller again and
+ * again. */
+static int spare_fd = -1;
+
+static int get_server_backlog(void)
+{
+    const char *backlog_str = getenv("QREXEC_SOCKET_BACKLOG");
+    char *endptr;
+    long backlog;
+
+    if (!backlog_str)
+        return SOMAXCONN;
+    backlog = strtol(backlog_str, &endptr, 10);
+    if (*backlog_str == '\0' || *endptr != '\0' || backlog <= 0 ||
+            backlog > SOMAXCONN) {
+        LOG(ERROR, "Invalid QREXEC_SOCKET_BACKLOG value: %s", backlog_str);
+        return SOMAXCONN;
+    }
+    return backlog;
+}
+
 int get_server_socket(const char *socket_address)
 {
     struct sockaddr_un sockname;
@@ -36,7 +61,7 @@ int get_server_socket(const char *socket_address)
 
     unlink(socket_address);
 
-    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (s < 0) {
         PERROR("socket");
         exit(1);
@@ -52,24 +77,55 @@ int get_server_socket(const char *socket_address)
         exit(1);
     }
     //      chmod(sockname.sun_path, 0666);
-    if (listen(s, 5) == -1) {
+    if (listen(s, get_server_backlog()) == -1) {
         PERROR("listen");
         close(s);
         exit(1);
     }
+    if (spare_fd < 0)
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
     return s;
 }
 
-int do_accept(int s)
+int do_accept4(int s, int flags)
 {
-    struct sockaddr_un peer;
-    unsigned int addrlen;
-    int fd;
-    addrlen = sizeof(peer);
-    fd = accept(s, (struct sockaddr *) &peer, &addrlen);
-    if (fd == -1) {
-        PERROR("unix accept");
-        exit(1);
+    int fd, err;
+
+    for (;;) {
+        fd = accept4(s, NULL, NULL, flags | SOCK_CLOEXEC);
+        if (fd >= 0)
+            return fd;
+        switch (errno) {
+            case EINTR:
+            case ECONNABORTED:
+            case EPROTO:
+                continue;
+            case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+                return -1;
+            case EMFILE:
+            case ENFILE:
+                err = errno;
+                LOG(WARNING, "Out of file descriptors, dropping a connection");
+                if (spare_fd >= 0) {
+                    close(spare_fd);
+                    fd = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+                    if (fd >= 0)
+                        close(fd);
+                    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                }
+                errno = err;
+                return -1;
+            default:
+                PERROR("unix accept");
+                return -1;
+        }
     }
-    return fd;
+}
+
+int do_accept(int s)
+{
+    return do_accept4(s, 0);
 }
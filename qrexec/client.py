@@ -19,12 +19,25 @@ import pathlib
 import subprocess
 import asyncio
 import os
+import struct
+import sys
 
 from .utils import prepare_subprocess_kwds
 
 QREXEC_CLIENT_DOM0 = '/usr/bin/qrexec-client'
 QREXEC_CLIENT_VM = '/usr/bin/qrexec-client-vm'
 RPC_MULTIPLEXER = '/usr/lib/qubes/qubes-rpc-multiplexer'
+QREXEC_DAEMON_SOCKET_DIR = '/var/run/qubes'
+
+# qrexec-daemon socket protocol, see libqrexec/qrexec.h
+QREXEC_PROTOCOL_VERSION = 11
+MSG_EXEC_CMDLINE = 0x200
+MSG_SERVICE_CONNECT = 0x202
+MSG_CONNECTION_TERMINATED = 0x211
+MSG_HELLO = 0x300
+
+# like qrexec-client -w
+DEFAULT_CONNECTION_TIMEOUT = 5
 
 VERSION = None
 
@@ -74,6 +87,26 @@ async def call_async(dest, rpcname, arg=None, *, input=None):
 
     command = make_command(dest, rpcname, arg)
 
+    if command[0] == QREXEC_CLIENT_DOM0 and \
+            isinstance(input, (type(None), str, bytes)):
+        try:
+            from . import libqrexec
+            libqrexec.get_lib()
+        except OSError:
+            pass
+        else:
+            if isinstance(input, str):
+                input = input.encode()
+            try:
+                returncode, stdout = await call_daemon_async(
+                    command[2], command[3], input or b'')
+            except asyncio.TimeoutError:
+                # qrexec-client exits with 1 then
+                raise subprocess.CalledProcessError(1, command)
+            if returncode != 0:
+                raise subprocess.CalledProcessError(returncode, command)
+            return stdout.decode()
+
     if input is None:
         stdin = subprocess.DEVNULL
         to_communicate = None
@@ -99,6 +132,144 @@ async def call_async(dest, rpcname, arg=None, *, input=None):
     return stdout.decode()
 
 
+async def _recv_message(reader):
+    msg_type, length = struct.unpack('<LL', await reader.readexactly(8))
+    return msg_type, await reader.readexactly(length)
+
+
+def _message(msg_type, data):
+    return struct.pack('<LL', msg_type, len(data)) + data
+
+
+async def _daemon_connect(domain_name, socket_dir):
+    reader, writer = await asyncio.open_unix_connection(
+        os.path.join(socket_dir, 'qrexec.{}'.format(domain_name)))
+    try:
+        msg_type, data = await _recv_message(reader)
+        if msg_type != MSG_HELLO or \
+                data != struct.pack('<L', QREXEC_PROTOCOL_VERSION):
+            raise ConnectionError('incompatible qrexec-daemon')
+        writer.write(_message(
+            MSG_HELLO, struct.pack('<L', QREXEC_PROTOCOL_VERSION)))
+    except Exception:
+        writer.close()
+        raise
+    return reader, writer
+
+
+async def _daemon_request(reader, writer, msg_type, domid, data):
+    '''Send a request, return the data connection parameters (domain and
+    port)'''
+    writer.write(_message(msg_type, struct.pack('<LL', domid, 0) + data))
+    while True:
+        reply_type, reply = await _recv_message(reader)
+        if reply_type != MSG_CONNECTION_TERMINATED:
+            break
+    if reply_type != msg_type or len(reply) != 8:
+        raise ConnectionError('invalid response from qrexec-daemon')
+    return struct.unpack('<LL', reply)
+
+
+def _close_opened(opening):
+    '''Done callback of an abandoned :py:class:`qrexec.libqrexec.Call`
+    open, to free the call once it is there'''
+    if opening.cancelled() or opening.exception() is not None:
+        return
+    asyncio.get_running_loop().run_in_executor(None, opening.result().close)
+
+
+async def _daemon_call_open(domain_name, cmdline, socket_dir):
+    from . import libqrexec
+
+    reader, writer = await _daemon_connect(domain_name, socket_dir)
+    try:
+        params = libqrexec.ExecParams(*await _daemon_request(
+            reader, writer, MSG_EXEC_CMDLINE, 0, cmdline.encode() + b'\0'))
+    finally:
+        writer.close()
+
+    # libvchan_server_init() may block
+    opening = asyncio.get_running_loop().run_in_executor(
+        None, libqrexec.Call, params)
+    try:
+        return await asyncio.shield(opening)
+    except asyncio.CancelledError:
+        opening.add_done_callback(_close_opened)
+        raise
+
+
+async def call_daemon_async(domain_name, cmdline, input=b'', *,
+                            socket_dir=QREXEC_DAEMON_SOCKET_DIR,
+                            connection_timeout=DEFAULT_CONNECTION_TIMEOUT):
+    '''Run a command in a domain (dom0 only), like ``qrexec-client -d
+    domain_name cmdline``, without starting a process.
+
+    The qrexec-daemon socket protocol is handled here, and the data connection
+    by libqrexec (see :py:mod:`qrexec.libqrexec`), which also answers from its
+    response cache, if enabled.
+
+    :param connection_timeout: seconds for the domain to connect, like \
+        ``qrexec-client -w`` (0 or None - no limit)
+    :returns: a tuple of the exit code and stdout
+    :raises asyncio.TimeoutError: if the domain does not connect in time
+    '''
+    # pylint: disable=redefined-builtin
+    from . import libqrexec
+
+    cached = libqrexec.Call.cached(domain_name, cmdline, input)
+    if cached is not None:
+        with cached:
+            stderr = cached.read_all(2)
+            if stderr:
+                sys.stderr.write(stderr.decode(errors='replace'))
+            return cached.exit_code, cached.read_all(1)
+
+    loop = asyncio.get_running_loop()
+    deadline = None
+    if connection_timeout:
+        deadline = loop.time() + connection_timeout
+
+    def time_left():
+        return None if deadline is None else max(deadline - loop.time(), 0)
+
+    call = await asyncio.wait_for(
+        _daemon_call_open(domain_name, cmdline, socket_dir), time_left())
+    stdout = []
+    try:
+        call.cache_key(domain_name, cmdline, input)
+        connected = loop.create_future()
+        done = loop.create_future()
+
+        def step():
+            try:
+                if call.step():
+                    done.set_result(None)
+            except OSError as err:
+                done.set_exception(err)
+            if not connected.done() and (call.connected or done.done()):
+                connected.set_result(None)
+            stdout.append(call.read_all(1))
+            stderr = call.read_all(2)
+            if stderr:
+                # qrexec-client passes it to its own stderr
+                sys.stderr.write(stderr.decode(errors='replace'))
+            if done.done():
+                loop.remove_reader(call.fileno())
+
+        call.write(input)
+        call.close_stdin()
+        loop.add_reader(call.fileno(), step)
+        try:
+            await asyncio.wait_for(connected, time_left())
+            await done
+        finally:
+            loop.remove_reader(call.fileno())
+        return call.exit_code, b''.join(stdout)
+    finally:
+        # qrexec_call_free() may wait for the remote end
+        await loop.run_in_executor(None, call.close)
+
+
 def make_command(dest, rpcname, arg):
     assert '+' not in rpcname
     if arg is not None:
@@ -118,3 +289,46 @@ def make_command(dest, rpcname, arg):
 
     assert VERSION is None
     raise NotImplementedError('qrexec not available')
+
+
+async def service_connect_async(domain_name, caller_ident, cmdline, *,
+                                wait=False, socket_dir=None):
+    '''Start a service in a domain and connect it to a waiting service call
+    (dom0 only), like ``qrexec-client -d domain_name -c caller_ident -E
+    cmdline``, without starting a process.
+
+    The data connection is established directly between the domains, so only
+    the connection parameters are relayed here.
+
+    :param str caller_ident: ``request_id,source_name,source_id``, as given
+        by qrexec-daemon of the source domain
+    :param bool wait: wait until the connection is closed (``-W``)
+    '''
+    if socket_dir is None:
+        socket_dir = QREXEC_DAEMON_SOCKET_DIR
+    request_id, source_name, source_id = caller_ident.split(',')
+    request_id = request_id.encode()
+    if len(request_id) >= 32:
+        raise ValueError('request_id too long')
+
+    reader, writer = await _daemon_connect(domain_name, socket_dir)
+    try:
+        domain, port = await _daemon_request(
+            reader, writer, MSG_EXEC_CMDLINE, int(source_id),
+            cmdline.encode() + b'\0')
+        if not wait:
+            writer.close()
+
+        _, source_writer = await _daemon_connect(
+            source_name, socket_dir)
+        source_writer.write(_message(
+            MSG_SERVICE_CONNECT,
+            struct.pack('<LL32s', domain, port, request_id)))
+        await source_writer.drain()
+        source_writer.close()
+
+        if wait:
+            # qrexec-daemon closes the connection when the call ends
+            await reader.read()
+    finally:
+        writer.close()
@@ -0,0 +1,467 @@
+# The Qubes OS Project, http://www.qubes-os.org
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, see <https://www.gnu.org/licenses/>.
+
+'''Binding for the client API of libqrexec-utils (see libqrexec/client.c).
+
+This makes qrexec calls in-process, instead of running qrexec-client or
+qrexec-client-vm for each call.
+'''
+
+import ctypes
+import errno
+import os
+import select
+
+LIBRARY = 'libqrexec-utils.so.4'
+QREXEC_DAEMON_SOCKET_DIR = '/var/run/qubes'
+QREXEC_AGENT_TRIGGER_PATH = '/var/run/qubes/qrexec-agent'
+
+MSG_EXEC_CMDLINE = 0x200
+MSG_JUST_EXEC = 0x201
+MSG_SERVICE_CONNECT = 0x202
+
+# see struct exec_stdin_params
+MAX_EXEC_STDIN_LEN = 4096
+
+QREXEC_CALL_ERROR = -1
+QREXEC_CALL_RUNNING = 0
+QREXEC_CALL_DONE = 1
+
+
+class ExecParams(ctypes.Structure):
+    # pylint: disable=too-few-public-methods
+    _fields_ = [
+        ('connect_domain', ctypes.c_uint32),
+        ('connect_port', ctypes.c_uint32),
+    ]
+
+
+class CacheStats(ctypes.Structure):
+    # pylint: disable=too-few-public-methods
+    _fields_ = [
+        ('hits', ctypes.c_uint64),
+        ('misses', ctypes.c_uint64),
+        ('expired', ctypes.c_uint64),
+        ('stores', ctypes.c_uint64),
+        ('evictions', ctypes.c_uint64),
+        ('entries', ctypes.c_uint64),
+        ('bytes', ctypes.c_uint64),
+    ]
+
+
+_lib = None
+# domain name -> id, for reusing pooled connections
+_domain_ids = {}
+
+
+def load(path=None):
+    '''Load the library (by default from the standard library path)'''
+    # pylint: disable=global-statement
+    global _lib
+    lib = ctypes.CDLL(path or LIBRARY, use_errno=True)
+
+    lib.qrexec_daemon_connect.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+    lib.qrexec_daemon_request.argtypes = [
+        ctypes.c_int, ctypes.c_int, ctypes.c_int,
+        ctypes.c_char_p, ctypes.c_size_t, ctypes.POINTER(ExecParams)]
+    lib.qrexec_daemon_request_exec.argtypes = [
+        ctypes.c_int, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t,
+        ctypes.c_bool, ctypes.POINTER(ExecParams)]
+    lib.qrexec_agent_request.argtypes = [
+        ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p,
+        ctypes.POINTER(ExecParams)]
+    lib.qrexec_call_open.argtypes = [
+        ctypes.POINTER(ExecParams), ctypes.c_size_t]
+    lib.qrexec_call_open.restype = ctypes.c_void_p
+    lib.qrexec_call_free.argtypes = [ctypes.c_void_p]
+    lib.qrexec_call_free.restype = None
+    lib.qrexec_call_fd.argtypes = [ctypes.c_void_p]
+    lib.qrexec_call_step.argtypes = [ctypes.c_void_p]
+    lib.qrexec_call_write.argtypes = [
+        ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+    lib.qrexec_call_close_stdin.argtypes = [ctypes.c_void_p]
+    lib.qrexec_call_initial_stdin.argtypes = [
+        ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_bool]
+    lib.qrexec_call_read.argtypes = [
+        ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p, ctypes.c_size_t]
+    lib.qrexec_call_read.restype = ctypes.c_ssize_t
+    lib.qrexec_call_exit_code.argtypes = [ctypes.c_void_p]
+    lib.qrexec_call_connected.argtypes = [ctypes.c_void_p]
+    lib.qrexec_call_connected.restype = ctypes.c_bool
+    lib.qrexec_pool_set_size.argtypes = [ctypes.c_int]
+    lib.qrexec_pool_set_size.restype = None
+    lib.qrexec_call_reuse.argtypes = [ctypes.c_int, ctypes.c_char_p]
+    lib.qrexec_call_reuse.restype = ctypes.c_void_p
+    lib.qrexec_session_open.argtypes = [ctypes.c_int]
+    lib.qrexec_session_open.restype = ctypes.c_void_p
+    lib.qrexec_session_free.argtypes = [ctypes.c_void_p]
+    lib.qrexec_session_free.restype = None
+    lib.qrexec_session_fd.argtypes = [ctypes.c_void_p]
+    lib.qrexec_session_step.argtypes = [ctypes.c_void_p]
+    lib.qrexec_session_call.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    lib.qrexec_session_call.restype = ctypes.c_void_p
+    lib.qrexec_cache_set_size.argtypes = [ctypes.c_size_t]
+    lib.qrexec_cache_set_size.restype = None
+    lib.qrexec_call_cache_key.argtypes = [
+        ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p,
+        ctypes.c_size_t]
+    lib.qrexec_call_cached.argtypes = [
+        ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t]
+    lib.qrexec_call_cached.restype = ctypes.c_void_p
+    lib.qrexec_cache_invalidate.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+    lib.qrexec_cache_invalidate.restype = None
+    lib.qrexec_cache_get_stats.argtypes = [ctypes.POINTER(CacheStats)]
+    lib.qrexec_cache_get_stats.restype = None
+
+    _lib = lib
+    return lib
+
+
+def get_lib():
+    return _lib or load()
+
+
+def _oserror():
+    err = ctypes.get_errno()
+    return OSError(err, os.strerror(err))
+
+
+def daemon_connect(domain_name, socket_dir=QREXEC_DAEMON_SOCKET_DIR):
+    '''dom0: connect to qrexec-daemon of a domain, return the socket fd'''
+    fd = get_lib().qrexec_daemon_connect(
+        socket_dir.encode(), domain_name.encode())
+    if fd < 0:
+        raise _oserror()
+    return fd
+
+
+def daemon_request(fd, cmdline, msg_type=MSG_EXEC_CMDLINE, domid=0):
+    '''dom0: request a connection, return data connection parameters'''
+    if isinstance(cmdline, str):
+        cmdline = cmdline.encode() + b'\0'
+    params = ExecParams()
+    if get_lib().qrexec_daemon_request(
+            fd, msg_type, domid, cmdline, len(cmdline),
+            ctypes.byref(params)) < 0:
+        raise _oserror()
+    return params
+
+
+def daemon_request_exec(fd, cmdline, input, eof=True):
+    '''dom0: request a connection for a call from dom0, passing also initial
+    stdin (at most :py:data:`MAX_EXEC_STDIN_LEN` bytes) along; queue the same
+    with :py:meth:`Call.initial_stdin`'''
+    # pylint: disable=redefined-builtin
+    params = ExecParams()
+    if get_lib().qrexec_daemon_request_exec(
+            fd, cmdline.encode(), input, len(input), eof,
+            ctypes.byref(params)) < 0:
+        raise _oserror()
+    return params
+
+
+def agent_request(target, service_name,
+                  agent_socket=QREXEC_AGENT_TRIGGER_PATH):
+    '''VM: request a call, return the socket fd (to be closed when the call
+    ends) and the data connection parameters'''
+    params = ExecParams()
+    fd = get_lib().qrexec_agent_request(
+        agent_socket.encode(), target.encode(), service_name.encode(),
+        ctypes.byref(params))
+    if fd < 0:
+        raise _oserror()
+    return fd, params
+
+
+def set_pool_size(max_idle):
+    '''dom0: keep up to *max_idle* data connections open for reuse when calls
+    end (if enabled in qrexec-agent); 0 disables the pool'''
+    get_lib().qrexec_pool_set_size(max_idle)
+
+
+def set_cache_size(max_bytes):
+    '''Keep the responses of services that allow it (cache-ttl in their
+    rpc-config), up to *max_bytes* in total, and answer identical calls from
+    there; 0 disables the cache'''
+    get_lib().qrexec_cache_set_size(max_bytes)
+
+
+def cache_invalidate(target=None, service=None):
+    '''Drop cached responses from *target* for *service* (a name without
+    the argument); None matches any'''
+    get_lib().qrexec_cache_invalidate(
+        target.encode() if target is not None else None,
+        service.encode() if service is not None else None)
+
+
+def cache_stats():
+    '''Return the response cache counters, as a dict'''
+    stats = CacheStats()
+    get_lib().qrexec_cache_get_stats(ctypes.byref(stats))
+    return {name: getattr(stats, name) for name, _ in CacheStats._fields_}
+
+
+class Call:
+    '''Data connection of a call, to be driven by an event loop: when
+    :py:meth:`fileno` is readable, call :py:meth:`step`.'''
+
+    def __init__(self, params, buffer_size=0):
+        self._lib = get_lib()
+        self._call = self._lib.qrexec_call_open(
+            ctypes.byref(params), buffer_size)
+        if not self._call:
+            raise OSError('failed to open data connection')
+
+    @classmethod
+    def reuse(cls, domain, cmdline):
+        '''dom0: start *cmdline* in *domain* (id) over an idle connection
+        from the pool; return None if there is none'''
+        lib = get_lib()
+        handle = lib.qrexec_call_reuse(domain, cmdline.encode())
+        if not handle:
+            return None
+        return cls._from_handle(lib, handle)
+
+    @classmethod
+    def cached(cls, target, cmdline, input=b''):
+        '''Return a finished call with the cached response to *cmdline* in
+        *target* with *input*, or None if there is none'''
+        # pylint: disable=redefined-builtin
+        lib = get_lib()
+        handle = lib.qrexec_call_cached(
+            target.encode(), cmdline.encode(), input, len(input))
+        if not handle:
+            return None
+        return cls._from_handle(lib, handle)
+
+    @classmethod
+    def _from_handle(cls, lib, handle):
+        call = cls.__new__(cls)
+        call._lib = lib
+        call._call = handle
+        return call
+
+    def close(self):
+        if self._call:
+            self._lib.qrexec_call_free(self._call)
+            self._call = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def fileno(self):
+        return self._lib.qrexec_call_fd(self._call)
+
+    def step(self):
+        '''Process pending events, return True when the call has finished'''
+        ret = self._lib.qrexec_call_step(self._call)
+        if ret == QREXEC_CALL_ERROR:
+            raise OSError('qrexec call failed')
+        return ret == QREXEC_CALL_DONE
+
+    def write(self, data):
+        if self._lib.qrexec_call_write(self._call, data, len(data)) < 0:
+            raise _oserror()
+
+    def close_stdin(self):
+        if self._lib.qrexec_call_close_stdin(self._call) < 0:
+            raise _oserror()
+
+    def initial_stdin(self, data, eof=True):
+        '''Queue stdin passed in the request (see
+        :py:func:`daemon_request_exec`), before any other'''
+        if self._lib.qrexec_call_initial_stdin(
+                self._call, data, len(data), eof) < 0:
+            raise _oserror()
+
+    def cache_key(self, target, cmdline, input=b''):
+        '''Keep the response in the cache, if the service allows it; *input*
+        has to be all of stdin'''
+        # pylint: disable=redefined-builtin
+        if self._lib.qrexec_call_cache_key(
+                self._call, target.encode(), cmdline.encode(), input,
+                len(input)) < 0:
+            raise _oserror()
+
+    def read(self, stream=1, size=65536):
+        buf = ctypes.create_string_buffer(size)
+        ret = self._lib.qrexec_call_read(self._call, stream, buf, size)
+        if ret < 0:
+            raise _oserror()
+        return buf.raw[:ret]
+
+    def read_all(self, stream=1):
+        chunks = []
+        while True:
+            data = self.read(stream)
+            if not data:
+                return b''.join(chunks)
+            chunks.append(data)
+
+    @property
+    def connected(self):
+        '''True once the remote end has connected and the handshake is done'''
+        return self._lib.qrexec_call_connected(self._call)
+
+    @property
+    def exit_code(self):
+        code = self._lib.qrexec_call_exit_code(self._call)
+        return None if code < 0 else code
+
+
+class Session:
+    '''dom0: concurrent calls over one data connection. It is started from
+    an idle connection to *domain_name* in the pool (see
+    :py:func:`set_pool_size`), so there has to be an earlier call there.
+    All calls share :py:meth:`fileno`; when it is readable, call
+    :py:meth:`step`, then check each call.'''
+
+    def __init__(self, domain_name):
+        self._lib = get_lib()
+        self._session = None
+        if domain_name in _domain_ids:
+            self._session = self._lib.qrexec_session_open(
+                _domain_ids[domain_name])
+        if not self._session:
+            raise OSError('no idle data connection to ' + domain_name)
+
+    def close(self):
+        if self._session:
+            self._lib.qrexec_session_free(self._session)
+            self._session = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def fileno(self):
+        return self._lib.qrexec_session_fd(self._session)
+
+    def step(self):
+        if self._lib.qrexec_session_step(self._session) < 0:
+            raise OSError('qrexec session failed')
+
+    def call(self, cmdline):
+        '''Start a command, return its :py:class:`Call`'''
+        while True:
+            handle = self._lib.qrexec_session_call(
+                self._session, cmdline.encode())
+            if handle:
+                return Call._from_handle(self._lib, handle)
+            if ctypes.get_errno() != errno.EAGAIN:
+                raise _oserror()
+            select.select([self.fileno()], [], [])
+            self.step()
+
+    def run(self, cmdlines, input=b''):
+        '''Run the commands concurrently, return a list of exit codes,
+        stdout and stderr'''
+        # pylint: disable=redefined-builtin
+        calls = []
+        try:
+            for cmdline in cmdlines:
+                call_ = self.call(cmdline)
+                calls.append(call_)
+                call_.write(input)
+                call_.close_stdin()
+            results = [None] * len(calls)
+            outputs = [([], []) for _ in calls]
+            while None in results:
+                select.select([self.fileno()], [], [])
+                self.step()
+                for i, call_ in enumerate(calls):
+                    if results[i] is not None:
+                        continue
+                    done = call_.step()
+                    outputs[i][0].append(call_.read_all(1))
+                    outputs[i][1].append(call_.read_all(2))
+                    if done:
+                        results[i] = (call_.exit_code,
+                                      b''.join(outputs[i][0]),
+                                      b''.join(outputs[i][1]))
+            return results
+        finally:
+            for call_ in calls:
+                call_.close()
+
+
+def run_call(params, input=b''):
+    '''Run the data connection of a call to completion, return the exit code,
+    stdout and stderr'''
+    # pylint: disable=redefined-builtin
+    return _run(Call(params), input)
+
+
+def _run(call, input):
+    # pylint: disable=redefined-builtin
+    with call:
+        if call.exit_code is not None:
+            # from the cache
+            return call.exit_code, call.read_all(1), call.read_all(2)
+        if input is not None:
+            call.write(input)
+            call.close_stdin()
+        stdout, stderr = [], []
+        fd = call.fileno()
+        done = False
+        while not done:
+            select.select([fd], [], [])
+            done = call.step()
+            stdout.append(call.read_all(1))
+            stderr.append(call.read_all(2))
+        stdout.append(call.read_all(1))
+        stderr.append(call.read_all(2))
+        return call.exit_code, b''.join(stdout), b''.join(stderr)
+
+
+def call(domain_name, cmdline, input=b'', *,
+         socket_dir=QREXEC_DAEMON_SOCKET_DIR):
+    '''dom0: run a command in a domain, like ``qrexec-client -d domain_name
+    cmdline``; return the exit code, stdout and stderr
+
+    A cached response is used if there is one (see :py:func:`set_cache_size`).
+    Otherwise, an idle connection to the domain is used if there is one in
+    the pool (see :py:func:`set_pool_size`), or small input is passed along
+    with the request.'''
+    # pylint: disable=redefined-builtin
+    cached = Call.cached(domain_name, cmdline, input)
+    if cached is not None:
+        return _run(cached, input)
+    if domain_name in _domain_ids:
+        pooled = Call.reuse(_domain_ids[domain_name], cmdline)
+        if pooled is not None:
+            pooled.cache_key(domain_name, cmdline, input)
+            return _run(pooled, input)
+    initial = len(input) <= MAX_EXEC_STDIN_LEN
+    fd = daemon_connect(domain_name, socket_dir)
+    try:
+        if initial:
+            params = daemon_request_exec(fd, cmdline, input)
+        else:
+            params = daemon_request(fd, cmdline)
+    finally:
+        os.close(fd)
+    _domain_ids[domain_name] = params.connect_domain
+    call_ = Call(params)
+    call_.cache_key(domain_name, cmdline, input)
+    if initial:
+        call_.initial_stdin(input)
+        input = None
+    return _run(call_, input)
@@ -43,6 +43,7 @@ from typing import (
 )
 
 from .. import QREXEC_CLIENT, POLICYPATH, RPCNAME_ALLOWED_CHARSET, POLICYSUFFIX
+from .. import client
 from .. import exc
 from .. import utils
 from ..exc import (
@@ -536,16 +537,30 @@ class AllowResolution(AbstractResolution):
             self.ensure_target_running()
             dispvm = False
 
-        qrexec_opts = ['-d', target, '-c', caller_ident, '-E']
-        if dispvm:
-            qrexec_opts.append('-W')
         try:
-            command = [QREXEC_CLIENT] + qrexec_opts + [cmd]
-            process = await asyncio.create_subprocess_exec(*command)
-            await process.communicate()
+            if target in ('dom0', '@adminvm'):
+                # the service runs locally, as a child of qrexec-client
+                await self.execute_qrexec_client(target, caller_ident, cmd)
+            else:
+                # only connection parameters need to be relayed, do it
+                # without starting qrexec-client
+                try:
+                    await client.service_connect_async(
+                        target, caller_ident, cmd, wait=dispvm)
+                except (OSError, EOFError, ValueError) as err:
+                    raise ExecutionFailed(
+                        'qrexec connection to {} failed: {}'.format(
+                            target, err))
         finally:
             if dispvm:
                 self.cleanup_dispvm(target)
+
+    @staticmethod
+    async def execute_qrexec_client(target, caller_ident, cmd):
+        '''Run the call with qrexec-client'''
+        command = [QREXEC_CLIENT, '-d', target, '-c', caller_ident, '-E', cmd]
+        process = await asyncio.create_subprocess_exec(*command)
+        await process.communicate()
         if process.returncode != 0:
             raise ExecutionFailed('qrexec-client failed: {}'.format(command))
 
@@ -1317,25 +1317,23 @@ class TC_40_evaluate(unittest.TestCase):
 
     @unittest.mock.patch('qrexec.utils.qubesd_call')
     def test_120_execute(self, mock_qubesd_call):
-        with unittest.mock.patch('asyncio.create_subprocess_exec', new=AsyncMock()) as mock_subprocess:
-            asyncio.run(self._test_120_execute(mock_subprocess, mock_qubesd_call))
+        with unittest.mock.patch('qrexec.client.service_connect_async',
+                new=AsyncMock()) as mock_connect:
+            asyncio.run(self._test_120_execute(mock_connect, mock_qubesd_call))
 
-    async def _test_120_execute(self, mock_subprocess, mock_qubesd_call):
+    async def _test_120_execute(self, mock_connect, mock_qubesd_call):
         rule = parser.Rule.from_line(None,
             '* * @anyvm @anyvm allow',
             filepath='filename', lineno=12)
         request = _req('test-vm1', 'test-vm2')
         resolution = parser.AllowResolution(
             rule, request, user=None, target='test-vm2')
-        mock_subprocess.return_value.returncode = 0
         await resolution.execute('some-ident')
         self.assertEqual(mock_qubesd_call.mock_calls,
             [unittest.mock.call('test-vm2', 'admin.vm.Start')])
-        self.assertEqual(mock_subprocess.mock_calls,
-            [unittest.mock.call(QREXEC_CLIENT, '-d', 'test-vm2',
-             '-c', 'some-ident', '-E',
-             'DEFAULT:QUBESRPC test.Service+argument test-vm1'),
-             unittest.mock.call().communicate()])
+        self.assertEqual(mock_connect.mock_calls,
+            [unittest.mock.call('test-vm2', 'some-ident',
+             'DEFAULT:QUBESRPC test.Service+argument test-vm1', wait=False)])
 
     @unittest.expectedFailure
     @unittest.mock.patch('qrexec.utils.qubesd_call')
@@ -1381,10 +1379,11 @@ class TC_40_evaluate(unittest.TestCase):
 
     @unittest.mock.patch('qrexec.utils.qubesd_call')
     def test_122_execute_dispvm(self, mock_qubesd_call):
-        with unittest.mock.patch('asyncio.create_subprocess_exec', new=AsyncMock()) as mock_subprocess:
-            asyncio.run(self._test_122_execute_dispvm(mock_subprocess, mock_qubesd_call))
+        with unittest.mock.patch('qrexec.client.service_connect_async',
+                new=AsyncMock()) as mock_connect:
+            asyncio.run(self._test_122_execute_dispvm(mock_connect, mock_qubesd_call))
 
-    async def _test_122_execute_dispvm(self, mock_subprocess, mock_qubesd_call):
+    async def _test_122_execute_dispvm(self, mock_connect, mock_qubesd_call):
         rule = parser.Rule.from_line(None,
             '* * @anyvm @dispvm:default-dvm allow',
             filepath='filename', lineno=12)
@@ -1395,24 +1394,22 @@ class TC_40_evaluate(unittest.TestCase):
         mock_qubesd_call.side_effect = (lambda target, call:
             b'dispvm-name' if call == 'admin.vm.CreateDisposable' else
             unittest.mock.DEFAULT)
-        mock_subprocess.return_value.returncode = 0
         await resolution.execute('some-ident')
         self.assertEqual(mock_qubesd_call.mock_calls,
             [unittest.mock.call('default-dvm', 'admin.vm.CreateDisposable'),
              unittest.mock.call('dispvm-name', 'admin.vm.Start'),
              unittest.mock.call('dispvm-name', 'admin.vm.Kill')])
-        self.assertEqual(mock_subprocess.mock_calls,
-            [unittest.mock.call(QREXEC_CLIENT, '-d', 'dispvm-name',
-             '-c', 'some-ident', '-E', '-W',
-             'DEFAULT:QUBESRPC test.Service+argument test-vm1'),
-             unittest.mock.call().communicate()])
+        self.assertEqual(mock_connect.mock_calls,
+            [unittest.mock.call('dispvm-name', 'some-ident',
+             'DEFAULT:QUBESRPC test.Service+argument test-vm1', wait=True)])
 
     @unittest.mock.patch('qrexec.utils.qubesd_call')
     def test_123_execute_already_running(self, mock_qubesd_call):
-        with unittest.mock.patch('asyncio.create_subprocess_exec', new=AsyncMock()) as mock_subprocess:
-            asyncio.run(self._test_123_execute_already_running(mock_subprocess, mock_qubesd_call))
+        with unittest.mock.patch('qrexec.client.service_connect_async',
+                new=AsyncMock()) as mock_connect:
+            asyncio.run(self._test_123_execute_already_running(mock_connect, mock_qubesd_call))
 
-    async def _test_123_execute_already_running(self, mock_subprocess,
+    async def _test_123_execute_already_running(self, mock_connect,
             mock_qubesd_call):
         rule = parser.Rule.from_line(None,
             '* * @anyvm @anyvm allow',
@@ -1422,22 +1419,20 @@ class TC_40_evaluate(unittest.TestCase):
             rule, request, user=None, target='test-vm2')
         mock_qubesd_call.side_effect = \
             exc.QubesMgmtException('QubesVMNotHaltedError')
-        mock_subprocess.return_value.returncode = 0
         await resolution.execute('some-ident')
         self.assertEqual(mock_qubesd_call.mock_calls,
             [unittest.mock.call('test-vm2', 'admin.vm.Start')])
-        self.assertEqual(mock_subprocess.mock_calls,
-            [unittest.mock.call(QREXEC_CLIENT, '-d', 'test-vm2',
-             '-c', 'some-ident', '-E',
-             'DEFAULT:QUBESRPC test.Service+argument test-vm1'),
-             unittest.mock.call().communicate()])
+        self.assertEqual(mock_connect.mock_calls,
+            [unittest.mock.call('test-vm2', 'some-ident',
+             'DEFAULT:QUBESRPC test.Service+argument test-vm1', wait=False)])
 
     @unittest.mock.patch('qrexec.utils.qubesd_call')
     def test_124_execute_startup_error(self, mock_qubesd_call):
-        with unittest.mock.patch('asyncio.create_subprocess_exec', new=AsyncMock()) as mock_subprocess:
-            asyncio.run(self._test_124_execute_startup_error(mock_subprocess, mock_qubesd_call))
+        with unittest.mock.patch('qrexec.client.service_connect_async',
+                new=AsyncMock()) as mock_connect:
+            asyncio.run(self._test_124_execute_startup_error(mock_connect, mock_qubesd_call))
 
-    async def _test_124_execute_startup_error(self, mock_subprocess,
+    async def _test_124_execute_startup_error(self, mock_connect,
             mock_qubesd_call):
         rule = parser.Rule.from_line(None,
             '* * @anyvm @anyvm allow',
@@ -1452,14 +1447,15 @@ class TC_40_evaluate(unittest.TestCase):
             await resolution.execute('some-ident')
         self.assertEqual(mock_qubesd_call.mock_calls,
             [unittest.mock.call('test-vm2', 'admin.vm.Start')])
-        self.assertEqual(mock_subprocess.mock_calls, [])
+        self.assertEqual(mock_connect.mock_calls, [])
 
     @unittest.mock.patch('qrexec.utils.qubesd_call')
     def test_125_execute_call_error(self, mock_qubesd_call):
-        with unittest.mock.patch('asyncio.create_subprocess_exec', new=AsyncMock()) as mock_subprocess:
-            asyncio.run(self._test_125_execute_call_error(mock_subprocess, mock_qubesd_call))
+        with unittest.mock.patch('qrexec.client.service_connect_async',
+                new=AsyncMock()) as mock_connect:
+            asyncio.run(self._test_125_execute_call_error(mock_connect, mock_qubesd_call))
 
-    async def _test_125_execute_call_error(self, mock_subprocess,
+    async def _test_125_execute_call_error(self, mock_connect,
             __mock_qubesd_call):
         rule = parser.Rule.from_line(None,
             '* * @anyvm @anyvm allow',
@@ -1468,7 +1464,7 @@ class TC_40_evaluate(unittest.TestCase):
             'test-vm2', system_info=SYSTEM_INFO)
         resolution = parser.AllowResolution(
             rule, request, user=None, target='test-vm2')
-        mock_subprocess.return_value.returncode = 1
+        mock_connect.side_effect = ConnectionRefusedError()
         with self.assertRaises(exc.ExecutionFailed):
             await resolution.execute('some-ident')
 
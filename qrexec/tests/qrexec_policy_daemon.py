@@ -181,3 +181,21 @@ class TestPolicyDaemon:
         await self.send_data(async_server, tmp_path, data)
 
         mock_request.assert_not_called()
+
+    @pytest.mark.asyncio
+    async def test_response_cache_size(self, monkeypatch, tmp_path):
+        set_cache_size = Mock()
+        monkeypatch.setattr('qrexec.libqrexec.set_cache_size', set_cache_size)
+        monkeypatch.setattr('qrexec.tools.qrexec_policy_daemon.PolicyCache',
+                            Mock())
+
+        task = asyncio.ensure_future(qrexec_policy_daemon.start_serving([
+            '--socket-path', str(tmp_path / "socket.d"),
+            '--response-cache-size', '65536']))
+        while not (tmp_path / "socket.d").exists():
+            await asyncio.sleep(0.01)
+        task.cancel()
+        with suppress(asyncio.CancelledError):
+            await task
+
+        set_cache_size.assert_called_once_with(65536)
@@ -26,6 +26,9 @@ import shutil
 import struct
 import getpass
 import itertools
+import socket
+import threading
+import zlib
 
 import psutil
 import pytest
@@ -53,7 +56,7 @@ class TestAgentBase(unittest.TestCase):
         os.mkdir(os.path.join(self.tempdir, 'rpc-config'))
         self.addCleanup(shutil.rmtree, self.tempdir)
 
-    def start_agent(self):
+    def start_agent(self, args=()):
         env = os.environ.copy()
         env['LD_LIBRARY_PATH'] = os.path.join(ROOT_PATH, 'libqrexec')
         env['VCHAN_DOMAIN'] = str(self.domain)
@@ -64,13 +67,14 @@ class TestAgentBase(unittest.TestCase):
         ])
         env['QUBES_RPC_CONFIG_PATH'] = \
             os.path.join(self.tempdir, 'rpc-config')
+        env['QREXEC_CGROUP_ROOT'] = os.path.join(self.tempdir, 'cgroup')
         env['QREXEC_MULTIPLEXER_PATH'] = os.path.join(
             ROOT_PATH, 'lib', 'qubes-rpc-multiplexer')
         cmd = [
             os.path.join(ROOT_PATH, 'agent', 'qrexec-agent'),
             '--no-fork-server',
             '--agent-socket=' + os.path.join(self.tempdir, 'agent.sock'),
-        ]
+        ] + list(args)
         if os.environ.get('USE_STRACE'):
             cmd = ['strace', '-fD'] + cmd
         self.agent = subprocess.Popen(
@@ -118,6 +122,14 @@ class TestAgent(TestAgentBase):
         dom0 = self.connect_dom0()
         dom0.handshake()
 
+    def test_idle_no_wakeups(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        self.assertLessEqual(util.count_wakeups(self.agent.pid), 1)
+
     def test_just_exec(self):
         self.start_agent()
 
@@ -148,6 +160,65 @@ class TestAgent(TestAgentBase):
             (qrexec.MSG_CONNECTION_TERMINATED,
              struct.pack('<LL', self.target_domain, self.target_port)))
 
+    def test_just_exec_no_data(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        cmd = (('touch ' + os.path.join(self.tempdir, 'new_file'))
+               .encode('ascii'))
+        dom0.send_message(
+            qrexec.MSG_JUST_EXEC_NO_DATA,
+            struct.pack('<LL', self.target_domain, self.target_port) +
+            user + b':' + cmd + b'\0')
+
+        # no data connection, just the status
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_EXEC_STATUS,
+             struct.pack('<LLLl', self.target_domain, self.target_port,
+                         0, 0)))
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_CONNECTION_TERMINATED,
+             struct.pack('<LL', self.target_domain, self.target_port)))
+
+        util.wait_until(
+            lambda: os.path.exists(os.path.join(self.tempdir, 'new_file')),
+            'file created')
+
+    def test_just_exec_no_data_notify_exit(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_JUST_EXEC_NO_DATA,
+            struct.pack('<LL', self.target_domain, self.target_port) +
+            user + b':sleep 0.1; exit 3\0' +
+            struct.pack('<L', qrexec.JUST_EXEC_NOTIFY_EXIT))
+
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_EXEC_STATUS,
+             struct.pack('<LLLl', self.target_domain, self.target_port,
+                         0, 0)))
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_EXEC_STATUS,
+             struct.pack('<LLLl', self.target_domain, self.target_port,
+                         qrexec.EXEC_STATUS_EXITED, 3)))
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_CONNECTION_TERMINATED,
+             struct.pack('<LL', self.target_domain, self.target_port)))
+
     def test_exec_cmdline(self):
         self.start_agent()
 
@@ -181,6 +252,583 @@ class TestAgent(TestAgentBase):
             (qrexec.MSG_CONNECTION_TERMINATED,
              struct.pack('<LL', self.target_domain, self.target_port)))
 
+    def test_exec_cmdline_peer_version(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) +
+            user + b':echo Hello world\0' +
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION))
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+
+        # the process is started without waiting for our MSG_HELLO
+        self.assertEqual(target.recv_message(), (
+            qrexec.MSG_HELLO,
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION)))
+        messages = target.recv_all_messages()
+        self.assertListEqual(util.sort_messages(messages), [
+            (qrexec.MSG_DATA_STDOUT, b'Hello world\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+        ])
+
+    def test_exec_cmdline_peer_version_stdin(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0' +
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION))
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+
+        # our MSG_HELLO is processed along with the data
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_STDIN, b'stdin data\n')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        self.assertListEqual(util.sort_messages(messages), [
+            (qrexec.MSG_DATA_STDOUT, b'stdin data\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+        ])
+
+    def test_exec_cmdline_peer_version_late_hello(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0' +
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION))
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+
+        # MSG_HELLO is accepted only before anything else
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_STDIN, b'stdin data\n')
+        target.send_message(
+            qrexec.MSG_HELLO,
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION))
+        messages = target.recv_all_messages()
+        self.assertNotIn(qrexec.MSG_DATA_EXIT_CODE,
+                         [message_type for message_type, _ in messages])
+
+    def test_exec_cmdline_initial_stdin(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        data = b'stdin data\n'
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0' +
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION) +
+            struct.pack('<LL', qrexec.EXEC_STDIN_EOF, len(data)) + data)
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+
+        # the whole call completes without sending anything on the data vchan
+        self.assertEqual(target.recv_message(), (
+            qrexec.MSG_HELLO,
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION)))
+        messages = target.recv_all_messages()
+        self.assertListEqual(util.sort_messages(messages), [
+            (qrexec.MSG_DATA_STDOUT, data),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+        ])
+
+    def test_exec_cmdline_initial_stdin_more(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0' +
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION) +
+            struct.pack('<LL', 0, 6) + b'first ')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+
+        # the rest comes over the data vchan, after the initial part
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_STDIN, b'second\n')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        stdout = b''.join(data for msg_type, data in messages
+                          if msg_type == qrexec.MSG_DATA_STDOUT)
+        self.assertEqual(stdout, b'first second\n')
+        self.assertEqual(messages[-1],
+                         (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'))
+
+    def test_exec_cmdline_large_chunk(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+        target.handshake()
+
+        # more than MAX_DATA_CHUNK_V3 in one chunk (protocol 6+)
+        data = bytes(range(256)) * 1024
+        target.send_message(qrexec.MSG_DATA_STDIN, data)
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        stdout = b''.join(data for msg_type, data in messages
+                          if msg_type == qrexec.MSG_DATA_STDOUT)
+        self.assertEqual(stdout, data)
+        self.assertEqual(messages[-1],
+                         (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'))
+
+    def test_exec_cmdline_compressed_stdin(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+        target.handshake()
+
+        data = b'compressible stdin\n' * 1000
+        target.send_compressed_message(qrexec.MSG_DATA_STDIN, data)
+        target.send_message(qrexec.MSG_DATA_STDIN, b'tail\n')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        stdout = b''.join(data for msg_type, data in messages
+                          if msg_type == qrexec.MSG_DATA_STDOUT)
+        self.assertEqual(stdout, data + b'tail\n')
+        self.assertEqual(messages[-1],
+                         (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'))
+
+    def test_exec_cmdline_stripes(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+        target.handshake()
+
+        stripes = []
+        for i in range(4):
+            stripe = qrexec.vchan_server(
+                self.tempdir, 0, self.domain,
+                qrexec.stripe_port(self.target_port, i))
+            self.addCleanup(stripe.close)
+            stripes.append(stripe)
+        target.send_message(qrexec.MSG_DATA_STRIPES, struct.pack('<L', 2))
+        for stripe in stripes:
+            stripe.accept()
+        self.assertEqual(target.recv_message(),
+                         (qrexec.MSG_DATA_STRIPES, struct.pack('<L', 2)))
+
+        # stripes 0 and 1 carry stdin, out of order
+        stripes[1].send_stripe_chunk(0, b'first\n')
+        stripes[0].send_stripe_chunk(2, b'third\n')
+        stripes[1].send_stripe_chunk(1, b'second\n')
+        stripes[0].send_stripe_chunk(0, b'')
+        stripes[1].send_stripe_chunk(0, b'')
+        self.assertEqual(qrexec.recv_stripes(stripes[2:]),
+                         b'first\nsecond\nthird\n')
+
+        messages = target.recv_all_messages()
+        self.assertNotIn(qrexec.MSG_DATA_STDOUT,
+                         [msg_type for msg_type, data in messages])
+        self.assertEqual(messages[-1],
+                         (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'))
+
+    def test_exec_cmdline_stripes_refused(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+        target.handshake()
+
+        # too many, so the stripes are refused and the data stays here
+        target.send_message(qrexec.MSG_DATA_STRIPES, struct.pack('<L', 17))
+        self.assertEqual(target.recv_message(),
+                         (qrexec.MSG_DATA_STRIPES, struct.pack('<L', 0)))
+        target.send_message(qrexec.MSG_DATA_STDIN, b'stdin data\n')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        stdout = b''.join(data for msg_type, data in messages
+                          if msg_type == qrexec.MSG_DATA_STDOUT)
+        self.assertEqual(stdout, b'stdin data\n')
+        self.assertEqual(messages[-1],
+                         (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'))
+
+    def test_exec_cmdline_compressed_stdin_bad_length(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':cat\0')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+        target.handshake()
+
+        # declared length does not match the decompressed data
+        data = b'compressible stdin\n' * 1000
+        target.send_message(
+            qrexec.MSG_DATA_COMPRESSED,
+            struct.pack('<LL', qrexec.MSG_DATA_STDIN, len(data) - 1) +
+            zlib.compress(data))
+        messages = target.recv_all_messages()
+        self.assertNotIn(qrexec.MSG_DATA_EXIT_CODE,
+                         [msg_type for msg_type, data in messages])
+        self.assertEqual(b''.join(data for msg_type, data in messages
+                                  if msg_type == qrexec.MSG_DATA_STDOUT),
+                         b'')
+
+    def test_exec_cmdline_reuse(self):
+        self.start_agent(['--data-vchan-idle-timeout=10'])
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+
+        # only connections from dom0 can be reused
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) +
+            user + b':echo Hello world\0')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+        target.handshake()
+
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = [target.recv_message() for _ in range(5)]
+        self.assertListEqual(messages[3:], [
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+            (qrexec.MSG_DATA_IDLE, struct.pack('<L', 10000)),
+        ])
+        self.assertListEqual(util.sort_messages(messages[:3]), [
+            (qrexec.MSG_DATA_STDOUT, b'Hello world\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+        ])
+
+        target.send_message(qrexec.MSG_DATA_EXEC_CMDLINE,
+                            user + b':cat; exit 3\0')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'stdin data\n')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = [target.recv_message() for _ in range(5)]
+        self.assertListEqual(messages[3:], [
+            (qrexec.MSG_DATA_EXIT_CODE, struct.pack('<L', 3)),
+            (qrexec.MSG_DATA_IDLE, struct.pack('<L', 10000)),
+        ])
+        self.assertListEqual(util.sort_messages(messages[:3]), [
+            (qrexec.MSG_DATA_STDOUT, b'stdin data\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+        ])
+
+        # dom0 closes the connection instead of reusing it
+        target.close()
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_CONNECTION_TERMINATED,
+             struct.pack('<LL', 0, self.target_port)))
+
+    def start_mux(self):
+        self.start_agent(['--data-vchan-idle-timeout=10'])
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':true\0')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+        target.handshake()
+        messages = [target.recv_message() for _ in range(4)]
+        self.assertEqual(messages[-1],
+                         (qrexec.MSG_DATA_IDLE, struct.pack('<L', 10000)))
+        target.send_message(qrexec.MSG_DATA_MUX, b'')
+        return target, user
+
+    def recv_stream_until_exit(self, target, streams):
+        output = {stream: [] for stream in streams}
+        while streams:
+            stream, msg_type, data = target.recv_stream_message()
+            output.setdefault(stream, []).append((msg_type, data))
+            if msg_type == qrexec.MSG_DATA_EXIT_CODE:
+                streams.remove(stream)
+        return output
+
+    def test_exec_cmdline_mux(self):
+        target, user = self.start_mux()
+
+        target.send_stream_message(0, qrexec.MSG_DATA_EXEC_CMDLINE,
+                                   user + b':cat; exit 3\0')
+        target.send_stream_message(1, qrexec.MSG_DATA_EXEC_CMDLINE,
+                                   user + b':echo Hello world\0')
+        target.send_stream_message(0, qrexec.MSG_DATA_STDIN, b'stdin data\n')
+        target.send_stream_message(0, qrexec.MSG_DATA_STDIN, b'')
+        target.send_stream_message(1, qrexec.MSG_DATA_STDIN, b'')
+        output = self.recv_stream_until_exit(target, [0, 1])
+        self.assertListEqual(output[0][-1:], [
+            (qrexec.MSG_DATA_EXIT_CODE, struct.pack('<L', 3))])
+        self.assertListEqual(util.sort_messages(output[0][:-1]), [
+            (qrexec.MSG_DATA_STDOUT, b'stdin data\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+        ])
+        self.assertListEqual(output[1][-1:], [
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0')])
+        self.assertListEqual(util.sort_messages(output[1][:-1]), [
+            (qrexec.MSG_DATA_STDOUT, b'Hello world\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+        ])
+
+        # a command that cannot be started
+        target.send_stream_message(2, qrexec.MSG_DATA_EXEC_CMDLINE,
+                                   b'no colon\0')
+        output = self.recv_stream_until_exit(target, [2])
+        self.assertListEqual(output[2], [
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+            (qrexec.MSG_DATA_EXIT_CODE, struct.pack('<L', 127)),
+        ])
+
+    def test_exec_cmdline_mux_output_isolation(self):
+        target, user = self.start_mux()
+
+        # stream 0 does not get any credit for its output, it must not block
+        # stream 1
+        size = 4 * qrexec.STREAM_WINDOW
+        target.send_stream_message(
+            0, qrexec.MSG_DATA_EXEC_CMDLINE,
+            user + b':head -c %d /dev/zero\0' % size)
+        target.send_stream_message(0, qrexec.MSG_DATA_STDIN, b'')
+        stream0 = []
+
+        def recv_stdout(count):
+            received = 0
+            while received < count:
+                stream, msg_type, data = target.recv_stream_message()
+                self.assertEqual(stream, 0)
+                stream0.append((msg_type, data))
+                if msg_type == qrexec.MSG_DATA_STDOUT:
+                    received += len(data)
+            self.assertEqual(received, count)
+
+        recv_stdout(qrexec.STREAM_WINDOW)
+
+        target.send_stream_message(1, qrexec.MSG_DATA_EXEC_CMDLINE,
+                                   user + b':echo Hello world\0')
+        target.send_stream_message(1, qrexec.MSG_DATA_STDIN, b'')
+        output = self.recv_stream_until_exit(target, [1])
+        self.assertNotIn(0, output)
+        self.assertEqual(util.sort_messages(output[1]), [
+            (qrexec.MSG_DATA_STDOUT, b'Hello world\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+        ])
+
+        # the rest, as credit is given
+        for _ in range(3):
+            target.send_stream_message(
+                0, qrexec.MSG_DATA_CREDIT,
+                struct.pack('<L', qrexec.STREAM_WINDOW))
+            recv_stdout(qrexec.STREAM_WINDOW)
+        target.send_stream_message(0, qrexec.MSG_DATA_CREDIT,
+                                   struct.pack('<L', qrexec.STREAM_WINDOW))
+        stream0.extend(self.recv_stream_until_exit(target, [0])[0])
+        self.assertEqual(
+            [msg for msg in stream0 if msg[0] != qrexec.MSG_DATA_STDOUT], [
+                (qrexec.MSG_DATA_STDERR, b''),
+                (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+            ])
+        self.assertEqual(stream0[-2], (qrexec.MSG_DATA_STDOUT, b''))
+
+    def test_exec_cmdline_mux_input_isolation(self):
+        target, user = self.start_mux()
+
+        # stream 0 does not read its input for a while: the pipe takes some,
+        # the rest stays with the agent, within the window
+        target.send_stream_message(
+            0, qrexec.MSG_DATA_EXEC_CMDLINE,
+            user + b':sleep 2; wc -c\0')
+        output = {}
+        credit = 0
+        sent = 0
+
+        def recv():
+            nonlocal credit
+            stream, msg_type, data = target.recv_stream_message()
+            if msg_type == qrexec.MSG_DATA_CREDIT:
+                self.assertEqual(stream, 0)
+                credit += struct.unpack('<L', data)[0]
+                self.assertLessEqual(credit, sent)
+            else:
+                output.setdefault(stream, []).append((msg_type, data))
+            return stream, msg_type
+
+        # until the pipe is full, and the credit stops
+        while True:
+            chunk = qrexec.STREAM_WINDOW - (sent - credit)
+            target.send_stream_message(0, qrexec.MSG_DATA_STDIN,
+                                       b'a' * chunk)
+            sent += chunk
+            target.conn.settimeout(0.5)
+            try:
+                recv()
+            except socket.timeout:
+                break
+            finally:
+                target.conn.settimeout(None)
+        self.assertGreaterEqual(sent - credit, qrexec.STREAM_WINDOW // 2)
+
+        # no more credit now, but other streams run as usual
+        target.send_stream_message(1, qrexec.MSG_DATA_EXEC_CMDLINE,
+                                   user + b':echo Hello world\0')
+        target.send_stream_message(1, qrexec.MSG_DATA_STDIN, b'')
+        while recv() != (1, qrexec.MSG_DATA_EXIT_CODE):
+            pass
+        self.assertEqual(util.sort_messages(output[1]), [
+            (qrexec.MSG_DATA_STDOUT, b'Hello world\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+        ])
+        self.assertNotIn(0, output)
+
+        target.send_stream_message(0, qrexec.MSG_DATA_STDIN, b'')
+        while recv() != (0, qrexec.MSG_DATA_EXIT_CODE):
+            pass
+        stdout = b''.join(data for msg_type, data in output[0]
+                          if msg_type == qrexec.MSG_DATA_STDOUT)
+        self.assertEqual(int(stdout), sent)
+
+    def test_exec_cmdline_idle_timeout(self):
+        self.start_agent(['--data-vchan-idle-timeout=1'])
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        user = getpass.getuser().encode('ascii')
+        dom0.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, self.target_port) + user + b':true\0')
+
+        target = qrexec.vchan_server(
+            self.tempdir, 0, self.domain, self.target_port)
+        self.addCleanup(target.close)
+        target.accept()
+        target.handshake()
+
+        # not reused, the agent closes the connection after the timeout
+        messages = target.recv_all_messages()
+        self.assertListEqual(messages[-2:], [
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+            (qrexec.MSG_DATA_IDLE, struct.pack('<L', 1000)),
+        ])
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_CONNECTION_TERMINATED,
+             struct.pack('<LL', 0, self.target_port)))
+
     def test_trigger_service(self):
         self.start_agent()
 
@@ -230,6 +878,64 @@ class TestAgent(TestAgentBase):
         data = client.recvall(8)
         self.assertEqual(data, b'')
 
+    def reconnect_dom0(self, rx_bytes, agent_rx_bytes=0, flags=0):
+        """Reconnect dom0, resuming the connection (unless flags say
+        otherwise)"""
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+        self.assertEqual(dom0.recv_message(), (
+            qrexec.MSG_CONNECTION_SYNC,
+            struct.pack('<LLQ', 0, 0, agent_rx_bytes)))
+        dom0.send_message(qrexec.MSG_CONNECTION_SYNC,
+                          struct.pack('<LLQ', flags, 0, rx_bytes))
+        return dom0
+
+    def test_daemon_reconnect(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        client = self.connect_client()
+        ident = self.trigger_service(
+            dom0, client, b'target_domain', b'qubes.ServiceName')
+        dom0.close()
+
+        # the request survives the daemon reconnecting
+        dom0 = self.reconnect_dom0(8 + 96 + len(b'qubes.ServiceName') + 1)
+        dom0.send_message(
+            qrexec.MSG_SERVICE_CONNECT,
+            struct.pack('<LL32s',
+                        self.target_domain,
+                        self.target_port,
+                        ident))
+
+        data = client.recvall(8)
+        self.assertEqual(struct.unpack('<LL', data),
+                         (self.target_domain, self.target_port))
+
+        client.close()
+        self.assertEqual(
+            dom0.recv_message(),
+            (qrexec.MSG_CONNECTION_TERMINATED,
+             struct.pack('<LL', self.target_domain, self.target_port)))
+
+    def test_daemon_restarted(self):
+        self.start_agent()
+
+        dom0 = self.connect_dom0()
+        dom0.handshake()
+
+        client = self.connect_client()
+        self.trigger_service(
+            dom0, client, b'target_domain', b'qubes.ServiceName')
+        dom0.close()
+
+        # new daemon does not know about the request, the call is refused
+        self.reconnect_dom0(0, flags=1)
+        data = client.recvall(8)
+        self.assertEqual(data, b'')
+
     def trigger_service(self, dom0, client, target_domain_name, service_name):
         source_params = (
             struct.pack('<64s32s',
@@ -330,6 +1036,147 @@ echo "arg: $1, remote domain: $QREXEC_REMOTE_DOMAIN, input: $input"
             (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0')
         ])
 
+    def test_exec_service_compress(self):
+        util.make_executable_service(self.tempdir, 'rpc', 'qubes.Service', '''\
+#!/bin/sh
+seq 100000
+''')
+        with open(os.path.join(self.tempdir, 'rpc-config', 'qubes.Service'),
+                  'w') as f:
+            f.write('compress=1')
+
+        target = self.execute_qubesrpc('qubes.Service+arg', 'domX')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        self.assertIn(qrexec.MSG_DATA_COMPRESSED,
+                      [msg_type for msg_type, data in messages])
+        messages = qrexec.decompress_messages(messages)
+        stdout = b''.join(data for msg_type, data in messages
+                          if msg_type == qrexec.MSG_DATA_STDOUT)
+        self.assertEqual(stdout, b''.join(b'%d\n' % i
+                                          for i in range(1, 100001)))
+        self.assertEqual(messages[-1],
+                         (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'))
+
+    def test_exec_service_cache_ttl(self):
+        util.make_executable_service(self.tempdir, 'rpc', 'qubes.Service', '''\
+#!/bin/sh
+echo "arg: $1"
+''')
+        with open(os.path.join(self.tempdir, 'rpc-config', 'qubes.Service'),
+                  'w') as f:
+            f.write('cache-ttl=60')
+
+        target = self.execute_qubesrpc('qubes.Service+arg', 'domX')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        # before any output
+        self.assertEqual(messages[0],
+                         (qrexec.MSG_DATA_CACHE_TTL, struct.pack('<L', 60)))
+        self.assertListEqual(util.sort_messages(messages[1:]), [
+            (qrexec.MSG_DATA_STDOUT, b'arg: arg\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_STDERR, b''),
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0')
+        ])
+
+    def test_exec_service_max_chunk(self):
+        util.make_executable_service(self.tempdir, 'rpc', 'qubes.Service', '''\
+#!/bin/sh
+seq 10000
+''')
+        with open(os.path.join(self.tempdir, 'rpc-config', 'qubes.Service'),
+                  'w') as f:
+            f.write('max-chunk=1000')
+
+        target = self.execute_qubesrpc('qubes.Service+arg', 'domX')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        stdout = [data for msg_type, data in messages
+                  if msg_type == qrexec.MSG_DATA_STDOUT]
+        self.assertLessEqual(max(len(data) for data in stdout), 1000)
+        self.assertEqual(b''.join(stdout),
+                         b''.join(b'%d\n' % i for i in range(1, 10001)))
+
+    def test_exec_service_stdio_buffer_size(self):
+        util.make_executable_service(self.tempdir, 'rpc', 'qubes.Service', '''\
+#!/bin/sh
+exec python3 -c 'import socket
+s = socket.socket(fileno=1)
+size = s.getsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF)
+s.detach()
+print(size)'
+''')
+        with open(os.path.join(self.tempdir, 'rpc-config', 'qubes.Service'),
+                  'w') as f:
+            f.write('stdio-buffer-size=16384')
+
+        target = self.execute_qubesrpc('qubes.Service+arg', 'domX')
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        # doubled by the kernel, see socket(7)
+        self.assertEqual(b''.join(data for msg_type, data in messages
+                                  if msg_type == qrexec.MSG_DATA_STDOUT),
+                         b'32768\n')
+
+    def test_exec_service_scheduling(self):
+        util.make_executable_service(self.tempdir, 'rpc', 'qubes.Service', '''\
+#!/bin/sh
+echo $$
+exec cat >/dev/null
+''')
+        with open(os.path.join(self.tempdir, 'rpc-config', 'qubes.Service'),
+                  'w') as f:
+            f.write('nice=7\n'
+                    'scheduling-policy=batch\n'
+                    'io-class=best-effort\n'
+                    'io-level=6\n'
+                    'cpu-affinity=0\n'
+                    'cgroup=qrexec-test.slice\n'
+                    'cpu-weight=50\n'
+                    'io-weight=20\n')
+        # the files the kernel creates with the cgroup
+        cgroup = os.path.join(self.tempdir, 'cgroup', 'qrexec-test.slice')
+        os.makedirs(cgroup)
+        for name in ('cgroup.procs', 'cpu.weight', 'io.weight'):
+            open(os.path.join(cgroup, name), 'w').close()
+
+        target = self.execute_qubesrpc('qubes.Service+arg', 'domX')
+        msg_type, data = target.recv_message()
+        self.assertEqual(msg_type, qrexec.MSG_DATA_STDOUT)
+
+        def stat(pid):
+            with open('/proc/{}/stat'.format(pid)) as f:
+                # fields after the command name, from the 3rd one
+                return f.read().rsplit(')', 1)[1].split()
+
+        # the service and its parents up to the data pump: the process of
+        # the agent that runs it
+        pids = [int(data)]
+        while int(stat(pids[-1])[1]) != self.agent.pid:
+            pids.append(int(stat(pids[-1])[1]))
+        for pid in (pids[0], pids[-1]):
+            self.assertEqual(int(stat(pid)[16]), 7)
+            self.assertEqual(os.sched_getscheduler(pid), os.SCHED_BATCH)
+            self.assertEqual(os.sched_getaffinity(pid), {0})
+            self.assertEqual(
+                subprocess.check_output(['ionice', '-p', str(pid)]),
+                b'best-effort: prio 6\n')
+
+        def read_cgroup(name):
+            with open(os.path.join(cgroup, name)) as f:
+                return f.read()
+
+        self.assertEqual(read_cgroup('cpu.weight'), '50\n')
+        self.assertEqual(read_cgroup('io.weight'), '20\n')
+        # written last from the process that started the service
+        self.assertIn(int(read_cgroup('cgroup.procs')), pids)
+
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        self.assertEqual(messages[-1],
+                         (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'))
+
     def test_exec_service_fail(self):
         target = self.execute_qubesrpc('qubes.Service+arg', 'domX')
         target.send_message(qrexec.MSG_DATA_STDIN, b'')
@@ -453,6 +1300,22 @@ class TestAgentStreams(TestAgentBase):
             (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0')
         ])
 
+    def test_idle_no_wakeups(self):
+        target = self.execute('cat')
+
+        target.send_message(qrexec.MSG_DATA_STDIN, b'data 1')
+        self.assertEqual(target.recv_message(),
+                         (qrexec.MSG_DATA_STDOUT, b'data 1'))
+
+        # the process handling the data (process_io)
+        children = psutil.Process(self.agent.pid).children()
+        self.assertEqual(len(children), 1)
+        self.assertLessEqual(util.count_wakeups(children[0].pid), 1)
+
+        target.send_message(qrexec.MSG_DATA_STDIN, b'')
+        messages = target.recv_all_messages()
+        self.assertEqual(messages[-1], (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'))
+
     def test_pass_stdin(self):
         target = self.execute('cat')
 
@@ -635,12 +1498,14 @@ class TestClientVm(unittest.TestCase):
         self.tempdir = tempfile.mkdtemp()
         self.addCleanup(shutil.rmtree, self.tempdir)
 
-    def start_client(self, args):
+    def start_client(self, args, stdin=subprocess.PIPE):
         env = os.environ.copy()
         env['LD_LIBRARY_PATH'] = os.path.join(ROOT_PATH, 'libqrexec')
         env['VCHAN_DOMAIN'] = str(self.domain)
         env['VCHAN_SOCKET_DIR'] = self.tempdir
         env['QREXEC_NO_ROOT'] = '1'
+        env['QUBES_RPC_CONFIG_PATH'] = \
+            os.path.join(self.tempdir, 'rpc-config')
         cmd = [
             os.path.join(ROOT_PATH, 'agent', 'qrexec-client-vm'),
             '--agent-socket=' + os.path.join(self.tempdir, 'agent.sock'),
@@ -651,7 +1516,7 @@ class TestClientVm(unittest.TestCase):
         self.client = subprocess.Popen(
             cmd,
             env=env,
-            stdin=subprocess.PIPE,
+            stdin=stdin,
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
             pass_fds=(stderr_dup,),
@@ -676,7 +1541,8 @@ class TestClientVm(unittest.TestCase):
         self.addCleanup(target_client.close)
         return target_client
 
-    def run_service(self, *, local_program=None, options=None):
+    def run_service(self, *, local_program=None, options=None,
+                    stdin=subprocess.PIPE):
         server = self.connect_server()
 
         args = options or []
@@ -685,7 +1551,7 @@ class TestClientVm(unittest.TestCase):
         if local_program:
             args += local_program
 
-        self.start_client(args)
+        self.start_client(args, stdin=stdin)
         server.accept()
 
         message_type, data = server.recv_message()
@@ -724,6 +1590,171 @@ class TestClientVm(unittest.TestCase):
         self.client.wait()
         self.assertEqual(self.client.returncode, 42)
 
+    def test_run_client_service_config(self):
+        os.mkdir(os.path.join(self.tempdir, 'rpc-config'))
+        with open(os.path.join(self.tempdir, 'rpc-config',
+                               'qubes.ServiceName'), 'w') as f:
+            f.write('max-chunk=1000\nfilter-escape-chars=1\n')
+        target_client = self.run_service()
+        data = bytes(range(256)) * 40
+        self.client.stdin.write(data)
+        self.client.stdin.close()
+        messages = []
+        while not messages or messages[-1] != (qrexec.MSG_DATA_STDIN, b''):
+            messages.append(target_client.recv_message())
+        self.assertLessEqual(max(len(data) for _, data in messages), 1000)
+        self.assertEqual(b''.join(data for _, data in messages), data)
+
+        target_client.send_message(qrexec.MSG_DATA_STDOUT, b'hello\x00world')
+        target_client.send_message(qrexec.MSG_DATA_STDOUT, b'')
+        self.assertEqual(self.client.stdout.read(), b'hello_world')
+        target_client.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                   struct.pack('<L', 0))
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 0)
+
+    def test_run_client_compress(self):
+        target_client = self.run_service(options=['--compress'])
+        data = b'compressible stdin\n' * 10000
+        self.client.stdin.write(data)
+        self.client.stdin.close()
+        messages = []
+        while not messages or messages[-1] != (qrexec.MSG_DATA_STDIN, b''):
+            messages.append(target_client.recv_message())
+        self.assertIn(qrexec.MSG_DATA_COMPRESSED,
+                      [msg_type for msg_type, data in messages])
+        messages = qrexec.decompress_messages(messages)
+        self.assertEqual(b''.join(data for msg_type, data in messages), data)
+        target_client.send_message(qrexec.MSG_DATA_STDOUT, b'')
+        target_client.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                   struct.pack('<L', 0))
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 0)
+
+    def test_run_client_stripes(self):
+        target_client = self.run_service(options=['--stripes=3'])
+        self.assertEqual(target_client.recv_message(),
+                         (qrexec.MSG_DATA_STRIPES, struct.pack('<L', 3)))
+        stripes = []
+        for i in range(6):
+            stripe = qrexec.vchan_client(
+                self.tempdir, self.domain, self.target_domain,
+                qrexec.stripe_port(self.target_port, i))
+            self.addCleanup(stripe.close)
+            stripes.append(stripe)
+        target_client.send_message(qrexec.MSG_DATA_STRIPES,
+                                   struct.pack('<L', 3))
+
+        data = bytes(range(256)) * 4096
+
+        def write_stdin():
+            self.client.stdin.write(data)
+            self.client.stdin.close()
+
+        writer = threading.Thread(target=write_stdin)
+        writer.start()
+        self.assertEqual(qrexec.recv_stripes(stripes[:3]), data)
+        writer.join()
+
+        stripes[3].send_stripe_chunk(0, b'stdout data\n')
+        for stripe in stripes[3:]:
+            stripe.send_stripe_chunk(0, b'')
+        self.assertEqual(self.client.stdout.read(), b'stdout data\n')
+        target_client.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                   struct.pack('<L', 0))
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 0)
+
+    def test_run_client_file_stdin(self):
+        # more than one window of the mapping, see file-input.c
+        data = bytes(range(256)) * 4096 * 20
+        path = os.path.join(self.tempdir, 'stdin')
+        with open(path, 'wb') as f:
+            f.write(data)
+        with open(path, 'rb', buffering=0) as f:
+            # the data is sent from the current offset
+            os.lseek(f.fileno(), 3, os.SEEK_SET)
+            target_client = self.run_service(stdin=f)
+            received = b''
+            while True:
+                message_type, message = target_client.recv_message()
+                self.assertEqual(message_type, qrexec.MSG_DATA_STDIN)
+                if not message:
+                    break
+                received += message
+            self.assertEqual(received, data[3:])
+            target_client.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target_client.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                       struct.pack('<L', 0))
+            self.client.wait()
+            self.assertEqual(self.client.returncode, 0)
+            # and the offset is left after it
+            self.assertEqual(os.lseek(f.fileno(), 0, os.SEEK_CUR), len(data))
+
+    def check_client_file_stdin_read(self, path):
+        if not os.path.exists(path):
+            self.skipTest('{} not available'.format(path))
+        with open(path, 'rb') as f:
+            data = f.read()
+        with open(path, 'rb', buffering=0) as f:
+            target_client = self.run_service(stdin=f)
+            received = b''
+            while True:
+                message_type, message = target_client.recv_message()
+                self.assertEqual(message_type, qrexec.MSG_DATA_STDIN)
+                if not message:
+                    break
+                received += message
+            self.assertEqual(received, data)
+            target_client.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target_client.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                       struct.pack('<L', 0))
+            self.client.wait()
+            self.assertEqual(self.client.returncode, 0)
+
+    def test_run_client_file_stdin_no_size(self):
+        # st_size is 0, the data is there only for read()
+        self.check_client_file_stdin_read('/proc/version')
+
+    def test_run_client_file_stdin_no_mmap(self):
+        # mmap() fails with ENODEV
+        self.check_client_file_stdin_read(
+            '/sys/kernel/mm/transparent_hugepage/enabled')
+
+    def test_run_client_file_stdin_truncated(self):
+        # small chunks, so that one ends in the middle of the last page
+        os.mkdir(os.path.join(self.tempdir, 'rpc-config'))
+        with open(os.path.join(self.tempdir, 'rpc-config',
+                               'qubes.ServiceName'), 'w') as f:
+            f.write('max-chunk=1000\n')
+        path = os.path.join(self.tempdir, 'stdin')
+        data = bytes(range(256)) * 4096 * 20
+        with open(path, 'wb') as f:
+            f.write(data)
+        with open(path, 'rb') as f:
+            target_client = self.run_service(stdin=f)
+        received = target_client.recv_message()[1]
+        # past what fits in the vchan; the rest of that page reads as zeros
+        size = 4096 * 20 + 100
+        os.truncate(path, size)
+        # the client exits, maybe in the middle of a message
+        stream = b''
+        while True:
+            chunk = target_client.conn.recv(65536)
+            if not chunk:
+                break
+            stream += chunk
+        while len(stream) >= 8:
+            message_type, length = struct.unpack('<LL', stream[:8])
+            self.assertEqual(message_type, qrexec.MSG_DATA_STDIN)
+            received += stream[8:8 + length]
+            stream = stream[8 + length:]
+        # only what is in the file, not the zeros past its end
+        self.assertEqual(received, data[:size])
+        self.client.wait()
+        # an error, not SIGBUS
+        self.assertEqual(self.client.returncode, 1)
+
     def test_run_client_refused(self):
         server = self.connect_server()
         self.start_client([self.target_domain_name, 'qubes.ServiceName'])
@@ -0,0 +1,154 @@
+# -*- encoding: utf-8 -*-
+#
+# The Qubes OS Project, http://www.qubes-os.org
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; either version 2.1 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License along
+# with this program; if not, see <http://www.gnu.org/licenses/>.
+
+'''Round-trip time of a policy.Ask call from dom0, as made by
+qrexec-policy-daemon for Ask and Notify, through qrexec-client and through
+:py:func:`qrexec.client.call_daemon_async`. Runs a real qrexec-daemon
+against a fake agent, on the socket vchan backend (build with
+BACKEND_VMM=socket first):
+
+    python3 -m qrexec.tests.socket.bench_call [count]
+'''
+
+import asyncio
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from . import qrexec
+from ... import client, libqrexec
+
+ROOT_PATH = os.path.join(os.path.dirname(__file__), '..', '..', '..')
+
+DOMAIN = 42
+DOMAIN_NAME = 'domX'
+CMDLINE = 'DEFAULT:QUBESRPC policy.Ask dom0'
+REQUEST = b'{"source": "work", "target": "personal", ' \
+    b'"service": "qubes.Filecopy"}'
+
+
+def connect_target(tempdir, domain, port):
+    # qrexec.vchan_client() retries every 50 ms, which would dominate
+    path = os.path.join(tempdir, 'vchan.{}.{}.{}.sock'.format(
+        domain, DOMAIN, port))
+    conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    while True:
+        try:
+            conn.connect(path)
+            return qrexec.QrexecClient(conn)
+        except (FileNotFoundError, ConnectionRefusedError):
+            time.sleep(0.0005)
+
+
+def serve_call(agent, agent_lock, tempdir, domain, port):
+    target = connect_target(tempdir, domain, port)
+    target.handshake()
+    while target.recv_message()[1]:
+        pass
+    target.send_message(qrexec.MSG_DATA_STDOUT, b'allow')
+    target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+    target.send_message(qrexec.MSG_DATA_EXIT_CODE, struct.pack('<L', 0))
+    target.close()
+    with agent_lock:
+        agent.send_message(qrexec.MSG_CONNECTION_TERMINATED,
+                           struct.pack('<LL', domain, port))
+
+
+def run_agent(agent, tempdir):
+    agent_lock = threading.Lock()
+    while True:
+        try:
+            msg_type, data = agent.recv_message()
+        except (OSError, struct.error):
+            # qrexec-daemon exited
+            return
+        if msg_type == qrexec.MSG_EXEC_CMDLINE:
+            domain, port = struct.unpack('<LL', data[:8])
+            threading.Thread(
+                target=serve_call,
+                args=(agent, agent_lock, tempdir, domain, port),
+                daemon=True).start()
+
+
+async def call_subprocess(tempdir):
+    proc = await asyncio.create_subprocess_exec(
+        os.path.join(ROOT_PATH, 'daemon', 'qrexec-client'),
+        '--socket-dir=' + tempdir, '-d', DOMAIN_NAME, CMDLINE,
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    stdout, _stderr = await proc.communicate(REQUEST)
+    assert (proc.returncode, stdout) == (0, b'allow')
+
+
+async def call_in_process(tempdir):
+    result = await client.call_daemon_async(
+        DOMAIN_NAME, CMDLINE, REQUEST, socket_dir=tempdir)
+    assert result == (0, b'allow')
+
+
+async def measure(func, tempdir, count):
+    await func(tempdir)
+    times = []
+    for _ in range(count):
+        start = time.perf_counter()
+        await func(tempdir)
+        times.append((time.perf_counter() - start) * 1000)
+    times.sort()
+    return [times[int(len(times) * p)] for p in (0.5, 0.9, 0.99)]
+
+
+async def run_benchmark(tempdir, count):
+    for name, func in (('qrexec-client', call_subprocess),
+                       ('call_daemon_async', call_in_process)):
+        print('{:18} p50 {:.2f} ms  p90 {:.2f} ms  p99 {:.2f} ms'.format(
+            name, *await measure(func, tempdir, count)), flush=True)
+
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 200
+    with tempfile.TemporaryDirectory() as tempdir:
+        os.environ['LD_LIBRARY_PATH'] = os.path.join(ROOT_PATH, 'libqrexec')
+        os.environ['VCHAN_DOMAIN'] = '0'
+        os.environ['VCHAN_SOCKET_DIR'] = tempdir
+        agent = qrexec.vchan_server(tempdir, DOMAIN, 0, 512)
+        daemon = subprocess.Popen([
+            os.path.join(ROOT_PATH, 'daemon', 'qrexec-daemon'),
+            '--socket-dir=' + tempdir, '--direct',
+            str(DOMAIN), DOMAIN_NAME])
+        try:
+            agent.accept()
+            agent.handshake()
+            while not os.path.exists(
+                    os.path.join(tempdir, 'qrexec.' + DOMAIN_NAME)):
+                time.sleep(0.01)
+            threading.Thread(target=run_agent, args=(agent, tempdir),
+                             daemon=True).start()
+            libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                        libqrexec.LIBRARY))
+            asyncio.run(run_benchmark(tempdir, count))
+        finally:
+            daemon.terminate()
+            daemon.wait()
+            agent.close()
+
+
+if __name__ == '__main__':
+    main()
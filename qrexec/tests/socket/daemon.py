@@ -17,6 +17,8 @@
 # You should have received a copy of the GNU Lesser General Public License along
 # with this program; if not, see <http://www.gnu.org/licenses/>.
 
+import asyncio
+import errno
 import unittest
 import subprocess
 import os.path
@@ -27,12 +29,16 @@ import struct
 from typing import Tuple
 import time
 import itertools
+import resource
+import threading
+import unittest.mock
 import socket
 
 import psutil
 
 from . import qrexec
 from . import util
+from ... import client, libqrexec
 
 ROOT_PATH = os.path.abspath(os.path.join(os.path.dirname(__file__),
                                          '..', '..', '..'))
@@ -65,7 +71,7 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
         self.stop_daemon()
         super().tearDown()
 
-    def start_daemon(self):
+    def start_daemon(self, args=()):
         policy_program_path = os.path.join(self.tempdir, 'qrexec-policy-exec')
         with open(policy_program_path, 'w') as f:
             f.write(self.POLICY_PROGRAM.format(tempdir=self.tempdir))
@@ -80,6 +86,7 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
             '--socket-dir=' + self.tempdir,
             '--policy-program=' + policy_program_path,
             '--direct',
+            *args,
             str(self.domain),
             self.domain_name,
         ]
@@ -119,9 +126,9 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
         with open(os.path.join(self.tempdir, 'qrexec-policy-exitcode'), 'w') as f:
             f.write(str(exitcode))
 
-    def start_daemon_with_agent(self):
+    def start_daemon_with_agent(self, args=()):
         agent = self.connect_agent()
-        self.start_daemon()
+        self.start_daemon(args)
         agent.accept()
         return agent
 
@@ -141,6 +148,15 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
         agent = self.start_daemon_with_agent()
         agent.handshake()
 
+    def test_idle_no_wakeups(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        client = self.connect_client()
+        client.handshake()
+
+        self.assertLessEqual(util.count_wakeups(self.daemon.pid), 1)
+
     def test_trigger_service_refused(self):
         agent = self.start_daemon_with_agent()
         agent.handshake()
@@ -153,6 +169,134 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
         self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
         self.assertEqual(data, struct.pack('<32s', ident.encode()))
 
+    def test_policy_timeout(self):
+        agent = self.start_daemon_with_agent(['--policy-timeout=1'])
+        agent.handshake()
+
+        # hung policy evaluation
+        self.set_policy_params(10, 0)
+
+        target_domain_name = 'target_domain'
+        ident = 'SOCKET42'
+
+        start = time.monotonic()
+        message_type, data = self.trigger_service(
+            agent, target_domain_name, 'qubes.ServiceName', ident)
+        self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+        self.assertEqual(data, struct.pack('<32s', ident.encode()))
+        self.assertGreaterEqual(time.monotonic() - start, 1)
+
+    def test_policy_timeout_slots_reclaimed(self):
+        # refuse calls when all slots are taken, instead of queueing them
+        agent = self.start_daemon_with_agent(
+            ['--policy-timeout=2', '--max-queued=0'])
+        agent.handshake()
+
+        # fill all the pending requests slots with hung policy evaluations
+        self.set_policy_params(10, 0)
+        idents = ['SOCKET{}'.format(i) for i in range(256)]
+        for ident in idents:
+            self.send_trigger_service(
+                agent, 'target_domain', 'qubes.ServiceName', ident)
+        self.send_trigger_service(
+            agent, 'target_domain', 'qubes.ServiceName', 'SOCKET_FULL')
+        self.assertEqual(agent.recv_message(), (
+            qrexec.MSG_SERVICE_REFUSED,
+            struct.pack('<32s', b'SOCKET_FULL')))
+
+        refused = set()
+        for _ in idents:
+            message_type, data = agent.recv_message()
+            self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+            refused.add(data)
+        self.assertSetEqual(refused, {
+            struct.pack('<32s', ident.encode()) for ident in idents})
+
+        # the slots are free again, the next request gets evaluated
+        self.set_policy_params(0, 1)
+        message_type, data = self.trigger_service(
+            agent, 'target_domain', 'qubes.ServiceName', 'SOCKET_NEXT')
+        self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+        self.assertEqual(data, struct.pack('<32s', b'SOCKET_NEXT'))
+
+    def test_admission_queue(self):
+        agent = self.start_daemon_with_agent(['--max-policy-evaluations=1'])
+        agent.handshake()
+
+        # the calls are evaluated one by one instead of being refused
+        self.set_policy_params(0.5, 1)
+        idents = ['SOCKET{}'.format(i) for i in range(3)]
+        start = time.monotonic()
+        for ident in idents:
+            self.send_trigger_service(
+                agent, 'target_domain', 'qubes.ServiceName', ident)
+        for ident in idents:
+            self.assertEqual(agent.recv_message(), (
+                qrexec.MSG_SERVICE_REFUSED,
+                struct.pack('<32s', ident.encode())))
+        self.assertGreaterEqual(time.monotonic() - start, 1.5)
+        self.assertEqual(self.get_policy_program_params()[-1], idents[-1])
+
+    def test_admission_queue_full(self):
+        agent = self.start_daemon_with_agent(
+            ['--max-policy-evaluations=1', '--max-queued=1'])
+        agent.handshake()
+
+        self.set_policy_params(1, 1)
+        idents = ['SOCKET{}'.format(i) for i in range(3)]
+        for ident in idents:
+            self.send_trigger_service(
+                agent, 'target_domain', 'qubes.ServiceName', ident)
+        # the first one is being evaluated, the second one queued, the third
+        # one refused right away
+        for ident in [idents[2], idents[0], idents[1]]:
+            self.assertEqual(agent.recv_message(), (
+                qrexec.MSG_SERVICE_REFUSED,
+                struct.pack('<32s', ident.encode())))
+
+    def test_admission_queue_timeout(self):
+        agent = self.start_daemon_with_agent(
+            ['--max-policy-evaluations=1', '--queue-timeout=1'])
+        agent.handshake()
+
+        self.set_policy_params(3, 1)
+        idents = ['SOCKET{}'.format(i) for i in range(3)]
+        start = time.monotonic()
+        for ident in idents:
+            self.send_trigger_service(
+                agent, 'target_domain', 'qubes.ServiceName', ident)
+        # the first one is being evaluated, the others are refused when
+        # they have waited for too long, without being evaluated
+        for ident in idents[1:]:
+            self.assertEqual(agent.recv_message(), (
+                qrexec.MSG_SERVICE_REFUSED,
+                struct.pack('<32s', ident.encode())))
+        elapsed = time.monotonic() - start
+        self.assertGreaterEqual(elapsed, 1)
+        self.assertLess(elapsed, 3)
+        self.assertEqual(agent.recv_message(), (
+            qrexec.MSG_SERVICE_REFUSED,
+            struct.pack('<32s', idents[0].encode())))
+        self.assertEqual(self.get_policy_program_params()[-1], idents[0])
+
+    def test_rate_limit(self):
+        agent = self.start_daemon_with_agent(
+            ['--rate-limit=2', '--rate-burst=1'])
+        agent.handshake()
+
+        self.set_policy_params(0, 1)
+        idents = ['SOCKET{}'.format(i) for i in range(3)]
+        start = time.monotonic()
+        for ident in idents:
+            self.send_trigger_service(
+                agent, 'target_domain', 'qubes.ServiceName', ident)
+        for ident in idents:
+            self.assertEqual(agent.recv_message(), (
+                qrexec.MSG_SERVICE_REFUSED,
+                struct.pack('<32s', ident.encode())))
+        # one call immediately, then one every 0.5s
+        self.assertGreaterEqual(time.monotonic() - start, 1)
+
     def send_trigger_service(self,
                              agent,
                              target_domain_name: str,
@@ -191,6 +335,50 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
         client = self.connect_client()
         client.handshake()
 
+    def test_client_timeout(self):
+        agent = self.start_daemon_with_agent(['--client-timeout=1'])
+        agent.handshake()
+
+        client = self.connect_client()
+        client.handshake()
+
+        # no request sent, the daemon should disconnect the client
+        start = time.monotonic()
+        self.assertListEqual(client.recv_all_messages(), [])
+        self.assertGreaterEqual(time.monotonic() - start, 1)
+
+    def test_client_burst(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        clients = [self.connect_client() for _ in range(100)]
+        for client in clients:
+            client.handshake()
+
+    def test_client_out_of_fds(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+        self.connect_client().handshake()
+
+        # leave room for just a few clients
+        nfds = len(os.listdir('/proc/{}/fd'.format(self.daemon.pid)))
+        _soft, hard = resource.prlimit(self.daemon.pid, resource.RLIMIT_NOFILE)
+        resource.prlimit(self.daemon.pid, resource.RLIMIT_NOFILE,
+                         (nfds + 5, hard))
+
+        clients = [self.connect_client() for _ in range(20)]
+        # the rest are dropped, instead of waiting or killing the daemon
+        accepted = [client for client in clients if client.recvall(8)]
+        self.assertLess(len(accepted), len(clients))
+        self.assertGreater(len(accepted), 0)
+        self.assertIsNone(self.daemon.poll())
+
+        for client in clients:
+            client.close()
+        resource.prlimit(self.daemon.pid, resource.RLIMIT_NOFILE,
+                         (hard, hard))
+        self.connect_client().handshake()
+
     def test_restart_agent(self):
         agent = self.start_daemon_with_agent()
         agent.handshake()
@@ -223,6 +411,69 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
 
         self.stop_daemon()
 
+    def reconnect_agent(self, rx_bytes, daemon_rx_bytes=0):
+        """Reconnect the agent, resuming the connection"""
+        util.wait_until(
+            lambda: not os.path.exists(
+                os.path.join(self.tempdir, 'qrexec.{}'.format(self.domain))),
+            'socket deleted')
+        agent = self.connect_agent()
+        agent.accept()
+        agent.handshake()
+        agent.send_message(qrexec.MSG_CONNECTION_SYNC,
+                           struct.pack('<LLQ', 0, 0, rx_bytes))
+        self.assertEqual(agent.recv_message(), (
+            qrexec.MSG_CONNECTION_SYNC,
+            struct.pack('<LLQ', 0, 0, daemon_rx_bytes)))
+        return agent
+
+    def test_restart_agent_mid_burst(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        cmds = ['user:command{}'.format(i) for i in range(10)]
+        ports = [self.client_exec(self.domain + 1, cmd) for cmd in cmds]
+
+        # the agent gets only part of the messages before the connection
+        # breaks, the rest is lost
+        rx_bytes = 0
+        for i in range(4):
+            message_type, data = agent.recv_message()
+            self.assertEqual((message_type, data[8:]),
+                             (qrexec.MSG_JUST_EXEC, cmds[i].encode() + b'\0'))
+            rx_bytes += 8 + len(data)
+        agent.close()
+
+        agent = self.reconnect_agent(rx_bytes)
+        for i in range(4, 10):
+            self.assertEqual(agent.recv_message(), (
+                qrexec.MSG_JUST_EXEC,
+                struct.pack('<LL', self.domain + 1, ports[i]) +
+                cmds[i].encode() + b'\0'))
+
+        # nothing is sent twice, and new calls work
+        port = self.client_exec(self.domain + 1, 'user:command10')
+        self.assertNotIn(port, ports)
+        message_type, data = agent.recv_message()
+        self.assertEqual(data[8:], b'user:command10\0')
+
+    def test_restart_agent_pending_request(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        self.set_policy_params(1, 1)
+        ident = 'SOCKET42'
+        self.send_trigger_service(
+            agent, 'target_domain', 'qubes.ServiceName', ident)
+        self.wait_for_policy_program_call()
+        agent.close()
+
+        # the response reaches the reconnected agent
+        agent = self.reconnect_agent(
+            0, 8 + 96 + len('qubes.ServiceName') + 1)
+        self.assertEqual(agent.recv_message(), (
+            qrexec.MSG_SERVICE_REFUSED, struct.pack('<32s', ident.encode())))
+
     def test_client_exec(self):
         agent = self.start_daemon_with_agent()
         agent.handshake()
@@ -232,9 +483,94 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
 
         message_type, data = agent.recv_message()
         self.assertEqual(message_type, qrexec.MSG_JUST_EXEC)
+        # with the data protocol version of the dom0 side
         self.assertEqual(data,
                          struct.pack('<LL', 0, port) +
-                         cmd.encode() + b'\0')
+                         cmd.encode() + b'\0' +
+                         struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION))
+
+    def test_client_exec_no_data(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        client = self.connect_client()
+        client.handshake()
+        cmd = b'user:command\0'
+        flags = struct.pack('<L', qrexec.JUST_EXEC_NOTIFY_EXIT)
+        client.send_message(qrexec.MSG_JUST_EXEC_NO_DATA,
+                            struct.pack('<LL', 0, 0) + cmd + flags)
+        message_type, data = client.recv_message()
+        self.assertEqual(message_type, qrexec.MSG_JUST_EXEC_NO_DATA)
+        _domain, port = struct.unpack('<LL', data)
+
+        # passed along as is
+        self.assertEqual(agent.recv_message(), (
+            qrexec.MSG_JUST_EXEC_NO_DATA,
+            struct.pack('<LL', 0, port) + cmd + flags))
+
+        # the status goes to the client, then the call ends as usual
+        status = struct.pack('<LLLl', 0, port, 0, 0)
+        agent.send_message(qrexec.MSG_EXEC_STATUS, status)
+        self.assertEqual(client.recv_message(),
+                         (qrexec.MSG_EXEC_STATUS, status))
+        agent.send_message(qrexec.MSG_CONNECTION_TERMINATED,
+                           struct.pack('<LL', 0, port))
+        self.assertEqual(client.recvall(8), b'')
+
+    def test_client_exec_no_data_old_agent(self):
+        agent = self.start_daemon_with_agent()
+        # before MSG_JUST_EXEC_NO_DATA (protocol 10)
+        agent.send_message(qrexec.MSG_HELLO, struct.pack('<L', 9))
+        self.assertEqual(agent.recv_message()[0], qrexec.MSG_HELLO)
+
+        client = self.connect_client()
+        client.handshake()
+        client.send_message(qrexec.MSG_JUST_EXEC_NO_DATA,
+                            struct.pack('<LL', 0, 0) + b'user:command\0' +
+                            struct.pack('<L', 0))
+        # the client has to serve the data connection after all
+        message_type, data = client.recv_message()
+        self.assertEqual(message_type, qrexec.MSG_JUST_EXEC)
+        _domain, port = struct.unpack('<LL', data)
+
+        self.assertEqual(agent.recv_message(), (
+            qrexec.MSG_JUST_EXEC,
+            struct.pack('<LL', 0, port) + b'user:command\0' +
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION)))
+
+    def test_client_exec_initial_stdin(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        client = self.connect_client()
+        client.handshake()
+        cmd = b'user:cat\0'
+        initial_stdin = struct.pack('<LL', qrexec.EXEC_STDIN_EOF, 4) + b'data'
+        client.send_message(qrexec.MSG_EXEC_CMDLINE,
+                            struct.pack('<LL', 0, 0) + cmd + initial_stdin)
+        message_type, data = client.recv_message()
+        self.assertEqual(message_type, qrexec.MSG_EXEC_CMDLINE)
+        _domain, port = struct.unpack('<LL', data)
+
+        # passed along, after the data protocol version of the dom0 side
+        self.assertEqual(agent.recv_message(), (
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, port) + cmd +
+            struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION) +
+            initial_stdin))
+
+    def test_client_exec_initial_stdin_invalid(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        client = self.connect_client()
+        client.handshake()
+        # length does not match
+        client.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', 0, 0) + b'user:cat\0' +
+            struct.pack('<LL', 0, 5) + b'data')
+        self.assertEqual(client.recvall(8), b'')
 
     def client_exec(self,
                     domain: int,
@@ -283,6 +619,44 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
         port = self.client_exec(domain2)
         self.assertEqual(port, 514)
 
+    def test_client_session(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        domain = self.domain + 1
+        client = self.connect_client()
+        client.handshake()
+        client.send_message(qrexec.MSG_SESSION_START, b'')
+
+        ports = []
+        for cmd in ['user:command1', 'user:command2']:
+            client.send_message(
+                qrexec.MSG_JUST_EXEC,
+                struct.pack('<LL', domain, 0) + cmd.encode() + b'\0')
+            message_type, data = client.recv_message()
+            self.assertEqual(message_type, qrexec.MSG_JUST_EXEC)
+            self.assertEqual(struct.unpack('<LL', data)[0], self.domain)
+            ports.append(struct.unpack('<LL', data)[1])
+            self.assertEqual(agent.recv_message(), (
+                qrexec.MSG_JUST_EXEC,
+                struct.pack('<LL', domain, ports[-1]) + cmd.encode() + b'\0'))
+        self.assertEqual(ports, [514, 516])
+
+        # the client is notified instead of disconnected
+        agent.send_message(qrexec.MSG_CONNECTION_TERMINATED,
+                           struct.pack('<LL', domain, ports[0]))
+        self.assertEqual(client.recv_message(), (
+            qrexec.MSG_CONNECTION_TERMINATED,
+            struct.pack('<LL', domain, ports[0])))
+
+        # the port is free again
+        cmd = 'user:command3'
+        client.send_message(
+            qrexec.MSG_JUST_EXEC,
+            struct.pack('<LL', domain, 0) + cmd.encode() + b'\0')
+        self.assertEqual(client.recv_message(), (
+            qrexec.MSG_JUST_EXEC, struct.pack('<LL', self.domain, ports[0])))
+
     def test_client_service_connect(self):
         agent = self.start_daemon_with_agent()
         agent.handshake()
@@ -376,6 +750,247 @@ exit $(cat {tempdir}/qrexec-policy-exitcode || echo 1)
         self.assertEqual(agent.recv_all_messages(), [])
 
 
+@unittest.skipIf(os.environ.get('SKIP_SOCKET_TESTS'),
+                 'socket tests not set up')
+class TestDaemonMulti(TestDaemon):
+    """Run the TestDaemon tests against qrexec-daemon --multi, with the
+    domain attached using qrexec-daemon --attach."""
+
+    def start_daemon(self, args=()):
+        self.start_multi_daemon(args)
+        self.attach_domain(self.domain, self.domain_name)
+
+    def start_multi_daemon(self, args=()):
+        policy_program_path = os.path.join(self.tempdir, 'qrexec-policy-exec')
+        with open(policy_program_path, 'w') as f:
+            f.write(self.POLICY_PROGRAM.format(tempdir=self.tempdir))
+        os.chmod(policy_program_path, 0o700)
+
+        cmd = [
+            os.path.join(ROOT_PATH, 'daemon', 'qrexec-daemon'),
+            '--socket-dir=' + self.tempdir,
+            '--policy-program=' + policy_program_path,
+            '--multi',
+            *args,
+        ]
+        self.daemon = subprocess.Popen(cmd, env=self.daemon_env())
+        util.wait_until(
+            lambda: os.path.exists(
+                os.path.join(self.tempdir, 'qrexec-daemon.sock')),
+            'qrexec-daemon --multi socket created')
+
+    def attach_domain(self, domain, domain_name, action='--attach', args=()):
+        attach = subprocess.Popen([
+            os.path.join(ROOT_PATH, 'daemon', 'qrexec-daemon'),
+            '--socket-dir=' + self.tempdir,
+            action,
+            *args,
+            str(domain),
+            domain_name,
+        ], env=self.daemon_env())
+        self.addCleanup(attach.wait)
+        return attach
+
+    def attach_domain_with_agent(self, domain, domain_name, args=()):
+        agent = qrexec.vchan_server(self.tempdir, domain, 0, 512)
+        self.addCleanup(agent.close)
+        attach = self.attach_domain(domain, domain_name, args=args)
+        agent.accept()
+        agent.handshake()
+        self.assertEqual(attach.wait(), 0)
+        return agent
+
+    def daemon_env(self):
+        env = os.environ.copy()
+        env['LD_LIBRARY_PATH'] = os.path.join(ROOT_PATH, 'libqrexec')
+        env['VCHAN_DOMAIN'] = '0'
+        env['VCHAN_SOCKET_DIR'] = self.tempdir
+        env['QREXEC_STARTUP_TIMEOUT'] = '10'
+        return env
+
+    def test_attach_status(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        # the same domain cannot be attached twice
+        attach = self.attach_domain(self.domain, self.domain_name)
+        self.assertEqual(attach.wait(), 1)
+
+    def test_attach_connect_timeout(self):
+        self.start_multi_daemon(['--connect-timeout=1'])
+        start = time.monotonic()
+        attach = self.attach_domain(self.domain, self.domain_name)
+        # the agent never connects, the domain is given up on
+        self.assertEqual(attach.wait(timeout=5), 1)
+        self.assertGreaterEqual(time.monotonic() - start, 0.5)
+
+        # and can be attached again, here after a restart with a new id
+        new_domain = self.domain + 1
+        agent = qrexec.vchan_server(self.tempdir, new_domain, 0, 512)
+        self.addCleanup(agent.close)
+        attach = self.attach_domain(new_domain, self.domain_name)
+        agent.accept()
+        agent.handshake()
+        self.assertEqual(attach.wait(), 0)
+
+    def test_reattach_stale(self):
+        self.start_multi_daemon()
+        # the domain was restarted with a new id before its agent connected
+        stale_attach = self.attach_domain(self.domain, self.domain_name)
+        util.wait_until(
+            lambda: len(os.listdir(
+                '/proc/{}/task'.format(self.daemon.pid))) > 1,
+            'connecting to the agent')
+        new_domain = self.domain + 1
+        agent = qrexec.vchan_server(self.tempdir, new_domain, 0, 512)
+        self.addCleanup(agent.close)
+        attach = self.attach_domain(new_domain, self.domain_name)
+        self.assertEqual(stale_attach.wait(timeout=5), 1)
+        agent.accept()
+        agent.handshake()
+        self.assertEqual(attach.wait(), 0)
+
+    def test_detach(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+        socket_path = os.path.join(self.tempdir,
+                                   'qrexec.{}'.format(self.domain))
+        util.wait_until(lambda: os.path.exists(socket_path), 'socket created')
+
+        detach = self.attach_domain(self.domain, self.domain_name, '--detach')
+        self.assertEqual(detach.wait(), 0)
+        util.wait_until(lambda: not os.path.exists(socket_path),
+                        'socket deleted')
+        self.assertListEqual(agent.recv_all_messages(), [])
+
+        detach = self.attach_domain(self.domain, self.domain_name, '--detach')
+        self.assertEqual(detach.wait(), 1)
+
+    def test_attach_limits(self):
+        self.start_multi_daemon()
+        agent = self.attach_domain_with_agent(
+            self.domain, self.domain_name, ['--max-policy-evaluations=1'])
+
+        # the calls of this domain are evaluated one by one
+        self.set_policy_params(0.5, 1)
+        idents = ['SOCKET{}'.format(i) for i in range(3)]
+        start = time.monotonic()
+        for ident in idents:
+            self.send_trigger_service(
+                agent, 'target_domain', 'qubes.ServiceName', ident)
+        for ident in idents:
+            self.assertEqual(agent.recv_message(), (
+                qrexec.MSG_SERVICE_REFUSED,
+                struct.pack('<32s', ident.encode())))
+        self.assertGreaterEqual(time.monotonic() - start, 1.5)
+
+    def test_fair_admission(self):
+        # Load test: one domain floods the daemon with calls, while another
+        # one makes a call at a time. They share two policy evaluations.
+        self.start_multi_daemon(['--max-total-policy-evaluations=2'])
+        quiet_agent = self.attach_domain_with_agent(
+            self.domain, self.domain_name)
+        # attached last, so that it comes first in the list of domains
+        noisy_agent = self.attach_domain_with_agent(
+            self.domain + 1, 'noisy_domain')
+
+        self.set_policy_params(0.3, 1)
+        noisy_idents = ['NOISY{}'.format(i) for i in range(30)]
+        start = time.monotonic()
+        for ident in noisy_idents:
+            self.send_trigger_service(
+                noisy_agent, 'target_domain', 'qubes.ServiceName', ident)
+
+        # the calls of the quiet domain wait for at most one evaluation of
+        # the noisy one, instead of for the whole flood
+        latencies = []
+        for i in range(5):
+            ident = 'QUIET{}'.format(i)
+            call_start = time.monotonic()
+            self.send_trigger_service(
+                quiet_agent, 'target_domain', 'qubes.ServiceName', ident)
+            self.assertEqual(quiet_agent.recv_message(), (
+                qrexec.MSG_SERVICE_REFUSED,
+                struct.pack('<32s', ident.encode())))
+            latencies.append(time.monotonic() - call_start)
+        self.assertLess(max(latencies), 1.2)
+
+        refused = set()
+        for _ in noisy_idents:
+            message_type, data = noisy_agent.recv_message()
+            self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+            refused.add(data)
+        self.assertSetEqual(refused, {
+            struct.pack('<32s', ident.encode()) for ident in noisy_idents})
+        # 30 evaluations of 0.3s, two at a time
+        self.assertGreaterEqual(time.monotonic() - start, 4.5)
+
+    def test_policy_slots_per_process(self):
+        # The domains share the slots for policy programs, one process runs
+        # at most 256 of them at a time. Here the calls of the first domain
+        # are allowed, so they do not count as evaluations any more, but
+        # the programs are still running.
+        self.start_multi_daemon(['--max-queued=0'])
+        agent = self.attach_domain_with_agent(self.domain, self.domain_name)
+        other_agent = self.attach_domain_with_agent(
+            self.domain + 1, 'other_domain')
+
+        self.set_policy_params(3, 0)
+        idents = ['SOCKET{}'.format(i) for i in range(200)]
+        for ident in idents:
+            self.send_trigger_service(
+                agent, 'target_domain', 'qubes.ServiceName', ident)
+        util.wait_until(
+            lambda: len(psutil.Process(self.daemon.pid).children()) == 200,
+            'policy programs started')
+        for ident in idents:
+            client = self.connect_client()
+            client.handshake()
+            data = struct.pack('<LL', self.domain + 2, 513) + \
+                ident.encode() + b'\0'
+            client.send_message(qrexec.MSG_SERVICE_CONNECT, data)
+            self.assertEqual(agent.recv_message(),
+                             (qrexec.MSG_SERVICE_CONNECT, data))
+
+        start = time.monotonic()
+        for i in range(57):
+            self.send_trigger_service(
+                other_agent, 'target_domain', 'qubes.ServiceName',
+                'OTHER{}'.format(i))
+        # refused right away, there are no slots left
+        self.assertEqual(other_agent.recv_message(), (
+            qrexec.MSG_SERVICE_REFUSED, struct.pack('<32s', b'OTHER56')))
+        self.assertLess(time.monotonic() - start, 1.5)
+        self.assertLessEqual(
+            len(psutil.Process(self.daemon.pid).children()), 256)
+
+    def test_domain_isolation(self):
+        agent = self.start_daemon_with_agent()
+        agent.handshake()
+
+        other_domain = self.domain + 1
+        other_agent = qrexec.vchan_server(self.tempdir, other_domain, 0, 512)
+        self.addCleanup(other_agent.close)
+        attach = self.attach_domain(other_domain, 'other_domain')
+        other_agent.accept()
+        other_agent.handshake()
+        self.assertEqual(attach.wait(), 0)
+
+        # invalid message from the other domain's agent disconnects only it
+        other_agent.sendall(struct.pack('<LL', 0x1234, 0))
+        self.assertListEqual(other_agent.recv_all_messages(), [])
+        util.wait_until(
+            lambda: not os.path.exists(
+                os.path.join(self.tempdir, 'qrexec.{}'.format(other_domain))),
+            'socket deleted')
+
+        message_type, _ = self.trigger_service(
+            agent, 'target_domain', 'qubes.ServiceName', 'SOCKET42')
+        self.assertEqual(message_type, qrexec.MSG_SERVICE_REFUSED)
+        client = self.connect_client()
+        client.handshake()
+
+
 @unittest.skipIf(os.environ.get('SKIP_SOCKET_TESTS'),
                  'socket tests not set up')
 class TestClient(unittest.TestCase):
@@ -390,7 +1005,7 @@ class TestClient(unittest.TestCase):
     def make_executable_service(self, *args):
         util.make_executable_service(self.tempdir, *args)
 
-    def start_client(self, args):
+    def start_client(self, args, stdin=None):
         env = os.environ.copy()
         env['LD_LIBRARY_PATH'] = os.path.join(ROOT_PATH, 'libqrexec')
         env['VCHAN_DOMAIN'] = '0'
@@ -412,6 +1027,7 @@ class TestClient(unittest.TestCase):
         self.client = subprocess.Popen(
             cmd,
             env=env,
+            stdin=stdin,
             stdout=subprocess.PIPE,
         )
         self.addCleanup(self.stop_client)
@@ -470,6 +1086,795 @@ class TestClient(unittest.TestCase):
         self.client.wait()
         self.assertEqual(self.client.returncode, 42)
 
+    def test_run_vm_command_connection_timeout(self):
+        cmd = 'user:command'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+        self.start_client(['-d', target_domain_name, '-w', '1', cmd])
+        target_daemon.accept()
+        target_daemon.handshake()
+        self.assertEqual(
+            target_daemon.recv_message(),
+            (qrexec.MSG_EXEC_CMDLINE,
+             struct.pack('<LL', 0, 0) + cmd.encode() + b'\0'))
+        target_daemon.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', target_domain, target_port))
+
+        # the target never connects to the data vchan
+        start = time.monotonic()
+        self.client.wait(timeout=10)
+        self.assertEqual(self.client.returncode, 1)
+        self.assertGreaterEqual(time.monotonic() - start, 0.5)
+
+    def test_run_vm_command_just_exec(self):
+        cmd = 'user:command'
+        target_domain_name = 'target_domain'
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+        self.start_client(['-d', target_domain_name, '-e', cmd])
+        target_daemon.accept()
+        target_daemon.handshake()
+
+        # no data connection, the status comes from the daemon
+        self.assertEqual(
+            target_daemon.recv_message(),
+            (qrexec.MSG_JUST_EXEC_NO_DATA,
+             struct.pack('<LL', 0, 0) + cmd.encode() + b'\0' +
+             struct.pack('<L', 0)))
+        target_daemon.send_message(
+            qrexec.MSG_JUST_EXEC_NO_DATA,
+            struct.pack('<LL', 42, target_port))
+        target_daemon.send_message(
+            qrexec.MSG_EXEC_STATUS,
+            struct.pack('<LLLl', 0, target_port, 0, 0))
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 0)
+
+    def test_run_vm_command_just_exec_wait_exit(self):
+        cmd = 'user:command'
+        target_domain_name = 'target_domain'
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+        self.start_client(['-d', target_domain_name, '-e', '--wait-exit',
+                           cmd])
+        target_daemon.accept()
+        target_daemon.handshake()
+
+        self.assertEqual(
+            target_daemon.recv_message(),
+            (qrexec.MSG_JUST_EXEC_NO_DATA,
+             struct.pack('<LL', 0, 0) + cmd.encode() + b'\0' +
+             struct.pack('<L', qrexec.JUST_EXEC_NOTIFY_EXIT)))
+        target_daemon.send_message(
+            qrexec.MSG_JUST_EXEC_NO_DATA,
+            struct.pack('<LL', 42, target_port))
+        target_daemon.send_message(
+            qrexec.MSG_EXEC_STATUS,
+            struct.pack('<LLLl', 0, target_port, 0, 0))
+        self.assertIsNone(self.client.poll())
+        target_daemon.send_message(
+            qrexec.MSG_EXEC_STATUS,
+            struct.pack('<LLLl', 0, target_port,
+                        qrexec.EXEC_STATUS_EXITED, 42))
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 42)
+
+    def test_run_vm_command_just_exec_old_agent(self):
+        cmd = 'user:command'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+        self.start_client(['-d', target_domain_name, '-e', cmd],
+                          stdin=subprocess.DEVNULL)
+        target_daemon.accept()
+        target_daemon.handshake()
+        target_daemon.recv_message()
+        # the daemon falls back to MSG_JUST_EXEC
+        target_daemon.send_message(
+            qrexec.MSG_JUST_EXEC,
+            struct.pack('<LL', target_domain, target_port))
+
+        target = self.connect_target(target_domain, target_port)
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                            struct.pack('<L', 0))
+        target.close()
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 0)
+
+    def test_run_vm_command_from_dom0_stripes(self):
+        cmd = 'user:command'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+        self.start_client(['-d', target_domain_name, '--stripes=2', cmd],
+                          stdin=subprocess.DEVNULL)
+        target_daemon.accept()
+        target_daemon.handshake()
+        target_daemon.recv_message()
+        target_daemon.send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', target_domain, target_port))
+
+        target = self.connect_target(target_domain, target_port)
+        target.handshake()
+        self.assertEqual(target.recv_message(),
+                         (qrexec.MSG_DATA_STRIPES, struct.pack('<L', 2)))
+        stripes = [
+            self.connect_target(target_domain,
+                                qrexec.stripe_port(target_port, i))
+            for i in range(4)
+        ]
+        target.send_message(qrexec.MSG_DATA_STRIPES, struct.pack('<L', 2))
+
+        # stripes 0 and 1 carry the (empty) stdin, 2 and 3 the output
+        self.assertEqual(qrexec.recv_stripes(stripes[:2]), b'')
+        stripes[3].send_stripe_chunk(0, b'stdout ')
+        stripes[2].send_stripe_chunk(1, b'data\n')
+        stripes[2].send_stripe_chunk(0, b'')
+        stripes[3].send_stripe_chunk(0, b'')
+        self.assertEqual(self.client.stdout.read(), b'stdout data\n')
+        target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                            struct.pack('<L', 42))
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 42)
+
+    def test_run_targets(self):
+        cmd = 'user:command'
+        targets = [('target1', 42), ('target2', 43), ('target3', 44)]
+        target_port = 513
+
+        target_daemons = [self.connect_daemon(name) for name, _ in targets]
+        self.start_client(
+            ['--targets=' + ','.join(name for name, _ in targets),
+             '--max-concurrent=2', cmd])
+
+        vchans = []
+        for (_, domain), target_daemon in zip(targets[:2],
+                                                 target_daemons[:2]):
+            target_daemon.accept()
+            target_daemon.handshake()
+            # no stdin
+            self.assertEqual(
+                target_daemon.recv_message(),
+                (qrexec.MSG_EXEC_CMDLINE,
+                 struct.pack('<LL', 0, 0) + cmd.encode() + b'\0' +
+                 struct.pack('<LL', qrexec.EXEC_STDIN_EOF, 0)))
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', domain, target_port))
+        # the calls are started one after another, then run concurrently
+        for _, domain in targets[:2]:
+            target = self.connect_target(domain, target_port)
+            target.handshake()
+            vchans.append(target)
+
+        # the third one waits for a free slot
+        vchans[1].send_message(qrexec.MSG_DATA_STDOUT, b'out2\n')
+        vchans[1].send_message(qrexec.MSG_DATA_STDERR, b'err2\n')
+        vchans[1].send_message(qrexec.MSG_DATA_STDOUT, b'')
+        vchans[1].send_message(qrexec.MSG_DATA_EXIT_CODE,
+                               struct.pack('<L', 2))
+        target_daemons[2].accept()
+        target_daemons[2].handshake()
+        target_daemons[2].recv_message()
+        target_daemons[2].send_message(
+            qrexec.MSG_EXEC_CMDLINE,
+            struct.pack('<LL', targets[2][1], target_port))
+        target = self.connect_target(targets[2][1], target_port)
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+        target.send_message(qrexec.MSG_DATA_EXIT_CODE, struct.pack('<L', 0))
+
+        vchans[0].send_message(qrexec.MSG_DATA_STDOUT, b'out1\n')
+        vchans[0].send_message(qrexec.MSG_DATA_STDOUT, b'')
+        vchans[0].send_message(qrexec.MSG_DATA_EXIT_CODE,
+                               struct.pack('<L', 1))
+
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 2)
+        # records of each target come in order
+        records = {}
+        output = self.client.stdout.read()
+        while output:
+            header, output = output.split(b'\n', 1)
+            name, what, value = header.decode().split(' ')
+            if what == 'exit':
+                data = int(value)
+            else:
+                data, output = output[:int(value)], output[int(value):]
+            records.setdefault(name, []).append((what, data))
+        self.assertEqual(records, {
+            'target1': [('out', b'out1\n'), ('exit', 1)],
+            'target2': [('out', b'out2\n'), ('err', b'err2\n'),
+                        ('exit', 2)],
+            'target3': [('exit', 0)],
+        })
+
+    def test_run_targets_failed(self):
+        target_daemon = self.connect_daemon('target1')
+        self.start_client(['--targets=target1,missing', 'user:command'])
+        target_daemon.accept()
+        target_daemon.handshake()
+        target_daemon.recv_message()
+        target_daemon.send_message(qrexec.MSG_EXEC_CMDLINE,
+                                   struct.pack('<LL', 42, 513))
+        target = self.connect_target(42, 513)
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+        target.send_message(qrexec.MSG_DATA_EXIT_CODE, struct.pack('<L', 0))
+
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 1)
+        self.assertEqual(self.client.stdout.read(),
+                         b'missing exit 1\ntarget1 exit 0\n')
+
+    def test_run_targets_connection_timeout(self):
+        target_daemons = [self.connect_daemon(name)
+                          for name in ['target1', 'target2']]
+        start = time.monotonic()
+        self.start_client(['-w', '1', '--targets=target1,target2',
+                           'user:command'])
+        for target_daemon, domain in zip(target_daemons, [42, 43]):
+            target_daemon.accept()
+            target_daemon.handshake()
+            target_daemon.recv_message()
+            target_daemon.send_message(qrexec.MSG_EXEC_CMDLINE,
+                                       struct.pack('<LL', domain, 513))
+        # target1 never connects, target2 is not held up by it
+        target = self.connect_target(43, 513)
+        target.handshake()
+        target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+        target.send_message(qrexec.MSG_DATA_EXIT_CODE, struct.pack('<L', 0))
+        self.assertEqual(self.client.stdout.readline(), b'target2 exit 0\n')
+
+        self.assertEqual(self.client.stdout.read(), b'target1 exit 1\n')
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 1)
+        self.assertGreaterEqual(time.monotonic() - start, 0.5)
+
+    def test_run_batch(self):
+        cmds = ['user:command1', 'user:command2']
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_ports = [513, 514]
+
+        target_daemon = self.connect_daemon(target_domain_name)
+        cmds_path = os.path.join(self.tempdir, 'cmds')
+        with open(cmds_path, 'w') as f:
+            f.write(''.join(cmd + '\n\n' for cmd in cmds))
+        with open(cmds_path, 'rb') as f:
+            self.start_client(['-d', target_domain_name, '--batch'], stdin=f)
+        target_daemon.accept()
+        target_daemon.handshake()
+        self.assertEqual(target_daemon.recv_message(),
+                         (qrexec.MSG_SESSION_START, b''))
+
+        targets = []
+        for cmd, port in zip(cmds, target_ports):
+            self.assertEqual(
+                target_daemon.recv_message(),
+                (qrexec.MSG_EXEC_CMDLINE,
+                 struct.pack('<LL', 0, 0) + cmd.encode() + b'\0'))
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, port))
+            target = self.connect_target(target_domain, port)
+            target.handshake()
+            targets.append(target)
+
+        # output is written as each call finishes
+        for target, data, code in [(targets[1], b'second\n', 1),
+                                   (targets[0], b'first\n', 3)]:
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_STDIN, b''))
+            target.send_message(qrexec.MSG_DATA_STDOUT, data)
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', code))
+            self.assertEqual(self.client.stdout.read(len(data)), data)
+
+        self.assertEqual(self.client.stdout.read(), b'')
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 3)
+
+    def test_run_in_process(self):
+        cmd = 'user:command'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            self.assertEqual(
+                target_daemon.recv_message(),
+                (qrexec.MSG_EXEC_CMDLINE,
+                 struct.pack('<LL', 0, 0) + cmd.encode() + b'\0' +
+                 struct.pack('<LL', qrexec.EXEC_STDIN_EOF, 10) +
+                 b'stdin data'))
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, target_port))
+
+            # an older agent ignores initial stdin, so it is sent again
+            target = self.connect_target(target_domain, target_port)
+            target.send_message(qrexec.MSG_HELLO, struct.pack('<L', 4))
+            self.assertEqual(
+                target.recv_message(),
+                (qrexec.MSG_HELLO,
+                 struct.pack('<L', qrexec.QREXEC_PROTOCOL_VERSION)))
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_STDIN, b'stdin data'))
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_STDIN, b''))
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'stdout data\n')
+            target.send_message(qrexec.MSG_DATA_STDERR, b'stderr data\n')
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 42))
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        with unittest.mock.patch.dict(os.environ, {
+                'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+            result = libqrexec.call(target_domain_name, cmd, b'stdin data',
+                                    socket_dir=self.tempdir)
+        self.assertEqual(result, (42, b'stdout data\n', b'stderr data\n'))
+
+    def test_run_in_process_initial_stdin(self):
+        cmd = 'user:command'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            target_daemon.recv_message()
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, target_port))
+
+            # stdin is not sent again
+            target = self.connect_target(target_domain, target_port)
+            target.handshake()
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'stdout data\n')
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 0))
+            self.assertEqual(target.recv_all_messages(), [])
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        with unittest.mock.patch.dict(os.environ, {
+                'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+            result = libqrexec.call(target_domain_name, cmd, b'stdin data',
+                                    socket_dir=self.tempdir)
+        self.assertEqual(result, (0, b'stdout data\n', b''))
+
+    def test_run_in_process_pool(self):
+        cmd = 'user:command'
+        cmd2 = 'user:command2'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            self.assertEqual(
+                target_daemon.recv_message(),
+                (qrexec.MSG_EXEC_CMDLINE,
+                 struct.pack('<LL', 0, 0) + cmd.encode() + b'\0' +
+                 struct.pack('<LL', qrexec.EXEC_STDIN_EOF, 0)))
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, target_port))
+
+            target = self.connect_target(target_domain, target_port)
+            target.handshake()
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'first\n')
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 0))
+            target.send_message(qrexec.MSG_DATA_IDLE,
+                                struct.pack('<L', 10000))
+
+            # second call, without qrexec-daemon
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_EXEC_CMDLINE,
+                              cmd2.encode() + b'\0'))
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_STDIN, b'stdin data'))
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_STDIN, b''))
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'second\n')
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 1))
+            target.send_message(qrexec.MSG_DATA_IDLE,
+                                struct.pack('<L', 10000))
+
+            # closed when the pool is disabled
+            self.assertEqual(target.recv_all_messages(), [])
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        libqrexec.set_pool_size(1)
+        try:
+            with unittest.mock.patch.dict(os.environ, {
+                    'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+                result = libqrexec.call(target_domain_name, cmd,
+                                        socket_dir=self.tempdir)
+                self.assertEqual(result, (0, b'first\n', b''))
+                result = libqrexec.call(target_domain_name, cmd2,
+                                        b'stdin data',
+                                        socket_dir=self.tempdir)
+                self.assertEqual(result, (1, b'second\n', b''))
+        finally:
+            libqrexec.set_pool_size(0)
+
+    def test_run_in_process_pool_default_user(self):
+        cmd = 'user:command'
+        cmd2 = 'DEFAULT:command2'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            # ready for the second call
+            target_daemon2 = self.connect_daemon(target_domain_name)
+            target_daemon.handshake()
+            target_daemon.recv_message()
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, 513))
+            target = self.connect_target(target_domain, 513)
+            target.handshake()
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 0))
+            target.send_message(qrexec.MSG_DATA_IDLE,
+                                struct.pack('<L', 10000))
+
+            # the user is filled in by qrexec-daemon, so the second call
+            # goes through it and not over the idle connection
+            target_daemon2.accept()
+            target_daemon2.handshake()
+            self.assertEqual(
+                target_daemon2.recv_message(),
+                (qrexec.MSG_EXEC_CMDLINE,
+                 struct.pack('<LL', 0, 0) + cmd2.encode() + b'\0' +
+                 struct.pack('<LL', qrexec.EXEC_STDIN_EOF, 0)))
+            target_daemon2.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, 514))
+            target2 = self.connect_target(target_domain, 514)
+            target2.handshake()
+            target2.send_message(qrexec.MSG_DATA_STDOUT, b'second\n')
+            target2.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target2.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                 struct.pack('<L', 0))
+
+            # nothing was sent over the idle one
+            self.assertEqual(target.recv_all_messages(), [])
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        libqrexec.set_pool_size(1)
+        try:
+            with unittest.mock.patch.dict(os.environ, {
+                    'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+                result = libqrexec.call(target_domain_name, cmd,
+                                        socket_dir=self.tempdir)
+                self.assertEqual(result, (0, b'', b''))
+                result = libqrexec.call(target_domain_name, cmd2,
+                                        socket_dir=self.tempdir)
+                self.assertEqual(result, (0, b'second\n', b''))
+        finally:
+            libqrexec.set_pool_size(0)
+
+    def test_run_in_process_cache(self):
+        cmd = 'user:QUBESRPC qubes.Service+arg dom0'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            target_daemon.recv_message()
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, target_port))
+
+            target = self.connect_target(target_domain, target_port)
+            target.handshake()
+            target.send_message(qrexec.MSG_DATA_CACHE_TTL,
+                                struct.pack('<L', 60))
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'stdout data\n')
+            target.send_message(qrexec.MSG_DATA_STDERR, b'stderr data\n')
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 3))
+            self.assertEqual(target.recv_all_messages(), [])
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        libqrexec.set_cache_size(1 << 20)
+        before = libqrexec.cache_stats()
+        expected = (3, b'stdout data\n', b'stderr data\n')
+        try:
+            with unittest.mock.patch.dict(os.environ, {
+                    'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+                result = libqrexec.call(target_domain_name, cmd,
+                                        b'stdin data', socket_dir=self.tempdir)
+                self.assertEqual(result, expected)
+                thread.join()
+
+                # the daemon accepts only one connection, so these cannot
+                # go past the cache
+                result = libqrexec.call(target_domain_name, cmd,
+                                        b'stdin data', socket_dir=self.tempdir)
+                self.assertEqual(result, expected)
+                with self.assertRaises(OSError):
+                    libqrexec.call(target_domain_name, cmd, b'other data',
+                                   socket_dir=self.tempdir)
+                stats = libqrexec.cache_stats()
+                self.assertEqual(
+                    {name: stats[name] - before[name]
+                     for name in ('hits', 'misses', 'stores', 'entries')},
+                    {'hits': 1, 'misses': 2, 'stores': 1, 'entries': 1})
+
+                libqrexec.cache_invalidate(target_domain_name, 'qubes.Other')
+                self.assertEqual(libqrexec.cache_stats()['entries'],
+                                 before['entries'] + 1)
+                libqrexec.cache_invalidate(target_domain_name, 'qubes.Service')
+                self.assertEqual(libqrexec.cache_stats()['entries'],
+                                 before['entries'])
+                with self.assertRaises(OSError):
+                    libqrexec.call(target_domain_name, cmd, b'stdin data',
+                                   socket_dir=self.tempdir)
+        finally:
+            libqrexec.set_cache_size(0)
+
+    def test_run_in_process_session(self):
+        cmd = 'user:command'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+        big = b'x' * qrexec.STREAM_WINDOW
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            target_daemon.recv_message()
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, target_port))
+
+            target = self.connect_target(target_domain, target_port)
+            target.handshake()
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 0))
+            target.send_message(qrexec.MSG_DATA_IDLE,
+                                struct.pack('<L', 10000))
+
+            self.assertEqual(target.recv_message(), (qrexec.MSG_DATA_MUX, b''))
+            messages = [target.recv_stream_message() for _ in range(6)]
+            self.assertEqual(sorted(messages), [
+                (0, qrexec.MSG_DATA_STDIN, b''),
+                (0, qrexec.MSG_DATA_STDIN, b'stdin data'),
+                (0, qrexec.MSG_DATA_EXEC_CMDLINE, b'user:first\0'),
+                (1, qrexec.MSG_DATA_STDIN, b''),
+                (1, qrexec.MSG_DATA_STDIN, b'stdin data'),
+                (1, qrexec.MSG_DATA_EXEC_CMDLINE, b'user:second\0'),
+            ])
+            # a full window on stream 1, before stream 0 is done
+            target.send_stream_message(1, qrexec.MSG_DATA_STDOUT, big)
+            target.send_stream_message(0, qrexec.MSG_DATA_STDOUT, b'first\n')
+            target.send_stream_message(0, qrexec.MSG_DATA_STDOUT, b'')
+            target.send_stream_message(0, qrexec.MSG_DATA_EXIT_CODE,
+                                       struct.pack('<L', 1))
+            # credited back once read
+            self.assertEqual(target.recv_stream_message(),
+                             (1, qrexec.MSG_DATA_CREDIT,
+                              struct.pack('<L', len(big))))
+            target.send_stream_message(1, qrexec.MSG_DATA_STDERR, b'err\n')
+            target.send_stream_message(1, qrexec.MSG_DATA_STDOUT, b'')
+            target.send_stream_message(1, qrexec.MSG_DATA_EXIT_CODE,
+                                       struct.pack('<L', 2))
+
+            # closed with the session
+            self.assertEqual(target.recv_all_messages(), [])
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        libqrexec.set_pool_size(1)
+        try:
+            with unittest.mock.patch.dict(os.environ, {
+                    'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+                result = libqrexec.call(target_domain_name, cmd,
+                                        socket_dir=self.tempdir)
+                self.assertEqual(result, (0, b'', b''))
+                with libqrexec.Session(target_domain_name) as session:
+                    # the user is filled in only by qrexec-daemon
+                    with self.assertRaises(OSError) as exc:
+                        session.call('DEFAULT:first')
+                    self.assertEqual(exc.exception.errno, errno.EINVAL)
+                    results = session.run(['user:first', 'user:second'],
+                                          b'stdin data')
+                self.assertEqual(results, [
+                    (1, b'first\n', b''),
+                    (2, big, b'err\n'),
+                ])
+        finally:
+            libqrexec.set_pool_size(0)
+
+    def test_call_async(self):
+        cmdline = 'DEFAULT:QUBESRPC qubes.Service dom0'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            self.assertEqual(
+                target_daemon.recv_message(),
+                (qrexec.MSG_EXEC_CMDLINE,
+                 struct.pack('<LL', 0, 0) + cmdline.encode() + b'\0'))
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, target_port))
+
+            target = self.connect_target(target_domain, target_port)
+            target.handshake()
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_STDIN, b'{"param": 1}'))
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_STDIN, b''))
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'allow')
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 0))
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        with unittest.mock.patch.dict(os.environ, {
+                'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+            result = asyncio.run(asyncio.wait_for(
+                client.call_daemon_async(target_domain_name, cmdline,
+                                         b'{"param": 1}',
+                                         socket_dir=self.tempdir),
+                10))
+        self.assertEqual(result, (0, b'allow'))
+
+    def test_call_async_compressed_output(self):
+        cmdline = 'DEFAULT:QUBESRPC qubes.Service dom0'
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+        output = b'compressible output\n' * 1000
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            target_daemon.recv_message()
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, target_port))
+
+            target = self.connect_target(target_domain, target_port)
+            target.handshake()
+            self.assertEqual(target.recv_message(),
+                             (qrexec.MSG_DATA_STDIN, b''))
+            target.send_compressed_message(qrexec.MSG_DATA_STDOUT, output)
+            target.send_message(qrexec.MSG_DATA_STDOUT, b'')
+            target.send_message(qrexec.MSG_DATA_EXIT_CODE,
+                                struct.pack('<L', 0))
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        with unittest.mock.patch.dict(os.environ, {
+                'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+            result = asyncio.run(asyncio.wait_for(
+                client.call_daemon_async(target_domain_name, cmdline, b'',
+                                         socket_dir=self.tempdir),
+                10))
+        self.assertEqual(result, (0, output))
+
+    def test_call_async_connection_timeout(self):
+        cmdline = 'DEFAULT:QUBESRPC qubes.Service dom0'
+        target_domain_name = 'target_domain'
+
+        target_daemon = self.connect_daemon(target_domain_name)
+
+        def target_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            target_daemon.recv_message()
+            # the target never connects
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE, struct.pack('<LL', 42, 513))
+
+        thread = threading.Thread(target=target_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        libqrexec.load(os.path.join(ROOT_PATH, 'libqrexec',
+                                    libqrexec.LIBRARY))
+        start = time.monotonic()
+        with unittest.mock.patch.dict(os.environ, {
+                'VCHAN_DOMAIN': '0', 'VCHAN_SOCKET_DIR': self.tempdir}):
+            with self.assertRaises(asyncio.TimeoutError):
+                asyncio.run(asyncio.wait_for(
+                    client.call_daemon_async(target_domain_name, cmdline,
+                                             socket_dir=self.tempdir,
+                                             connection_timeout=1),
+                    10))
+        self.assertLess(time.monotonic() - start, 5)
+
     def test_run_vm_command_from_dom0_with_local_command(self):
         cmd = 'user:command'
         local_cmd = "while read x; do echo input: $x; done; exit 44"
@@ -552,6 +1957,50 @@ class TestClient(unittest.TestCase):
         self.client.wait()
         self.assertEqual(self.client.returncode, 0)
 
+    def test_service_connect_async(self):
+        cmd = 'user:command'
+        request_id = 'SOCKET11'
+        src_domain_name = 'src_domain'
+        src_domain = 43
+        target_domain_name = 'target_domain'
+        target_domain = 42
+        target_port = 513
+
+        target_daemon = self.connect_daemon(target_domain_name)
+        src_daemon = self.connect_daemon(src_domain_name)
+
+        def daemon_side():
+            target_daemon.accept()
+            target_daemon.handshake()
+            self.assertEqual(
+                target_daemon.recv_message(),
+                (qrexec.MSG_EXEC_CMDLINE,
+                 struct.pack('<LL', src_domain, 0) + cmd.encode() + b'\0'))
+            target_daemon.send_message(
+                qrexec.MSG_EXEC_CMDLINE,
+                struct.pack('<LL', target_domain, target_port))
+
+            src_daemon.accept()
+            src_daemon.handshake()
+            self.assertEqual(
+                src_daemon.recv_message(),
+                (qrexec.MSG_SERVICE_CONNECT,
+                 struct.pack('<LL32s', target_domain, target_port,
+                             request_id.encode())))
+            # the call has ended
+            target_daemon.close()
+
+        thread = threading.Thread(target=daemon_side)
+        thread.start()
+        self.addCleanup(thread.join)
+
+        asyncio.run(asyncio.wait_for(
+            client.service_connect_async(
+                target_domain_name,
+                '{},{},{}'.format(request_id, src_domain_name, src_domain),
+                cmd, wait=True, socket_dir=self.tempdir),
+            10))
+
     def connect_service_request(self, cmd):
         request_id = 'SOCKET11'
         src_domain_name = 'src_domain'
@@ -658,6 +2107,28 @@ echo "wait for session: remote domain: $QREXEC_REMOTE_DOMAIN" >{}
         self.client.wait()
         self.assertEqual(self.client.returncode, 0)
 
+    def test_run_dom0_service_cache_ttl(self):
+        util.make_executable_service(self.tempdir, 'rpc', 'qubes.Service', """\
+        #!/bin/sh
+        echo "arg: $1"
+        """)
+        with open(os.path.join(self.tempdir, 'rpc-config', 'qubes.Service'),
+                  'w') as f:
+            f.write('cache-ttl=60')
+
+        cmd = 'QUBESRPC qubes.Service+arg src_domain name src_domain'
+        source = self.connect_service_request(cmd)
+
+        source.send_message(qrexec.MSG_DATA_STDIN, b'')
+        self.assertEqual(source.recv_all_messages(), [
+            (qrexec.MSG_DATA_CACHE_TTL, struct.pack('<L', 60)),
+            (qrexec.MSG_DATA_STDOUT, b'arg: arg\n'),
+            (qrexec.MSG_DATA_STDOUT, b''),
+            (qrexec.MSG_DATA_EXIT_CODE, b'\0\0\0\0'),
+        ])
+        self.client.wait()
+        self.assertEqual(self.client.returncode, 0)
+
     def test_run_dom0_service_socket(self):
         socket_path = os.path.join(self.tempdir, 'rpc', 'qubes.SocketService+arg')
         server = qrexec.socket_server(socket_path)
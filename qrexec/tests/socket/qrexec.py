@@ -21,6 +21,7 @@ import socket
 import os
 import struct
 import time
+import zlib
 
 
 # See libqrexec/qrexec.h
@@ -28,14 +29,29 @@ MSG_DATA_STDIN = 0x190
 MSG_DATA_STDOUT = 0x191
 MSG_DATA_STDERR = 0x192
 MSG_DATA_EXIT_CODE = 0x193
+MSG_DATA_IDLE = 0x194
+MSG_DATA_EXEC_CMDLINE = 0x195
+MSG_DATA_MUX = 0x196
+MSG_DATA_CREDIT = 0x197
+MSG_DATA_COMPRESSED = 0x198
+MSG_DATA_STRIPES = 0x199
+MSG_DATA_CACHE_TTL = 0x19a
 MSG_EXEC_CMDLINE = 0x200
 MSG_JUST_EXEC = 0x201
 MSG_SERVICE_CONNECT = 0x202
 MSG_SERVICE_REFUSED = 0x203
+MSG_JUST_EXEC_NO_DATA = 0x204
 MSG_CONNECTION_TERMINATED = 0x211
 MSG_TRIGGER_SERVICE3 = 0x212
+MSG_EXEC_STATUS = 0x213
+MSG_SESSION_START = 0x280
 MSG_HELLO = 0x300
-QREXEC_PROTOCOL_VERSION = 3
+MSG_CONNECTION_SYNC = 0x301
+QREXEC_PROTOCOL_VERSION = 11
+EXEC_STDIN_EOF = 1
+JUST_EXEC_NOTIFY_EXIT = 1
+EXEC_STATUS_EXITED = 1
+STREAM_WINDOW = 65536
 
 
 class QrexecClient:
@@ -74,6 +90,25 @@ class QrexecClient:
         data = self.recvall(data_len)
         return message_type, data
 
+    def send_stream_message(self, stream, message_type, data):
+        header = struct.pack('<LLL', message_type, len(data), stream)
+        self.sendall(header)
+        self.sendall(data)
+
+    def recv_stream_message(self):
+        header = self.recvall(12)
+        message_type, data_len, stream = struct.unpack('<LLL', header)
+        data = self.recvall(data_len)
+        return stream, message_type, data
+
+    def send_compressed_message(self, message_type, data):
+        self.send_message(
+            MSG_DATA_COMPRESSED,
+            struct.pack('<LL', message_type, len(data)) + zlib.compress(data))
+
+    def send_stripe_chunk(self, seq, data):
+        self.sendall(struct.pack('<LL', seq, len(data)) + data)
+
     def recv_all_messages(self):
         messages = []
         while True:
@@ -112,6 +147,36 @@ class QrexecServer(QrexecClient):
         self.server_conn = None
 
 
+def decompress_messages(messages):
+    """Replace MSG_DATA_COMPRESSED messages with what they contain"""
+    result = []
+    for message_type, data in messages:
+        if message_type == MSG_DATA_COMPRESSED:
+            message_type, data_len = struct.unpack('<LL', data[:8])
+            data = zlib.decompress(data[8:])
+            assert len(data) == data_len, (len(data), data_len)
+        result.append((message_type, data))
+    return result
+
+
+def recv_stripes(stripes):
+    """Receive the data from the stripes until they all end, in order"""
+    chunks = {}
+    for stripe in stripes:
+        while True:
+            seq, data_len = struct.unpack('<LL', stripe.recvall(8))
+            if data_len == 0:
+                break
+            assert seq not in chunks, seq
+            chunks[seq] = stripe.recvall(data_len)
+    assert sorted(chunks) == list(range(len(chunks))), sorted(chunks)
+    return b''.join(chunks[seq] for seq in sorted(chunks))
+
+
+def stripe_port(port, i):
+    return (port << 5) | i
+
+
 def vchan_client(socket_dir, domain, remote_domain, port):
     vchan_socket_path = os.path.join(
         socket_dir, 'vchan.{}.{}.{}.sock'.format(
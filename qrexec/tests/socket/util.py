@@ -19,6 +19,13 @@
 import os
 import time
 
+import psutil
+
+
+# How long to watch an idle process in count_wakeups() tests. Set
+# QREXEC_TEST_IDLE_TIME=60 to check over a full minute.
+IDLE_TIME = float(os.environ.get('QREXEC_TEST_IDLE_TIME', '3'))
+
 
 def wait_until(func, message, n_tries=10, delay=0.1):
     for _ in range(n_tries):
@@ -28,6 +35,18 @@ def wait_until(func, message, n_tries=10, delay=0.1):
     raise Exception('Timed out waiting: ' + message)
 
 
+def count_wakeups(pid, duration=IDLE_TIME):
+    '''
+    Count how many times the process was scheduled (context switches) during
+    *duration* seconds. An idle process waiting for events should not wake up
+    at all.
+    '''
+    proc = psutil.Process(pid)
+    before = sum(proc.num_ctx_switches())
+    time.sleep(duration)
+    return sum(proc.num_ctx_switches()) - before
+
+
 def sort_messages(messages):
     '''
     Sort a list of messages (message_type, data) by message type.
@@ -26,7 +26,7 @@ import logging
 import os
 
 from .qrexec_policy_exec import handle_request
-from .. import POLICYPATH, POLICYSOCKET
+from .. import POLICYPATH, POLICYSOCKET, libqrexec
 from ..policy.utils import PolicyCache
 
 argparser = argparse.ArgumentParser(description='Evaluate qrexec policy daemon')
@@ -37,6 +37,11 @@ argparser.add_argument('--policy-path',
 argparser.add_argument('--socket-path',
     type=pathlib.Path, default=POLICYSOCKET,
     help='Use alternative policy socket path')
+argparser.add_argument('--response-cache-size',
+    type=int, default=0, metavar='BYTES',
+    help='Answer repeated calls made for the policy (like policy.Ask) from '
+         'a cache of up to BYTES, if the called service allows it '
+         '(cache-ttl in its rpc-config); default: no cache')
 
 REQUIRED_REQUEST_ARGUMENTS = ('domain_id', 'source', 'intended_target',
                               'service_and_arg', 'process_ident')
@@ -110,6 +115,13 @@ async def start_serving(args=None):
     policy_cache = PolicyCache(args.policy_path)
     policy_cache.initialize_watcher()
 
+    if args.response_cache_size:
+        # used by qrexec.client.call_async()
+        try:
+            libqrexec.set_cache_size(args.response_cache_size)
+        except OSError as err:
+            log.warning('Response cache not available: %s', err)
+
     server = await asyncio.start_unix_server(
         functools.partial(
             handle_client_connection, log, policy_cache),